@@ -0,0 +1,411 @@
+// Headless benchmarks for the scan, decode, thumbnail and export paths.
+// Built and run by `make bench`; results are written as JSON so runs from
+// different commits can be compared.
+#include "raylib.h"
+#include "state.h"
+#include "export.h"
+#include "pdfgen.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bump when the corpus changes, so stale corpora get regenerated
+#define CORPUS_VERSION 1
+#define MAX_SAMPLES 4096
+
+typedef struct {
+    const char* ext;
+    int width;
+    int height;
+    int format;
+    const char* label;
+} CorpusSpec;
+
+// Each spec is written CORPUS_COPIES times, with different content
+#define CORPUS_COPIES 3
+static const CorpusSpec corpusSpecs[] = {
+    { "jpg", 640, 480, PIXELFORMAT_UNCOMPRESSED_R8G8B8, "rgb" },
+    { "jpg", 2048, 1536, PIXELFORMAT_UNCOMPRESSED_R8G8B8, "rgb" },
+    { "jpg", 4000, 3000, PIXELFORMAT_UNCOMPRESSED_R8G8B8, "rgb" },
+    { "jpg", 1024, 768, PIXELFORMAT_UNCOMPRESSED_GRAYSCALE, "grey" },
+    { "png", 640, 480, PIXELFORMAT_UNCOMPRESSED_R8G8B8, "rgb" },
+    { "png", 2048, 1536, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8, "rgba" },
+    { "png", 1024, 768, PIXELFORMAT_UNCOMPRESSED_GRAYSCALE, "grey" },
+    { "png", 1024, 768, PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA, "greya" },
+    { "png", 4000, 3000, PIXELFORMAT_UNCOMPRESSED_R8G8B8, "rgb" },
+    { "bmp", 640, 480, PIXELFORMAT_UNCOMPRESSED_R8G8B8, "rgb" },
+    { "bmp", 2048, 1536, PIXELFORMAT_UNCOMPRESSED_R8G8B8, "rgb" },
+};
+static const char* corpusFormats[] = { "jpg", "png", "bmp" };
+
+typedef struct {
+    double samples[MAX_SAMPLES];
+    int count;
+    long long items;
+    long long bytes;
+} Timer;
+
+static FILE* out;
+static int resultCount;
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void AddSample(Timer* t, double start, long long items, long long bytes) {
+    if (t->count < MAX_SAMPLES) t->samples[t->count++] = (Now() - start) * 1000.0;
+    t->items += items;
+    t->bytes += bytes;
+}
+
+static int CompareDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Writes one result object: per-sample times in ms, plus throughput
+static void Report(const char* name, Timer* t) {
+    if (t->count == 0) return;
+    double total = 0;
+    for (int i = 0; i < t->count; i++) total += t->samples[i];
+    qsort(t->samples, t->count, sizeof(double), CompareDouble);
+    double seconds = total / 1000.0;
+
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"samples\": %d, \"total_ms\": %.3f, \"mean_ms\": %.3f, "
+            "\"median_ms\": %.3f, \"min_ms\": %.3f, \"max_ms\": %.3f, \"items_per_s\": %.1f, \"bytes_per_s\": %.0f}",
+            resultCount++ ? "," : "", name, t->count, total, total / t->count, t->samples[t->count / 2],
+            t->samples[0], t->samples[t->count - 1], seconds > 0 ? t->items / seconds : 0.0,
+            seconds > 0 ? t->bytes / seconds : 0.0);
+    fflush(out);
+    fprintf(stderr, "bench: %-32s %10.3f ms median, %d samples\n", name, t->samples[t->count / 2], t->count);
+}
+
+static long long FileSize(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return 0;
+    fseek(f, 0, SEEK_END);
+    long long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+static const char* FileExt(const char* path) {
+    const char* dot = strrchr(path, '.');
+    return dot ? dot + 1 : "";
+}
+
+// Something photo-like: smooth noise, a colour cast and a few hard edges
+static Image MakeCorpusImage(const CorpusSpec* spec, int copy) {
+    static const Color tints[] = { { 255, 200, 150, 255 }, { 150, 200, 255, 255 }, { 200, 255, 180, 255 } };
+    Image image = GenImagePerlinNoise(spec->width, spec->height, copy * 997, copy * 331, 3.0f + copy);
+    ImageColorTint(&image, tints[copy % 3]);
+    for (int i = 0; i < 6; i++) {
+        int r = spec->height / (8 + i);
+        ImageDrawCircle(&image, (spec->width * (i + 1 + copy)) / 9 % spec->width, (spec->height * (i * 3 + 1)) / 11 % spec->height,
+                        r, (Color){ (unsigned char)(40 * i), (unsigned char)(255 - 30 * i), (unsigned char)(90 + 20 * copy), 255 });
+    }
+    if (spec->format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 || spec->format == PIXELFORMAT_UNCOMPRESSED_GRAY_ALPHA) {
+        // Give the alpha channel something to compress too
+        Image mask = GenImageGradientRadial(spec->width, spec->height, 0.3f, WHITE, BLANK);
+        ImageAlphaMask(&image, mask);
+        UnloadImage(mask);
+    }
+    ImageFormat(&image, spec->format);
+    return image;
+}
+
+// Writes the corpus into dir unless this version of it is already there.
+// Formats raylib can't write are listed in skipped.
+static bool GenerateCorpus(const char* dir, char* skipped, size_t skippedLen) {
+    char stampPath[MAX_PATH_LEN];
+    char path[MAX_PATH_LEN];
+
+    skipped[0] = 0;
+    EnsureDirectoryExists(dir);
+    snprintf(stampPath, MAX_PATH_LEN, "%s/.corpus-%d", dir, CORPUS_VERSION);
+    FILE* stamp = fopen(stampPath, "r");
+    if (stamp) {
+        if (!fgets(skipped, (int)skippedLen, stamp)) skipped[0] = 0;
+        skipped[strcspn(skipped, "\n")] = 0;
+        fclose(stamp);
+        return true;
+    }
+
+    SetRandomSeed(CORPUS_VERSION);
+    for (size_t s = 0; s < sizeof(corpusSpecs) / sizeof(corpusSpecs[0]); s++) {
+        const CorpusSpec* spec = &corpusSpecs[s];
+        if (strstr(skipped, spec->ext)) continue;
+        for (int copy = 0; copy < CORPUS_COPIES; copy++) {
+            snprintf(path, MAX_PATH_LEN, "%s/%s_%dx%d_%s_%d.%s", dir, spec->ext, spec->width, spec->height, spec->label, copy, spec->ext);
+            fprintf(stderr, "bench: generating %s\n", path);
+            Image image = MakeCorpusImage(spec, copy);
+            bool ok = ExportImage(image, path);
+            UnloadImage(image);
+            if (!ok) {
+                fprintf(stderr, "bench: this raylib can't write .%s files, skipping them\n", spec->ext);
+                snprintf(skipped + strlen(skipped), skippedLen - strlen(skipped), "%s%s", skipped[0] ? " " : "", spec->ext);
+                remove(path);
+                break;
+            }
+        }
+    }
+
+    stamp = fopen(stampPath, "w");
+    if (!stamp) return false;
+    fprintf(stamp, "%s\n", skipped);
+    fclose(stamp);
+    return true;
+}
+
+static bool HasSuffix(const char* name, const char* suffix) {
+    size_t len = strlen(name), suffixLen = strlen(suffix);
+    return len >= suffixLen && strcmp(name + len - suffixLen, suffix) == 0;
+}
+
+// Removes the files in dir ending in suffix, to start a benchmark cold
+static void RemoveDirectoryFiles(const char* dir, const char* suffix) {
+    DIR* d = opendir(dir);
+    if (!d) return;
+    struct dirent* entry;
+    char path[MAX_PATH_LEN];
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.' || !HasSuffix(entry->d_name, suffix)) continue;
+        snprintf(path, MAX_PATH_LEN, "%s/%s", dir, entry->d_name);
+        remove(path);
+    }
+    closedir(d);
+}
+
+// Every corpus file, including formats the gallery doesn't list (BMP)
+static char corpusFiles[256][MAX_PATH_LEN];
+static int corpusFileCount;
+
+static void ListCorpus(const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) return;
+    struct dirent* entry;
+    corpusFileCount = 0;
+    while ((entry = readdir(d)) != NULL && corpusFileCount < 256) {
+        for (size_t f = 0; f < sizeof(corpusFormats) / sizeof(corpusFormats[0]); f++) {
+            if (entry->d_name[0] != '.' && strcmp(FileExt(entry->d_name), corpusFormats[f]) == 0) {
+                snprintf(corpusFiles[corpusFileCount++], MAX_PATH_LEN, "%s/%s", dir, entry->d_name);
+                break;
+            }
+        }
+    }
+    closedir(d);
+}
+
+static void BenchScan(State* state, const char* corpus, int iterations) {
+    Timer t = { 0 };
+    for (int i = 0; i < iterations; i++) {
+        double start = Now();
+        LoadFolder(state, corpus);
+        AddSample(&t, start, state->imageCount, 0);
+    }
+    Report("scan", &t);
+}
+
+static void BenchDecode(void) {
+    for (size_t f = 0; f < sizeof(corpusFormats) / sizeof(corpusFormats[0]); f++) {
+        Timer t = { 0 };
+        char name[64];
+        for (int i = 0; i < corpusFileCount; i++) {
+            const char* path = corpusFiles[i];
+            if (strcmp(FileExt(path), corpusFormats[f]) != 0) continue;
+            long long size = FileSize(path);
+            double start = Now();
+            Image image = LoadImage(path);
+            AddSample(&t, start, 1, size);
+            UnloadImage(image);
+        }
+        snprintf(name, sizeof(name), "decode_%s", corpusFormats[f]);
+        Report(name, &t);
+    }
+}
+
+static void BenchThumbnails(State* state, const char* corpus) {
+    char thumbDir[MAX_PATH_LEN];
+    snprintf(thumbDir, MAX_PATH_LEN, "%s/.rayview_thumbs", corpus);
+    RemoveDirectoryFiles(thumbDir, "");
+
+    Timer cold = { 0 }, warm = { 0 }, load = { 0 };
+    for (int i = 0; i < state->imageCount; i++) {
+        double start = Now();
+        RefreshThumbnail(corpus, state->images[i].path);
+        AddSample(&cold, start, 1, FileSize(state->images[i].path));
+    }
+    for (int i = 0; i < state->imageCount; i++) {
+        double start = Now();
+        RefreshThumbnail(corpus, state->images[i].path);
+        AddSample(&warm, start, 1, 0);
+    }
+    for (int i = 0; i < state->imageCount; i++) {
+        double start = Now();
+        Image thumb = LoadThumbnail(corpus, state->images[i].path);
+        AddSample(&load, start, 1, 0);
+        UnloadImage(thumb);
+    }
+    Report("thumbnail_build", &cold);
+    Report("thumbnail_check", &warm);
+    Report("thumbnail_load", &load);
+}
+
+// Adds every corpus image to pdf, one per page, timing each by format
+static void AddCorpusImages(struct pdf_doc* pdf, Timer* timers) {
+    for (int i = 0; i < corpusFileCount; i++) {
+        const char* path = corpusFiles[i];
+        int dataSize = 0;
+        unsigned char* data = LoadFileData(path, &dataSize);
+        if (!data) continue;
+        size_t f = 0;
+        while (f < sizeof(corpusFormats) / sizeof(corpusFormats[0]) && strcmp(FileExt(path), corpusFormats[f]) != 0) f++;
+
+        pdf_append_page(pdf);
+        double start = Now();
+        if (pdf_add_image_data(pdf, NULL, 36, 36, 540, -1, data, dataSize) < 0) {
+            fprintf(stderr, "bench: %s: %s\n", path, pdf_get_err(pdf, NULL));
+        } else if (f < sizeof(corpusFormats) / sizeof(corpusFormats[0])) {
+            AddSample(&timers[f], start, 1, dataSize);
+        }
+        UnloadFileData(data);
+    }
+}
+
+static void BenchPdf(int iterations) {
+    static const struct { const char* name; int flags; } modes[] = {
+        { "pdf_save_file_classic", 0 },
+        { "pdf_save_file_object_streams", PDF_SAVE_OBJECT_STREAMS },
+        { "pdf_save_file_linearized", PDF_SAVE_LINEARIZED },
+    };
+    Timer add[sizeof(corpusFormats) / sizeof(corpusFormats[0])] = { 0 };
+    char name[64];
+
+    struct pdf_doc* pdf = pdf_create(PDF_LETTER_WIDTH, PDF_LETTER_HEIGHT, NULL);
+    if (!pdf) return;
+    pdf_set_compression(pdf, 6);
+    AddCorpusImages(pdf, add);
+    for (size_t f = 0; f < sizeof(corpusFormats) / sizeof(corpusFormats[0]); f++) {
+        snprintf(name, sizeof(name), "pdf_add_image_data_%s", corpusFormats[f]);
+        Report(name, &add[f]);
+    }
+
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        Timer t = { 0 };
+        pdf_set_save_flags(pdf, modes[m].flags);
+        for (int i = 0; i < iterations; i++) {
+            FILE* fp = tmpfile();
+            if (!fp) break;
+            double start = Now();
+            pdf_save_file(pdf, fp);
+            fflush(fp);
+            AddSample(&t, start, 1, ftell(fp));
+            fclose(fp);
+        }
+        Report(modes[m].name, &t);
+    }
+    pdf_destroy(pdf);
+}
+
+// The whole export, as the GUI runs it: cold (no encoded image cache or
+// contact sheet proxies), then warm
+static void BenchExport(State* state, const char* corpus, const char* pdfPath, int iterations) {
+    ImageEntry** pages = malloc(state->imageCount * sizeof(ImageEntry*));
+    char path[MAX_PATH_LEN];
+    if (!pages) return;
+    for (int i = 0; i < state->imageCount; i++) pages[i] = &state->images[i];
+
+    Timer cold = { 0 }, warm = { 0 }, sheetCold = { 0 }, sheetWarm = { 0 };
+    snprintf(path, MAX_PATH_LEN, "%s/.rayview_export_cache", corpus);
+    RemoveDirectoryFiles(path, "");
+    snprintf(path, MAX_PATH_LEN, "%s/.rayview_thumbs", corpus);
+    RemoveDirectoryFiles(path, "__proxy.jpg");
+    snprintf(path, MAX_PATH_LEN, "%s.rayview_export", pdfPath);
+
+    double start = Now();
+    remove(path);
+    if (ExportPdf(state, pages, state->imageCount, pdfPath)) AddSample(&cold, start, state->imageCount, FileSize(pdfPath));
+    for (int i = 0; i < iterations; i++) {
+        remove(path); // Without the manifest the PDF is rewritten, from cache
+        start = Now();
+        if (ExportPdf(state, pages, state->imageCount, pdfPath)) AddSample(&warm, start, state->imageCount, FileSize(pdfPath));
+    }
+    start = Now();
+    if (ExportContactSheet(state, pages, state->imageCount, 20, pdfPath)) AddSample(&sheetCold, start, state->imageCount, FileSize(pdfPath));
+    for (int i = 0; i < iterations; i++) {
+        start = Now();
+        if (ExportContactSheet(state, pages, state->imageCount, 20, pdfPath)) AddSample(&sheetWarm, start, state->imageCount, FileSize(pdfPath));
+    }
+    Report("export_pdf_cold", &cold);
+    Report("export_pdf_warm", &warm);
+    Report("export_contact_sheet_20_cold", &sheetCold);
+    Report("export_contact_sheet_20_warm", &sheetWarm);
+
+    remove(path);
+    remove(pdfPath);
+    free(pages);
+}
+
+int main(int argc, char** argv) {
+    const char* corpus = "build/bench-corpus";
+    const char* outPath = NULL;
+    const char* label = "";
+    int iterations = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) corpus = argv[++i];
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) outPath = argv[++i];
+        else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc) label = argv[++i];
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "usage: bench [--corpus DIR] [--out FILE] [--label TEXT] [--iterations N]\n");
+            return 2;
+        }
+    }
+    if (iterations < 1) iterations = 1;
+    SetTraceLogLevel(LOG_WARNING);
+
+    char skipped[64];
+    if (!GenerateCorpus(corpus, skipped, sizeof(skipped))) {
+        fprintf(stderr, "bench: unable to write the corpus in '%s'\n", corpus);
+        return 1;
+    }
+
+    State* state = calloc(1, sizeof(State));
+    if (!state) return 1;
+    InitializeDefaults(state);
+    strncpy(state->folder, corpus, MAX_PATH_LEN - 1);
+    LoadFolder(state, corpus);
+    ListCorpus(corpus);
+
+    out = outPath ? fopen(outPath, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "bench: unable to write '%s'\n", outPath);
+        free(state);
+        return 1;
+    }
+
+    long long corpusBytes = 0;
+    for (int i = 0; i < corpusFileCount; i++) corpusBytes += FileSize(corpusFiles[i]);
+    fprintf(out, "{\n  \"label\": \"%s\", \"time\": %lld, \"corpus_version\": %d, \"corpus_files\": %d, "
+            "\"corpus_bytes\": %lld, \"corpus_skipped\": \"%s\", \"iterations\": %d,\n  \"results\": [",
+            label, (long long)time(NULL), CORPUS_VERSION, corpusFileCount, corpusBytes, skipped, iterations);
+
+    char pdfPath[MAX_PATH_LEN];
+    snprintf(pdfPath, MAX_PATH_LEN, "%s.pdf", corpus);
+    BenchScan(state, corpus, iterations * 10);
+    BenchDecode();
+    BenchThumbnails(state, corpus);
+    BenchPdf(iterations);
+    BenchExport(state, corpus, pdfPath, iterations);
+
+    fprintf(out, "\n  ]\n}\n");
+    if (outPath) fclose(out);
+    free(state);
+    return 0;
+}
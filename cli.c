@@ -0,0 +1,314 @@
+#include "cli.h"
+#include "raylib.h"
+#include "state.h"
+#include "settings.h"
+#include "export.h"
+#include "perf.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static void PrintUsage(void) {
+    fprintf(stderr,
+        "usage: graphics-assembler export [options] <folder> <output.pdf> [page ...]\n"
+        "       graphics-assembler thumbs [--jobs N] <folder> ...\n"
+        "\n"
+        "Exports the pages, in order, with no window. Pages are the file names\n"
+        "given after the output, else those in --pages, else the selection saved\n"
+        "in the settings file, else every image in the folder by name.\n"
+        "\n"
+        "  --settings FILE      canvas, margins and selection from a project file or\n"
+        "                       an older .rayview_settings file (default\n"
+        "                       <folder>/.rayview_project)\n"
+        "  --sequence NAME      export the named sequence rather than the one last\n"
+        "                       open\n"
+        "  --pages FILE         page order, one file name per line; [BLANK_PAGE]\n"
+        "                       for a blank page\n"
+        "  --canvas W H         canvas size in inches\n"
+        "  --margins T B L R    margins in inches\n"
+        "  --per-page N         1, or 4, 9, 20 or 35 for contact sheets\n"
+        "  --linearize          write a linearized (fast web view) PDF\n"
+        "  --classic            write a PDF 1.4 cross-reference table\n"
+        "\n"
+        "thumbs builds any missing or out of date gallery thumbnails, using N\n"
+        "threads (default: one per core).\n"
+        "\n"
+        "With RAYVIEW_PERF_LOG set to a file, timings are appended to it as JSON lines.\n");
+}
+
+// Copies a number given on the command line into one of the layout buffers
+static bool SetInches(char* buf, const char* value) {
+    char* end;
+    float inches = strtof(value, &end);
+    if (*end != 0 || inches < 0 || strlen(value) >= 8) {
+        fprintf(stderr, "export: invalid size '%s'\n", value);
+        return false;
+    }
+    strcpy(buf, value);
+    return true;
+}
+
+static int ComparePath(const void* a, const void* b) {
+    return strcmp((*(ImageEntry* const*)a)->path, (*(ImageEntry* const*)b)->path);
+}
+
+// Collects the selected images in page order. With nothing selected, and
+// allIfNone, every image in the folder is used, by name
+static int GetExportPages(State* state, ImageEntry** pages, bool allIfNone) {
+    int count = GetSelection(state, pages);
+    if (count > 0 || !allIfNone) return count;
+
+    for (int i = 0; i < state->imageCount; i++) {
+        if (strcmp(state->images[i].path, "[BLANK_PAGE]") != 0) pages[count++] = &state->images[i];
+    }
+    qsort(pages, count, sizeof(*pages), ComparePath);
+    return count;
+}
+
+static int RunExport(int argc, char** argv) {
+    const char* settingsPath = NULL;
+    const char* pagesPath = NULL;
+    const char* sequenceName = NULL;
+    const char* positional[2] = { 0 };
+    const char* canvas[2] = { 0 };
+    const char* margins[4] = { 0 };
+    int positionalCount = 0;
+    int firstPage = argc;
+    int perPage = 1;
+    int saveFlags = PDF_SAVE_OBJECT_STREAMS;
+
+    for (int i = 0; i < argc; i++) {
+        const char* arg = argv[i];
+        if (positionalCount == 2) {
+            firstPage = i; // Everything after the output is a page
+            break;
+        } else if (strcmp(arg, "--settings") == 0 && i + 1 < argc) {
+            settingsPath = argv[++i];
+        } else if (strcmp(arg, "--sequence") == 0 && i + 1 < argc) {
+            sequenceName = argv[++i];
+        } else if (strcmp(arg, "--pages") == 0 && i + 1 < argc) {
+            pagesPath = argv[++i];
+        } else if (strcmp(arg, "--canvas") == 0 && i + 2 < argc) {
+            canvas[0] = argv[++i];
+            canvas[1] = argv[++i];
+        } else if (strcmp(arg, "--margins") == 0 && i + 4 < argc) {
+            for (int m = 0; m < 4; m++) margins[m] = argv[++i];
+        } else if (strcmp(arg, "--per-page") == 0 && i + 1 < argc) {
+            perPage = atoi(argv[++i]);
+        } else if (strcmp(arg, "--linearize") == 0) {
+            saveFlags = PDF_SAVE_LINEARIZED;
+        } else if (strcmp(arg, "--classic") == 0) {
+            saveFlags = 0;
+        } else if (arg[0] == '-' && arg[1] != 0) {
+            fprintf(stderr, "export: unknown option '%s'\n", arg);
+            PrintUsage();
+            return 2;
+        } else {
+            positional[positionalCount++] = arg;
+        }
+    }
+    if (positionalCount < 2 || (perPage != 1 && perPage != 4 && perPage != 9 && perPage != 20 && perPage != 35)) {
+        PrintUsage();
+        return 2;
+    }
+
+    // The image table is large, keep it off the stack
+    State* state = calloc(1, sizeof(State));
+    ImageEntry** pages = malloc(MAX_IMAGES * sizeof(ImageEntry*));
+    int result = 1;
+    if (!state || !pages) goto done;
+
+    InitializeDefaults(state);
+    state->exportSaveFlags = saveFlags;
+    strncpy(state->folder, positional[0], MAX_PATH_LEN - 1);
+    LoadFolder(state, state->folder);
+    if (state->imageCount == 0) {
+        fprintf(stderr, "export: no images in '%s'\n", state->folder);
+        goto done;
+    }
+
+    // Settings supply the layout, and the selection unless pages are given
+    if (settingsPath) {
+        if (!LoadSettingsFile(state, settingsPath)) {
+            fprintf(stderr, "export: unable to read settings '%s'\n", settingsPath);
+            goto done;
+        }
+    } else {
+        LoadSettings(state);
+    }
+    if (sequenceName) {
+        int sequence = FindSequence(state, sequenceName);
+        if (sequence < 0) {
+            fprintf(stderr, "export: no sequence '%s' in the settings\n", sequenceName);
+            goto done;
+        }
+        SwitchSequence(state, sequence);
+    }
+    if (pagesPath || firstPage < argc) {
+        for (int i = 0; i < state->imageCount; i++) {
+            state->images[i].selected = false;
+            state->images[i].selectionOrder = -1;
+        }
+    }
+    if (pagesPath && !LoadPageList(state, pagesPath)) {
+        fprintf(stderr, "export: unable to read page list '%s'\n", pagesPath);
+        goto done;
+    }
+    for (int i = firstPage; i < argc; i++) SelectPage(state, GetFileName(argv[i]), i - firstPage + 1);
+
+    if (canvas[0] && (!SetInches(state->bufCanvasW, canvas[0]) || !SetInches(state->bufCanvasH, canvas[1]))) goto done;
+    if (margins[0] && (!SetInches(state->bufMarginT, margins[0]) || !SetInches(state->bufMarginB, margins[1]) ||
+                       !SetInches(state->bufMarginL, margins[2]) || !SetInches(state->bufMarginR, margins[3]))) goto done;
+
+    int pageCount = GetExportPages(state, pages, !pagesPath && firstPage == argc);
+    if (pageCount == 0) {
+        fprintf(stderr, "export: none of the pages are in '%s'\n", state->folder);
+        goto done;
+    }
+    bool ok;
+    if (perPage > 1) {
+        ok = ExportContactSheet(state, pages, pageCount, perPage, positional[1]);
+    } else {
+        ok = ExportPdf(state, pages, pageCount, positional[1]);
+    }
+    if (ok) {
+        printf("%s: %d pages\n", positional[1], perPage > 1 ? (pageCount + perPage - 1) / perPage : pageCount);
+        result = 0;
+    } else {
+        fprintf(stderr, "export: unable to write '%s'\n", positional[1]);
+    }
+
+done:
+    free(pages);
+    if (state) FreeSequences(state);
+    free(state);
+    return result;
+}
+
+// Every image across all the folders is one job; workers take the next one
+// until there are none left
+typedef struct {
+    const char* folder;
+    char path[MAX_PATH_LEN];
+} ThumbJob;
+
+typedef struct {
+    ThumbJob* jobs;
+    int jobCount;
+    int next;
+    int counts[3]; // Indexed by ThumbResult
+    pthread_mutex_t lock;
+} ThumbQueue;
+
+static void* ThumbWorker(void* arg) {
+    ThumbQueue* queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int job = queue->next < queue->jobCount ? queue->next++ : -1;
+        pthread_mutex_unlock(&queue->lock);
+        if (job < 0) break;
+
+        ThumbResult result = RefreshThumbnail(queue->jobs[job].folder, queue->jobs[job].path);
+        if (result == THUMB_FAILED) fprintf(stderr, "thumbs: unable to read '%s'\n", queue->jobs[job].path);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->counts[result]++;
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+static int RunThumbs(int argc, char** argv) {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int firstFolder = 0;
+
+    if (argc >= 2 && strcmp(argv[0], "--jobs") == 0) {
+        threads = atoi(argv[1]);
+        firstFolder = 2;
+    }
+    if (firstFolder >= argc || threads < 1) {
+        PrintUsage();
+        return 2;
+    }
+    if (threads > 256) threads = 256;
+
+    ThumbQueue queue = { 0 };
+    State* state = calloc(1, sizeof(State));
+    struct stat* folders = calloc(argc, sizeof(struct stat));
+    int capacity = 0, folderCount = 0, result = 1;
+    if (!state || !folders) goto done;
+
+    for (int f = firstFolder; f < argc; f++) {
+        // A folder named twice, or by two different paths, would have two
+        // workers writing each of its thumbnails, so it's only queued once
+        struct stat st = { 0 };
+        bool seen = false;
+        if (stat(argv[f], &st) == 0) {
+            for (int i = 0; i < folderCount && !seen; i++) {
+                seen = folders[i].st_dev == st.st_dev && folders[i].st_ino == st.st_ino;
+            }
+        }
+        if (seen) continue;
+        folders[folderCount++] = st;
+        LoadFolder(state, argv[f]);
+        if (state->imageCount == 0) fprintf(stderr, "thumbs: no images in '%s'\n", argv[f]);
+        if (queue.jobCount + state->imageCount > capacity) {
+            capacity = (queue.jobCount + state->imageCount) * 2;
+            ThumbJob* jobs = realloc(queue.jobs, capacity * sizeof(ThumbJob));
+            if (!jobs) goto done;
+            queue.jobs = jobs;
+        }
+        for (int i = 0; i < state->imageCount; i++) {
+            queue.jobs[queue.jobCount].folder = argv[f];
+            strcpy(queue.jobs[queue.jobCount].path, state->images[i].path);
+            queue.jobCount++;
+        }
+    }
+    if (threads > queue.jobCount) threads = queue.jobCount > 0 ? queue.jobCount : 1;
+
+    struct timespec start, end;
+    pthread_t workers[256];
+    int started = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_init(&queue.lock, NULL);
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, ThumbWorker, &queue) != 0) break;
+    }
+    if (started == 0) ThumbWorker(&queue);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&queue.lock);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%d images in %d folders: %d built, %d up to date, %d failed in %.2fs (%.1f images/s, %d threads)\n",
+           queue.jobCount, folderCount, queue.counts[THUMB_BUILT], queue.counts[THUMB_CURRENT],
+           queue.counts[THUMB_FAILED], seconds, seconds > 0 ? queue.jobCount / seconds : 0.0, started > 0 ? started : 1);
+    result = queue.counts[THUMB_FAILED] > 0 ? 1 : 0;
+
+done:
+    free(queue.jobs);
+    free(folders);
+    if (state) FreeSequences(state);
+    free(state);
+    return result;
+}
+
+int RunCommandLine(int argc, char** argv) {
+    SetTraceLogLevel(LOG_WARNING);
+    int result = 2;
+    if (argc >= 2 && strcmp(argv[1], "export") == 0) {
+        PerfLogOpen("export");
+        result = RunExport(argc - 2, argv + 2);
+    } else if (argc >= 2 && strcmp(argv[1], "thumbs") == 0) {
+        PerfLogOpen("thumbs");
+        result = RunThumbs(argc - 2, argv + 2);
+    } else {
+        PrintUsage();
+    }
+    PerfLogClose();
+    return result;
+}
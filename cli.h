@@ -0,0 +1,8 @@
+#ifndef CLI_H
+#define CLI_H
+
+// Runs a headless subcommand given on the command line and returns the
+// process exit code. No window or GL context is ever created.
+int RunCommandLine(int argc, char** argv);
+
+#endif // CLI_H
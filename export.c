@@ -0,0 +1,428 @@
+#include "export.h"
+#include "layout.h"
+#include "raylib.h"
+#include "pdfgen.h"
+#include "perf.h"
+#include <dirent.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Alongside each exported PDF, <pdf>.rayview_export records what went
+// into it: the PDF's own size & mtime, the layout, then one line per page.
+#define EXPORT_MANIFEST_HEADER "rayview-export 2"
+#define EXPORT_LINE_LEN (MAX_PATH_LEN + 192)
+
+static void GetManifestPath(const char* pdfPath, char* outPath) {
+    snprintf(outPath, MAX_PATH_LEN, "%s.rayview_export", pdfPath);
+}
+
+static void GetLayoutKey(const State* state, char* out, size_t outLen) {
+    snprintf(out, outLen, "%s %s %s %s %s %s %d", state->bufCanvasW, state->bufCanvasH, state->bufMarginT, state->bufMarginB, state->bufMarginL, state->bufMarginR, state->exportSaveFlags);
+}
+
+// A page is unchanged while its source file keeps its size and mtime
+static void GetPageSignature(const ImageEntry* entry, char* out, size_t outLen) {
+    struct stat st;
+    if (strcmp(entry->path, "[BLANK_PAGE]") == 0 || stat(entry->path, &st) != 0) {
+        snprintf(out, outLen, "0 0 %s", entry->path);
+    } else {
+        snprintf(out, outLen, "%lld %lld %s", (long long)st.st_size, (long long)st.st_mtime, entry->path);
+    }
+}
+
+// Encoded images are kept in <folder>/.rayview_export_cache, named after
+// the source file's path, size and mtime, so layout changes and repeated
+// exports reuse them and an edited image simply gets a new entry. Entries
+// that no longer match an image in the folder are pruned after each export.
+static bool GetExportCacheKey(const ImageEntry* entry, uint64_t* key) {
+    char signature[EXPORT_LINE_LEN];
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+
+    GetPageSignature(entry, signature, sizeof(signature));
+    if (strncmp(signature, "0 0 ", 4) == 0) return false; // Unreadable source, nothing worth caching
+    for (const char* c = signature; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+    }
+    *key = hash;
+    return true;
+}
+
+static void GetExportCachePath(const State* state, const ImageEntry* entry, char* outPath) {
+    char cacheDir[MAX_PATH_LEN];
+    uint64_t key;
+
+    if (!GetExportCacheKey(entry, &key)) {
+        outPath[0] = 0;
+        return;
+    }
+    snprintf(cacheDir, MAX_PATH_LEN, "%s/.rayview_export_cache", state->folder);
+    EnsureDirectoryExists(cacheDir);
+    snprintf(outPath, MAX_PATH_LEN, "%s/%016llx.xobj", cacheDir, (unsigned long long)key);
+}
+
+static int CompareKeys(const void* a, const void* b) {
+    uint64_t ka = *(const uint64_t*)a, kb = *(const uint64_t*)b;
+    return ka < kb ? -1 : ka > kb;
+}
+
+// Deletes cache entries for images that have since been edited or removed,
+// and any temporary files left by an interrupted write. Entries for every
+// image still in the folder are kept, exported this time or not, so the
+// cache never holds more than one entry per image.
+static void PruneExportCache(const State* state) {
+    char cacheDir[MAX_PATH_LEN];
+    snprintf(cacheDir, MAX_PATH_LEN, "%s/.rayview_export_cache", state->folder);
+    DIR* dir = opendir(cacheDir);
+    if (!dir) return;
+
+    uint64_t* keys = malloc((state->imageCount + 1) * sizeof(uint64_t));
+    if (!keys) {
+        closedir(dir);
+        return;
+    }
+    int keyCount = 0;
+    for (int i = 0; i < state->imageCount; i++) {
+        if (GetExportCacheKey(&state->images[i], &keys[keyCount])) keyCount++;
+    }
+    qsort(keys, keyCount, sizeof(uint64_t), CompareKeys);
+
+    struct dirent* entry;
+    int removed = 0;
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned long long key;
+        int nameLen = 0;
+        if (entry->d_name[0] == '.') continue;
+        bool current = sscanf(entry->d_name, "%16llx.xobj%n", &key, &nameLen) == 1 && entry->d_name[nameLen] == 0 && nameLen == 21 &&
+                       bsearch(&(uint64_t){ key }, keys, keyCount, sizeof(uint64_t), CompareKeys);
+        if (!current) {
+            char path[MAX_PATH_LEN + MAX_FILENAME_LEN];
+            snprintf(path, sizeof(path), "%s/%s", cacheDir, entry->d_name);
+            if (remove(path) == 0) removed++;
+        }
+    }
+    closedir(dir);
+    free(keys);
+    if (removed > 0) TraceLog(LOG_INFO, "EXPORT: Removed %d stale cache entries", removed);
+}
+
+// A page's manifest line: its own layout, then its signature
+static void GetPageLine(const ImageEntry* entry, char* out, size_t outLen) {
+    const PageLayout* l = &entry->layout;
+    int len = snprintf(out, outLen, "%d %d %d %g %g %g %g %g %g %g %g ", l->fit, l->rotation, l->ownMargins, l->margins[0], l->margins[1], l->margins[2], l->margins[3], l->crop.x, l->crop.y, l->crop.width, l->crop.height);
+    if (len > 0 && (size_t)len < outLen) GetPageSignature(entry, out + len, outLen - len);
+}
+
+static bool GetPdfSignature(const char* pdfPath, char* out, size_t outLen) {
+    struct stat st;
+    if (stat(pdfPath, &st) != 0) return false;
+    snprintf(out, outLen, "%lld %lld", (long long)st.st_size, (long long)st.st_mtime);
+    return true;
+}
+
+static long long GetFileBytes(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long long)st.st_size : 0;
+}
+
+static bool ReadManifestLine(FILE* f, char* line) {
+    if (!fgets(line, EXPORT_LINE_LEN, f)) return false;
+    line[strcspn(line, "\r\n")] = 0;
+    return true;
+}
+
+// Returns how many leading pages the PDF at pdfPath already holds, or -1 if
+// it has to be written from scratch
+static int CountExportedPages(const State* state, ImageEntry** pages, int pageCount, const char* pdfPath) {
+    char manifestPath[MAX_PATH_LEN];
+    char line[EXPORT_LINE_LEN];
+    char expected[EXPORT_LINE_LEN];
+    int count = -1;
+
+    GetManifestPath(pdfPath, manifestPath);
+    FILE* f = fopen(manifestPath, "r");
+    if (!f) return -1;
+
+    if (!ReadManifestLine(f, line) || strcmp(line, EXPORT_MANIFEST_HEADER) != 0) goto done;
+    if (!ReadManifestLine(f, line) || !GetPdfSignature(pdfPath, expected, sizeof(expected)) || strcmp(line, expected) != 0) goto done;
+    GetLayoutKey(state, expected, sizeof(expected));
+    if (!ReadManifestLine(f, line) || strcmp(line, expected) != 0) goto done;
+
+    count = 0;
+    while (ReadManifestLine(f, line)) {
+        if (count >= pageCount) {
+            count = -1; // Pages have been removed since
+            break;
+        }
+        GetPageLine(pages[count], expected, sizeof(expected));
+        if (strcmp(line, expected) != 0) {
+            count = -1;
+            break;
+        }
+        count++;
+    }
+
+done:
+    fclose(f);
+    return count;
+}
+
+static void WriteManifest(const State* state, ImageEntry** pages, int pageCount, const char* pdfPath) {
+    char manifestPath[MAX_PATH_LEN];
+    char line[EXPORT_LINE_LEN];
+
+    GetManifestPath(pdfPath, manifestPath);
+    FILE* f = fopen(manifestPath, "w");
+    if (!f) return;
+    fprintf(f, "%s\n", EXPORT_MANIFEST_HEADER);
+    if (GetPdfSignature(pdfPath, line, sizeof(line))) fprintf(f, "%s\n", line);
+    GetLayoutKey(state, line, sizeof(line));
+    fprintf(f, "%s\n", line);
+    for (int i = 0; i < pageCount; i++) {
+        GetPageLine(pages[i], line, sizeof(line));
+        fprintf(f, "%s\n", line);
+    }
+    fclose(f);
+}
+
+// Draws an image where place puts it. place is in units of scale points,
+// measured down from top at the left edge left, as on the canvas.
+static int AddPlacedImage(struct pdf_doc* pdf, struct pdf_object* image, const Placement* place, float left, float top, float scale) {
+    uint32_t imgW, imgH;
+    pdf_get_image_size(image, &imgW, &imgH);
+    const Rectangle* s = &place->src;
+    const Rectangle* d = &place->dst;
+    float k = d->width / ((place->rotation & 1) ? s->height : s->width);
+
+    // Canvas position of image pixel (u, v) is origin + u * du + v * dv
+    Vector2 du, dv, origin;
+    switch (place->rotation & 3) {
+        case 0:
+            du = (Vector2){ k, 0 };
+            dv = (Vector2){ 0, k };
+            origin = (Vector2){ d->x - k * s->x, d->y - k * s->y };
+            break;
+        case 1:
+            du = (Vector2){ 0, k };
+            dv = (Vector2){ -k, 0 };
+            origin = (Vector2){ d->x + d->width + k * s->y, d->y - k * s->x };
+            break;
+        case 2:
+            du = (Vector2){ -k, 0 };
+            dv = (Vector2){ 0, -k };
+            origin = (Vector2){ d->x + d->width + k * s->x, d->y + d->height + k * s->y };
+            break;
+        default:
+            du = (Vector2){ 0, -k };
+            dv = (Vector2){ k, 0 };
+            origin = (Vector2){ d->x - k * s->y, d->y + d->height + k * s->x };
+            break;
+    }
+
+    // The image is the unit square, its top at 1, and PDF y runs upwards
+    const float matrix[6] = {
+        scale * du.x * imgW, -scale * du.y * imgW,
+        -scale * dv.x * imgH, scale * dv.y * imgH,
+        left + scale * (origin.x + dv.x * imgH), top - scale * (origin.y + dv.y * imgH)
+    };
+    return pdf_add_image_transform(pdf, NULL, image, matrix, left + d->x * scale, top - (d->y + d->height) * scale, d->width * scale, d->height * scale);
+}
+
+static bool WritePdf(const State* state, ImageEntry** pages, int pageCount, const char* pdfPath, bool append) {
+    Canvas canvas = GetCanvas(state);
+    float pageW = canvas.width * 72.0f;
+    float pageH = canvas.height * 72.0f;
+
+    struct pdf_info info = { .creator = "Raylib Viewer", .producer = "PDFGen", .title = "Image Compilation" };
+    struct pdf_doc *pdf = pdf_create(pageW, pageH, &info);
+    if (!pdf) return false;
+    pdf_set_font(pdf, "Helvetica");
+    pdf_set_compression(pdf, 6);
+    pdf_set_save_flags(pdf, state->exportSaveFlags);
+
+    for (int i = 0; i < pageCount; i++) {
+        pdf_append_page(pdf);
+        if (strcmp(pages[i]->path, "[BLANK_PAGE]") != 0) {
+            char cachePath[MAX_PATH_LEN];
+            GetExportCachePath(state, pages[i], cachePath);
+            PerfCount(cachePath[0] && FileExists(cachePath) ? PERF_EXPORT_CACHE_HIT : PERF_EXPORT_CACHE_MISS);
+            PerfZone load = PerfBegin(PERF_PDF_IMAGE);
+            struct pdf_object *image = pdf_load_image_file(pdf, pages[i]->path, cachePath[0] ? cachePath : NULL);
+            PerfEnd(load, GetFileName(pages[i]->path));
+            uint32_t imgW, imgH;
+            if (image && pdf_get_image_size(image, &imgW, &imgH) >= 0) {
+                const PageLayout* layout = &pages[i]->layout;
+                Placement place = PlacePage(GetPageArea(canvas, layout), layout, imgW, imgH);
+                if (place.dst.width > 0) AddPlacedImage(pdf, image, &place, 0, pageH, 72.0f);
+            } else {
+                TraceLog(LOG_WARNING, "EXPORT: Skipping %s: %s", pages[i]->path, pdf_get_err(pdf, NULL));
+            }
+        }
+    }
+
+    PerfZone save = PerfBegin(PERF_PDF_SAVE);
+    int result = append ? pdf_save_append(pdf, pdfPath) : pdf_save(pdf, pdfPath);
+    PerfEnd(save, NULL);
+    if (result < 0) {
+        TraceLog(LOG_WARNING, "EXPORT: %s", pdf_get_err(pdf, NULL));
+    }
+    pdf_destroy(pdf);
+    return result >= 0;
+}
+
+// Contact sheet proxies are JPEG copies of the gallery thumbnails, kept next
+// to them so the PDF can take the compressed data as is. They're remade
+// whenever the source is newer. Falls back to the PNG thumbnail itself if
+// raylib can't write JPEGs.
+static bool GetSheetProxy(const State* state, const ImageEntry* entry, char* outPath) {
+    char thumbPath[MAX_PATH_LEN];
+    GetThumbPath(state->folder, GetFileName(entry->path), thumbPath);
+    snprintf(outPath, MAX_PATH_LEN, "%s/.rayview_thumbs/%s__proxy.jpg", state->folder, GetFileName(entry->path));
+    if (FileExists(outPath) && GetFileModTime(outPath) >= GetFileModTime(entry->path)) return true;
+
+    Image thumb = LoadThumbnail(state->folder, entry->path);
+    if (!thumb.data) return false;
+    bool ok = ExportImage(thumb, outPath);
+    UnloadImage(thumb);
+    if (!ok) strcpy(outPath, thumbPath);
+    return true;
+}
+
+// Shortens text with a trailing "..." until it fits in width
+static void FitCaption(struct pdf_doc* pdf, const char* text, float size, float width, char* out, size_t outLen) {
+    float textW = 0;
+    size_t len = strlen(text);
+
+    snprintf(out, outLen, "%s", text);
+    if (len >= outLen) len = outLen - 1;
+    while (len > 0 && pdf_get_font_text_width(pdf, "Helvetica", out, size, &textW) >= 0 && textW > width) {
+        len--;
+        snprintf(out, outLen, "%.*s...", (int)len, text);
+    }
+}
+
+bool ExportContactSheet(const State* state, ImageEntry** pages, int pageCount, int perPage, const char* pdfPath) {
+    static const struct { int count, cols, rows; } grids[] = { { 4, 2, 2 }, { 9, 3, 3 }, { 20, 4, 5 }, { 35, 5, 7 } };
+    Canvas canvas = GetCanvas(state);
+    int cols = 0, rows = 0;
+
+    for (size_t i = 0; i < sizeof(grids) / sizeof(grids[0]); i++) {
+        if (grids[i].count == perPage) {
+            cols = grids[i].cols;
+            rows = grids[i].rows;
+        }
+    }
+    if (cols == 0) return false;
+    PerfZone zone = PerfBegin(PERF_EXPORT);
+    int64_t start = PerfNow();
+
+    float pageW = canvas.width * 72.0f;
+    float pageH = canvas.height * 72.0f;
+    float drawX = canvas.margins[2] * 72.0f;
+    float drawY = canvas.margins[1] * 72.0f;
+    float drawW = (canvas.width - canvas.margins[2] - canvas.margins[3]) * 72.0f;
+    float drawH = (canvas.height - canvas.margins[0] - canvas.margins[1]) * 72.0f;
+    if (drawW > drawH) {
+        int t = cols; // Landscape sheets get the longer side across
+        cols = rows;
+        rows = t;
+    }
+
+    float cellW = drawW / cols;
+    float cellH = drawH / rows;
+    float gap = fminf(cellW, cellH) * 0.06f;
+    float captionSize = fmaxf(5.0f, fminf(9.0f, cellH * 0.06f));
+    float captionH = captionSize * 1.6f;
+
+    struct pdf_info info = { .creator = "Raylib Viewer", .producer = "PDFGen", .title = "Contact Sheet" };
+    struct pdf_doc *pdf = pdf_create(pageW, pageH, &info);
+    if (!pdf) {
+        PerfEnd(zone, NULL);
+        return false;
+    }
+    pdf_set_font(pdf, "Helvetica");
+    pdf_set_compression(pdf, 6);
+    pdf_set_save_flags(pdf, state->exportSaveFlags);
+
+    for (int i = 0; i < pageCount; i++) {
+        int cell = i % (cols * rows);
+        if (cell == 0) pdf_append_page(pdf);
+        if (strcmp(pages[i]->path, "[BLANK_PAGE]") == 0) continue; // Left as an empty cell
+
+        // Cells fill left to right, top to bottom; PDF y runs upwards
+        float x = drawX + (cell % cols) * cellW + gap / 2.0f;
+        float y = drawY + drawH - (cell / cols + 1) * cellH + gap / 2.0f;
+        float w = cellW - gap;
+        float h = cellH - gap - captionH;
+
+        char proxyPath[MAX_PATH_LEN];
+        struct pdf_object *image = NULL;
+        uint32_t imgW, imgH;
+        if (GetSheetProxy(state, pages[i], proxyPath)) {
+            PerfZone load = PerfBegin(PERF_PDF_IMAGE);
+            image = pdf_load_image_file(pdf, proxyPath, NULL);
+            PerfEnd(load, GetFileName(pages[i]->path));
+        }
+        if (image && pdf_get_image_size(image, &imgW, &imgH) >= 0) {
+            // Proofs show the page's crop and turn, but always the whole of it
+            PageLayout layout = pages[i]->layout;
+            layout.fit = PAGE_FIT;
+            Placement place = PlacePage((Rectangle){ 0, 0, w, h }, &layout, imgW, imgH);
+            if (place.dst.width > 0) AddPlacedImage(pdf, image, &place, x, y + captionH + h, 1.0f);
+        } else {
+            TraceLog(LOG_WARNING, "EXPORT: Skipping %s: %s", pages[i]->path, pdf_get_err(pdf, NULL));
+        }
+
+        char caption[MAX_FILENAME_LEN];
+        float captionW = 0;
+        FitCaption(pdf, GetFileName(pages[i]->path), captionSize, w, caption, sizeof(caption));
+        pdf_get_font_text_width(pdf, "Helvetica", caption, captionSize, &captionW);
+        pdf_add_text(pdf, NULL, caption, captionSize, x + (w - captionW) / 2.0f, y + captionSize * 0.4f, PDF_BLACK);
+    }
+
+    PerfZone save = PerfBegin(PERF_PDF_SAVE);
+    int result = pdf_save(pdf, pdfPath);
+    PerfEnd(save, NULL);
+    if (result < 0) {
+        TraceLog(LOG_WARNING, "EXPORT: %s", pdf_get_err(pdf, NULL));
+    } else {
+        PerfLogExport("contact_sheet", (pageCount + cols * rows - 1) / (cols * rows), GetFileBytes(pdfPath), PerfNow() - start);
+    }
+    pdf_destroy(pdf);
+
+    // Whatever was there before has been replaced, so its manifest no longer applies
+    char manifestPath[MAX_PATH_LEN];
+    GetManifestPath(pdfPath, manifestPath);
+    remove(manifestPath);
+    PerfEnd(zone, GetFileName(pdfPath));
+    return result >= 0;
+}
+
+bool ExportPdf(const State* state, ImageEntry** pages, int pageCount, const char* pdfPath) {
+    int exported = CountExportedPages(state, pages, pageCount, pdfPath);
+    if (exported == pageCount) return true; // Nothing new since the last export
+    PerfZone zone = PerfBegin(PERF_EXPORT);
+    int64_t start = PerfNow();
+    long long bytesBefore = GetFileBytes(pdfPath);
+
+    // Unchanged pages stay where they are in the file; only new ones are
+    // written. An update would undo linearization, so those are rewritten.
+    bool appended = exported > 0 && !(state->exportSaveFlags & PDF_SAVE_LINEARIZED) && WritePdf(state, pages + exported, pageCount - exported, pdfPath, true);
+    bool ok = appended || WritePdf(state, pages, pageCount, pdfPath, false);
+
+    if (ok) {
+        long long bytes = GetFileBytes(pdfPath) - (appended ? bytesBefore : 0);
+        PerfLogExport(appended ? "pdf_append" : "pdf", appended ? pageCount - exported : pageCount, bytes, PerfNow() - start);
+        WriteManifest(state, pages, pageCount, pdfPath);
+        PruneExportCache(state);
+    } else {
+        char manifestPath[MAX_PATH_LEN];
+        GetManifestPath(pdfPath, manifestPath);
+        remove(manifestPath);
+    }
+    PerfEnd(zone, GetFileName(pdfPath));
+    return ok;
+}
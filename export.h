@@ -0,0 +1,20 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "state.h"
+#include <stdbool.h>
+
+// Images per page offered for export: one per page, then contact sheets
+#define SHEET_LAYOUTS { 1, 4, 9, 20, 35 }
+
+// Writes the pages, in order, to a PDF at pdfPath using the canvas and
+// margins in state. If pdfPath is an earlier export with the same layout
+// whose pages are a prefix of these, only the new pages are appended to it.
+bool ExportPdf(const State* state, ImageEntry** pages, int pageCount, const char* pdfPath);
+
+// Writes the pages as contact sheets, perPage (4, 9, 20 or 35) images to a
+// sheet with each file name underneath. Images are drawn from small proxies
+// made from the gallery thumbnails, not the originals, to keep proofs small.
+bool ExportContactSheet(const State* state, ImageEntry** pages, int pageCount, int perPage, const char* pdfPath);
+
+#endif // EXPORT_H
@@ -0,0 +1,771 @@
+// Fuzz target and throughput benchmark for pdfgen's image parsers:
+// pdf_parse_image_header, and pdf_add_image_data behind it, which between
+// them walk every byte of each image an export embeds.
+//
+// Built with -DFUZZ_LIBFUZZER and clang's -fsanitize=fuzzer this is a plain
+// libFuzzer target (`make fuzz-libfuzzer`). Otherwise it's a standalone
+// driver, run under ASan/UBSan by `make fuzz`, that mutates a seed corpus
+// with a fixed seed, checks parsing time grows linearly with the input,
+// checks documents past 4 GB save and append with intact cross-references
+// (and that linearizing one is refused), and reports throughput per format.
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 // for a 64-bit off_t & fseeko
+#endif
+#include "pdfgen.h"
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+// Feeds one input through both entry points, on a fresh document so each
+// run starts from the same state
+static void RunOne(const uint8_t* data, size_t len) {
+    struct pdf_img_info info;
+    char err[128];
+    pdf_parse_image_header(&info, data, len, err, sizeof(err));
+
+    struct pdf_doc* pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    if (!pdf) return;
+    pdf_append_page(pdf);
+    pdf_add_image_data(pdf, NULL, 0, 0, 100, 100, data, len);
+    pdf_destroy(pdf);
+}
+
+#ifdef FUZZ_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    RunOne(data, size);
+    return 0;
+}
+
+#else
+
+#define MAX_INPUTS 256
+#define MAX_INPUT_LEN (4 << 20)
+
+typedef struct {
+    uint8_t* data;
+    size_t len;
+    size_t capacity;
+} Buffer;
+
+typedef struct {
+    char name[64];
+    Buffer buf;
+} Input;
+
+static Input inputs[MAX_INPUTS];
+static int inputCount;
+static uint64_t rngState = 0x9e3779b97f4a7c15ull;
+
+// The input being run, written out if a sanitizer stops the process
+static const Buffer* current;
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t Random(void) {
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return (uint32_t)(rngState >> 16);
+}
+
+static void Reserve(Buffer* b, size_t extra) {
+    if (b->len + extra <= b->capacity) return;
+    size_t capacity = b->capacity ? b->capacity : 256;
+    while (capacity < b->len + extra) capacity *= 2;
+    uint8_t* data = realloc(b->data, capacity);
+    if (!data) {
+        fprintf(stderr, "fuzz: out of memory\n");
+        exit(1);
+    }
+    b->data = data;
+    b->capacity = capacity;
+}
+
+static void Put(Buffer* b, const void* data, size_t len) {
+    Reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void PutByte(Buffer* b, uint8_t v) {
+    Put(b, &v, 1);
+}
+
+static void PutBE16(Buffer* b, uint32_t v) {
+    uint8_t bytes[2] = { v >> 8, v };
+    Put(b, bytes, 2);
+}
+
+static void PutBE32(Buffer* b, uint32_t v) {
+    uint8_t bytes[4] = { v >> 24, v >> 16, v >> 8, v };
+    Put(b, bytes, 4);
+}
+
+static void PutLE16(Buffer* b, uint32_t v) {
+    uint8_t bytes[2] = { v, v >> 8 };
+    Put(b, bytes, 2);
+}
+
+static void PutLE32(Buffer* b, uint32_t v) {
+    uint8_t bytes[4] = { v, v >> 8, v >> 16, v >> 24 };
+    Put(b, bytes, 4);
+}
+
+static Buffer* AddInput(const char* name) {
+    if (inputCount == MAX_INPUTS) return NULL;
+    Input* input = &inputs[inputCount++];
+    snprintf(input->name, sizeof(input->name), "%s", name);
+    input->buf = (Buffer){ 0 };
+    return &input->buf;
+}
+
+static void PutPngChunk(Buffer* b, const char* type, const uint8_t* data, uint32_t len) {
+    PutBE32(b, len);
+    size_t start = b->len;
+    Put(b, type, 4);
+    if (len) Put(b, data, len);
+    PutBE32(b, crc32(0, b->data + start, len + 4));
+}
+
+// Lays out the raw rows of each pass, a filter byte and then the packed
+// samples, filled with noise. With no rows to fill, just returns their size.
+static size_t FillPngRows(uint8_t* rows, uint32_t width, uint32_t height, int bitsPerPixel, int interlace) {
+    static const uint8_t adam7[7][4] = { { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 }, { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 } };
+    static const uint8_t single[1][4] = { { 0, 0, 1, 1 } };
+    const uint8_t(*passes)[4] = interlace ? adam7 : single;
+    size_t len = 0;
+
+    for (int p = 0; p < (interlace ? 7 : 1); p++) {
+        uint32_t pw = width > passes[p][0] ? (width - passes[p][0] + passes[p][2] - 1) / passes[p][2] : 0;
+        uint32_t ph = height > passes[p][1] ? (height - passes[p][1] + passes[p][3] - 1) / passes[p][3] : 0;
+        size_t rowLen = ((size_t)pw * bitsPerPixel + 7) / 8;
+        for (uint32_t y = 0; pw && y < ph; y++) {
+            if (rows) {
+                rows[len] = 0;
+                for (size_t i = 1; i <= rowLen; i++) rows[len + i] = Random();
+            }
+            len += 1 + rowLen;
+        }
+    }
+    return len;
+}
+
+// A valid PNG of noise, interlaced or not. extraChunks tiny tEXt chunks go
+// before the data, which is split into idatChunks pieces.
+static void MakePng(Buffer* b, uint32_t width, uint32_t height, int colorType, int depth, int interlace, int extraChunks, int idatChunks) {
+    static const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    const int channels[] = { 1, 0, 3, 1, 2, 0, 4 };
+    uint8_t ihdr[13];
+
+    Put(b, signature, sizeof(signature));
+    for (int i = 0; i < 4; i++) {
+        ihdr[i] = width >> (24 - i * 8);
+        ihdr[4 + i] = height >> (24 - i * 8);
+    }
+    ihdr[8] = depth;
+    ihdr[9] = colorType;
+    ihdr[10] = ihdr[11] = 0;
+    ihdr[12] = interlace;
+    PutPngChunk(b, "IHDR", ihdr, sizeof(ihdr));
+    if (colorType == 3) {
+        uint8_t palette[48];
+        for (int i = 0; i < 48; i++) palette[i] = i * 5;
+        PutPngChunk(b, "PLTE", palette, sizeof(palette));
+    }
+    for (int i = 0; i < extraChunks; i++) PutPngChunk(b, "tEXt", (const uint8_t*)"a", 1);
+
+    size_t rawLen = FillPngRows(NULL, width, height, channels[colorType] * depth, interlace);
+    uint8_t* raw = malloc(rawLen ? rawLen : 1);
+    uLongf packedLen = compressBound(rawLen);
+    uint8_t* packed = malloc(packedLen);
+    if (!raw || !packed) {
+        fprintf(stderr, "fuzz: out of memory\n");
+        exit(1);
+    }
+    FillPngRows(raw, width, height, channels[colorType] * depth, interlace);
+    compress2(packed, &packedLen, raw, rawLen, 6);
+    uint32_t piece = (packedLen + idatChunks - 1) / idatChunks;
+    for (uLongf pos = 0; pos < packedLen; pos += piece) {
+        PutPngChunk(b, "IDAT", packed + pos, packedLen - pos < piece ? packedLen - pos : piece);
+    }
+    PutPngChunk(b, "IEND", NULL, 0);
+    free(raw);
+    free(packed);
+}
+
+// Enough of a baseline JPEG for the header parser, which is all pdfgen
+// reads: segments are copied into the PDF as they are. extraSegments APP1
+// segments, and fill bytes before each marker, come before the frame header.
+static void MakeJpeg(Buffer* b, uint32_t width, uint32_t height, int components, int extraSegments, int fill) {
+    PutBE16(b, 0xffd8);
+    for (int i = 0; i < extraSegments; i++) {
+        for (int f = 0; f < fill; f++) PutByte(b, 0xff);
+        PutBE16(b, 0xffe1);
+        PutBE16(b, 4);
+        PutBE16(b, 0);
+    }
+    PutBE16(b, 0xffc0);
+    PutBE16(b, 8 + 3 * components);
+    PutByte(b, 8);
+    PutBE16(b, height);
+    PutBE16(b, width);
+    PutByte(b, components);
+    for (int c = 0; c < components; c++) {
+        PutByte(b, c + 1);
+        PutByte(b, 0x11);
+        PutByte(b, 0);
+    }
+    PutBE16(b, 0xffd9);
+}
+
+static void MakeBmp(Buffer* b, int32_t width, int32_t height, int bits) {
+    uint32_t stride = ((uint32_t)width * (bits / 8) + 3) & ~3u;
+    uint32_t size = 54 + stride * (uint32_t)abs(height);
+    Put(b, "BM", 2);
+    PutLE32(b, size);
+    PutLE32(b, 0);
+    PutLE32(b, 54);
+    PutLE32(b, 40);
+    PutLE32(b, width);
+    PutLE32(b, height);
+    PutLE16(b, 1);
+    PutLE16(b, bits);
+    for (int i = 0; i < 6; i++) PutLE32(b, 0);
+    for (uint32_t i = 54; i < size; i++) PutByte(b, i * 7);
+}
+
+static void MakePpm(Buffer* b, uint32_t width, uint32_t height, bool color, int comments) {
+    char header[64];
+    Put(b, color ? "P6\n" : "P5\n", 3);
+    for (int i = 0; i < comments; i++) Put(b, "# comment\n", 10);
+    int len = snprintf(header, sizeof(header), "%u %u\n255\n", width, height);
+    Put(b, header, len);
+    for (size_t i = 0; i < (size_t)width * height * (color ? 3 : 1); i++) PutByte(b, i * 13);
+}
+
+static void AddSeeds(void) {
+    MakePng(AddInput("png_grey8"), 17, 9, 0, 8, 0, 0, 1);
+    MakePng(AddInput("png_grey1"), 33, 5, 0, 1, 0, 0, 1);
+    MakePng(AddInput("png_rgb8"), 16, 16, 2, 8, 0, 1, 3);
+    MakePng(AddInput("png_indexed4"), 15, 7, 3, 4, 0, 0, 1);
+    MakePng(AddInput("png_grey_alpha8"), 9, 9, 4, 8, 0, 0, 2);
+    MakePng(AddInput("png_rgba16"), 7, 5, 6, 16, 0, 0, 1);
+    MakePng(AddInput("png_rgb8_interlaced"), 13, 11, 2, 8, 1, 0, 1);
+    MakePng(AddInput("png_rgba8_interlaced"), 3, 2, 6, 8, 1, 0, 1);
+    MakeJpeg(AddInput("jpeg_rgb"), 640, 480, 3, 1, 0);
+    MakeJpeg(AddInput("jpeg_grey"), 32, 32, 1, 0, 2);
+    MakeBmp(AddInput("bmp_24"), 5, 3, 24);
+    MakeBmp(AddInput("bmp_24_top_down"), 6, -4, 24);
+    MakeBmp(AddInput("bmp_32"), 3, 3, 32);
+    MakePpm(AddInput("ppm_rgb"), 4, 3, true, 0);
+    MakePpm(AddInput("pgm_grey"), 5, 2, false, 2);
+}
+
+static bool ReadFile(const char* path, Buffer* b) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0 && b->len + n <= MAX_INPUT_LEN) Put(b, chunk, n);
+    fclose(f);
+    return b->len > 0;
+}
+
+static void AddCorpus(const char* dirPath) {
+    DIR* dir = opendir(dirPath);
+    if (!dir) {
+        fprintf(stderr, "fuzz: unable to read '%s'\n", dirPath);
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[1024];
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "%s/%s", dirPath, entry->d_name);
+        Buffer* b = AddInput(entry->d_name);
+        if (!b) break;
+        if (!ReadFile(path, b)) {
+            free(b->data);
+            inputCount--;
+        }
+    }
+    closedir(dir);
+}
+
+static void SaveCurrent(void) {
+    if (!current) return;
+    FILE* f = fopen("fuzz-crash.bin", "wb");
+    if (f) {
+        fwrite(current->data, 1, current->len, f);
+        fclose(f);
+        fprintf(stderr, "fuzz: input written to fuzz-crash.bin\n");
+    }
+}
+
+// ASan and UBSan call this before they abort, when they're linked in
+extern void __sanitizer_set_death_callback(void (*callback)(void)) __attribute__((weak));
+
+static void Mutate(Buffer* b) {
+    static const uint32_t interesting[] = { 0, 1, 2, 0x7f, 0x80, 0xff, 0x7fff, 0xffff, 0x10000, 0x7fffffff, 0x80000000, 0xffffffff };
+    int ops = 1 + Random() % 4;
+
+    for (int op = 0; op < ops && b->len > 0; op++) {
+        size_t pos = Random() % b->len;
+        switch (Random() % 6) {
+        case 0:
+            b->data[pos] ^= 1 << (Random() % 8);
+            break;
+        case 1:
+            b->data[pos] = interesting[Random() % 6];
+            break;
+        case 2:
+            if (pos + 4 <= b->len) {
+                uint32_t v = interesting[Random() % 12];
+                for (int i = 0; i < 4; i++) b->data[pos + i] = v >> (Random() % 2 ? 24 - i * 8 : i * 8);
+            }
+            break;
+        case 3:
+            b->len = pos; // Truncate
+            break;
+        case 4: {
+            // Repeat a short run, stretching whatever is there
+            size_t run = 1 + Random() % 16;
+            if (pos + run > b->len) run = b->len - pos;
+            if (b->len + run * 8 > MAX_INPUT_LEN) break;
+            Reserve(b, run * 8);
+            memmove(b->data + pos + run * 8, b->data + pos, b->len - pos);
+            for (int i = 0; i < 8; i++) memcpy(b->data + pos + i * run, b->data + pos + run * 8, run);
+            b->len += run * 8;
+            break;
+        }
+        default:
+            b->data[pos] = Random();
+            break;
+        }
+    }
+}
+
+static int Fuzz(int iterations) {
+    Buffer b = { 0 };
+    double slowest = 0;
+    char slowestName[64] = "";
+
+    for (int i = 0; i < iterations; i++) {
+        const Input* seed = &inputs[Random() % inputCount];
+        b.len = 0;
+        Put(&b, seed->buf.data, seed->buf.len);
+        Mutate(&b);
+
+        current = &b;
+        double start = Now();
+        RunOne(b.data, b.len);
+        double elapsed = Now() - start;
+        current = NULL;
+
+        if (elapsed > slowest) {
+            slowest = elapsed;
+            snprintf(slowestName, sizeof(slowestName), "%s", seed->name);
+        }
+    }
+    free(b.data);
+    printf("fuzz: %d mutated inputs, slowest %.2f ms (from %s)\n", iterations, slowest * 1000.0, slowestName);
+    return 0;
+}
+
+// Time for one run over an input, repeated until the total is measurable
+static double TimeRun(const Buffer* b) {
+    int runs = 0;
+    double start = Now(), elapsed;
+    do {
+        RunOne(b->data, b->len);
+        runs++;
+        elapsed = Now() - start;
+    } while (elapsed < 0.05);
+    return elapsed / runs;
+}
+
+// Inputs built to stress each parser loop, at a base size and 16 times it.
+// Linear parsing takes about 16 times as long on the larger one; the check
+// allows a generous 4x on top of that for noise, well short of the 256x a
+// quadratic loop would take.
+static int CheckLinear(void) {
+    const int scale = 16;
+    const double limit = 4.0;
+    int failures = 0;
+
+    for (int test = 0; test < 6; test++) {
+        Buffer small = { 0 }, large = { 0 };
+        const char* name = "";
+        for (int size = 0; size < 2; size++) {
+            Buffer* b = size ? &large : &small;
+            int n = size ? 2000 * scale : 2000;
+            switch (test) {
+            case 0: name = "png_ancillary_chunks"; MakePng(b, 8, 8, 2, 8, 0, n, 1); break;
+            case 1: name = "png_idat_chunks"; MakePng(b, 64, n / 8, 2, 8, 0, 0, n); break;
+            case 2: name = "png_interlaced_rows"; MakePng(b, 64, n / 4, 6, 8, 1, 0, 1); break;
+            case 3: name = "jpeg_segments"; MakeJpeg(b, 8, 8, 3, n, 3); break;
+            case 4: name = "bmp_rows"; MakeBmp(b, 61, n / 8, 24); break;
+            case 5: name = "ppm_comments"; MakePpm(b, 8, 8, true, n); break;
+            }
+        }
+
+        double ratio = (TimeRun(&large) / large.len) / (TimeRun(&small) / small.len);
+        printf("fuzz: linear %-22s %8zu -> %9zu bytes, %.2fx time per byte\n", name, small.len, large.len, ratio);
+        if (ratio > limit) {
+            fprintf(stderr, "fuzz: %s grows faster than its input\n", name);
+            failures++;
+        }
+        free(small.data);
+        free(large.data);
+    }
+    return failures;
+}
+
+// Saving behind a sparse hole puts every object and cross-reference past
+// 4 GB without writing anywhere near that much. Those offsets need more
+// than 32 bits, so truncating one anywhere leaves an entry that doesn't
+// point at its object, or a startxref pdfgen can't append to.
+#define LARGE_OFFSET ((int64_t)9 << 29)
+#define LARGE_FILE "fuzz-offsets.pdf"
+
+// A few pages sharing one image, as an export of a repeated asset would
+static struct pdf_doc* MakeOffsetDoc(int flags, int pages) {
+    static uint8_t pixels[32 * 32 * 3];
+    struct pdf_doc* pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+    if (!pdf) return NULL;
+    for (size_t i = 0; i < sizeof(pixels); i++) pixels[i] = (uint8_t)(i * 7);
+    pdf_set_save_flags(pdf, flags);
+    for (int i = 0; i < pages; i++) {
+        pdf_append_page(pdf);
+        pdf_add_text(pdf, NULL, "offsets", 12, 50, 50, PDF_BLACK);
+        pdf_add_rgb24(pdf, NULL, 50, 100, 100, 100, pixels, 32, 32);
+    }
+    return pdf;
+}
+
+// The offset after the last startxref in the file, or -1
+static int64_t ReadStartXref(FILE* f) {
+    char tail[64];
+    long long offset = -1;
+    if (fseeko(f, -(off_t)(sizeof(tail) - 1), SEEK_END) != 0) return -1;
+    size_t n = fread(tail, 1, sizeof(tail) - 1, f);
+    tail[n] = '\0';
+    for (size_t i = n; i-- > 0;) {
+        if (strncmp(tail + i, "startxref", 9) == 0) {
+            sscanf(tail + i + 9, "%lld", &offset);
+            break;
+        }
+    }
+    return offset;
+}
+
+// Whether object num starts at offset, which has to be past the hole
+static bool ObjectAt(FILE* f, long long offset, int num) {
+    char line[64];
+    int found;
+    if (offset < LARGE_OFFSET || fseeko(f, offset, SEEK_SET) != 0 || !fgets(line, sizeof(line), f) ||
+        sscanf(line, "%d 0 obj", &found) != 1 || found != num) {
+        fprintf(stderr, "fuzz: xref entry for object %d doesn't point at it\n", num);
+        return false;
+    }
+    return true;
+}
+
+static int CheckXrefTable(FILE* f, int64_t offset, int64_t* prev) {
+    char line[256];
+    long long offsets[64];
+    int nums[64], count = 0;
+
+    if (fseeko(f, offset, SEEK_SET) != 0 || !fgets(line, sizeof(line), f) || strncmp(line, "xref", 4) != 0) return -1;
+    while (fgets(line, sizeof(line), f) && strncmp(line, "trailer", 7) != 0) {
+        int first, entries;
+        if (sscanf(line, "%d %d", &first, &entries) != 2) return -1;
+        for (int i = 0; i < entries; i++) {
+            char entry[21];
+            if (fread(entry, 1, 20, f) != 20) return -1;
+            entry[20] = '\0';
+            if (entry[17] != 'n' || count == 64) continue;
+            offsets[count] = strtoll(entry, NULL, 10);
+            nums[count++] = first + i;
+        }
+    }
+    while (fgets(line, sizeof(line), f) && strncmp(line, ">>", 2) != 0) {
+        long long older;
+        if (sscanf(line, " /Prev %lld", &older) == 1) *prev = older;
+    }
+    for (int i = 0; i < count; i++) {
+        if (!ObjectAt(f, offsets[i], nums[i])) return -1;
+    }
+    return count;
+}
+
+// Undoes the PNG row filters of a /Predictor 12 stream, one byte per pixel
+static bool Unfilter(uint8_t* rows, size_t len, int columns) {
+    size_t stride = columns + 1;
+    if (len % stride) return false;
+    for (size_t r = 0; r < len / stride; r++) {
+        uint8_t* row = rows + r * stride + 1;
+        const uint8_t* up = r ? row - stride : NULL;
+        for (int i = 0; i < columns; i++) {
+            int a = i ? row[i - 1] : 0, b = up ? up[i] : 0, c = up && i ? up[i - 1] : 0;
+            int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+            switch (row[-1]) {
+            case 0: break;
+            case 1: row[i] += a; break;
+            case 2: row[i] += b; break;
+            case 3: row[i] += (a + b) / 2; break;
+            case 4: row[i] += pa <= pb && pa <= pc ? a : pb <= pc ? b : c; break;
+            default: return false;
+            }
+        }
+    }
+    return true;
+}
+
+static int CheckXrefStream(FILE* f, int64_t offset, int64_t* prev) {
+    char dict[4096];
+    const char* key;
+    int width = 0, size = 0, index[64], subsections = 0, count = 0;
+    long long older;
+    size_t length = 0, entries = 0;
+
+    if (fseeko(f, offset, SEEK_SET) != 0) return -1;
+    size_t n = fread(dict, 1, sizeof(dict) - 1, f);
+    dict[n] = '\0';
+    char* data = strstr(dict, ">>stream\r\n");
+    if (!data) return -1;
+    *data = '\0';
+    data += strlen(">>stream\r\n");
+    if ((key = strstr(dict, "/W [1 ")) == NULL || sscanf(key, "/W [1 %d 2]", &width) != 1 || width < 1 || width > 8 ||
+        (key = strstr(dict, "/Length ")) == NULL || sscanf(key, "/Length %zu", &length) != 1 ||
+        (key = strstr(dict, "/Size ")) == NULL || sscanf(key, "/Size %d", &size) != 1)
+        return -1;
+    if ((key = strstr(dict, "/Prev ")) != NULL && sscanf(key, "/Prev %lld", &older) == 1) *prev = older;
+    if ((key = strstr(dict, "/Index [")) != NULL) {
+        key += strlen("/Index [");
+        for (int used; subsections < 64 && sscanf(key, "%d%n", &index[subsections], &used) == 1; subsections++) key += used;
+    } else {
+        index[0] = 0;
+        index[1] = size;
+        subsections = 2;
+    }
+    for (int i = 1; i < subsections; i += 2) entries += index[i];
+
+    // The stream may run past what was read with the dictionary
+    uint8_t* compressed = malloc(length);
+    uLongf rowsLen = entries * (width + 4);
+    uint8_t* rows = malloc(rowsLen ? rowsLen : 1);
+    bool ok = compressed && rows && fseeko(f, offset + (data - dict), SEEK_SET) == 0 &&
+              fread(compressed, 1, length, f) == length && uncompress(rows, &rowsLen, compressed, length) == Z_OK &&
+              rowsLen == entries * (width + 4) && Unfilter(rows, rowsLen, width + 3);
+    const uint8_t* row = rows;
+    for (int s = 0; ok && s + 1 < subsections; s += 2) {
+        for (int i = 0; ok && i < index[s + 1]; i++, row += width + 4) {
+            long long field = 0;
+            for (int b = 0; b < width; b++) field = (field << 8) | row[2 + b];
+            if (row[1] != 1) continue;
+            ok = ObjectAt(f, field, index[s] + i);
+            count++;
+        }
+    }
+    free(compressed);
+    free(rows);
+    return ok ? count : -1;
+}
+
+// Follows the cross-reference section at offset, table or stream, checking
+// that each object in it starts where its entry says. Returns how many were
+// checked, or -1, and sets prev to the older section's offset (-1 for none).
+static int CheckXref(FILE* f, int64_t offset, int64_t* prev) {
+    char start[5] = "";
+    *prev = -1;
+    if (fseeko(f, offset, SEEK_SET) != 0 || fread(start, 1, 4, f) != 4) return -1;
+    return strcmp(start, "xref") == 0 ? CheckXrefTable(f, offset, prev) : CheckXrefStream(f, offset, prev);
+}
+
+// Saves a document past 4 GB, in the classic layout and with object
+// streams, then appends pages to it twice. Appending makes pdfgen read
+// back every earlier section, so this covers both writing and parsing, and
+// each new section is also checked entry by entry here.
+static int CheckLargeOffsets(void) {
+    static const char* names[] = { "xref_table", "xref_stream" };
+    static const int flags[] = { 0, PDF_SAVE_OBJECT_STREAMS };
+    int failures = 0;
+
+    for (int layout = 0; layout < 2; layout++) {
+        int64_t startxref = -1;
+        int checked = 0;
+        bool ok = true;
+
+        for (int update = 0; update < 3 && ok; update++) {
+            struct pdf_doc* pdf = MakeOffsetDoc(flags[layout], update ? 1 : 3);
+            int ret = -1;
+            if (pdf && update == 0) {
+                FILE* f = fopen(LARGE_FILE, "wb");
+                if (f) {
+                    ret = fseeko(f, LARGE_OFFSET, SEEK_SET) == 0 ? pdf_save_file(pdf, f) : -1;
+                    if (fclose(f) != 0) ret = -1;
+                }
+            } else if (pdf) {
+                ret = pdf_save_append(pdf, LARGE_FILE);
+            }
+            if (ret < 0) fprintf(stderr, "fuzz: %s save %d failed: %s\n", names[layout], update, pdf_get_err(pdf, NULL));
+            pdf_destroy(pdf);
+
+            FILE* f = ret < 0 ? NULL : fopen(LARGE_FILE, "rb");
+            int64_t older = startxref;
+            startxref = f ? ReadStartXref(f) : -1;
+            ok = startxref > LARGE_OFFSET && startxref > older;
+            if (ok) {
+                int64_t prev;
+                int n = CheckXref(f, startxref, &prev);
+                ok = n > 0 && prev == older;
+                if (ok) checked += n;
+            }
+            if (f) fclose(f);
+            if (!ok) fprintf(stderr, "fuzz: %s update %d has a bad cross-reference\n", names[layout], update);
+        }
+        remove(LARGE_FILE);
+
+        printf("fuzz: offsets %-21s startxref %" PRId64 ", %d entries checked\n", names[layout], startxref,
+               checked);
+        failures += !ok;
+    }
+    return failures;
+}
+
+// Linearized hint tables only have 32-bit offsets and lengths, so a file
+// with an image bigger than that has to be refused, not written with them
+// cut short. The JPEG is mostly hole, and is left in its file until saving.
+static int CheckLargeLinearized(void) {
+    static const uint8_t header[] = { 0xff, 0xd8, 0xff, 0xc0, 0, 17, 8, 0, 8, 0, 8, 3, 1, 0x11, 0, 2, 0x11, 0, 3, 0x11, 0 };
+    static const uint8_t end[] = { 0xff, 0xd9 };
+    const char* image = LARGE_FILE ".jpg";
+    int ret = -1;
+
+    FILE* f = fopen(image, "wb");
+    if (f) {
+        bool written = fwrite(header, sizeof(header), 1, f) == 1 && fseeko(f, LARGE_OFFSET, SEEK_SET) == 0 &&
+                       fwrite(end, sizeof(end), 1, f) == 1;
+        if (fclose(f) == 0 && written) {
+            struct pdf_doc* pdf = pdf_create(PDF_A4_WIDTH, PDF_A4_HEIGHT, NULL);
+            if (pdf) {
+                pdf_set_save_flags(pdf, PDF_SAVE_LINEARIZED);
+                pdf_append_page(pdf);
+                pdf_append_page(pdf);
+                if (pdf_add_image_file(pdf, NULL, 50, 50, 100, 100, image) >= 0) ret = pdf_save(pdf, LARGE_FILE);
+                pdf_destroy(pdf);
+            }
+        }
+    }
+    remove(image);
+    remove(LARGE_FILE);
+
+    printf("fuzz: offsets %-21s %s\n", "linearized", ret == -EFBIG ? "refused past 4 GB" : "not refused");
+    return ret != -EFBIG;
+}
+
+// Header parsing and full embedding throughput, per format
+static void Throughput(void) {
+    static const char* formats[] = { "png", "jpeg", "bmp", "ppm" };
+    static const int formatIds[] = { IMAGE_PNG, IMAGE_JPG, IMAGE_BMP, IMAGE_PPM };
+    for (int f = 0; f < 4; f++) {
+        double parseTime = 0, addTime = 0;
+        long long bytes = 0;
+        int files = 0;
+
+        for (int i = 0; i < inputCount; i++) {
+            struct pdf_img_info info;
+            char err[128];
+            const Buffer* b = &inputs[i].buf;
+            if (pdf_parse_image_header(&info, b->data, b->len, err, sizeof(err)) < 0 || info.image_format != formatIds[f]) continue;
+
+            double start = Now();
+            int runs = 0;
+            do {
+                pdf_parse_image_header(&info, b->data, b->len, err, sizeof(err));
+                runs++;
+            } while (Now() - start < 0.01);
+            parseTime += (Now() - start) / runs;
+            addTime += TimeRun(b);
+            bytes += b->len;
+            files++;
+        }
+        if (files == 0) continue;
+        printf("fuzz: throughput %-4s %3d files, %10.0f headers/s, %8.1f MB/s embedded\n", formats[f], files,
+               files / parseTime, bytes / addTime / 1e6);
+    }
+}
+
+int main(int argc, char** argv) {
+    int iterations = 20000;
+    bool replay = false;
+    int failures = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--corpus") == 0 && i + 1 < argc) AddCorpus(argv[++i]);
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) rngState = strtoull(argv[++i], NULL, 0) | 1;
+        else if (strcmp(argv[i], "--write-seeds") == 0 && i + 1 < argc) {
+            const char* dir = argv[++i];
+            AddSeeds();
+            for (int s = 0; s < inputCount; s++) {
+                char path[1024];
+                snprintf(path, sizeof(path), "%s/%s", dir, inputs[s].name);
+                FILE* f = fopen(path, "wb");
+                if (!f || fwrite(inputs[s].buf.data, 1, inputs[s].buf.len, f) != inputs[s].buf.len) {
+                    fprintf(stderr, "fuzz: unable to write '%s'\n", path);
+                    return 1;
+                }
+                fclose(f);
+            }
+            return 0;
+        } else if (strcmp(argv[i], "--replay") == 0) {
+            replay = true;
+        } else if (replay && argv[i][0] != '-') {
+            Buffer* b = AddInput(argv[i]);
+            if (b && !ReadFile(argv[i], b)) fprintf(stderr, "fuzz: unable to read '%s'\n", argv[i]);
+        } else {
+            fprintf(stderr, "usage: fuzz [--corpus DIR] [--iterations N] [--seed N]\n"
+                            "       fuzz --write-seeds DIR\n"
+                            "       fuzz --replay FILE ...\n");
+            return 2;
+        }
+    }
+
+    if (__sanitizer_set_death_callback) __sanitizer_set_death_callback(SaveCurrent);
+
+    if (replay) {
+        for (int i = 0; i < inputCount; i++) {
+            current = &inputs[i].buf;
+            RunOne(inputs[i].buf.data, inputs[i].buf.len);
+        }
+        printf("fuzz: %d inputs replayed\n", inputCount);
+        return 0;
+    }
+
+    AddSeeds();
+    printf("fuzz: %d seeds\n", inputCount);
+    failures += Fuzz(iterations);
+    failures += CheckLinear();
+    failures += CheckLargeOffsets();
+    failures += CheckLargeLinearized();
+    Throughput();
+
+    for (int i = 0; i < inputCount; i++) free(inputs[i].buf.data);
+    return failures ? 1 : 0;
+}
+
+#endif // FUZZ_LIBFUZZER
@@ -0,0 +1,226 @@
+#include "journal.h"
+#include "settings.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Oldest edits are dropped past this many
+#define JOURNAL_LIMIT 1024
+
+typedef enum {
+    EDIT_INSERT, // image put in at position; undone by taking it out
+    EDIT_REMOVE, // image taken out from position; undone by putting it back
+    EDIT_MOVE    // pages at positions moved to start at position
+} EditKind;
+
+typedef struct {
+    EditKind kind;
+    int image;      // Index into state->images, or -1 for a move
+    int position;
+    bool blank;     // Insert of a new blank page, whose entry goes on undo
+    int* positions; // A move's pages, where they were, ascending
+    int count;
+} Edit;
+
+// A ring of edits: the oldest at first, cursor of them currently applied
+static struct {
+    Edit edits[JOURNAL_LIMIT];
+    int first;
+    int count;
+    int cursor;
+    int version;
+} journal;
+
+// The page order, kept between edits so none of them has to sort the
+// selection; rebuilt by the first edit after the journal is cleared
+static ImageEntry* pages[MAX_IMAGES];
+static int pageCount;
+static bool pagesValid;
+static ImageEntry* scratch[MAX_IMAGES];
+
+static Edit* EditAt(int i) {
+    return &journal.edits[(journal.first + i) % JOURNAL_LIMIT];
+}
+
+static void FreeEdit(Edit* edit) {
+    free(edit->positions);
+    edit->positions = NULL;
+}
+
+static void SyncPages(State* state) {
+    if (pagesValid) return;
+    pageCount = GetSelection(state, pages);
+    // Numbers from 1 with no gaps, which older page lists didn't promise
+    for (int i = 0; i < pageCount; i++) pages[i]->selectionOrder = i + 1;
+    pagesValid = true;
+}
+
+// Numbers the pages from first up to (not including) last, the only ones
+// an edit shifted
+static void StoreOrder(int first, int last) {
+    for (int i = first; i < last; i++) {
+        pages[i]->selected = true;
+        pages[i]->selectionOrder = i + 1;
+    }
+    journal.version++;
+    MarkSettingsChanged();
+}
+
+// Adds a blank page entry, left for Insert to place
+static int NewBlank(State* state) {
+    AddBlankPage(state, -1);
+    state->images[state->imageCount - 1].selected = false;
+    return state->imageCount - 1;
+}
+
+static void Insert(State* state, int image, int position) {
+    SyncPages(state);
+    if (position > pageCount) position = pageCount;
+    memmove(pages + position + 1, pages + position, (pageCount - position) * sizeof(ImageEntry*));
+    pages[position] = &state->images[image];
+    pageCount++;
+    StoreOrder(position, pageCount);
+}
+
+static void Remove(State* state, int image) {
+    SyncPages(state);
+    ImageEntry* entry = &state->images[image];
+    int position = entry->selectionOrder - 1;
+    if (!entry->selected || position < 0 || position >= pageCount || pages[position] != entry) return;
+    memmove(pages + position, pages + position + 1, (pageCount - position - 1) * sizeof(ImageEntry*));
+    pageCount--;
+    entry->selected = false;
+    entry->selectionOrder = -1;
+    StoreOrder(position, pageCount);
+}
+
+// Takes the pages at positions out and puts them back as a block at start,
+// or the reverse when undoing. Only the span from the first page touched
+// to the last is rewritten.
+static void Move(State* state, const int* positions, int moved, int start, bool undo) {
+    SyncPages(state);
+    int first = positions[0] < start ? positions[0] : start;
+    int last = positions[moved - 1] + 1 > start + moved ? positions[moved - 1] + 1 : start + moved;
+    int before = start - first; // Pages in the span that stay ahead of the block
+    ImageEntry** rest = scratch + moved;
+
+    if (!undo) {
+        for (int i = first, p = 0, r = 0; i < last; i++) {
+            if (p < moved && positions[p] == i) {
+                scratch[p++] = pages[i];
+            } else {
+                rest[r++] = pages[i];
+            }
+        }
+        memcpy(pages + first, rest, before * sizeof(ImageEntry*));
+        memcpy(pages + start, scratch, moved * sizeof(ImageEntry*));
+        memcpy(pages + start + moved, rest + before, (last - start - moved) * sizeof(ImageEntry*));
+    } else {
+        memcpy(scratch, pages + start, moved * sizeof(ImageEntry*));
+        memcpy(rest, pages + first, before * sizeof(ImageEntry*));
+        memcpy(rest + before, pages + start + moved, (last - start - moved) * sizeof(ImageEntry*));
+        for (int i = first, p = 0, r = 0; i < last; i++) {
+            pages[i] = p < moved && positions[p] == i ? scratch[p++] : rest[r++];
+        }
+    }
+    StoreOrder(first, last);
+}
+
+static void Apply(State* state, const Edit* edit, bool undo) {
+    bool insert = (edit->kind == EDIT_INSERT) != undo;
+    switch (edit->kind) {
+        case EDIT_INSERT:
+        case EDIT_REMOVE:
+            if (insert) {
+                if (edit->blank) NewBlank(state); // Takes back the same entry, it was the last
+                Insert(state, edit->image, edit->position);
+            } else {
+                Remove(state, edit->image);
+                if (edit->blank && edit->image == state->imageCount - 1) state->imageCount--;
+            }
+            break;
+        case EDIT_MOVE:
+            Move(state, edit->positions, edit->count, edit->position, undo);
+            break;
+    }
+}
+
+// Adds an edit that's just been made, dropping anything that was undone
+// and, if full, the oldest
+static void Record(Edit edit) {
+    while (journal.count > journal.cursor) FreeEdit(EditAt(--journal.count));
+    if (journal.count == JOURNAL_LIMIT) {
+        FreeEdit(EditAt(0));
+        journal.first = (journal.first + 1) % JOURNAL_LIMIT;
+        journal.count--;
+    }
+    *EditAt(journal.count++) = edit;
+    journal.cursor = journal.count;
+}
+
+void JournalSelect(State* state, int image) {
+    if (state->images[image].selected) return;
+    Edit edit = { EDIT_INSERT, image, MAX_IMAGES, false, NULL, 0 };
+    Insert(state, image, MAX_IMAGES);
+    edit.position = state->images[image].selectionOrder - 1;
+    Record(edit);
+}
+
+void JournalDeselect(State* state, int image) {
+    if (!state->images[image].selected) return;
+    SyncPages(state);
+    Edit edit = { EDIT_REMOVE, image, state->images[image].selectionOrder - 1, false, NULL, 0 };
+    Remove(state, image);
+    Record(edit);
+}
+
+void JournalAddBlank(State* state) {
+    if (state->imageCount >= MAX_IMAGES) return;
+    Edit edit = { EDIT_INSERT, NewBlank(state), MAX_IMAGES, true, NULL, 0 };
+    Insert(state, edit.image, MAX_IMAGES);
+    edit.position = state->images[edit.image].selectionOrder - 1;
+    Record(edit);
+}
+
+int JournalMove(State* state, const int* positions, int count, int target) {
+    int start = 0;
+    for (int i = 0; i < count && positions[i] < target; i++) start++;
+    start = target - start; // Pages before target that aren't moving
+    Edit edit = { EDIT_MOVE, -1, start, false, malloc(count * sizeof(int)), count };
+    if (count == 0 || !edit.positions) {
+        free(edit.positions);
+        return start;
+    }
+    memcpy(edit.positions, positions, count * sizeof(int));
+    Move(state, positions, count, start, false);
+    Record(edit);
+    return start;
+}
+
+bool Undo(State* state) {
+    if (journal.cursor == 0) return false;
+    Apply(state, EditAt(--journal.cursor), true);
+    return true;
+}
+
+bool Redo(State* state) {
+    if (journal.cursor == journal.count) return false;
+    Apply(state, EditAt(journal.cursor++), false);
+    return true;
+}
+
+void ClearJournal(void) {
+    for (int i = 0; i < journal.count; i++) FreeEdit(EditAt(i));
+    journal.first = journal.count = journal.cursor = 0;
+    journal.version++;
+    pagesValid = false;
+}
+
+int GetJournalPages(State* state, ImageEntry** out) {
+    SyncPages(state);
+    memcpy(out, pages, pageCount * sizeof(ImageEntry*));
+    return pageCount;
+}
+
+int GetJournalVersion(void) {
+    return journal.version;
+}
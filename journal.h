@@ -0,0 +1,34 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "state.h"
+#include <stdbool.h>
+
+// Undoable edits to the active sequence's page order. Each records only
+// the pages it touched and where they were, never the whole order, and
+// marks the settings changed for autosave. Positions count from 0 in page
+// order. The journal keeps the order itself between edits, so it has to be
+// cleared whenever the selection is replaced some other way: a sequence
+// applied, a folder or page list loaded.
+
+// Adds image as the last page
+void JournalSelect(State* state, int image);
+// Takes image out of the sequence, closing up the pages after it
+void JournalDeselect(State* state, int image);
+// Adds a blank page at the end
+void JournalAddBlank(State* state);
+// Moves the pages at positions, count of them in ascending order, to just
+// before position target, keeping their order. Returns where the first of
+// them ends up.
+int JournalMove(State* state, const int* positions, int count, int target);
+
+bool Undo(State* state);
+bool Redo(State* state);
+void ClearJournal(void);
+// Changes whenever the page order is edited, undone or redone, so views
+// holding a copy of it know to refresh
+int GetJournalVersion(void);
+// Copies the page order into out, without sorting the selection
+int GetJournalPages(State* state, ImageEntry** out);
+
+#endif // JOURNAL_H
@@ -0,0 +1,86 @@
+#include "layout.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The last layout boxes parsed, so a frame costs a compare rather than six
+// strtof calls
+static struct {
+    char fields[6][8];
+    Canvas canvas;
+    bool valid;
+} parsed;
+
+Canvas GetCanvas(const State* state) {
+    bool changed = !parsed.valid;
+    for (int i = 0; i < 6 && !changed; i++) {
+        changed = strncmp(parsed.fields[i], GetLayoutField((State*)state, i), 8) != 0;
+    }
+    if (changed) {
+        float values[6];
+        for (int i = 0; i < 6; i++) {
+            memcpy(parsed.fields[i], GetLayoutField((State*)state, i), 8);
+            values[i] = strtof(parsed.fields[i], NULL);
+        }
+        parsed.canvas = (Canvas){ values[0], values[1], { values[2], values[3], values[4], values[5] } };
+        parsed.valid = true;
+    }
+    return parsed.canvas;
+}
+
+Rectangle GetPageArea(Canvas canvas, const PageLayout* page) {
+    const float* margins = page->ownMargins ? page->margins : canvas.margins;
+    return (Rectangle){ margins[2], margins[0], canvas.width - margins[2] - margins[3], canvas.height - margins[0] - margins[1] };
+}
+
+Placement PlacePage(Rectangle area, const PageLayout* page, float imageW, float imageH) {
+    Placement place = { { 0, 0, imageW, imageH }, area, page->rotation & 3 };
+    if (page->crop.width > 0 && page->crop.height > 0) {
+        place.src = (Rectangle){ page->crop.x * imageW, page->crop.y * imageH, page->crop.width * imageW, page->crop.height * imageH };
+    }
+
+    // Its size as it sits on the page
+    bool turned = place.rotation & 1;
+    float w = turned ? place.src.height : place.src.width;
+    float h = turned ? place.src.width : place.src.height;
+    if (w <= 0 || h <= 0 || area.width <= 0 || area.height <= 0) {
+        place.dst.width = place.dst.height = 0;
+        return place;
+    }
+
+    if (page->fit == PAGE_FILL) {
+        // Trim the source to the area's shape, keeping its middle
+        float scale = fmaxf(area.width / w, area.height / h);
+        float trimW = (turned ? area.height : area.width) / scale;
+        float trimH = (turned ? area.width : area.height) / scale;
+        place.src.x += (place.src.width - trimW) / 2.0f;
+        place.src.y += (place.src.height - trimH) / 2.0f;
+        place.src.width = trimW;
+        place.src.height = trimH;
+    } else {
+        float scale = fminf(area.width / w, area.height / h);
+        place.dst.width = w * scale;
+        place.dst.height = h * scale;
+        place.dst.x = area.x + (area.width - place.dst.width) / 2.0f;
+        place.dst.y = area.y + (area.height - place.dst.height) / 2.0f;
+    }
+    return place;
+}
+
+Vector2 PlacedToImage(const Placement* place, Vector2 point) {
+    const Rectangle* d = &place->dst;
+    float k = d->width / ((place->rotation & 1) ? place->src.height : place->src.width);
+    if (k <= 0) return (Vector2){ place->src.x, place->src.y };
+
+    // Distances in from the edges the image's top left ends up at
+    float left = point.x - d->x, top = point.y - d->y;
+    float right = d->x + d->width - point.x, bottom = d->y + d->height - point.y;
+    Vector2 offset;
+    switch (place->rotation & 3) {
+        case 0: offset = (Vector2){ left, top }; break;
+        case 1: offset = (Vector2){ top, right }; break;
+        case 2: offset = (Vector2){ right, bottom }; break;
+        default: offset = (Vector2){ bottom, left }; break;
+    }
+    return (Vector2){ place->src.x + offset.x / k, place->src.y + offset.y / k };
+}
@@ -0,0 +1,34 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "state.h"
+
+// Where a page's image goes, worked out once here for both the full view
+// and the PDF so the preview is what gets exported. Canvas positions are
+// in inches from its top left.
+
+// The layout boxes as numbers
+typedef struct {
+    float width, height;
+    float margins[4]; // T B L R
+} Canvas;
+
+// The part of an image drawn, in its pixels before rotating, and the box on
+// the canvas it lands in after rotating
+typedef struct {
+    Rectangle src;
+    Rectangle dst;
+    int rotation; // Quarter turns clockwise
+} Placement;
+
+// The layout boxes parsed, parsing them again only once they've changed
+Canvas GetCanvas(const State* state);
+// The space inside a page's margins, its own if it has them
+Rectangle GetPageArea(Canvas canvas, const PageLayout* page);
+// Places an imageW x imageH image in area (any units) as page says. dst is
+// empty if there's no room for it.
+Placement PlacePage(Rectangle area, const PageLayout* page, float imageW, float imageH);
+// The image pixel drawn at point, in the same units as the placement's dst
+Vector2 PlacedToImage(const Placement* place, Vector2 point);
+
+#endif // LAYOUT_H
@@ -2,17 +2,57 @@
 #include "state.h"
 #include "ui.h"
 #include "settings.h"
+#include "cli.h"
+#include "perf.h"
+#include "journal.h"
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+int main(int argc, char** argv) {
+    // Any arguments mean a headless run, see cli.c
+    if (argc > 1) return RunCommandLine(argc, argv);
 
-int main(void) {
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(1000, 800, "Graphics Assembler");
     SetTargetFPS(60);
 
     State state;
+    PerfLogOpen("gui");
     InitializeState(&state);
+    StartAutosave(&state);
+    PerfEnable(true);
+    bool showPerf = false;
 
     while (!WindowShouldClose()) {
+        PerfZone frame = PerfBegin(PERF_FRAME);
+
+        // F3 shows timings, F4 writes them out for chrome://tracing
+        if (IsKeyPressed(KEY_F3)) showPerf = !showPerf;
+        if (IsKeyPressed(KEY_F4)) {
+            char tracePath[MAX_PATH_LEN];
+            char stamp[32];
+            time_t now = time(NULL);
+            strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+            snprintf(tracePath, MAX_PATH_LEN, "%s/rayview-trace-%s.json", state.folder, stamp);
+            if (PerfWriteTrace(tracePath)) {
+                TraceLog(LOG_INFO, "PERF: Trace written to %s", tracePath);
+            } else {
+                TraceLog(LOG_WARNING, "PERF: Unable to write %s", tracePath);
+            }
+        }
+
+        // Ctrl+Z undoes a selection or ordering edit, Ctrl+Shift+Z or Ctrl+Y redoes it
+        bool ctrl = IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL) || IsKeyDown(KEY_LEFT_SUPER) || IsKeyDown(KEY_RIGHT_SUPER);
+        if (ctrl && state.activeBox == TEXTBOX_NONE) {
+            bool shift = IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT);
+            if (IsKeyPressed(KEY_Y) || (shift && IsKeyPressed(KEY_Z))) {
+                Redo(&state);
+            } else if (IsKeyPressed(KEY_Z)) {
+                Undo(&state);
+            }
+        }
+
         BeginDrawing();
         ClearBackground(RAYWHITE);
 
@@ -27,32 +67,18 @@ int main(void) {
                 DrawReorderView(&state);
                 break;
         }
+        UpdateAutosave(&state);
+        if (showPerf) DrawPerfOverlay(&state);
 
+        PerfZone present = PerfBegin(PERF_PRESENT);
         EndDrawing();
+        PerfEnd(present, NULL);
+        PerfEnd(frame, NULL);
+        PerfEndFrame();
     }
 
-    // Save settings on exit
-    state.selectedFileCount = 0;
-    ImageEntry* sortedSelection[MAX_SELECTED_FILES];
-    for (int i = 0; i < state.imageCount; ++i) {
-        if (state.images[i].selected) {
-            sortedSelection[state.selectedFileCount++] = &state.images[i];
-        }
-    }
-    for (int i = 0; i < state.selectedFileCount - 1; i++) {
-        for (int j = 0; j < state.selectedFileCount - i - 1; j++) {
-            if (sortedSelection[j]->selectionOrder > sortedSelection[j+1]->selectionOrder) {
-                ImageEntry* temp = sortedSelection[j];
-                sortedSelection[j] = sortedSelection[j+1];
-                sortedSelection[j+1] = temp;
-            }
-        }
-    }
-    for (int i = 0; i < state.selectedFileCount; ++i) {
-        strncpy(state.selectedFiles[i], GetFileName(sortedSelection[i]->path), MAX_FILENAME_LEN - 1);
-        state.selectedFiles[i][MAX_FILENAME_LEN - 1] = '\0';
-    }
-    SaveSettings(&state);
+    // Only the last change can still be unwritten
+    StopAutosave(&state);
 
     for (int i = 0; i < state.imageCount; i++) {
         if (state.images[i].loaded) UnloadTexture(state.images[i].texture);
@@ -60,7 +86,10 @@ int main(void) {
         if (state.images[i].fullLoaded) UnloadImage(state.images[i].fullImage);
     }
     UnloadFont(state.font);
+    FreeSequences(&state);
+    ClearJournal();
 
     CloseWindow();
+    PerfLogClose();
     return 0;
 }
\ No newline at end of file
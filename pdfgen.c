@@ -104,7 +104,15 @@ typedef SSIZE_T ssize_t;
 #endif
 
 #ifndef _XOPEN_SOURCE
-#define _XOPEN_SOURCE 600 /* for M_SQRT2 */
+#define _XOPEN_SOURCE 700 /* for M_SQRT2 & st_mtim */
+#endif
+
+#if defined(__APPLE__) && !defined(_DARWIN_C_SOURCE)
+#define _DARWIN_C_SOURCE /* for st_mtimespec */
+#endif
+
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 /* for a 64-bit off_t & ftello */
 #endif
 
 #include <sys/types.h> /* for ssize_t */
@@ -114,7 +122,6 @@ typedef SSIZE_T ssize_t;
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
-#include <locale.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -124,6 +131,7 @@ typedef SSIZE_T ssize_t;
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <zlib.h>
 
 #include "pdfgen.h"
 
@@ -145,9 +153,18 @@ typedef SSIZE_T ssize_t;
 #undef stat
 #endif
 #define stat _stat
+#define ftello _ftelli64
+#define fseeko _fseeki64
+#define ftruncate _chsize_s
+#include <io.h> // _chsize_s
 #define SKIP_ATTRIBUTE
 #else
 #include <strings.h> // strcasecmp
+#include <unistd.h>   // ftruncate
+#endif
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
 #endif
 
 /**
@@ -193,6 +210,9 @@ static inline uint32_t bswap32(uint32_t x)
 // issues
 #define MAX_IMAGE_WIDTH (16 * 1024)
 #define MAX_IMAGE_HEIGHT (16 * 1024)
+// Largest output buffer reserved before compressing; bigger streams grow as
+// they go. Sizes come from image headers, which can claim anything.
+#define MAX_DEFLATE_RESERVE (32 * 1024 * 1024)
 
 // Signatures for various image formats
 static const uint8_t bmp_signature[] = {'B', 'M'};
@@ -226,10 +246,27 @@ enum {
     OBJ_count,
 };
 
+/**
+ * Everything that lives as long as the document does (objects, their info
+ * block and the flexarray bins that index them) is carved out of large
+ * blocks, rather than allocated one at a time, and released in one go by
+ * pdf_destroy
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t used;
+    size_t size;
+};
+
+struct arena {
+    struct arena_block *blocks;
+};
+
 struct flexarray {
     void ***bins;
     int item_count;
     int bin_count;
+    struct arena *arena; /* Where the bins are allocated from */
 };
 
 /**
@@ -246,7 +283,7 @@ struct dstr {
 struct pdf_object {
     int type;                /* See OBJ_xxxx */
     int index;               /* PDF output index */
-    int offset;              /* Byte position within the output file */
+    int64_t offset;          /* Byte position within the output file */
     struct pdf_object *prev; /* Previous of this type */
     struct pdf_object *next; /* Next of this type */
     union {
@@ -260,11 +297,32 @@ struct pdf_object {
             struct pdf_object *page;
             struct dstr stream;
         } stream;
+        struct {
+            struct dstr dict; /* XObject dictionary entries, bar /Length */
+            struct dstr data; /* Encoded image data */
+            uint32_t width;   /* Size of the image in pixels */
+            uint32_t height;
+            struct pdf_object *smask; /* Optional transparency mask */
+            int id;            /* N in the /ImageN resource name */
+            uint64_t digest;   /* Hash of the source data, for re-use */
+            size_t digest_len; /* Number of source bytes hashed */
+            bool data_is_source; /* data holds the hashed bytes as-is */
+            /* Encoded data left in a file (data is then empty), and the
+             * file's inode, size & mtime (in ns), so changes can be spotted
+             * at save time */
+            char *source;
+            int64_t source_offset;
+            size_t source_len;
+            uint64_t source_ino;
+            int64_t source_size;
+            int64_t source_mtime_ns;
+        } image;
         struct {
             float width;
             float height;
             struct flexarray children;
             struct flexarray annotations;
+            struct flexarray images; /* Image XObjects drawn on this page */
         } page;
         struct pdf_info *info;
         struct {
@@ -291,11 +349,20 @@ struct pdf_doc {
 
     float width;
     float height;
+    int compress_level; /* zlib level for streams & raw images, 0 = off */
+    int save_flags;     /* PDF_SAVE_xxx output layout */
+
+    struct arena arena;
 
     struct pdf_object *current_font;
 
     struct pdf_object *last_objects[OBJ_count];
     struct pdf_object *first_objects[OBJ_count];
+
+    /* Images with a digest, open-addressed on it, for pdf_find_image */
+    struct pdf_object **image_table;
+    size_t image_table_size; /* A power of two, or 0 */
+    size_t image_table_used;
 };
 
 /**
@@ -322,13 +389,15 @@ struct rgb_value {
 /**
  * Simple flexible resizing array implementation
  * The bins get larger in powers of two
- * bin 0 = 1024 items
- *     1 = 2048 items
- *     2 = 4096 items
+ * bin 0 = 16 items
+ *     1 = 32 items
+ *     2 = 64 items
  *     etc...
+ * Most arrays (a page's annotations, a bookmark's children) only ever hold
+ * a handful of items, so the first bin is kept small
  */
 /* What is the first index that will be in the given bin? */
-#define MIN_SHIFT 10
+#define MIN_SHIFT 4
 #define MIN_OFFSET ((1 << MIN_SHIFT) - 1)
 static int bin_offset[] = {
     (1 << (MIN_SHIFT + 0)) - 1 - MIN_OFFSET,
@@ -347,6 +416,12 @@ static int bin_offset[] = {
     (1 << (MIN_SHIFT + 13)) - 1 - MIN_OFFSET,
     (1 << (MIN_SHIFT + 14)) - 1 - MIN_OFFSET,
     (1 << (MIN_SHIFT + 15)) - 1 - MIN_OFFSET,
+    (1 << (MIN_SHIFT + 16)) - 1 - MIN_OFFSET,
+    (1 << (MIN_SHIFT + 17)) - 1 - MIN_OFFSET,
+    (1 << (MIN_SHIFT + 18)) - 1 - MIN_OFFSET,
+    (1 << (MIN_SHIFT + 19)) - 1 - MIN_OFFSET,
+    (1 << (MIN_SHIFT + 20)) - 1 - MIN_OFFSET,
+    (1 << (MIN_SHIFT + 21)) - 1 - MIN_OFFSET,
 };
 
 static inline int flexarray_get_bin(const struct flexarray *flex, int index)
@@ -375,11 +450,12 @@ static inline int flexarray_get_bin_offset(const struct flexarray *flex,
     return index - bin_offset[bin];
 }
 
+static void *arena_alloc(struct arena *arena, size_t len);
+
+/* The bins themselves belong to the arena, and go when it does */
 static void flexarray_clear(struct flexarray *flex)
 {
-    for (int i = 0; i < flex->bin_count; i++)
-        free(flex->bins[i]);
-    free(flex->bins);
+    flex->bins = NULL;
     flex->bin_count = 0;
     flex->item_count = 0;
 }
@@ -394,20 +470,19 @@ static int flexarray_set(struct flexarray *flex, int index, void *data)
     int bin = flexarray_get_bin(flex, index);
     if (bin < 0)
         return -EINVAL;
-    if (bin >= flex->bin_count) {
-        void ***bins = (void ***)realloc(flex->bins, (flex->bin_count + 1) *
-                                                         sizeof(*flex->bins));
-        if (!bins)
+    if (!flex->bins) {
+        flex->bins = (void ***)arena_alloc(
+            flex->arena, ARRAY_SIZE(bin_offset) * sizeof(*flex->bins));
+        if (!flex->bins)
             return -ENOMEM;
-        flex->bin_count++;
-        flex->bins = bins;
-        flex->bins[flex->bin_count - 1] =
-            (void **)calloc(flexarray_get_bin_size(flex, flex->bin_count - 1),
-                            sizeof(void *));
-        if (!flex->bins[flex->bin_count - 1]) {
-            flex->bin_count--;
+    }
+    while (bin >= flex->bin_count) {
+        flex->bins[flex->bin_count] = (void **)arena_alloc(
+            flex->arena,
+            flexarray_get_bin_size(flex, flex->bin_count) * sizeof(void *));
+        if (!flex->bins[flex->bin_count])
             return -ENOMEM;
-        }
+        flex->bin_count++;
     }
     flex->item_count++;
     flex->bins[bin][flexarray_get_bin_offset(flex, bin, index)] = data;
@@ -431,6 +506,56 @@ static inline void *flexarray_get(const struct flexarray *flex, int index)
     return flex->bins[bin][flexarray_get_bin_offset(flex, bin, index)];
 }
 
+/**
+ * Bump allocator for the document arena. Blocks come from calloc, and
+ * nothing is ever handed back before arena_free, so allocations are always
+ * zeroed. Anything too large for a normal block gets one of its own
+ */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(len)                                                     \
+    (((len) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static void *arena_alloc(struct arena *arena, size_t len)
+{
+    const size_t header = ARENA_ROUND(sizeof(struct arena_block));
+    struct arena_block *block = arena->blocks;
+    void *ptr;
+
+    len = ARENA_ROUND(len);
+    if (!block || block->size - block->used < len) {
+        size_t size = ARENA_BLOCK_SIZE;
+        if (len > ARENA_BLOCK_SIZE - header)
+            size = header + len;
+        block = (struct arena_block *)calloc(1, size);
+        if (!block)
+            return NULL;
+        block->used = header;
+        block->size = size;
+        if (size > ARENA_BLOCK_SIZE && arena->blocks) {
+            /* Keep filling the current block */
+            block->next = arena->blocks->next;
+            arena->blocks->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    ptr = (char *)block + block->used;
+    block->used += len;
+    return ptr;
+}
+
+static void arena_free(struct arena *arena)
+{
+    while (arena->blocks) {
+        struct arena_block *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
 /**
  * Simple dynamic string object. Tries to store a reasonable amount on the
  * stack before falling back to malloc once things get large
@@ -452,6 +577,11 @@ static size_t dstr_len(const struct dstr *str)
     return str->used_len;
 }
 
+/**
+ * Make room for at least len bytes. This allocates exactly what is asked
+ * for, so callers that know the final size up front (image payloads, file
+ * contents) can reserve it once. Incremental appends go through dstr_grow
+ */
 static ssize_t dstr_ensure(struct dstr *str, size_t len)
 {
     if (len <= str->alloc_len)
@@ -459,9 +589,7 @@ static ssize_t dstr_ensure(struct dstr *str, size_t len)
     if (!str->data && len <= sizeof(str->static_data))
         str->alloc_len = len;
     else if (str->alloc_len < len) {
-        size_t new_len;
-
-        new_len = len + 4096;
+        size_t new_len = len;
 
         if (str->data) {
             char *new_data = (char *)realloc((void *)str->data, new_len);
@@ -481,61 +609,338 @@ static ssize_t dstr_ensure(struct dstr *str, size_t len)
     return 0;
 }
 
-// Locales can replace the decimal character with a ','.
-// This breaks the PDF output, so we force a 'safe' locale.
-static void force_locale(char *buf, int len)
+/**
+ * Make room for at least len bytes, growing geometrically so a string built
+ * up from many small appends is only copied a logarithmic number of times
+ */
+static ssize_t dstr_grow(struct dstr *str, size_t len)
 {
-    char *saved_locale = setlocale(LC_ALL, NULL);
+    size_t new_len;
 
-    if (!saved_locale) {
-        *buf = '\0';
-    } else {
-        strncpy(buf, saved_locale, len - 1);
-        buf[len - 1] = '\0';
+    if (len <= str->alloc_len)
+        return 0;
+    if (!str->data && len <= sizeof(str->static_data))
+        return dstr_ensure(str, len);
+    new_len = str->alloc_len * 2;
+    if (new_len < 4096)
+        new_len = 4096;
+    if (new_len < len)
+        new_len = len;
+    return dstr_ensure(str, new_len);
+}
+
+static ssize_t dstr_append_data(struct dstr *str, const void *extend,
+                                size_t len);
+
+/**
+ * Number formatting for PDF output. The C library routes %f through the
+ * locale (which can turn the decimal point into a ','), and is far more
+ * general than we need, so integers and reals are written by hand instead.
+ * Reals are rounded to a fixed number of decimals, and trailing zeros are
+ * dropped, so "100.000000" goes out as "100"
+ */
+static int dstr_append_digits(struct dstr *str, unsigned long long value,
+                              bool negative)
+{
+    char buf[24];
+    char *p = buf + sizeof(buf);
+
+    do {
+        *--p = '0' + (char)(value % 10);
+        value /= 10;
+    } while (value);
+    if (negative)
+        *--p = '-';
+    return (int)dstr_append_data(str, p, buf + sizeof(buf) - p);
+}
+
+static int dstr_append_int(struct dstr *str, long long value)
+{
+    if (value < 0)
+        return dstr_append_digits(str, 0ULL - (unsigned long long)value,
+                                  true);
+    return dstr_append_digits(str, (unsigned long long)value, false);
+}
+
+static int dstr_printf_libc(struct dstr *str, const char *fmt, ...);
+
+/**
+ * printf's "%.*f" for reals too large to scale into an integer exactly,
+ * tidied to match dstr_append_real: '.' for the decimal point whatever
+ * the locale, and no trailing zeros
+ */
+static int dstr_append_large_real(struct dstr *str, double value,
+                                  int decimals)
+{
+    size_t start = str->used_len, out, point = 0;
+    char *data;
+    int ret = dstr_printf_libc(str, "%.*f", decimals, value);
+
+    if (ret < 0)
+        return ret;
+    data = dstr_data(str);
+    for (size_t i = out = start; i < str->used_len; i++) {
+        if ((data[i] >= '0' && data[i] <= '9') || data[i] == '-')
+            data[out++] = data[i];
+        else if (!point)
+            data[point = out++] = '.';
+    }
+    if (point) {
+        while (data[out - 1] == '0')
+            out--;
+        if (out - 1 == point)
+            out--;
+    }
+    str->used_len = out;
+    data[out] = '\0';
+    return (int)(out - start);
+}
+
+static int dstr_append_real(struct dstr *str, double value, int decimals)
+{
+    static const uint32_t scale[] = {1,      10,      100,     1000,
+                                     10000,  100000,  1000000, 10000000,
+                                     100000000};
+    char buf[48];
+    char *p = buf + sizeof(buf);
+    bool negative = value < 0;
+    unsigned long long n, whole;
+    uint32_t frac;
+    double scaled;
+
+    if (decimals >= (int)ARRAY_SIZE(scale))
+        decimals = (int)ARRAY_SIZE(scale) - 1;
+    /* There's no way to write these in a PDF */
+    if (!isfinite(value))
+        return -EINVAL;
+    if (negative)
+        value = -value;
+    scaled = value * scale[decimals];
+    /* Nothing drawn on a page comes close, but past 2^52 the scaled value
+     * has no room left for the halfway points rounding is checked against */
+    if (scaled >= 4503599627370496.0)
+        return dstr_append_large_real(str, negative ? -value : value,
+                                      decimals);
+
+    /* Round to the nearest integer, ties to even, as printf does. The
+     * product is itself rounded, which can make a value just short of a
+     * tie look like one (or the reverse). Close to one, fma's result has
+     * the sign of the exact difference from each halfway point, which
+     * settles it */
+    n = (unsigned long long)rint(scaled);
+    if (fabs(fabs(scaled - (double)n) - 0.5) <= scaled * 0x1p-52) {
+        double rest = fma(value, scale[decimals], -((double)n + 0.5));
+        if (rest > 0 || (rest == 0 && (n & 1))) {
+            n++;
+        } else {
+            rest = fma(value, scale[decimals], -((double)n - 0.5));
+            if (rest < 0 || (rest == 0 && (n & 1)))
+                n--;
+        }
     }
+    whole = n / scale[decimals];
+    frac = (uint32_t)(n % scale[decimals]);
 
-    setlocale(LC_NUMERIC, "POSIX");
+    if (frac) {
+        int digits = decimals;
+        while (frac % 10 == 0) {
+            frac /= 10;
+            digits--;
+        }
+        while (digits--) {
+            *--p = '0' + (char)(frac % 10);
+            frac /= 10;
+        }
+        *--p = '.';
+    }
+    do {
+        *--p = '0' + (char)(whole % 10);
+        whole /= 10;
+    } while (whole);
+    if (negative && n)
+        *--p = '-';
+    return (int)dstr_append_data(str, p, buf + sizeof(buf) - p);
 }
 
-static void restore_locale(char *buf)
+/**
+ * Hand a single conversion we don't write ourselves (field widths, hex and
+ * so on, none of which are locale sensitive) to the C library. Formats
+ * straight into whatever space is free, and only runs vsnprintf a second
+ * time if that wasn't enough
+ */
+static int dstr_printf_libc(struct dstr *str, const char *fmt, ...)
 {
-    setlocale(LC_ALL, buf);
+    va_list ap, aq;
+    size_t avail;
+    int len;
+
+    if (dstr_grow(str, str->used_len + 64) < 0)
+        return -ENOMEM;
+    avail = str->alloc_len - str->used_len;
+    va_start(ap, fmt);
+    va_copy(aq, ap);
+    len = vsnprintf(dstr_data(str) + str->used_len, avail, fmt, ap);
+    if (len >= 0 && (size_t)len >= avail) {
+        if (dstr_grow(str, str->used_len + len + 1) < 0)
+            len = -ENOMEM;
+        else
+            vsnprintf(dstr_data(str) + str->used_len, len + 1, fmt, aq);
+    }
+    va_end(ap);
+    va_end(aq);
+    if (len < 0) {
+        dstr_data(str)[str->used_len] = '\0';
+        return len == -ENOMEM ? len : -EINVAL;
+    }
+    str->used_len += len;
+    return len;
 }
 
+/**
+ * Append printf-style formatted text. Plain %d, %i, %u, %c and %s, and all
+ * %f conversions, are written directly; %f writes at most 6 decimals (or
+ * the given precision), without trailing zeros, and ignores field widths.
+ * A NaN or infinite %f fails with -EINVAL, as a PDF can't hold one.
+ * Anything else goes through dstr_printf_libc one conversion at a time,
+ * with integer arguments widened to long long
+ */
 #ifndef SKIP_ATTRIBUTE
 static int dstr_printf(struct dstr *str, const char *fmt, ...)
     __attribute__((format(printf, 2, 3)));
 #endif
 static int dstr_printf(struct dstr *str, const char *fmt, ...)
 {
-    va_list ap, aq;
-    int len;
-    char saved_locale[32];
-
-    force_locale(saved_locale, sizeof(saved_locale));
+    va_list ap;
+    size_t start = str->used_len;
+    const char *p = fmt;
+    int ret = 0;
 
     va_start(ap, fmt);
-    va_copy(aq, ap);
-    len = vsnprintf(NULL, 0, fmt, ap);
-    if (dstr_ensure(str, str->used_len + len + 1) < 0) {
-        va_end(ap);
-        va_end(aq);
-        restore_locale(saved_locale);
-        return -ENOMEM;
+    while (*p && ret >= 0) {
+        const char *pct = strchr(p, '%');
+        const char *spec;
+        char libc_fmt[32];
+        int decimals = -1, longs = 0;
+        bool size = false, plain;
+
+        if (!pct) {
+            ret = (int)dstr_append_data(str, p, strlen(p));
+            break;
+        }
+        if (pct > p && (ret = (int)dstr_append_data(str, p, pct - p)) < 0)
+            break;
+
+        /* flags, width, precision, then length modifiers */
+        spec = p = pct + 1;
+        while (*p && strchr("-+ #0", *p))
+            p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p == '.') {
+            decimals = 0;
+            while (*++p >= '0' && *p <= '9')
+                decimals = decimals * 10 + (*p - '0');
+        }
+        plain = p == spec;
+        for (;; p++) {
+            if (*p == 'l')
+                longs++;
+            else if (*p == 'z')
+                size = true;
+            else if (*p != 'h')
+                break;
+        }
+        if (!plain && *p != 'f') {
+            if (p - spec + 4 > (int)sizeof(libc_fmt)) {
+                ret = -EINVAL;
+                break;
+            }
+            libc_fmt[0] = '%';
+            memcpy(libc_fmt + 1, spec, p - spec);
+            libc_fmt[p - spec + 1] = '\0';
+            /* Drop the modifiers and pass everything as long long */
+            libc_fmt[strcspn(libc_fmt, "lzh")] = '\0';
+        }
+
+        switch (*p) {
+        case '%':
+            ret = (int)dstr_append_data(str, "%", 1);
+            break;
+        case 'd':
+        case 'i': {
+            long long v = size        ? (long long)va_arg(ap, ssize_t)
+                          : longs > 1 ? va_arg(ap, long long)
+                          : longs     ? va_arg(ap, long)
+                                      : va_arg(ap, int);
+            if (plain) {
+                ret = dstr_append_int(str, v);
+            } else {
+                strcat(libc_fmt, "lld");
+                ret = dstr_printf_libc(str, libc_fmt, v);
+            }
+            break;
+        }
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o': {
+            unsigned long long v = size ? va_arg(ap, size_t)
+                                   : longs > 1 ? va_arg(ap, unsigned long long)
+                                   : longs     ? va_arg(ap, unsigned long)
+                                               : va_arg(ap, unsigned int);
+            if (plain && *p == 'u') {
+                ret = dstr_append_digits(str, v, false);
+            } else {
+                char conv[4] = {'l', 'l', *p, '\0'};
+                if (plain) {
+                    libc_fmt[0] = '%';
+                    libc_fmt[1] = '\0';
+                }
+                strcat(libc_fmt, conv);
+                ret = dstr_printf_libc(str, libc_fmt, v);
+            }
+            break;
+        }
+        case 'c': {
+            char c = (char)va_arg(ap, int);
+            ret = (int)dstr_append_data(str, &c, 1);
+            break;
+        }
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            if (plain) {
+                ret = (int)dstr_append_data(str, s, strlen(s));
+            } else {
+                strcat(libc_fmt, "s");
+                ret = dstr_printf_libc(str, libc_fmt, s);
+            }
+            break;
+        }
+        case 'f':
+            ret = dstr_append_real(str, va_arg(ap, double),
+                                   decimals < 0 ? 6 : decimals);
+            break;
+        default:
+            ret = -EINVAL;
+            break;
+        }
+        if (*p)
+            p++;
     }
-    vsprintf(dstr_data(str) + str->used_len, fmt, aq);
-    str->used_len += len;
     va_end(ap);
-    va_end(aq);
-    restore_locale(saved_locale);
 
-    return len;
+    if (ret < 0) {
+        str->used_len = start;
+        dstr_data(str)[start] = '\0';
+        return ret;
+    }
+    return (int)(str->used_len - start);
 }
 
 static ssize_t dstr_append_data(struct dstr *str, const void *extend,
                                 size_t len)
 {
-    if (dstr_ensure(str, str->used_len + len + 1) < 0)
+    if (dstr_grow(str, str->used_len + len + 1) < 0)
         return -ENOMEM;
     memcpy(dstr_data(str) + str->used_len, extend, len);
     str->used_len += len;
@@ -548,6 +953,12 @@ static ssize_t dstr_append(struct dstr *str, const char *extend)
     return dstr_append_data(str, extend, strlen(extend));
 }
 
+static void dstr_reset(struct dstr *str)
+{
+    str->used_len = 0;
+    dstr_data(str)[0] = '\0';
+}
+
 static void dstr_free(struct dstr *str)
 {
     if (str->data)
@@ -556,138 +967,523 @@ static void dstr_free(struct dstr *str)
 }
 
 /**
- * PDF Implementation
+ * Compression helpers
+ * Streams are compressed with zlib, which is what /FlateDecode expects.
+ * The deflater writes straight into a dstr, so callers can feed it a row
+ * at a time without building the whole uncompressed image first.
  */
+struct deflater {
+    z_stream zs;
+    struct dstr *out;
+};
 
-#ifndef SKIP_ATTRIBUTE
-static int pdf_set_err(struct pdf_doc *doc, int errval, const char *buffer,
-                       ...) __attribute__((format(printf, 3, 4)));
-#endif
-static int pdf_set_err(struct pdf_doc *doc, int errval, const char *buffer,
-                       ...)
+static int deflater_init(struct deflater *d, struct dstr *out, int level,
+                         size_t expected_len)
 {
-    va_list ap;
-    int len;
-
-    va_start(ap, buffer);
-    len = vsnprintf(doc->errstr, sizeof(doc->errstr) - 1, buffer, ap);
-    va_end(ap);
-
-    if (len < 0) {
-        doc->errstr[0] = '\0';
-        return errval;
+    memset(&d->zs, 0, sizeof(d->zs));
+    d->out = out;
+    if (deflateInit(&d->zs, level) != Z_OK)
+        return -ENOMEM;
+    /* Reserve the worst case up front, so the output is rarely regrown */
+    size_t reserve = deflateBound(&d->zs, expected_len) + 1;
+    if (reserve > MAX_DEFLATE_RESERVE)
+        reserve = MAX_DEFLATE_RESERVE;
+    if (dstr_ensure(out, out->used_len + reserve) < 0) {
+        deflateEnd(&d->zs);
+        return -ENOMEM;
     }
+    return 0;
+}
 
-    if (len >= (int)(sizeof(doc->errstr) - 1))
-        len = (int)(sizeof(doc->errstr) - 1);
+static int deflater_write(struct deflater *d, const void *data, size_t len,
+                          bool finish)
+{
+    d->zs.next_in = (Bytef *)data;
+    d->zs.avail_in = (uInt)len;
 
-    doc->errstr[len] = '\0';
-    doc->errval = errval;
+    for (;;) {
+        int ret;
 
-    return errval;
+        if (d->out->alloc_len - d->out->used_len < 1024 &&
+            dstr_grow(d->out, d->out->alloc_len + 64 * 1024) < 0)
+            return -ENOMEM;
+        d->zs.next_out = (Bytef *)dstr_data(d->out) + d->out->used_len;
+        d->zs.avail_out = (uInt)(d->out->alloc_len - d->out->used_len - 1);
+        ret = deflate(&d->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+        d->out->used_len = d->out->alloc_len - 1 - d->zs.avail_out;
+        if (ret == Z_STREAM_END)
+            break;
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            return -EINVAL;
+        if (!finish && d->zs.avail_in == 0 && d->zs.avail_out > 0)
+            break;
+    }
+    dstr_data(d->out)[d->out->used_len] = '\0';
+    return 0;
 }
 
-const char *pdf_get_err(const struct pdf_doc *pdf, int *errval)
+static void deflater_end(struct deflater *d)
 {
-    if (!pdf)
-        return NULL;
-    if (pdf->errstr[0] == '\0')
-        return NULL;
-    if (errval)
-        *errval = pdf->errval;
-    return pdf->errstr;
+    deflateEnd(&d->zs);
 }
 
-void pdf_clear_err(struct pdf_doc *pdf)
+static int deflate_data(struct dstr *out, const void *data, size_t len,
+                        int level)
 {
-    if (!pdf)
-        return;
-    pdf->errstr[0] = '\0';
-    pdf->errval = 0;
-}
+    struct deflater d;
+    int ret = deflater_init(&d, out, level, len);
 
-static int pdf_get_errval(struct pdf_doc *pdf)
-{
-    if (!pdf)
-        return 0;
-    return pdf->errval;
+    if (ret < 0)
+        return ret;
+    ret = deflater_write(&d, data, len, true);
+    deflater_end(&d);
+    return ret;
 }
 
-static struct pdf_object *pdf_get_object(const struct pdf_doc *pdf, int index)
+static inline uint8_t paeth_predictor(int a, int b, int c)
 {
-    return (struct pdf_object *)flexarray_get(&pdf->objects, index);
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if (pa <= pb && pa <= pc)
+        return (uint8_t)a;
+    if (pb <= pc)
+        return (uint8_t)b;
+    return (uint8_t)c;
 }
 
-static int pdf_append_object(struct pdf_doc *pdf, struct pdf_object *obj)
+/**
+ * Apply one PNG filter type to a row. prev is the unfiltered previous row
+ * (all zeros for the first row) and bpp is the number of bytes per pixel.
+ */
+static void png_filter(uint8_t type, uint8_t *out, const uint8_t *row,
+                       const uint8_t *prev, size_t len, size_t bpp)
 {
-    int index = flexarray_append(&pdf->objects, obj);
-
-    if (index < 0)
-        return index;
-    obj->index = index;
-
-    if (pdf->last_objects[obj->type]) {
-        obj->prev = pdf->last_objects[obj->type];
-        pdf->last_objects[obj->type]->next = obj;
-    }
-    pdf->last_objects[obj->type] = obj;
-
-    if (!pdf->first_objects[obj->type])
-        pdf->first_objects[obj->type] = obj;
+    size_t i;
 
-    return 0;
-}
-
-static void pdf_object_destroy(struct pdf_object *object)
-{
-    switch (object->type) {
-    case OBJ_stream:
-    case OBJ_image:
-        dstr_free(&object->stream.stream);
+    switch (type) {
+    case 0: // None
+        memcpy(out, row, len);
         break;
-    case OBJ_page:
-        flexarray_clear(&object->page.children);
-        flexarray_clear(&object->page.annotations);
+    case 1: // Sub
+        for (i = 0; i < bpp && i < len; i++)
+            out[i] = row[i];
+        for (; i < len; i++)
+            out[i] = row[i] - row[i - bpp];
         break;
-    case OBJ_info:
-        free(object->info);
+    case 2: // Up
+        for (i = 0; i < len; i++)
+            out[i] = row[i] - prev[i];
         break;
-    case OBJ_bookmark:
-        flexarray_clear(&object->bookmark.children);
+    case 3: // Average
+        for (i = 0; i < bpp && i < len; i++)
+            out[i] = row[i] - (prev[i] >> 1);
+        for (; i < len; i++)
+            out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+        break;
+    default: // Paeth
+        for (i = 0; i < bpp && i < len; i++)
+            out[i] = row[i] - prev[i];
+        for (; i < len; i++)
+            out[i] =
+                row[i] - paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]);
         break;
     }
-    free(object);
 }
 
-static struct pdf_object *pdf_add_object(struct pdf_doc *pdf, int type)
+/**
+ * Filter a row for /Predictor 15 output. Every filter type is tried and the
+ * one with the smallest sum of absolute (signed) values is kept, which is
+ * the usual heuristic PNG encoders use to pick the most compressible row.
+ * dst needs room for len + 1 bytes, as the filter type is stored first;
+ * scratch needs room for len bytes.
+ */
+static void png_filter_row(uint8_t *dst, uint8_t *scratch, const uint8_t *row,
+                           const uint8_t *prev, size_t len, size_t bpp)
 {
-    struct pdf_object *obj;
-
-    if (!pdf)
-        return NULL;
-
-    obj = (struct pdf_object *)calloc(1, sizeof(*obj));
-    if (!obj) {
-        pdf_set_err(pdf, -errno,
-                    "Unable to allocate object %d of type %d: %s",
-                    flexarray_size(&pdf->objects) + 1, type, strerror(errno));
-        return NULL;
+    uint32_t best_sum = UINT32_MAX;
+
+    for (uint8_t type = 0; type < 5; type++) {
+        uint8_t *out = type == 0 ? dst + 1 : scratch;
+        uint32_t sum = 0;
+
+        png_filter(type, out, row, prev, len, bpp);
+        for (size_t i = 0; i < len; i++)
+            sum += out[i] < 128 ? out[i] : 256 - out[i];
+        if (sum < best_sum) {
+            best_sum = sum;
+            dst[0] = type;
+            if (out != dst + 1)
+                memcpy(dst + 1, out, len);
+        }
     }
+}
 
-    obj->type = type;
+/**
+ * Builds PNG predicted, deflated image data a row at a time, keeping only
+ * the previous row around for the filters to refer to
+ */
+struct png_deflater {
+    struct deflater d;
+    uint8_t *prev;     /* Previous unfiltered row, all zero to begin with */
+    uint8_t *filtered; /* Filter type byte & filtered row */
+    uint8_t *scratch;  /* Space for trying out the filter types */
+    size_t row_len;    /* Bytes per row */
+    size_t bpp;        /* Bytes per pixel */
+};
 
-    if (pdf_append_object(pdf, obj) < 0) {
-        free(obj);
-        return NULL;
-    }
+static int png_deflater_init(struct png_deflater *pw, struct dstr *out,
+                             int level, size_t row_len, size_t bpp,
+                             uint32_t height)
+{
+    int ret;
 
-    return obj;
+    pw->row_len = row_len;
+    pw->bpp = bpp;
+    pw->prev = (uint8_t *)calloc(3 * row_len + 1, 1);
+    if (!pw->prev)
+        return -ENOMEM;
+    pw->filtered = pw->prev + row_len;
+    pw->scratch = pw->filtered + row_len + 1;
+    ret = deflater_init(&pw->d, out, level, (row_len + 1) * height);
+    if (ret < 0)
+        free(pw->prev);
+    return ret;
 }
 
-static void pdf_del_object(struct pdf_doc *pdf, struct pdf_object *obj)
+static int png_deflater_write(struct png_deflater *pw, const uint8_t *row)
 {
-    int type = obj->type;
-    flexarray_set(&pdf->objects, obj->index, NULL);
+    png_filter_row(pw->filtered, pw->scratch, row, pw->prev, pw->row_len,
+                   pw->bpp);
+    memcpy(pw->prev, row, pw->row_len);
+    return deflater_write(&pw->d, pw->filtered, pw->row_len + 1, false);
+}
+
+static int png_deflater_finish(struct png_deflater *pw)
+{
+    return deflater_write(&pw->d, NULL, 0, true);
+}
+
+static void png_deflater_end(struct png_deflater *pw)
+{
+    deflater_end(&pw->d);
+    free(pw->prev);
+}
+
+/**
+ * Compress 8-bit-per-component pixel data, PNG filtering each row so it
+ * can be described with a /Predictor 15 decode parameter
+ */
+static int deflate_pixels(struct dstr *out, const uint8_t *data,
+                          uint32_t width, uint32_t height, int colours,
+                          int level)
+{
+    struct png_deflater pw;
+    size_t row_len = (size_t)width * colours;
+    int ret = png_deflater_init(&pw, out, level, row_len, colours, height);
+
+    if (ret < 0)
+        return ret;
+    for (uint32_t y = 0; y < height && ret >= 0; y++)
+        ret = png_deflater_write(&pw, &data[(size_t)y * row_len]);
+    if (ret >= 0)
+        ret = png_deflater_finish(&pw);
+    png_deflater_end(&pw);
+    return ret;
+}
+
+/**
+ * Undo a PNG row filter in place, see png_filter for the parameters
+ */
+static int png_unfilter_row(uint8_t type, uint8_t *row, const uint8_t *prev,
+                            size_t len, size_t bpp)
+{
+    size_t i;
+
+    switch (type) {
+    case 0: // None
+        break;
+    case 1: // Sub
+        for (i = bpp; i < len; i++)
+            row[i] += row[i - bpp];
+        break;
+    case 2: // Up
+        for (i = 0; i < len; i++)
+            row[i] += prev[i];
+        break;
+    case 3: // Average
+        for (i = 0; i < bpp && i < len; i++)
+            row[i] += prev[i] >> 1;
+        for (; i < len; i++)
+            row[i] += (row[i - bpp] + prev[i]) >> 1;
+        break;
+    case 4: // Paeth
+        for (i = 0; i < bpp && i < len; i++)
+            row[i] += prev[i];
+        for (; i < len; i++)
+            row[i] += paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]);
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Streams unfiltered rows out of PNG image data (the concatenated IDAT
+ * chunks), so only two rows are ever held in memory
+ */
+struct png_inflater {
+    z_stream zs;
+    uint8_t *row;   /* Filter type byte & the row being decoded */
+    uint8_t *prev;  /* Filter type byte & the previous unfiltered row */
+    size_t row_len; /* Bytes per row, excluding the filter type */
+    size_t bpp;     /* Bytes per complete pixel (at least 1) */
+};
+
+static int png_inflater_init(struct png_inflater *pr, const uint8_t *data,
+                             size_t len, size_t row_len, size_t bpp)
+{
+    memset(pr, 0, sizeof(*pr));
+    pr->row_len = row_len;
+    pr->bpp = bpp;
+    pr->row = (uint8_t *)calloc(2 * (row_len + 1), 1);
+    if (!pr->row)
+        return -ENOMEM;
+    pr->prev = pr->row + row_len + 1;
+    if (inflateInit(&pr->zs) != Z_OK) {
+        free(pr->row);
+        return -ENOMEM;
+    }
+    pr->zs.next_in = (Bytef *)data;
+    pr->zs.avail_in = (uInt)len;
+    return 0;
+}
+
+/**
+ * Inflate exactly len bytes into buf
+ */
+static int png_inflater_read(struct png_inflater *pr, uint8_t *buf, size_t len)
+{
+    pr->zs.next_out = buf;
+    pr->zs.avail_out = (uInt)len;
+    while (pr->zs.avail_out > 0) {
+        int ret = inflate(&pr->zs, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END && pr->zs.avail_out > 0)
+            return -EINVAL;
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Decode the next row. The returned row stays valid until the following
+ * call, and NULL is returned if the data is truncated or corrupt
+ */
+static const uint8_t *png_inflater_next(struct png_inflater *pr)
+{
+    uint8_t *tmp;
+
+    if (png_inflater_read(pr, pr->row, pr->row_len + 1) < 0)
+        return NULL;
+    if (png_unfilter_row(pr->row[0], pr->row + 1, pr->prev + 1, pr->row_len,
+                         pr->bpp) < 0)
+        return NULL;
+
+    tmp = pr->prev;
+    pr->prev = pr->row;
+    pr->row = tmp;
+    return pr->prev + 1;
+}
+
+/**
+ * Discard the next len bytes of inflated data, without unfiltering them
+ */
+static int png_inflater_skip(struct png_inflater *pr, size_t len)
+{
+    uint8_t scratch[4096];
+
+    while (len > 0) {
+        size_t chunk = len < sizeof(scratch) ? len : sizeof(scratch);
+        if (png_inflater_read(pr, scratch, chunk) < 0)
+            return -EINVAL;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Start a new decoder at the current position of src, with its own row
+ * geometry. This lets the passes of an interlaced image be read in
+ * parallel without inflating the whole image up front.
+ */
+static int png_inflater_fork(struct png_inflater *dst, struct png_inflater *src,
+                             size_t row_len, size_t bpp)
+{
+    memset(dst, 0, sizeof(*dst));
+    dst->row_len = row_len;
+    dst->bpp = bpp;
+    dst->row = (uint8_t *)calloc(2 * (row_len + 1), 1);
+    if (!dst->row)
+        return -ENOMEM;
+    dst->prev = dst->row + row_len + 1;
+    if (inflateCopy(&dst->zs, &src->zs) != Z_OK) {
+        free(dst->row);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void png_inflater_end(struct png_inflater *pr)
+{
+    inflateEnd(&pr->zs);
+    free(pr->row < pr->prev ? pr->row : pr->prev);
+}
+
+/**
+ * PDF Implementation
+ */
+
+#ifndef SKIP_ATTRIBUTE
+static int pdf_set_err(struct pdf_doc *doc, int errval, const char *buffer,
+                       ...) __attribute__((format(printf, 3, 4)));
+#endif
+static int pdf_set_err(struct pdf_doc *doc, int errval, const char *buffer,
+                       ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, buffer);
+    len = vsnprintf(doc->errstr, sizeof(doc->errstr) - 1, buffer, ap);
+    va_end(ap);
+
+    if (len < 0) {
+        doc->errstr[0] = '\0';
+        return errval;
+    }
+
+    if (len >= (int)(sizeof(doc->errstr) - 1))
+        len = (int)(sizeof(doc->errstr) - 1);
+
+    doc->errstr[len] = '\0';
+    doc->errval = errval;
+
+    return errval;
+}
+
+const char *pdf_get_err(const struct pdf_doc *pdf, int *errval)
+{
+    if (!pdf)
+        return NULL;
+    if (pdf->errstr[0] == '\0')
+        return NULL;
+    if (errval)
+        *errval = pdf->errval;
+    return pdf->errstr;
+}
+
+void pdf_clear_err(struct pdf_doc *pdf)
+{
+    if (!pdf)
+        return;
+    pdf->errstr[0] = '\0';
+    pdf->errval = 0;
+}
+
+static int pdf_get_errval(struct pdf_doc *pdf)
+{
+    if (!pdf)
+        return 0;
+    return pdf->errval;
+}
+
+static struct pdf_object *pdf_get_object(const struct pdf_doc *pdf, int index)
+{
+    return (struct pdf_object *)flexarray_get(&pdf->objects, index);
+}
+
+static int pdf_append_object(struct pdf_doc *pdf, struct pdf_object *obj)
+{
+    int index = flexarray_append(&pdf->objects, obj);
+
+    if (index < 0)
+        return index;
+    obj->index = index;
+
+    if (pdf->last_objects[obj->type]) {
+        obj->prev = pdf->last_objects[obj->type];
+        pdf->last_objects[obj->type]->next = obj;
+    }
+    pdf->last_objects[obj->type] = obj;
+
+    if (!pdf->first_objects[obj->type])
+        pdf->first_objects[obj->type] = obj;
+
+    return 0;
+}
+
+static void pdf_object_destroy(struct pdf_object *object)
+{
+    switch (object->type) {
+    case OBJ_stream:
+        dstr_free(&object->stream.stream);
+        break;
+    case OBJ_image:
+        dstr_free(&object->image.dict);
+        dstr_free(&object->image.data);
+        free(object->image.source);
+        break;
+    case OBJ_page:
+        flexarray_clear(&object->page.children);
+        flexarray_clear(&object->page.annotations);
+        flexarray_clear(&object->page.images);
+        break;
+    case OBJ_bookmark:
+        flexarray_clear(&object->bookmark.children);
+        break;
+    }
+}
+
+static struct pdf_object *pdf_add_object(struct pdf_doc *pdf, int type)
+{
+    struct pdf_object *obj;
+
+    if (!pdf)
+        return NULL;
+
+    obj = (struct pdf_object *)arena_alloc(&pdf->arena, sizeof(*obj));
+    if (!obj) {
+        pdf_set_err(pdf, -errno,
+                    "Unable to allocate object %d of type %d: %s",
+                    flexarray_size(&pdf->objects) + 1, type, strerror(errno));
+        return NULL;
+    }
+
+    obj->type = type;
+    switch (type) {
+    case OBJ_page:
+        obj->page.children.arena = &pdf->arena;
+        obj->page.annotations.arena = &pdf->arena;
+        obj->page.images.arena = &pdf->arena;
+        break;
+    case OBJ_bookmark:
+        obj->bookmark.children.arena = &pdf->arena;
+        break;
+    }
+
+    /* On failure the object stays in the arena, unused, until pdf_destroy */
+    if (pdf_append_object(pdf, obj) < 0)
+        return NULL;
+
+    return obj;
+}
+
+static void pdf_del_object(struct pdf_doc *pdf, struct pdf_object *obj)
+{
+    int type = obj->type;
+    flexarray_set(&pdf->objects, obj->index, NULL);
     if (pdf->last_objects[type] == obj) {
         pdf->last_objects[type] = NULL;
         for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
@@ -722,6 +1518,7 @@ struct pdf_doc *pdf_create(float width, float height,
         return NULL;
     pdf->width = width;
     pdf->height = height;
+    pdf->objects.arena = &pdf->arena;
 
     /* We don't want to use ID 0 */
     pdf_add_object(pdf, OBJ_none);
@@ -732,7 +1529,8 @@ struct pdf_doc *pdf_create(float width, float height,
         pdf_destroy(pdf);
         return NULL;
     }
-    obj->info = (struct pdf_info *)calloc(sizeof(*obj->info), 1);
+    obj->info =
+        (struct pdf_info *)arena_alloc(&pdf->arena, sizeof(*obj->info));
     if (!obj->info) {
         pdf_destroy(pdf);
         return NULL;
@@ -801,9 +1599,14 @@ float pdf_page_height(const struct pdf_object *page)
 void pdf_destroy(struct pdf_doc *pdf)
 {
     if (pdf) {
-        for (int i = 0; i < flexarray_size(&pdf->objects); i++)
-            pdf_object_destroy(pdf_get_object(pdf, i));
+        for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+            struct pdf_object *obj = pdf_get_object(pdf, i);
+            if (obj)
+                pdf_object_destroy(obj);
+        }
         flexarray_clear(&pdf->objects);
+        arena_free(&pdf->arena);
+        free(pdf->image_table);
         free(pdf);
     }
 }
@@ -851,6 +1654,27 @@ int pdf_set_font(struct pdf_doc *pdf, const char *font)
     return 0;
 }
 
+int pdf_set_compression(struct pdf_doc *pdf, int level)
+{
+    if (!pdf)
+        return -EINVAL;
+    if (level < 0 || level > 9)
+        return pdf_set_err(pdf, -EINVAL, "Invalid compression level %d",
+                           level);
+    pdf->compress_level = level;
+    return 0;
+}
+
+int pdf_set_save_flags(struct pdf_doc *pdf, int flags)
+{
+    if (!pdf)
+        return -EINVAL;
+    if (flags & ~(PDF_SAVE_OBJECT_STREAMS | PDF_SAVE_LINEARIZED))
+        return pdf_set_err(pdf, -EINVAL, "Invalid save flags 0x%x", flags);
+    pdf->save_flags = flags;
+    return 0;
+}
+
 struct pdf_object *pdf_append_page(struct pdf_doc *pdf)
 {
     struct pdf_object *page;
@@ -913,43 +1737,32 @@ static int pdf_get_bookmark_count(const struct pdf_object *obj)
     return count;
 }
 
-static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
+/**
+ * Write the body of a dictionary object, ie: everything between the
+ * "obj" & "endobj" keywords. Stream objects are written by the caller, as
+ * their payload can be large, and they can't go in an object stream.
+ */
+static int pdf_write_object_body(struct pdf_doc *pdf,
+                                 struct pdf_object *object, struct dstr *out)
 {
-    struct pdf_object *object = pdf_get_object(pdf, index);
-    if (!object)
-        return -ENOENT;
-
-    if (object->type == OBJ_none)
-        return -ENOENT;
-
-    object->offset = ftell(fp);
-
-    fprintf(fp, "%d 0 obj\r\n", index);
-
     switch (object->type) {
-    case OBJ_stream:
-    case OBJ_image: {
-        fwrite(dstr_data(&object->stream.stream),
-               dstr_len(&object->stream.stream), 1, fp);
-        break;
-    }
     case OBJ_info: {
         struct pdf_info *info = object->info;
 
-        fprintf(fp, "<<\r\n");
+        dstr_printf(out, "<<\r\n");
         if (info->creator[0])
-            fprintf(fp, "  /Creator (%s)\r\n", info->creator);
+            dstr_printf(out, "  /Creator (%s)\r\n", info->creator);
         if (info->producer[0])
-            fprintf(fp, "  /Producer (%s)\r\n", info->producer);
+            dstr_printf(out, "  /Producer (%s)\r\n", info->producer);
         if (info->title[0])
-            fprintf(fp, "  /Title (%s)\r\n", info->title);
+            dstr_printf(out, "  /Title (%s)\r\n", info->title);
         if (info->author[0])
-            fprintf(fp, "  /Author (%s)\r\n", info->author);
+            dstr_printf(out, "  /Author (%s)\r\n", info->author);
         if (info->subject[0])
-            fprintf(fp, "  /Subject (%s)\r\n", info->subject);
+            dstr_printf(out, "  /Subject (%s)\r\n", info->subject);
         if (info->date[0])
-            fprintf(fp, "  /CreationDate (D:%s)\r\n", info->date);
-        fprintf(fp, ">>\r\n");
+            dstr_printf(out, "  /CreationDate (D:%s)\r\n", info->date);
+        dstr_printf(out, ">>\r\n");
         break;
     }
 
@@ -957,63 +1770,62 @@ static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
         struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
         bool printed_xobjects = false;
 
-        fprintf(fp,
+        dstr_printf(out,
                 "<<\r\n"
                 "  /Type /Page\r\n"
                 "  /Parent %d 0 R\r\n",
                 pages->index);
-        fprintf(fp, "  /MediaBox [0 0 %f %f]\r\n", object->page.width,
+        dstr_printf(out, "  /MediaBox [0 0 %f %f]\r\n", object->page.width,
                 object->page.height);
-        fprintf(fp, "  /Resources <<\r\n");
-        fprintf(fp, "    /Font <<\r\n");
+        dstr_printf(out, "  /Resources <<\r\n");
+        dstr_printf(out, "    /Font <<\r\n");
         for (struct pdf_object *font = pdf_find_first_object(pdf, OBJ_font);
              font; font = font->next)
-            fprintf(fp, "      /F%d %d 0 R\r\n", font->font.index,
+            dstr_printf(out, "      /F%d %d 0 R\r\n", font->font.index,
                     font->index);
-        fprintf(fp, "    >>\r\n");
+        dstr_printf(out, "    >>\r\n");
         // We trim transparency to just 4-bits
-        fprintf(fp, "    /ExtGState <<\r\n");
+        dstr_printf(out, "    /ExtGState <<\r\n");
         for (int i = 0; i < 16; i++) {
-            fprintf(fp, "      /GS%d <</ca %f>>\r\n", i,
+            dstr_printf(out, "      /GS%d <</ca %f>>\r\n", i,
                     (float)(15 - i) / 15);
         }
-        fprintf(fp, "    >>\r\n");
-
-        for (struct pdf_object *image = pdf_find_first_object(pdf, OBJ_image);
-             image; image = image->next) {
-            if (image->stream.page == object) {
-                if (!printed_xobjects) {
-                    fprintf(fp, "    /XObject <<");
-                    printed_xobjects = true;
-                }
-                fprintf(fp, "      /Image%d %d 0 R ", image->index,
-                        image->index);
+        dstr_printf(out, "    >>\r\n");
+
+        for (int i = 0; i < flexarray_size(&object->page.images); i++) {
+            struct pdf_object *image =
+                (struct pdf_object *)flexarray_get(&object->page.images, i);
+            if (!printed_xobjects) {
+                dstr_printf(out, "    /XObject <<");
+                printed_xobjects = true;
             }
+            dstr_printf(out, "      /Image%d %d 0 R ", image->image.id,
+                    image->index);
         }
         if (printed_xobjects)
-            fprintf(fp, "    >>\r\n");
-        fprintf(fp, "  >>\r\n");
+            dstr_printf(out, "    >>\r\n");
+        dstr_printf(out, "  >>\r\n");
 
-        fprintf(fp, "  /Contents [\r\n");
+        dstr_printf(out, "  /Contents [\r\n");
         for (int i = 0; i < flexarray_size(&object->page.children); i++) {
             struct pdf_object *child =
                 (struct pdf_object *)flexarray_get(&object->page.children, i);
-            fprintf(fp, "%d 0 R\r\n", child->index);
+            dstr_printf(out, "%d 0 R\r\n", child->index);
         }
-        fprintf(fp, "]\r\n");
+        dstr_printf(out, "]\r\n");
 
         if (flexarray_size(&object->page.annotations)) {
-            fprintf(fp, "  /Annots [\r\n");
+            dstr_printf(out, "  /Annots [\r\n");
             for (int i = 0; i < flexarray_size(&object->page.annotations);
                  i++) {
                 struct pdf_object *child = (struct pdf_object *)flexarray_get(
                     &object->page.annotations, i);
-                fprintf(fp, "%d 0 R\r\n", child->index);
+                dstr_printf(out, "%d 0 R\r\n", child->index);
             }
-            fprintf(fp, "]\r\n");
+            dstr_printf(out, "]\r\n");
         }
 
-        fprintf(fp, ">>\r\n");
+        dstr_printf(out, ">>\r\n");
         break;
     }
 
@@ -1025,7 +1837,7 @@ static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
             parent = pdf_find_first_object(pdf, OBJ_outline);
         if (!object->bookmark.page)
             break;
-        fprintf(fp,
+        dstr_printf(out,
                 "<<\r\n"
                 "  /Dest [%d 0 R /XYZ 0 %f null]\r\n"
                 "  /Parent %d 0 R\r\n"
@@ -1039,9 +1851,9 @@ static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
                                                    0);
             l = (struct pdf_object *)flexarray_get(&object->bookmark.children,
                                                    nchildren - 1);
-            fprintf(fp, "  /First %d 0 R\r\n", f->index);
-            fprintf(fp, "  /Last %d 0 R\r\n", l->index);
-            fprintf(fp, "  /Count %d\r\n", pdf_get_bookmark_count(object));
+            dstr_printf(out, "  /First %d 0 R\r\n", f->index);
+            dstr_printf(out, "  /Last %d 0 R\r\n", l->index);
+            dstr_printf(out, "  /Count %d\r\n", pdf_get_bookmark_count(object));
         }
         // Find the previous bookmark with the same parent
         for (other = object->prev;
@@ -1049,15 +1861,15 @@ static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
              other = other->prev)
             ;
         if (other)
-            fprintf(fp, "  /Prev %d 0 R\r\n", other->index);
+            dstr_printf(out, "  /Prev %d 0 R\r\n", other->index);
         // Find the next bookmark with the same parent
         for (other = object->next;
              other && other->bookmark.parent != object->bookmark.parent;
              other = other->next)
             ;
         if (other)
-            fprintf(fp, "  /Next %d 0 R\r\n", other->index);
-        fprintf(fp, ">>\r\n");
+            dstr_printf(out, "  /Next %d 0 R\r\n", other->index);
+        dstr_printf(out, ">>\r\n");
         break;
     }
 
@@ -1076,7 +1888,7 @@ static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
             }
 
             /* Bookmark outline */
-            fprintf(fp,
+            dstr_printf(out,
                     "<<\r\n"
                     "  /Count %d\r\n"
                     "  /Type /Outlines\r\n"
@@ -1085,166 +1897,2052 @@ static int pdf_save_object(struct pdf_doc *pdf, FILE *fp, int index)
                     ">>\r\n",
                     count, first->index, last->index);
         }
-        break;
+        break;
+    }
+
+    case OBJ_font:
+        dstr_printf(out,
+                "<<\r\n"
+                "  /Type /Font\r\n"
+                "  /Subtype /Type1\r\n"
+                "  /BaseFont /%s\r\n"
+                "  /Encoding /WinAnsiEncoding\r\n"
+                ">>\r\n",
+                object->font.name);
+        break;
+
+    case OBJ_pages: {
+        int npages = 0;
+
+        dstr_printf(out, "<<\r\n"
+                    "  /Type /Pages\r\n"
+                    "  /Kids [ ");
+        for (struct pdf_object *page = pdf_find_first_object(pdf, OBJ_page);
+             page; page = page->next) {
+            npages++;
+            dstr_printf(out, "%d 0 R ", page->index);
+        }
+        dstr_printf(out, "]\r\n");
+        dstr_printf(out, "  /Count %d\r\n", npages);
+        dstr_printf(out, ">>\r\n");
+        break;
+    }
+
+    case OBJ_catalog: {
+        struct pdf_object *outline = pdf_find_first_object(pdf, OBJ_outline);
+        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
+
+        dstr_printf(out, "<<\r\n"
+                    "  /Type /Catalog\r\n");
+        if (outline)
+            dstr_printf(out,
+                    "  /Outlines %d 0 R\r\n"
+                    "  /PageMode /UseOutlines\r\n",
+                    outline->index);
+        dstr_printf(out,
+                "  /Pages %d 0 R\r\n"
+                ">>\r\n",
+                pages->index);
+        break;
+    }
+
+    case OBJ_link: {
+        dstr_printf(out,
+                "<<\r\n"
+                "  /Type /Annot\r\n"
+                "  /Subtype /Link\r\n"
+                "  /Rect [%f %f %f %f]\r\n"
+                "  /Dest [%u 0 R /XYZ %f %f null]\r\n"
+                "  /Border [0 0 0]\r\n"
+                ">>\r\n",
+                object->link.llx, object->link.lly, object->link.urx,
+                object->link.ury, object->link.target_page->index,
+                object->link.target_x, object->link.target_y);
+        break;
+    }
+
+    default:
+        return pdf_set_err(pdf, -EINVAL, "Invalid PDF object type %d",
+                           object->type);
+    }
+
+    return 0;
+}
+
+static bool pdf_object_is_stream(const struct pdf_object *object)
+{
+    return object->type == OBJ_stream || object->type == OBJ_image;
+}
+
+/**
+ * Modification time of a file in nanoseconds, so that a file rewritten
+ * within the same second is still seen to have changed
+ */
+static int64_t file_mtime_ns(const struct stat *buf)
+{
+#if defined(_MSC_VER)
+    return (int64_t)buf->st_mtime * 1000000000;
+#elif defined(__APPLE__)
+    return (int64_t)buf->st_mtimespec.tv_sec * 1000000000 +
+           buf->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)buf->st_mtim.tv_sec * 1000000000 + buf->st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * An object as it appears in the file: the head runs from "N 0 obj" up to
+ * any stream data, then comes the stream payload and a fixed tail. Stream
+ * payloads are referenced rather than copied, so big images are only
+ * touched when they are actually written out. A payload may also be left
+ * in a file (payload_file), to be copied straight across.
+ */
+struct object_layout {
+    struct dstr head;
+    const char *payload;
+    size_t payload_len;
+    const char *payload_file;
+    int64_t payload_offset;
+    const char *tail;
+};
+
+static int pdf_layout_object(struct pdf_doc *pdf, struct pdf_object *object,
+                             struct object_layout *layout)
+{
+    struct dstr *head = &layout->head;
+    int ret = 0;
+
+    dstr_reset(head);
+    layout->payload = NULL;
+    layout->payload_len = 0;
+    layout->payload_file = NULL;
+    layout->tail = "endobj\r\n";
+
+    if (dstr_printf(head, "%d 0 obj\r\n", object->index) < 0)
+        return pdf_set_err(pdf, -ENOMEM, "Unable to allocate object %d",
+                           object->index);
+
+    switch (object->type) {
+    case OBJ_stream:
+        layout->payload = dstr_data(&object->stream.stream);
+        layout->payload_len = dstr_len(&object->stream.stream);
+        break;
+
+    case OBJ_image:
+        if (object->image.source) {
+            struct stat buf;
+
+            if (stat(object->image.source, &buf) < 0 ||
+                (uint64_t)buf.st_ino != object->image.source_ino ||
+                (int64_t)buf.st_size != object->image.source_size ||
+                file_mtime_ns(&buf) != object->image.source_mtime_ns)
+                return pdf_set_err(pdf, -ESTALE,
+                                   "Image %s has changed since it was added",
+                                   object->image.source);
+            layout->payload_file = object->image.source;
+            layout->payload_offset = object->image.source_offset;
+        }
+        if (dstr_printf(head,
+                        "<<\r\n"
+                        "  /Type /XObject\r\n"
+                        "  /Name /Image%d\r\n"
+                        "  /Subtype /Image\r\n",
+                        object->image.id) < 0 ||
+            dstr_append_data(head, dstr_data(&object->image.dict),
+                             dstr_len(&object->image.dict)) < 0 ||
+            (object->image.smask &&
+             dstr_printf(head, "  /SMask %d 0 R\r\n",
+                         object->image.smask->index) < 0) ||
+            dstr_printf(head, "  /Length %zu\r\n>>stream\r\n",
+                        object->image.source ? object->image.source_len
+                                             : dstr_len(&object->image.data)) <
+                0)
+            return pdf_set_err(pdf, -ENOMEM, "Unable to allocate object %d",
+                               object->index);
+        layout->payload = dstr_data(&object->image.data);
+        layout->payload_len = object->image.source
+                                  ? object->image.source_len
+                                  : dstr_len(&object->image.data);
+        layout->tail = "\r\nendstream\r\nendobj\r\n";
+        break;
+
+    default:
+        ret = pdf_write_object_body(pdf, object, head);
+        break;
+    }
+    return ret;
+}
+
+static size_t object_layout_len(const struct object_layout *layout)
+{
+    return dstr_len(&layout->head) + layout->payload_len +
+           strlen(layout->tail);
+}
+
+/**
+ * Copy len bytes from offset in the named file to fp. On Linux, when fp is
+ * a regular file, the kernel does this with sendfile() so the data never
+ * passes through user space; otherwise it is streamed through a small
+ * buffer.
+ */
+static int copy_file_data(FILE *fp, const char *file_name, int64_t offset,
+                          size_t len)
+{
+    char buffer[16384];
+    FILE *in = fopen(file_name, "rb");
+    int ret = 0;
+
+    if (!in)
+        return -errno;
+
+#if defined(__linux__)
+    int64_t pos;
+    if (fflush(fp) == 0 && (pos = ftello(fp)) >= 0) {
+        off_t in_offset = offset;
+        size_t done = 0;
+
+        while (done < len) {
+            ssize_t n = sendfile(fileno(fp), fileno(in), &in_offset,
+                                 len - done);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        /* Bring the stdio position back in line with the descriptor */
+        if (done > 0 && fseeko(fp, pos + done, SEEK_SET) != 0)
+            ret = -errno;
+        offset += done;
+        len -= done;
+    }
+#endif
+
+    if (ret >= 0 && len > 0 && fseeko(in, offset, SEEK_SET) != 0)
+        ret = -errno;
+    while (ret >= 0 && len > 0) {
+        size_t n = fread(buffer, 1, len < sizeof(buffer) ? len : sizeof(buffer),
+                         in);
+        if (n == 0) {
+            ret = -EIO; /* The file has been truncated */
+            break;
+        }
+        fwrite(buffer, 1, n, fp);
+        len -= n;
+    }
+    fclose(in);
+    return ret;
+}
+
+static int object_layout_write(struct object_layout *layout, FILE *fp)
+{
+    int ret = 0;
+
+    fwrite(dstr_data(&layout->head), dstr_len(&layout->head), 1, fp);
+    if (layout->payload_file)
+        ret = copy_file_data(fp, layout->payload_file, layout->payload_offset,
+                             layout->payload_len);
+    else if (layout->payload_len)
+        fwrite(layout->payload, layout->payload_len, 1, fp);
+    fputs(layout->tail, fp);
+    return ret;
+}
+
+static int pdf_save_object(struct pdf_doc *pdf, FILE *fp,
+                           struct pdf_object *object,
+                           struct object_layout *layout)
+{
+    int ret;
+
+    if (!object || object->type == OBJ_none)
+        return -ENOENT;
+
+    ret = pdf_layout_object(pdf, object, layout);
+    if (ret < 0)
+        return ret;
+    object->offset = ftello(fp);
+    ret = object_layout_write(layout, fp);
+    if (ret < 0)
+        return pdf_set_err(pdf, ret, "Unable to copy image data from %s",
+                           layout->payload_file);
+
+    return 0;
+}
+
+// Slightly modified djb2 hash algorithm to get pseudo-random ID
+static uint64_t hash(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *d8 = (const uint8_t *)data;
+    for (; len; len--) {
+        hash = (((hash & 0x03ffffffffffffff) << 5) +
+                (hash & 0x7fffffffffffffff)) +
+               *d8++;
+    }
+    return hash;
+}
+
+/**
+ * Fast 64-bit digest used to spot repeated image payloads.
+ * Based on MurmurHash64A, it consumes 8 bytes per round so that hashing a
+ * large image costs little more than reading it.
+ */
+static uint64_t data_digest(const void *data, size_t len)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ull;
+    const uint8_t *d8 = (const uint8_t *)data;
+    uint64_t h = 0x5bd1e995ull ^ (len * m);
+
+    for (; len >= 8; len -= 8, d8 += 8) {
+        uint64_t k;
+        memcpy(&k, d8, sizeof(k));
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (len) {
+        uint64_t k = 0;
+        memcpy(&k, d8, len);
+        h ^= k;
+        h *= m;
+    }
+    h ^= h >> 47;
+    h *= m;
+    h ^= h >> 47;
+    return h;
+}
+
+/*
+ * Write the trailer entries shared by the classic trailer dictionary and
+ * cross-reference streams
+ */
+static int pdf_write_trailer_keys(struct pdf_doc *pdf, struct dstr *out,
+                                  int size)
+{
+    struct pdf_object *catalog = pdf_find_first_object(pdf, OBJ_catalog);
+    struct pdf_object *info = pdf_find_first_object(pdf, OBJ_info);
+    uint64_t id1, id2;
+    time_t now = time(NULL);
+    int xref_count = size - 1;
+
+    /* Generate document unique IDs */
+    id1 = hash(5381, info->info, sizeof(struct pdf_info));
+    id1 = hash(id1, &xref_count, sizeof(xref_count));
+    id2 = hash(5381, &now, sizeof(now));
+    if (dstr_printf(out,
+                    "/Size %d\r\n"
+                    "/Root %d 0 R\r\n"
+                    "/Info %d 0 R\r\n"
+                    "/ID [<%16.16" PRIx64 "> <%16.16" PRIx64 ">]\r\n",
+                    size, catalog->index, info->index, id1, id2) < 0)
+        return pdf_set_err(pdf, -ENOMEM, "Unable to allocate trailer");
+    return 0;
+}
+
+/*
+ * Classic PDF 1.4 layout: every object in turn, then a text xref table
+ */
+static int pdf_save_classic(struct pdf_doc *pdf, FILE *fp,
+                            struct object_layout *layout)
+{
+    struct pdf_object *obj;
+    struct dstr trailer = INIT_DSTR;
+    int64_t xref_offset;
+    int xref_count = 0;
+    int ret;
+
+    fprintf(fp, "%%PDF-1.4\r\n");
+    /* Hibit bytes */
+    fprintf(fp, "%c%c%c%c%c\r\n", 0x25, 0xc7, 0xec, 0x8f, 0xa2);
+
+    /* Dump all the objects & get their file offsets */
+    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+        ret = pdf_save_object(pdf, fp, pdf_get_object(pdf, i), layout);
+        if (ret == -ENOENT)
+            continue;
+        if (ret < 0)
+            return ret;
+        xref_count++;
+    }
+
+    /* xref */
+    xref_offset = ftello(fp);
+    /* Cross-reference table entries only have room for 10 digits */
+    if (xref_offset > INT64_C(9999999999))
+        return pdf_set_err(pdf, -EFBIG,
+                           "PDF too large for a cross-reference table: %" PRId64
+                           " bytes",
+                           xref_offset);
+    fprintf(fp, "xref\r\n");
+    fprintf(fp, "0 %d\r\n", xref_count + 1);
+    fprintf(fp, "0000000000 65535 f\r\n");
+    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
+        obj = pdf_get_object(pdf, i);
+        if (obj->type != OBJ_none)
+            fprintf(fp, "%10.10" PRId64 " 00000 n\r\n", obj->offset);
+    }
+
+    ret = pdf_write_trailer_keys(pdf, &trailer, xref_count + 1);
+    if (ret < 0)
+        return ret;
+    fprintf(fp, "trailer\r\n"
+                "<<\r\n");
+    fwrite(dstr_data(&trailer), dstr_len(&trailer), 1, fp);
+    fprintf(fp, ">>\r\n"
+                "startxref\r\n");
+    fprintf(fp, "%" PRId64 "\r\n", xref_offset);
+    fprintf(fp, "%%%%EOF\r\n");
+    dstr_free(&trailer);
+
+    return 0;
+}
+
+/* Objects per object stream; readers unpack a whole stream to get one */
+#define OBJSTM_MAX_OBJECTS 100
+
+/* One row of a cross-reference stream: type, offset/stream, gen/index */
+struct xref_entry {
+    uint8_t type;
+    int64_t field2;
+    uint16_t field3;
+};
+
+/*
+ * Write out the pending object stream, and record where it went
+ */
+static int pdf_flush_objstm(struct pdf_doc *pdf, FILE *fp, int index,
+                            int count, struct dstr *header, struct dstr *data,
+                            struct xref_entry *xref)
+{
+    const int level =
+        pdf->compress_level > 0 ? pdf->compress_level : Z_DEFAULT_COMPRESSION;
+    struct dstr compressed = INIT_DSTR;
+    struct deflater d;
+    int ret;
+
+    ret = deflater_init(&d, &compressed, level,
+                        dstr_len(header) + dstr_len(data));
+    if (ret >= 0) {
+        ret = deflater_write(&d, dstr_data(header), dstr_len(header), false);
+        if (ret >= 0)
+            ret = deflater_write(&d, dstr_data(data), dstr_len(data), true);
+        deflater_end(&d);
+    }
+    if (ret < 0) {
+        dstr_free(&compressed);
+        return pdf_set_err(pdf, -ENOMEM, "Unable to compress object stream");
+    }
+    xref[index] = (struct xref_entry){1, ftello(fp), 0};
+    fprintf(fp,
+            "%d 0 obj\r\n"
+            "<< /Type /ObjStm /N %d /First %zu /Length %zu "
+            "/Filter /FlateDecode >>stream\r\n",
+            index, count, dstr_len(header), dstr_len(&compressed));
+    fwrite(dstr_data(&compressed), dstr_len(&compressed), 1, fp);
+    fprintf(fp, "\r\nendstream\r\n"
+                "endobj\r\n");
+    dstr_free(&compressed);
+    dstr_reset(header);
+    dstr_reset(data);
+    return 0;
+}
+
+/*
+ * Write a cross-reference stream as object "index", followed by startxref.
+ * The rows cover the /Index subsections given (or objects 0 onwards if
+ * that's NULL), and the last row is the stream's own, filled in here.
+ */
+static int pdf_write_xref_stream(struct pdf_doc *pdf, FILE *fp, int index,
+                                 struct xref_entry *xref, int nentries,
+                                 const char *subsections,
+                                 struct dstr *trailer)
+{
+    struct dstr rows = INIT_DSTR, compressed = INIT_DSTR;
+    int64_t xref_offset;
+    int width, ret = 0;
+
+    /* Size the offset column to fit the largest offset, the xref's own */
+    xref_offset = ftello(fp);
+    xref[nentries - 1] = (struct xref_entry){1, xref_offset, 0};
+    for (width = 1; width < 8 && (xref_offset >> (width * 8)) != 0; width++)
+        ;
+    for (int i = 0; i < nentries; i++) {
+        uint8_t row[11];
+
+        row[0] = xref[i].type;
+        for (int b = 0; b < width; b++)
+            row[1 + b] = (uint8_t)(xref[i].field2 >> ((width - 1 - b) * 8));
+        row[1 + width] = (uint8_t)(xref[i].field3 >> 8);
+        row[2 + width] = (uint8_t)xref[i].field3;
+        if (dstr_append_data(&rows, row, width + 3) < 0) {
+            ret = pdf_set_err(pdf, -ENOMEM, "Unable to allocate xref stream");
+            goto out;
+        }
+    }
+    if (deflate_pixels(&compressed, (const uint8_t *)dstr_data(&rows),
+                       width + 3, nentries, 1,
+                       pdf->compress_level > 0 ? pdf->compress_level
+                                               : Z_DEFAULT_COMPRESSION) < 0) {
+        ret = pdf_set_err(pdf, -ENOMEM, "Unable to compress xref stream");
+        goto out;
+    }
+
+    fprintf(fp,
+            "%d 0 obj\r\n"
+            "<<\r\n"
+            "/Type /XRef\r\n"
+            "/W [1 %d 2]\r\n",
+            index, width);
+    if (subsections)
+        fprintf(fp, "/Index [%s]\r\n", subsections);
+    fwrite(dstr_data(trailer), dstr_len(trailer), 1, fp);
+    fprintf(fp,
+            "/Filter /FlateDecode\r\n"
+            "/DecodeParms << /Columns %d /Predictor 12 >>\r\n"
+            "/Length %zu\r\n"
+            ">>stream\r\n",
+            width + 3, dstr_len(&compressed));
+    fwrite(dstr_data(&compressed), dstr_len(&compressed), 1, fp);
+    fprintf(fp, "\r\nendstream\r\n"
+                "endobj\r\n"
+                "startxref\r\n");
+    fprintf(fp, "%" PRId64 "\r\n", xref_offset);
+    fprintf(fp, "%%%%EOF\r\n");
+
+out:
+    dstr_free(&rows);
+    dstr_free(&compressed);
+    return ret;
+}
+
+/*
+ * PDF 1.5 layout: streams are written as usual, every other object is
+ * packed into compressed object streams, and the xref is a binary,
+ * compressed cross-reference stream. Object & xref streams are numbered
+ * after the document's own objects.
+ */
+static int pdf_save_packed(struct pdf_doc *pdf, FILE *fp,
+                           struct object_layout *layout)
+{
+    const int nobjs = flexarray_size(&pdf->objects);
+    struct dstr header = INIT_DSTR, data = INIT_DSTR, trailer = INIT_DSTR;
+    struct xref_entry *xref;
+    int npacked = 0, nstreams, xref_index, count = 0, stm_index;
+    int ret = 0;
+
+    for (int i = 0; i < nobjs; i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        if (obj && obj->type != OBJ_none && !pdf_object_is_stream(obj))
+            npacked++;
+    }
+    nstreams = (npacked + OBJSTM_MAX_OBJECTS - 1) / OBJSTM_MAX_OBJECTS;
+    xref_index = nobjs + nstreams;
+    xref = (struct xref_entry *)calloc(xref_index + 1, sizeof(*xref));
+    if (!xref)
+        return pdf_set_err(pdf, -ENOMEM, "Unable to allocate xref stream");
+    xref[0] = (struct xref_entry){0, 0, 65535};
+
+    fprintf(fp, "%%PDF-1.5\r\n");
+    /* Hibit bytes */
+    fprintf(fp, "%c%c%c%c%c\r\n", 0x25, 0xc7, 0xec, 0x8f, 0xa2);
+
+    /* Streams go straight out, as they can't live in an object stream */
+    for (int i = 0; i < nobjs; i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        if (!obj || obj->type == OBJ_none || !pdf_object_is_stream(obj))
+            continue;
+        ret = pdf_save_object(pdf, fp, obj, layout);
+        if (ret < 0)
+            goto out;
+        xref[i] = (struct xref_entry){1, obj->offset, 0};
+    }
+
+    /* Everything else is gathered into object streams */
+    stm_index = nobjs;
+    for (int i = 0; i < nobjs; i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        size_t start = dstr_len(&data);
+
+        if (!obj || obj->type == OBJ_none || pdf_object_is_stream(obj))
+            continue;
+        dstr_printf(&header, "%d %zu ", i, start);
+        ret = pdf_write_object_body(pdf, obj, &data);
+        if (ret < 0)
+            goto out;
+        if (dstr_len(&data) == start)
+            dstr_append(&data, "null\r\n");
+        xref[i] = (struct xref_entry){2, stm_index, (uint16_t)count};
+        if (++count == OBJSTM_MAX_OBJECTS) {
+            ret = pdf_flush_objstm(pdf, fp, stm_index++, count, &header,
+                                   &data, xref);
+            if (ret < 0)
+                goto out;
+            count = 0;
+        }
+    }
+    if (count > 0) {
+        ret = pdf_flush_objstm(pdf, fp, stm_index, count, &header, &data,
+                               xref);
+        if (ret < 0)
+            goto out;
+    }
+
+    ret = pdf_write_trailer_keys(pdf, &trailer, xref_index + 1);
+    if (ret < 0)
+        goto out;
+    ret = pdf_write_xref_stream(pdf, fp, xref_index, xref, xref_index + 1,
+                                NULL, &trailer);
+
+out:
+    dstr_free(&header);
+    dstr_free(&data);
+    dstr_free(&trailer);
+    free(xref);
+    return ret;
+}
+
+/*
+ * Linearized ("fast web view") layout, as set out in Annex F of the PDF
+ * specification. Objects are renumbered and reordered so that a reader
+ * fetching the file over a network can show the first page as soon as it
+ * arrives:
+ *   header, linearization dictionary, first-page xref & trailer,
+ *   catalog & outline, hint stream, first page objects,
+ *   remaining pages in order, objects shared by later pages,
+ *   everything else, main xref & trailer.
+ * The first-page section takes the highest object numbers, and the whole
+ * file is laid out in memory (bar stream payloads) before it is written,
+ * so the output can still be a pipe.
+ */
+enum {
+    LIN_UNUSED = -1, /* Not needed by any page */
+    LIN_SHARED = -2, /* Needed by more than one page */
+};
+
+struct lin_state {
+    struct pdf_doc *pdf;
+    int *owner;          /* Page needing each object, or LIN_xxx */
+    uint8_t *first_page; /* Set for objects the first page needs */
+    uint8_t *placed;     /* Set once an object has a place in the file */
+    int *shared_id;      /* Position in the shared object hint table */
+    struct pdf_object **order; /* Objects in file order */
+    int count;                 /* Number of objects in order */
+    /* State for the hint table visitors */
+    struct bit_writer *bits;
+    int nbits;
+    int nshared;
+    int max_shared_id;
+};
+
+typedef void (*lin_visit_fn)(struct lin_state *ls, struct pdf_object *obj,
+                             int page_no);
+
+/*
+ * Visit a page and every object needed to display it
+ */
+static void lin_visit_page(struct lin_state *ls, struct pdf_object *page,
+                           int page_no, lin_visit_fn fn)
+{
+    fn(ls, page, page_no);
+    for (int i = 0; i < flexarray_size(&page->page.children); i++)
+        fn(ls, (struct pdf_object *)flexarray_get(&page->page.children, i),
+           page_no);
+    for (int i = 0; i < flexarray_size(&page->page.annotations); i++)
+        fn(ls,
+           (struct pdf_object *)flexarray_get(&page->page.annotations, i),
+           page_no);
+    for (int i = 0; i < flexarray_size(&page->page.images); i++) {
+        struct pdf_object *image =
+            (struct pdf_object *)flexarray_get(&page->page.images, i);
+        fn(ls, image, page_no);
+        if (image->image.smask)
+            fn(ls, image->image.smask, page_no);
+    }
+    /* Every page lists every font in its resources */
+    for (struct pdf_object *font = pdf_find_first_object(ls->pdf, OBJ_font);
+         font; font = font->next)
+        fn(ls, font, page_no);
+}
+
+static void lin_claim(struct lin_state *ls, struct pdf_object *obj,
+                      int page_no)
+{
+    int *owner = &ls->owner[obj->index];
+
+    if (*owner == LIN_UNUSED)
+        *owner = page_no;
+    else if (*owner != page_no)
+        *owner = LIN_SHARED;
+    if (page_no == 0)
+        ls->first_page[obj->index] = 1;
+}
+
+static void lin_place(struct lin_state *ls, struct pdf_object *obj)
+{
+    if (ls->placed[obj->index])
+        return;
+    ls->placed[obj->index] = 1;
+    ls->order[ls->count++] = obj;
+}
+
+static void lin_place_first(struct lin_state *ls, struct pdf_object *obj,
+                            int page_no)
+{
+    (void)page_no;
+    lin_place(ls, obj);
+}
+
+static void lin_place_private(struct lin_state *ls, struct pdf_object *obj,
+                              int page_no)
+{
+    if (ls->owner[obj->index] == page_no)
+        lin_place(ls, obj);
+}
+
+static void lin_count_shared(struct lin_state *ls, struct pdf_object *obj,
+                             int page_no)
+{
+    (void)page_no;
+    if (ls->owner[obj->index] != LIN_SHARED)
+        return;
+    ls->nshared++;
+    if (ls->shared_id[obj->index] > ls->max_shared_id)
+        ls->max_shared_id = ls->shared_id[obj->index];
+}
+
+/*
+ * Hint tables are packed bit fields, most significant bit first
+ */
+struct bit_writer {
+    struct dstr *out;
+    uint32_t acc;
+    int nbits;
+    int err;
+};
+
+static void bits_put(struct bit_writer *bw, uint32_t value, int nbits)
+{
+    for (int i = nbits - 1; i >= 0; i--) {
+        bw->acc = (bw->acc << 1) | ((value >> i) & 1);
+        if (++bw->nbits == 8) {
+            uint8_t byte = (uint8_t)bw->acc;
+            if (dstr_append_data(bw->out, &byte, 1) < 0)
+                bw->err = -ENOMEM;
+            bw->acc = 0;
+            bw->nbits = 0;
+        }
+    }
+}
+
+/* Each hint table item starts on a byte boundary */
+static void bits_flush(struct bit_writer *bw)
+{
+    if (bw->nbits)
+        bits_put(bw, 0, 8 - bw->nbits);
+}
+
+static int bits_needed(uint32_t value)
+{
+    int n = 0;
+
+    for (; value; value >>= 1)
+        n++;
+    return n;
+}
+
+static void lin_write_shared(struct lin_state *ls, struct pdf_object *obj,
+                             int page_no)
+{
+    (void)page_no;
+    if (ls->owner[obj->index] == LIN_SHARED)
+        bits_put(ls->bits, (uint32_t)ls->shared_id[obj->index], ls->nbits);
+}
+
+/*
+ * Hint table offsets & lengths are 32-bit fields, so a larger file can't
+ * be linearized (the xref table itself manages 10 digits)
+ */
+static int lin_check_size(struct lin_state *ls, uint64_t value,
+                          const char *what)
+{
+    if (value > UINT32_MAX)
+        return pdf_set_err(ls->pdf, -EFBIG,
+                           "PDF too large for linearization hint tables: "
+                           "%s of %" PRIu64 " bytes",
+                           what, value);
+    return 0;
+}
+
+/*
+ * Build the primary hint stream data: the page offset hint table, then
+ * the shared object hint table (which starts at *shared_start).
+ * Offsets are measured as if the hint stream itself wasn't there.
+ */
+static int lin_hint_tables(struct lin_state *ls, struct pdf_object **pages,
+                           int npages, const int *page_start,
+                           const int64_t *offset, const size_t *len,
+                           int nfirst, int nshared_section,
+                           struct pdf_object **shared_section,
+                           struct dstr *out, size_t *shared_start)
+{
+    struct bit_writer bw = {.out = out};
+    uint32_t *nobjects, *page_len;
+    uint32_t min_nobjects = UINT32_MAX, max_nobjects = 0;
+    uint32_t min_len = UINT32_MAX, max_len = 0;
+    uint32_t min_group = UINT32_MAX, max_group = 0;
+    int max_nshared = 0, nbits_nobjects, nbits_len, nbits_group;
+    int ret;
+
+    ret = lin_check_size(ls, (uint64_t)offset[pages[0]->index],
+                         "first page offset");
+    if (ret >= 0 && nshared_section)
+        ret = lin_check_size(ls, (uint64_t)offset[shared_section[0]->index],
+                             "shared object offset");
+    for (int i = 0; ret >= 0 && i < nfirst; i++)
+        ret = lin_check_size(ls, len[ls->order[page_start[0] + i]->index],
+                             "object length");
+    for (int i = 0; ret >= 0 && i < nshared_section; i++)
+        ret = lin_check_size(ls, len[shared_section[i]->index],
+                             "object length");
+    if (ret < 0)
+        return ret;
+
+    nobjects = (uint32_t *)calloc(2 * (size_t)npages, sizeof(uint32_t));
+    if (!nobjects)
+        return -ENOMEM;
+    page_len = nobjects + npages;
+
+    ls->bits = &bw;
+    ls->max_shared_id = 0;
+    for (int i = 0; i < npages; i++) {
+        uint64_t length = 0;
+
+        nobjects[i] = (uint32_t)(page_start[i + 1] - page_start[i]);
+        for (int j = page_start[i]; j < page_start[i + 1]; j++)
+            length += len[ls->order[j]->index];
+        ret = lin_check_size(ls, length, "page length");
+        if (ret < 0) {
+            free(nobjects);
+            return ret;
+        }
+        page_len[i] = (uint32_t)length;
+        if (nobjects[i] < min_nobjects)
+            min_nobjects = nobjects[i];
+        if (nobjects[i] > max_nobjects)
+            max_nobjects = nobjects[i];
+        if (page_len[i] < min_len)
+            min_len = page_len[i];
+        if (page_len[i] > max_len)
+            max_len = page_len[i];
+        /* The first page's shared objects are all in its own section */
+        if (i > 0) {
+            ls->nshared = 0;
+            lin_visit_page(ls, pages[i], i, lin_count_shared);
+            if (ls->nshared > max_nshared)
+                max_nshared = ls->nshared;
+        }
+    }
+    nbits_nobjects = bits_needed(max_nobjects - min_nobjects);
+    nbits_len = bits_needed(max_len - min_len);
+
+    /* Page offset hint table header. Content stream positions aren't
+     * tracked, so each page's content is described as the whole page */
+    bits_put(&bw, min_nobjects, 32);
+    bits_put(&bw, (uint32_t)offset[pages[0]->index], 32);
+    bits_put(&bw, (uint32_t)nbits_nobjects, 16);
+    bits_put(&bw, min_len, 32);
+    bits_put(&bw, (uint32_t)nbits_len, 16);
+    bits_put(&bw, 0, 32);
+    bits_put(&bw, 0, 16);
+    bits_put(&bw, min_len, 32);
+    bits_put(&bw, (uint32_t)nbits_len, 16);
+    bits_put(&bw, (uint32_t)bits_needed((uint32_t)max_nshared), 16);
+    bits_put(&bw, (uint32_t)bits_needed((uint32_t)ls->max_shared_id), 16);
+    bits_put(&bw, 0, 16);
+    bits_put(&bw, 0, 16);
+
+    /* Per-page entries, one item at a time across all the pages */
+    for (int i = 0; i < npages; i++)
+        bits_put(&bw, nobjects[i] - min_nobjects, nbits_nobjects);
+    bits_flush(&bw);
+    for (int i = 0; i < npages; i++)
+        bits_put(&bw, page_len[i] - min_len, nbits_len);
+    bits_flush(&bw);
+    for (int i = 0; i < npages; i++) {
+        ls->nshared = 0;
+        if (i > 0)
+            lin_visit_page(ls, pages[i], i, lin_count_shared);
+        bits_put(&bw, (uint32_t)ls->nshared,
+                 bits_needed((uint32_t)max_nshared));
+    }
+    bits_flush(&bw);
+    ls->nbits = bits_needed((uint32_t)ls->max_shared_id);
+    for (int i = 1; i < npages; i++)
+        lin_visit_page(ls, pages[i], i, lin_write_shared);
+    bits_flush(&bw);
+    /* No fractional positions, content offsets or content lengths */
+    for (int i = 0; i < npages; i++)
+        bits_put(&bw, page_len[i] - min_len, nbits_len);
+    bits_flush(&bw);
+    free(nobjects);
+
+    /* Shared object hint table: one single-object group for each object
+     * in the first page section, then each shared object */
+    *shared_start = dstr_len(out);
+    for (int i = 0; i < nfirst; i++) {
+        uint32_t l = (uint32_t)len[ls->order[page_start[0] + i]->index];
+        min_group = l < min_group ? l : min_group;
+        max_group = l > max_group ? l : max_group;
+    }
+    for (int i = 0; i < nshared_section; i++) {
+        uint32_t l = (uint32_t)len[shared_section[i]->index];
+        min_group = l < min_group ? l : min_group;
+        max_group = l > max_group ? l : max_group;
+    }
+    nbits_group = bits_needed(max_group - min_group);
+    bits_put(&bw, nshared_section ? (uint32_t)shared_section[0]->index : 0,
+             32);
+    bits_put(&bw,
+             nshared_section ? (uint32_t)offset[shared_section[0]->index] : 0,
+             32);
+    bits_put(&bw, (uint32_t)nfirst, 32);
+    bits_put(&bw, (uint32_t)(nfirst + nshared_section), 32);
+    bits_put(&bw, 0, 16);
+    bits_put(&bw, min_group, 32);
+    bits_put(&bw, (uint32_t)nbits_group, 16);
+    for (int i = 0; i < nfirst; i++)
+        bits_put(&bw,
+                 (uint32_t)len[ls->order[page_start[0] + i]->index] -
+                     min_group,
+                 nbits_group);
+    for (int i = 0; i < nshared_section; i++)
+        bits_put(&bw, (uint32_t)len[shared_section[i]->index] - min_group,
+                 nbits_group);
+    bits_flush(&bw);
+    /* No MD5 signatures */
+    for (int i = 0; i < nfirst + nshared_section; i++)
+        bits_put(&bw, 0, 1);
+    bits_flush(&bw);
+
+    return bw.err;
+}
+
+static int pdf_save_linearized(struct pdf_doc *pdf, FILE *fp)
+{
+    const int nobjs = flexarray_size(&pdf->objects);
+    const size_t header_len = strlen("%PDF-1.4\r\n") + 7;
+    struct lin_state ls = {.pdf = pdf};
+    struct pdf_object **pages = NULL, *obj;
+    struct object_layout *layout = NULL;
+    struct dstr hints = INIT_DSTR, hint_head = INIT_DSTR;
+    struct dstr first_xref = INIT_DSTR, main_xref = INIT_DSTR;
+    struct dstr trailer = INIT_DSTR;
+    int64_t *offset = NULL, pos, hint_offset = 0, hint_len, end_first;
+    int64_t xref_pos;
+    int64_t file_len;
+    size_t *len = NULL, shared_start, lin_len;
+    int *page_start = NULL, *owner = NULL;
+    int npages = 0, n4, n6, n8, nmain, first_no, hint_no, size;
+    int ret = 0;
+    char lin[256];
+
+    for (obj = pdf_find_first_object(pdf, OBJ_page); obj; obj = obj->next)
+        npages++;
+
+    pages = (struct pdf_object **)calloc(npages, sizeof(*pages));
+    page_start = (int *)calloc(npages + 1, sizeof(int));
+    ls.owner = (int *)malloc(nobjs * sizeof(int));
+    ls.first_page = (uint8_t *)calloc(nobjs, 1);
+    ls.placed = (uint8_t *)calloc(nobjs, 1);
+    ls.order = (struct pdf_object **)calloc(nobjs, sizeof(*ls.order));
+    if (!pages || !page_start || !ls.owner || !ls.first_page || !ls.placed ||
+        !ls.order) {
+        ret = pdf_set_err(pdf, -ENOMEM, "Unable to allocate linearized layout");
+        goto out;
+    }
+
+    npages = 0;
+    for (obj = pdf_find_first_object(pdf, OBJ_page); obj; obj = obj->next)
+        pages[npages++] = obj;
+    for (int i = 0; i < nobjs; i++)
+        ls.owner[i] = LIN_UNUSED;
+    for (int i = 0; i < npages; i++)
+        lin_visit_page(&ls, pages[i], i, lin_claim);
+
+    /* Part 4: the catalog, plus the outline as it is shown on opening */
+    lin_place(&ls, pdf_find_first_object(pdf, OBJ_catalog));
+    for (obj = pdf_find_first_object(pdf, OBJ_outline); obj; obj = obj->next)
+        lin_place(&ls, obj);
+    for (obj = pdf_find_first_object(pdf, OBJ_bookmark); obj; obj = obj->next)
+        lin_place(&ls, obj);
+    n4 = ls.count;
+    /* Part 6: everything the first page needs, page object first */
+    page_start[0] = ls.count;
+    lin_visit_page(&ls, pages[0], 0, lin_place_first);
+    /* Part 7: each later page with its private objects */
+    for (int i = 1; i < npages; i++) {
+        page_start[i] = ls.count;
+        lin_visit_page(&ls, pages[i], i, lin_place_private);
+    }
+    page_start[npages] = ls.count;
+    /* Part 8: objects shared between later pages */
+    for (int i = 0; i < nobjs; i++) {
+        obj = pdf_get_object(pdf, i);
+        if (obj && ls.owner[i] == LIN_SHARED && !ls.first_page[i])
+            lin_place(&ls, obj);
+    }
+    n8 = ls.count - page_start[npages];
+    /* Part 9: everything else, such as the page tree & info */
+    for (int i = 0; i < nobjs; i++) {
+        obj = pdf_get_object(pdf, i);
+        if (obj && obj->type != OBJ_none)
+            lin_place(&ls, obj);
+    }
+    n6 = page_start[1] - page_start[0];
+    nmain = ls.count - page_start[1];
+
+    /* Renumber: the main section from 1, then the first-page section
+     * (linearization dictionary, part 4, hint stream, part 6) */
+    first_no = nmain + 1;
+    hint_no = first_no + 1 + n4;
+    size = hint_no + 1 + n6;
+    for (int k = page_start[1]; k < ls.count; k++)
+        ls.order[k]->index = k - page_start[1] + 1;
+    for (int k = 0; k < n4; k++)
+        ls.order[k]->index = first_no + 1 + k;
+    for (int k = n4; k < page_start[1]; k++)
+        ls.order[k]->index = hint_no + 1 + (k - n4);
+
+    /* Re-key the per-object state by the new numbers */
+    owner = (int *)malloc(size * sizeof(int));
+    ls.shared_id = (int *)calloc(size, sizeof(int));
+    offset = (int64_t *)calloc(size, sizeof(int64_t));
+    len = (size_t *)calloc(size, sizeof(size_t));
+    layout = (struct object_layout *)calloc(ls.count, sizeof(*layout));
+    if (!owner || !ls.shared_id || !offset || !len || !layout) {
+        ret = pdf_set_err(pdf, -ENOMEM, "Unable to allocate linearized layout");
+        goto restore;
+    }
+    for (int i = 0; i < size; i++)
+        owner[i] = LIN_UNUSED;
+    for (int i = 0; i < nobjs; i++) {
+        obj = pdf_get_object(pdf, i);
+        if (obj && obj->type != OBJ_none)
+            owner[obj->index] = ls.owner[i];
+    }
+    free(ls.owner);
+    ls.owner = owner;
+    owner = NULL;
+    for (int k = 0; k < n6; k++)
+        ls.shared_id[ls.order[n4 + k]->index] = k;
+    for (int k = 0; k < n8; k++)
+        ls.shared_id[ls.order[page_start[npages] + k]->index] = n6 + k;
+
+    for (int k = 0; k < ls.count; k++) {
+        ret = pdf_layout_object(pdf, ls.order[k], &layout[k]);
+        if (ret < 0)
+            goto restore;
+        len[ls.order[k]->index] = object_layout_len(&layout[k]);
+    }
+
+    /* Work out where everything goes, leaving the hint stream out for
+     * now, as hint table offsets are measured without it */
+    lin_len = (size_t)snprintf(lin, sizeof(lin),
+                               "%d 0 obj\r\n"
+                               "<< /Linearized 1 /L %10d /H [ %10d %10d ] "
+                               "/O %10d /E %10d /N %10d /T %10d >>\r\n"
+                               "endobj\r\n",
+                               first_no, 0, 0, 0, 0, 0, 0, 0);
+    ret = pdf_write_trailer_keys(pdf, &trailer, size);
+    if (ret < 0)
+        goto restore;
+    pos = (int64_t)(header_len + lin_len + strlen("xref\r\n")) +
+          snprintf(NULL, 0, "%d %d\r\n", first_no, size - first_no) +
+          20 * (int64_t)(size - first_no) + strlen("trailer\r\n<<\r\n") +
+          dstr_len(&trailer) +
+          snprintf(NULL, 0, "/Prev %10d\r\n>>\r\nstartxref\r\n0\r\n%%%%EOF\r\n",
+                   0);
+    for (int k = 0; k < ls.count; k++) {
+        if (k == n4)
+            hint_offset = pos;
+        offset[ls.order[k]->index] = pos;
+        pos += len[ls.order[k]->index];
+    }
+
+    ret = lin_hint_tables(&ls, pages, npages, page_start, offset, len, n6,
+                          n8, ls.order + page_start[npages], &hints,
+                          &shared_start);
+    if (ret == -EFBIG)
+        goto restore;
+    if (ret < 0 || dstr_printf(&hint_head,
+                               "%d 0 obj\r\n"
+                               "<< /S %zu /Length %zu >>stream\r\n",
+                               hint_no, shared_start, dstr_len(&hints)) < 0) {
+        ret = pdf_set_err(pdf, -ENOMEM, "Unable to allocate hint tables");
+        goto restore;
+    }
+    hint_len = (int64_t)(dstr_len(&hint_head) + dstr_len(&hints) +
+                         strlen("\r\nendstream\r\nendobj\r\n"));
+
+    /* Now the real offsets */
+    for (int k = n4; k < ls.count; k++)
+        offset[ls.order[k]->index] += hint_len;
+    for (int k = 0; k < ls.count; k++)
+        ls.order[k]->offset = offset[ls.order[k]->index];
+    end_first = pos + hint_len;
+    if (page_start[1] > 0) {
+        obj = ls.order[page_start[1] - 1];
+        end_first = offset[obj->index] + len[obj->index];
+    }
+    xref_pos = pos + hint_len;
+
+    dstr_printf(&main_xref,
+                "xref\r\n"
+                "0 %d\r\n",
+                first_no);
+    dstr_append(&main_xref, "0000000000 65535 f\r\n");
+    for (int k = page_start[1]; k < ls.count; k++)
+        dstr_printf(&main_xref, "%10.10" PRId64 " 00000 n\r\n",
+                    offset[ls.order[k]->index]);
+    dstr_printf(&main_xref,
+                "trailer\r\n"
+                "<< /Size %d >>\r\n"
+                "startxref\r\n"
+                "%zu\r\n"
+                "%%%%EOF\r\n",
+                first_no, header_len + lin_len);
+    file_len = xref_pos + (int64_t)dstr_len(&main_xref);
+    if (file_len > INT64_C(9999999999)) {
+        ret = pdf_set_err(pdf, -EFBIG,
+                          "PDF too large for a cross-reference table: %" PRId64
+                          " bytes",
+                          file_len);
+        goto restore;
+    }
+
+    dstr_printf(&first_xref,
+                "xref\r\n"
+                "%d %d\r\n",
+                first_no, size - first_no);
+    dstr_printf(&first_xref, "%10.10zu 00000 n\r\n", header_len);
+    for (int k = 0; k < page_start[1]; k++) {
+        if (k == n4)
+            dstr_printf(&first_xref, "%10.10" PRId64 " 00000 n\r\n",
+                        hint_offset);
+        dstr_printf(&first_xref, "%10.10" PRId64 " 00000 n\r\n",
+                    offset[ls.order[k]->index]);
+    }
+    dstr_append(&first_xref, "trailer\r\n<<\r\n");
+    dstr_append_data(&first_xref, dstr_data(&trailer), dstr_len(&trailer));
+    dstr_printf(&first_xref,
+                "/Prev %10" PRId64 "\r\n"
+                ">>\r\n"
+                "startxref\r\n"
+                "0\r\n"
+                "%%%%EOF\r\n",
+                xref_pos);
+    snprintf(lin, sizeof(lin),
+             "%d 0 obj\r\n"
+             "<< /Linearized 1 /L %10" PRId64 " /H [ %10" PRId64 " %10" PRId64
+             " ] /O %10d /E %10" PRId64 " /N %10d /T %10" PRId64 " >>\r\n"
+             "endobj\r\n",
+             first_no, file_len, hint_offset, hint_len, pages[0]->index,
+             end_first, npages,
+             /* /T is the end of line just before the first xref entry */
+             xref_pos + (int64_t)strlen("xref\r\n") +
+                 snprintf(NULL, 0, "0 %d\r\n", first_no) - 1);
+
+    fprintf(fp, "%%PDF-1.4\r\n");
+    /* Hibit bytes */
+    fprintf(fp, "%c%c%c%c%c\r\n", 0x25, 0xc7, 0xec, 0x8f, 0xa2);
+    fputs(lin, fp);
+    fwrite(dstr_data(&first_xref), dstr_len(&first_xref), 1, fp);
+    for (int k = 0; k < ls.count; k++) {
+        if (k == n4) {
+            fwrite(dstr_data(&hint_head), dstr_len(&hint_head), 1, fp);
+            fwrite(dstr_data(&hints), dstr_len(&hints), 1, fp);
+            fputs("\r\nendstream\r\nendobj\r\n", fp);
+        }
+        ret = object_layout_write(&layout[k], fp);
+        if (ret < 0) {
+            pdf_set_err(pdf, ret, "Unable to copy image data from %s",
+                        layout[k].payload_file);
+            goto restore;
+        }
+    }
+    fwrite(dstr_data(&main_xref), dstr_len(&main_xref), 1, fp);
+    ret = 0;
+
+restore:
+    /* Put the original numbering back */
+    for (int i = 0; i < nobjs; i++) {
+        obj = pdf_get_object(pdf, i);
+        if (obj)
+            obj->index = i;
+    }
+out:
+    if (layout)
+        for (int k = 0; k < ls.count; k++)
+            dstr_free(&layout[k].head);
+    free(layout);
+    free(len);
+    free(offset);
+    free(owner);
+    free(ls.shared_id);
+    free(ls.order);
+    free(ls.placed);
+    free(ls.first_page);
+    free(ls.owner);
+    free(page_start);
+    free(pages);
+    dstr_free(&hints);
+    dstr_free(&hint_head);
+    dstr_free(&first_xref);
+    dstr_free(&main_xref);
+    dstr_free(&trailer);
+    return ret;
+}
+
+int pdf_save_file(struct pdf_doc *pdf, FILE *fp)
+{
+    struct object_layout layout = {.head = INIT_DSTR};
+    int ret;
+
+    /* Linearization needs a first page, and takes priority */
+    if ((pdf->save_flags & PDF_SAVE_LINEARIZED) &&
+        pdf_find_first_object(pdf, OBJ_page))
+        ret = pdf_save_linearized(pdf, fp);
+    else if (pdf->save_flags & PDF_SAVE_OBJECT_STREAMS)
+        ret = pdf_save_packed(pdf, fp, &layout);
+    else
+        ret = pdf_save_classic(pdf, fp, &layout);
+
+    dstr_free(&layout.head);
+
+    if (ret >= 0 && ferror(fp))
+        return pdf_set_err(pdf, -EIO, "Unable to write PDF: %s",
+                           strerror(errno));
+
+    return ret;
+}
+
+int pdf_save(struct pdf_doc *pdf, const char *filename)
+{
+    FILE *fp;
+    int e;
+
+    if (filename == NULL)
+        fp = stdout;
+    else if ((fp = fopen(filename, "wb")) == NULL)
+        return pdf_set_err(pdf, -errno, "Unable to open '%s': %s", filename,
+                           strerror(errno));
+
+    e = pdf_save_file(pdf, fp);
+
+    if (fp != stdout)
+        if (fclose(fp) != 0 && e >= 0)
+            return pdf_set_err(pdf, -errno, "Unable to close '%s': %s",
+                               filename, strerror(errno));
+
+    return e;
+}
+
+/**
+ * Incremental updates
+ * An existing file is extended by reading just enough of it to find the
+ * page tree, then adding the new objects, a replacement page tree node and
+ * a new xref section after the existing bytes, which are left untouched.
+ */
+
+#define XREF_UNSET 0xff
+
+/* What we know of the existing file, see pdf_save_append */
+struct pdf_reader {
+    FILE *fp;
+    int64_t len;             /* File length in bytes */
+    struct xref_entry *xref; /* Newest entry per object, XREF_UNSET if none */
+    int size;                /* Number of entries in xref */
+    int64_t startxref;       /* Offset of the newest xref section */
+    int root;                /* Catalog object number */
+    int info;                /* Info dictionary object number, or 0 */
+    char id[72];             /* First /ID string in hex, or empty */
+    bool xref_stream;        /* Newest section is a cross-reference stream */
+};
+
+static const char *find_bytes(const char *data, size_t len, const char *token)
+{
+    size_t token_len = strlen(token);
+
+    for (const char *end = data + len; (size_t)(end - data) >= token_len;
+         data++) {
+        data = (const char *)memchr(data, token[0], end - data);
+        if (!data || (size_t)(end - data) < token_len)
+            return NULL;
+        if (memcmp(data, token, token_len) == 0)
+            return data;
+    }
+    return NULL;
+}
+
+/**
+ * Find a key such as "/Size" in a dictionary, returning the position just
+ * after it
+ */
+static const char *dict_find(const char *data, size_t len, const char *key)
+{
+    const char *end = data + len;
+    size_t key_len = strlen(key);
+
+    for (const char *pos = data;
+         (pos = find_bytes(pos, end - pos, key)) != NULL; pos += key_len)
+        if (pos + key_len == end || !isalnum((unsigned char)pos[key_len]))
+            return pos + key_len;
+    return NULL;
+}
+
+static const char *skip_space(const char *pos, const char *end)
+{
+    while (pos < end && isspace((unsigned char)*pos))
+        pos++;
+    return pos;
+}
+
+/**
+ * Parse a non-negative integer, moving pos along past it
+ */
+static int parse_int(const char **pos, const char *end, int64_t *val)
+{
+    const char *p = skip_space(*pos, end);
+
+    if (p == end || !isdigit((unsigned char)*p))
+        return -EINVAL;
+    for (*val = 0; p < end && isdigit((unsigned char)*p); p++) {
+        if (*val > (INT64_MAX - 9) / 10)
+            return -EINVAL;
+        *val = *val * 10 + (*p - '0');
+    }
+    *pos = p;
+    return 0;
+}
+
+/**
+ * Parse an indirect reference ("12 0 R"), giving the object number
+ */
+static int parse_ref(const char **pos, const char *end, int *num)
+{
+    int64_t val, gen;
+
+    if (parse_int(pos, end, &val) < 0 || parse_int(pos, end, &gen) < 0)
+        return -EINVAL;
+    *pos = skip_space(*pos, end);
+    if (*pos == end || **pos != 'R' || val > INT_MAX)
+        return -EINVAL;
+    (*pos)++;
+    *num = (int)val;
+    return 0;
+}
+
+/**
+ * Look up an integer valued key, which must be present
+ */
+static int dict_int(const char *data, size_t len, const char *key,
+                    int64_t *val)
+{
+    const char *pos = dict_find(data, len, key);
+
+    if (!pos)
+        return -EINVAL;
+    return parse_int(&pos, data + len, val);
+}
+
+static int inflate_data(struct dstr *out, const void *data, size_t len)
+{
+    z_stream zs;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+        return -ENOMEM;
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)len;
+    do {
+        if (dstr_grow(out, dstr_len(out) + 4096 + 1) < 0) {
+            inflateEnd(&zs);
+            return -ENOMEM;
+        }
+        zs.next_out = (Bytef *)dstr_data(out) + dstr_len(out);
+        zs.avail_out = 4096;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        out->used_len += 4096 - zs.avail_out;
+        dstr_data(out)[out->used_len] = '\0';
+    } while (ret == Z_OK);
+    inflateEnd(&zs);
+
+    return ret == Z_STREAM_END ? 0 : -EINVAL;
+}
+
+/**
+ * Read up to len bytes from offset, stopping short at the end of the file
+ */
+static int reader_read(struct pdf_reader *rd, int64_t offset, size_t len,
+                       struct dstr *out)
+{
+    dstr_reset(out);
+    if (offset < 0 || offset > rd->len)
+        return -EINVAL;
+    if ((int64_t)len > rd->len - offset)
+        len = (size_t)(rd->len - offset);
+    if (dstr_ensure(out, len + 1) < 0)
+        return -ENOMEM;
+    if (fseeko(rd->fp, offset, SEEK_SET) != 0 ||
+        fread(dstr_data(out), 1, len, rd->fp) != len)
+        return -EIO;
+    out->used_len = len;
+    dstr_data(out)[len] = '\0';
+    return 0;
+}
+
+/**
+ * Read from offset until token turns up, giving the token's position
+ * within out
+ */
+static ssize_t reader_read_until(struct pdf_reader *rd, int64_t offset,
+                                 const char *token, struct dstr *out)
+{
+    for (size_t len = 4096;; len *= 2) {
+        const char *found;
+        int ret = reader_read(rd, offset, len, out);
+
+        if (ret < 0)
+            return ret;
+        found = find_bytes(dstr_data(out), dstr_len(out), token);
+        if (found)
+            return found - dstr_data(out);
+        if (dstr_len(out) < len)
+            return -EINVAL;
+    }
+}
+
+/**
+ * Read a stream object at offset, giving its dictionary (NUL terminated,
+ * in dict) and its decompressed data
+ */
+static int reader_read_stream(struct pdf_reader *rd, int64_t offset,
+                              struct dstr *dict, struct dstr *data)
+{
+    ssize_t dict_len = reader_read_until(rd, offset, "stream", dict);
+    const char *start;
+    int64_t length;
+    struct dstr raw = INIT_DSTR;
+    int ret;
+
+    if (dict_len < 0)
+        return (int)dict_len;
+    start = dstr_data(dict) + dict_len + strlen("stream");
+    if (*start == '\r')
+        start++;
+    if (*start == '\n')
+        start++;
+    offset += start - dstr_data(dict);
+    dict->used_len = dict_len;
+    dstr_data(dict)[dict_len] = '\0';
+
+    if (dict_int(dstr_data(dict), dict_len, "/Length", &length) < 0)
+        return -EINVAL;
+    /* pdfgen only ever writes compressed object & xref streams */
+    if (!dict_find(dstr_data(dict), dict_len, "/FlateDecode"))
+        return -ENOTSUP;
+    if (length > rd->len - offset)
+        return -EINVAL;
+    ret = reader_read(rd, offset, (size_t)length, &raw);
+    if (ret >= 0) {
+        dstr_reset(data);
+        ret = inflate_data(data, dstr_data(&raw), dstr_len(&raw));
+    }
+    dstr_free(&raw);
+    return ret;
+}
+
+static int reader_grow(struct pdf_reader *rd, int64_t size)
+{
+    struct xref_entry *xref;
+
+    if (size <= rd->size)
+        return 0;
+    if (size > INT_MAX / (int)sizeof(*xref))
+        return -EINVAL;
+    xref = (struct xref_entry *)realloc(rd->xref, size * sizeof(*xref));
+    if (!xref)
+        return -ENOMEM;
+    for (int i = rd->size; i < size; i++)
+        xref[i].type = XREF_UNSET;
+    rd->xref = xref;
+    rd->size = (int)size;
+    return 0;
+}
+
+/* Record an entry, unless a newer section has already supplied one */
+static void reader_set(struct pdf_reader *rd, int64_t num,
+                       struct xref_entry entry)
+{
+    if (num >= 0 && num < rd->size && rd->xref[num].type == XREF_UNSET)
+        rd->xref[num] = entry;
+}
+
+/**
+ * Pick up the trailer entries we need, from the newest section that has
+ * them, and return the /Prev offset or -1
+ */
+static int reader_trailer(struct pdf_reader *rd, const char *dict, size_t len,
+                          int64_t *prev)
+{
+    const char *end = dict + len, *pos;
+    int64_t size;
+
+    if (dict_int(dict, len, "/Size", &size) < 0)
+        return -EINVAL;
+    if (reader_grow(rd, size) < 0)
+        return -ENOMEM;
+    if (!rd->root && (pos = dict_find(dict, len, "/Root")) != NULL) {
+        if (parse_ref(&pos, end, &rd->root) < 0)
+            return -EINVAL;
+        if ((pos = dict_find(dict, len, "/Info")) != NULL &&
+            parse_ref(&pos, end, &rd->info) < 0)
+            return -EINVAL;
+        if ((pos = dict_find(dict, len, "/ID")) != NULL) {
+            size_t n = 0;
+
+            pos = skip_space(pos, end);
+            if (pos < end && *pos == '[')
+                pos = skip_space(pos + 1, end);
+            if (pos < end && *pos == '<')
+                for (pos++; pos < end && isxdigit((unsigned char)*pos) &&
+                            n < sizeof(rd->id) - 1;
+                     pos++)
+                    rd->id[n++] = *pos;
+            rd->id[n] = '\0';
+        }
     }
+    if (dict_int(dict, len, "/Prev", prev) < 0)
+        *prev = -1;
+    return 0;
+}
 
-    case OBJ_font:
-        fprintf(fp,
-                "<<\r\n"
-                "  /Type /Font\r\n"
-                "  /Subtype /Type1\r\n"
-                "  /BaseFont /%s\r\n"
-                "  /Encoding /WinAnsiEncoding\r\n"
-                ">>\r\n",
-                object->font.name);
-        break;
+/**
+ * Load one classic xref table & its trailer
+ */
+static int reader_xref_table(struct pdf_reader *rd, int64_t offset,
+                             struct dstr *buf, int64_t *prev)
+{
+    ssize_t trailer_pos = reader_read_until(rd, offset, "startxref", buf);
+    const char *pos, *end, *trailer;
+    int ret;
 
-    case OBJ_pages: {
-        int npages = 0;
+    if (trailer_pos < 0)
+        return (int)trailer_pos;
+    trailer = find_bytes(dstr_data(buf), trailer_pos, "trailer");
+    if (!trailer)
+        return -EINVAL;
+    end = dstr_data(buf) + trailer_pos;
+    ret = reader_trailer(rd, trailer, end - trailer, prev);
+    if (ret < 0)
+        return ret;
 
-        fprintf(fp, "<<\r\n"
-                    "  /Type /Pages\r\n"
-                    "  /Kids [ ");
-        for (struct pdf_object *page = pdf_find_first_object(pdf, OBJ_page);
-             page; page = page->next) {
-            npages++;
-            fprintf(fp, "%d 0 R ", page->index);
+    /* Subsections of "first count", each followed by its entries */
+    pos = dstr_data(buf) + strlen("xref");
+    end = trailer;
+    while (skip_space(pos, end) < end) {
+        int64_t first, count;
+
+        if (parse_int(&pos, end, &first) < 0 ||
+            parse_int(&pos, end, &count) < 0)
+            return -EINVAL;
+        for (int64_t i = 0; i < count; i++) {
+            int64_t field2, gen;
+
+            if (parse_int(&pos, end, &field2) < 0 ||
+                parse_int(&pos, end, &gen) < 0)
+                return -EINVAL;
+            pos = skip_space(pos, end);
+            if (pos == end || (*pos != 'n' && *pos != 'f'))
+                return -EINVAL;
+            reader_set(rd, first + i,
+                       (struct xref_entry){*pos == 'n' ? 1 : 0, field2,
+                                           (uint16_t)gen});
+            pos++;
         }
-        fprintf(fp, "]\r\n");
-        fprintf(fp, "  /Count %d\r\n", npages);
-        fprintf(fp, ">>\r\n");
-        break;
     }
+    return 0;
+}
 
-    case OBJ_catalog: {
-        struct pdf_object *outline = pdf_find_first_object(pdf, OBJ_outline);
-        struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
+/**
+ * Load one cross-reference stream, which doubles as the trailer
+ */
+static int reader_xref_stream(struct pdf_reader *rd, int64_t offset,
+                              struct dstr *buf, int64_t *prev)
+{
+    struct dstr data = INIT_DSTR;
+    const uint8_t zero[25] = {0}; /* The row above the first */
+    const char *dict, *pos, *end;
+    int64_t w[3], index[2], predictor = 0, columns, size;
+    size_t row_len, nrows, row = 0;
+    bool more = true;
+    int ret;
 
-        fprintf(fp, "<<\r\n"
-                    "  /Type /Catalog\r\n");
-        if (outline)
-            fprintf(fp,
-                    "  /Outlines %d 0 R\r\n"
-                    "  /PageMode /UseOutlines\r\n",
-                    outline->index);
-        fprintf(fp,
-                "  /Pages %d 0 R\r\n"
-                ">>\r\n",
-                pages->index);
-        break;
+    ret = reader_read_stream(rd, offset, buf, &data);
+    if (ret < 0)
+        goto out;
+    dict = dstr_data(buf);
+    end = dict + dstr_len(buf);
+    ret = reader_trailer(rd, dict, end - dict, prev);
+    if (ret < 0)
+        goto out;
+    dict_int(dict, end - dict, "/Size", &size);
+
+    ret = -EINVAL;
+    if ((pos = dict_find(dict, end - dict, "/W")) == NULL)
+        goto out;
+    pos = skip_space(pos, end);
+    if (pos == end || *pos++ != '[')
+        goto out;
+    for (int i = 0; i < 3; i++)
+        if (parse_int(&pos, end, &w[i]) < 0 || w[i] > 8)
+            goto out;
+    row_len = (size_t)(w[0] + w[1] + w[2]);
+    if (dict_int(dict, end - dict, "/Predictor", &predictor) >= 0 &&
+        predictor >= 10) {
+        if (dict_int(dict, end - dict, "/Columns", &columns) < 0 ||
+            columns != (int64_t)row_len)
+            goto out;
+        row_len++;
+    }
+    if (row_len == 0 || dstr_len(&data) % row_len != 0)
+        goto out;
+    nrows = dstr_len(&data) / row_len;
+
+    /* /Index pairs of "first count", defaulting to the whole table */
+    pos = dict_find(dict, end - dict, "/Index");
+    if (pos) {
+        pos = skip_space(pos, end);
+        if (pos == end || *pos++ != '[')
+            goto out;
+    }
+    while (more) {
+        if (!pos) {
+            index[0] = 0;
+            index[1] = size;
+            more = false;
+        } else {
+            pos = skip_space(pos, end);
+            if (pos < end && *pos == ']')
+                break;
+            if (parse_int(&pos, end, &index[0]) < 0 ||
+                parse_int(&pos, end, &index[1]) < 0)
+                goto out;
+        }
+        for (int64_t i = 0; i < index[1]; i++, row++) {
+            uint8_t *r = (uint8_t *)dstr_data(&data) + row * row_len;
+            int64_t field[3] = {1, 0, 0};
+
+            if (row >= nrows)
+                goto out;
+            if (predictor >= 10) {
+                if (png_unfilter_row(r[0], r + 1,
+                                     row ? r + 1 - row_len : zero,
+                                     row_len - 1, 1) < 0)
+                    goto out;
+                r++;
+            }
+            for (int f = 0; f < 3; f++) {
+                if (w[f])
+                    field[f] = 0;
+                for (int b = 0; b < w[f]; b++)
+                    field[f] = (field[f] << 8) | *r++;
+            }
+            reader_set(rd, index[0] + i,
+                       (struct xref_entry){(uint8_t)field[0], field[1],
+                                           (uint16_t)field[2]});
+        }
     }
+    ret = 0;
 
-    case OBJ_link: {
-        fprintf(fp,
-                "<<\r\n"
-                "  /Type /Annot\r\n"
-                "  /Subtype /Link\r\n"
-                "  /Rect [%f %f %f %f]\r\n"
-                "  /Dest [%u 0 R /XYZ %f %f null]\r\n"
-                "  /Border [0 0 0]\r\n"
-                ">>\r\n",
-                object->link.llx, object->link.lly, object->link.urx,
-                object->link.ury, object->link.target_page->index,
-                object->link.target_x, object->link.target_y);
-        break;
-    }
+out:
+    dstr_free(&data);
+    return ret;
+}
 
-    default:
-        return pdf_set_err(pdf, -EINVAL, "Invalid PDF object type %d",
-                           object->type);
-    }
+/**
+ * Find the newest xref section, then follow the /Prev chain back through
+ * the older ones
+ */
+static int reader_open(struct pdf_reader *rd, FILE *fp, struct dstr *buf)
+{
+    const char *data, *last = NULL, *pos;
+    int64_t offset, tail, prev;
+    size_t len;
+    int ret;
 
-    fprintf(fp, "endobj\r\n");
+    rd->fp = fp;
+    if (fseeko(fp, 0, SEEK_END) != 0 || (rd->len = ftello(fp)) < 0)
+        return -EIO;
+    tail = rd->len > 1024 ? rd->len - 1024 : 0;
+    ret = reader_read(rd, tail, (size_t)(rd->len - tail), buf);
+    if (ret < 0)
+        return ret;
+    data = dstr_data(buf);
+    len = dstr_len(buf);
+    for (pos = data; (pos = find_bytes(pos, data + len - pos, "startxref"));
+         pos++)
+        last = pos;
+    if (!last)
+        return -EINVAL;
+    pos = last + strlen("startxref");
+    if (parse_int(&pos, data + len, &rd->startxref) < 0)
+        return -EINVAL;
 
+    offset = rd->startxref;
+    for (int sections = 0; offset >= 0; sections++) {
+        /* Each section takes at least a few dozen bytes, so more than
+         * that would fit means a /Prev loop */
+        if (sections > rd->len / 32)
+            return -EINVAL;
+        ret = reader_read(rd, offset, 4, buf);
+        if (ret < 0)
+            return ret;
+        if (dstr_len(buf) == 4 && memcmp(dstr_data(buf), "xref", 4) == 0) {
+            ret = reader_xref_table(rd, offset, buf, &prev);
+        } else {
+            if (sections == 0)
+                rd->xref_stream = true;
+            ret = reader_xref_stream(rd, offset, buf, &prev);
+        }
+        if (ret < 0)
+            return ret;
+        offset = prev;
+    }
+    if (rd->root <= 0 || rd->root >= rd->size)
+        return -EINVAL;
     return 0;
 }
 
-// Slightly modified djb2 hash algorithm to get pseudo-random ID
-static uint64_t hash(uint64_t hash, const void *data, size_t len)
+/**
+ * Fetch the text of object num, between "obj" & "endobj"
+ */
+static int reader_load_object(struct pdf_reader *rd, int num,
+                              struct dstr *out)
 {
-    const uint8_t *d8 = (const uint8_t *)data;
-    for (; len; len--) {
-        hash = (((hash & 0x03ffffffffffffff) << 5) +
-                (hash & 0x7fffffffffffffff)) +
-               *d8++;
-    }
-    return hash;
+    struct dstr buf = INIT_DSTR, dict = INIT_DSTR;
+    struct xref_entry entry;
+    const char *pos, *end;
+    int64_t first, count, start = -1, stop = -1;
+    ssize_t len;
+    int ret = -EINVAL;
+
+    if (num <= 0 || num >= rd->size)
+        return -EINVAL;
+    entry = rd->xref[num];
+    dstr_reset(out);
+
+    if (entry.type == 1) {
+        len = reader_read_until(rd, entry.field2, "endobj", &buf);
+        if (len < 0) {
+            ret = (int)len;
+            goto out;
+        }
+        pos = find_bytes(dstr_data(&buf), len, "obj");
+        if (pos) {
+            pos += strlen("obj");
+            ret = dstr_append_data(out, pos, dstr_data(&buf) + len - pos) < 0
+                      ? -ENOMEM
+                      : 0;
+        }
+    } else if (entry.type == 2 && entry.field2 > 0 &&
+               entry.field2 < rd->size && rd->xref[entry.field2].type == 1) {
+        /* Packed in an object stream: "num offset" pairs, then objects */
+        ret = reader_read_stream(rd, rd->xref[entry.field2].field2, &dict,
+                                 &buf);
+        if (ret < 0)
+            goto out;
+        ret = -EINVAL;
+        if (dict_int(dstr_data(&dict), dstr_len(&dict), "/N", &count) < 0 ||
+            dict_int(dstr_data(&dict), dstr_len(&dict), "/First", &first) <
+                0 ||
+            entry.field3 >= count)
+            goto out;
+        pos = dstr_data(&buf);
+        end = pos + dstr_len(&buf);
+        for (int64_t i = 0; i < count && i <= entry.field3 + 1; i++) {
+            int64_t n, offset;
+
+            if (parse_int(&pos, end, &n) < 0 ||
+                parse_int(&pos, end, &offset) < 0)
+                goto out;
+            if (i == entry.field3) {
+                if (n != num)
+                    goto out;
+                start = first + offset;
+            } else if (i == entry.field3 + 1) {
+                stop = first + offset;
+            }
+        }
+        if (stop < 0)
+            stop = (int64_t)dstr_len(&buf);
+        if (start < 0 || start > stop || stop > (int64_t)dstr_len(&buf))
+            goto out;
+        ret = dstr_append_data(out, dstr_data(&buf) + start, stop - start) < 0
+                  ? -ENOMEM
+                  : 0;
+    }
+
+out:
+    dstr_free(&buf);
+    dstr_free(&dict);
+    return ret;
 }
 
-int pdf_save_file(struct pdf_doc *pdf, FILE *fp)
+/**
+ * Locate the page tree through the catalog. Only a single level tree,
+ * as pdfgen writes, is understood. Its /Kids are passed back verbatim.
+ */
+static int reader_pages(struct pdf_reader *rd, int *pages_no,
+                        struct dstr *kids, int *count)
 {
-    struct pdf_object *obj;
-    int xref_offset;
-    int xref_count = 0;
-    uint64_t id1, id2;
+    struct dstr obj = INIT_DSTR;
+    const char *pos, *end, *open;
+    int64_t npages;
+    int ret;
+
+    ret = reader_load_object(rd, rd->root, &obj);
+    if (ret < 0)
+        goto out;
+    ret = -EINVAL;
+    pos = dict_find(dstr_data(&obj), dstr_len(&obj), "/Pages");
+    if (!pos ||
+        parse_ref(&pos, dstr_data(&obj) + dstr_len(&obj), pages_no) < 0)
+        goto out;
+
+    ret = reader_load_object(rd, *pages_no, &obj);
+    if (ret < 0)
+        goto out;
+    ret = -EINVAL;
+    end = dstr_data(&obj) + dstr_len(&obj);
+    if (dict_int(dstr_data(&obj), dstr_len(&obj), "/Count", &npages) < 0)
+        goto out;
+    pos = dict_find(dstr_data(&obj), dstr_len(&obj), "/Kids");
+    if (!pos)
+        goto out;
+    pos = skip_space(pos, end);
+    if (pos == end || *pos++ != '[')
+        goto out;
+    open = pos;
+    for (*count = 0; skip_space(pos, end) < end && *skip_space(pos, end) != ']';
+         (*count)++) {
+        int kid;
+
+        if (parse_ref(&pos, end, &kid) < 0 || kid <= 0)
+            goto out;
+    }
+    if (skip_space(pos, end) == end)
+        goto out;
+    /* Kids that are themselves page tree nodes throw the count out */
+    if (npages != *count) {
+        ret = -ENOTSUP;
+        goto out;
+    }
+    ret = dstr_append_data(kids, open, pos - open) < 0 ? -ENOMEM : 0;
+
+out:
+    dstr_free(&obj);
+    return ret;
+}
+
+/*
+ * Write the new objects, the replacement page tree node & the xref
+ * section, in the same style (table or stream) as the existing newest one
+ */
+static int pdf_write_update(struct pdf_doc *pdf, FILE *fp,
+                            struct pdf_reader *rd, int pages_no,
+                            struct dstr *kids, int nkids)
+{
+    struct object_layout layout = {.head = INIT_DSTR};
+    struct pdf_object *pages = pdf_find_first_object(pdf, OBJ_pages);
+    struct dstr trailer = INIT_DSTR, index = INIT_DSTR;
+    struct xref_entry *xref = NULL;
+    const int nobjs = flexarray_size(&pdf->objects);
+    int next = rd->size, nentries = 0, npages = nkids;
     time_t now = time(NULL);
-    char saved_locale[32];
+    int64_t xref_offset;
+    int ret = 0;
 
-    force_locale(saved_locale, sizeof(saved_locale));
+    /* Everything new is numbered after the existing objects; the page
+     * tree node replaces the old one, and the rest is already there */
+    for (int i = 0; i < nobjs; i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
 
-    fprintf(fp, "%%PDF-1.3\r\n");
-    /* Hibit bytes */
-    fprintf(fp, "%c%c%c%c%c\r\n", 0x25, 0xc7, 0xec, 0x8f, 0xa2);
+        if (!obj)
+            continue;
+        switch (obj->type) {
+        case OBJ_none:
+        case OBJ_info:
+        case OBJ_catalog:
+        case OBJ_outline:
+        case OBJ_pages:
+            obj->index = -1;
+            break;
+        default:
+            obj->index = next++;
+            break;
+        }
+    }
+    pages->index = pages_no;
 
-    /* Dump all the objects & get their file offsets */
-    for (int i = 0; i < flexarray_size(&pdf->objects); i++)
-        if (pdf_save_object(pdf, fp, i) >= 0)
-            xref_count++;
+    xref = (struct xref_entry *)calloc(next - rd->size + 2, sizeof(*xref));
+    if (!xref) {
+        ret = pdf_set_err(pdf, -ENOMEM, "Unable to allocate xref");
+        goto out;
+    }
+    for (int i = 0; i < nobjs; i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
 
-    /* xref */
-    xref_offset = ftell(fp);
-    fprintf(fp, "xref\r\n");
-    fprintf(fp, "0 %d\r\n", xref_count + 1);
-    fprintf(fp, "0000000000 65535 f\r\n");
-    for (int i = 0; i < flexarray_size(&pdf->objects); i++) {
-        obj = pdf_get_object(pdf, i);
-        if (obj->type != OBJ_none)
-            fprintf(fp, "%10.10d 00000 n\r\n", obj->offset);
+        if (!obj || obj->index < rd->size)
+            continue;
+        ret = pdf_save_object(pdf, fp, obj, &layout);
+        if (ret < 0)
+            goto out;
+        xref[++nentries] = (struct xref_entry){1, obj->offset, 0};
     }
 
+    xref[0] = (struct xref_entry){1, ftello(fp), 0};
     fprintf(fp,
-            "trailer\r\n"
+            "%d 0 obj\r\n"
             "<<\r\n"
-            "/Size %d\r\n",
-            xref_count + 1);
-    obj = pdf_find_first_object(pdf, OBJ_catalog);
-    fprintf(fp, "/Root %d 0 R\r\n", obj->index);
-    obj = pdf_find_first_object(pdf, OBJ_info);
-    fprintf(fp, "/Info %d 0 R\r\n", obj->index);
-    /* Generate document unique IDs */
-    id1 = hash(5381, obj->info, sizeof(struct pdf_info));
-    id1 = hash(id1, &xref_count, sizeof(xref_count));
-    id2 = hash(5381, &now, sizeof(now));
-    fprintf(fp, "/ID [<%16.16" PRIx64 "> <%16.16" PRIx64 ">]\r\n", id1, id2);
+            "  /Type /Pages\r\n"
+            "  /Kids [",
+            pages_no);
+    fwrite(dstr_data(kids), dstr_len(kids), 1, fp);
+    for (struct pdf_object *page = pdf_find_first_object(pdf, OBJ_page); page;
+         page = page->next, npages++)
+        fprintf(fp, " %d 0 R", page->index);
+    fprintf(fp,
+            "]\r\n"
+            "  /Count %d\r\n"
+            ">>\r\n"
+            "endobj\r\n",
+            npages);
+
+    /* The first /ID string stays, the second marks this revision */
+    if (dstr_printf(&trailer, "/Size %d\r\n/Root %d 0 R\r\n",
+                    next + rd->xref_stream, rd->root) < 0 ||
+        (rd->info && dstr_printf(&trailer, "/Info %d 0 R\r\n", rd->info) < 0) ||
+        (rd->id[0] &&
+         dstr_printf(&trailer, "/ID [<%s> <%16.16" PRIx64 ">]\r\n", rd->id,
+                     hash(5381, &now, sizeof(now))) < 0) ||
+        dstr_printf(&trailer, "/Prev %" PRId64 "\r\n", rd->startxref) < 0) {
+        ret = pdf_set_err(pdf, -ENOMEM, "Unable to allocate trailer");
+        goto out;
+    }
+
+    if (rd->xref_stream) {
+        dstr_printf(&index, "%d 1 %d %d", pages_no, rd->size,
+                    next - rd->size + 1);
+        ret = pdf_write_xref_stream(pdf, fp, next, xref, nentries + 2,
+                                    dstr_data(&index), &trailer);
+        goto out;
+    }
+
+    xref_offset = ftello(fp);
+    if (xref_offset > INT64_C(9999999999)) {
+        ret = pdf_set_err(pdf, -EFBIG,
+                          "PDF too large for a cross-reference table: %" PRId64
+                          " bytes",
+                          xref_offset);
+        goto out;
+    }
+    /* Restating the head of the free list keeps strict readers happy */
+    fprintf(fp,
+            "xref\r\n"
+            "0 1\r\n"
+            "0000000000 65535 f\r\n"
+            "%d 1\r\n"
+            "%10.10" PRId64 " 00000 n\r\n",
+            pages_no, xref[0].field2);
+    fprintf(fp, "%d %d\r\n", rd->size, nentries);
+    for (int i = 1; i <= nentries; i++)
+        fprintf(fp, "%10.10" PRId64 " 00000 n\r\n", xref[i].field2);
+    fprintf(fp, "trailer\r\n"
+                "<<\r\n");
+    fwrite(dstr_data(&trailer), dstr_len(&trailer), 1, fp);
     fprintf(fp, ">>\r\n"
                 "startxref\r\n");
-    fprintf(fp, "%d\r\n", xref_offset);
+    fprintf(fp, "%" PRId64 "\r\n", xref_offset);
     fprintf(fp, "%%%%EOF\r\n");
 
-    restore_locale(saved_locale);
-
-    return 0;
+out:
+    /* Put the original numbering back */
+    for (int i = 0; i < nobjs; i++) {
+        struct pdf_object *obj = pdf_get_object(pdf, i);
+        if (obj)
+            obj->index = i;
+    }
+    dstr_free(&layout.head);
+    dstr_free(&trailer);
+    dstr_free(&index);
+    free(xref);
+    return ret;
 }
 
-int pdf_save(struct pdf_doc *pdf, const char *filename)
+int pdf_save_append(struct pdf_doc *pdf, const char *filename)
 {
+    struct pdf_reader rd = {0};
+    struct dstr buf = INIT_DSTR, kids = INIT_DSTR;
+    int pages_no, nkids, ret;
     FILE *fp;
-    int e;
 
-    if (filename == NULL)
-        fp = stdout;
-    else if ((fp = fopen(filename, "wb")) == NULL)
+    if (!pdf_find_first_object(pdf, OBJ_page))
+        return pdf_set_err(pdf, -EINVAL, "No pages to append");
+    if (pdf_find_first_object(pdf, OBJ_bookmark))
+        return pdf_set_err(pdf, -ENOTSUP,
+                           "Bookmarks can't be added to an existing PDF");
+
+    fp = fopen(filename, "r+b");
+    if (!fp)
         return pdf_set_err(pdf, -errno, "Unable to open '%s': %s", filename,
                            strerror(errno));
 
-    e = pdf_save_file(pdf, fp);
-
-    if (fp != stdout)
-        if (fclose(fp) != 0 && e >= 0)
-            return pdf_set_err(pdf, -errno, "Unable to close '%s': %s",
-                               filename, strerror(errno));
-
-    return e;
+    ret = reader_open(&rd, fp, &buf);
+    if (ret >= 0)
+        ret = reader_pages(&rd, &pages_no, &kids, &nkids);
+    if (ret < 0) {
+        pdf_set_err(pdf, ret, "Unable to find the page tree of '%s'",
+                    filename);
+        goto out;
+    }
+
+    if (fseeko(fp, 0, SEEK_END) != 0) {
+        ret = pdf_set_err(pdf, -errno, "Unable to seek '%s': %s", filename,
+                          strerror(errno));
+        goto out;
+    }
+    ret = pdf_write_update(pdf, fp, &rd, pages_no, &kids, nkids);
+    if (ret >= 0 && (fflush(fp) != 0 || ferror(fp)))
+        ret = pdf_set_err(pdf, -EIO, "Unable to write PDF: %s",
+                          strerror(errno));
+    /* Leave the original intact if the update didn't make it out */
+    if (ret < 0) {
+        fflush(fp);
+        if (ftruncate(fileno(fp), rd.len) != 0)
+            ret = pdf_set_err(pdf, ret, "Unable to restore '%s' after a "
+                                        "failed update",
+                              filename);
+    }
+
+out:
+    if (fclose(fp) != 0 && ret >= 0)
+        ret = pdf_set_err(pdf, -errno, "Unable to close '%s': %s", filename,
+                          strerror(errno));
+    dstr_free(&buf);
+    dstr_free(&kids);
+    free(rd.xref);
+    return ret;
 }
 
 static int pdf_add_stream(struct pdf_doc *pdf, struct pdf_object *page,
@@ -1268,6 +3966,27 @@ static int pdf_add_stream(struct pdf_doc *pdf, struct pdf_object *page,
     if (!obj)
         return pdf->errval;
 
+    if (pdf->compress_level > 0) {
+        struct dstr compressed = INIT_DSTR;
+
+        /* Tiny streams (a single image placement, say) can come out
+         * larger once the filter is declared, so keep whichever is smaller
+         */
+        if (deflate_data(&compressed, buffer, len, pdf->compress_level) >=
+                0 &&
+            dstr_len(&compressed) + 22 < len) {
+            dstr_printf(&obj->stream.stream,
+                        "<< /Length %zu /Filter /FlateDecode >>stream\r\n",
+                        dstr_len(&compressed));
+            dstr_append_data(&obj->stream.stream, dstr_data(&compressed),
+                             dstr_len(&compressed));
+            dstr_append(&obj->stream.stream, "\r\nendstream\r\n");
+            dstr_free(&compressed);
+            return flexarray_append(&page->page.children, obj);
+        }
+        dstr_free(&compressed);
+    }
+
     dstr_printf(&obj->stream.stream, "<< /Length %zu >>stream\r\n", len);
     dstr_append_data(&obj->stream.stream, buffer, len);
     dstr_append(&obj->stream.stream, "\r\nendstream\r\n");
@@ -3178,98 +5897,119 @@ int pdf_add_barcode(struct pdf_doc *pdf, struct pdf_object *page, int code,
     }
 }
 
-static pdf_object *pdf_add_raw_grayscale8(struct pdf_doc *pdf,
-                                          const uint8_t *data, uint32_t width,
-                                          uint32_t height)
+/**
+ * Create an image XObject from its dictionary entries (bar the type, name
+ * & length, which are added when it is written) & its encoded data.
+ * The new image takes ownership of both.
+ */
+static struct pdf_object *pdf_add_image_xobject(struct pdf_doc *pdf,
+                                                uint32_t width,
+                                                uint32_t height,
+                                                struct dstr *dict,
+                                                struct dstr *data)
 {
-    struct pdf_object *obj;
-    size_t len;
-    const char *endstream = ">\r\nendstream\r\n";
-    struct dstr str = INIT_DSTR;
-    size_t data_len = (size_t)width * (size_t)height;
-
-    dstr_printf(&str,
-                "<<\r\n"
-                "  /Type /XObject\r\n"
-                "  /Name /Image%d\r\n"
-                "  /Subtype /Image\r\n"
-                "  /ColorSpace /DeviceGray\r\n"
-                "  /Height %d\r\n"
-                "  /Width %d\r\n"
-                "  /BitsPerComponent 8\r\n"
-                "  /Length %zu\r\n"
-                ">>stream\r\n",
-                flexarray_size(&pdf->objects), height, width, data_len + 1);
-
-    len = dstr_len(&str) + data_len + strlen(endstream) + 1;
-    if (dstr_ensure(&str, len) < 0) {
-        dstr_free(&str);
-        pdf_set_err(pdf, -ENOMEM,
-                    "Unable to allocate %zu bytes memory for image", len);
-        return NULL;
-    }
-    dstr_append_data(&str, data, data_len);
-    dstr_append(&str, endstream);
-
-    obj = pdf_add_object(pdf, OBJ_image);
+    struct pdf_object *obj = pdf_add_object(pdf, OBJ_image);
     if (!obj) {
-        dstr_free(&str);
+        dstr_free(dict);
+        dstr_free(data);
         return NULL;
     }
-    obj->stream.stream = str;
+
+    obj->image.dict = *dict;
+    *dict = INIT_DSTR;
+    obj->image.data = *data;
+    *data = INIT_DSTR;
+    obj->image.id = obj->index;
+    obj->image.width = width;
+    obj->image.height = height;
 
     return obj;
 }
 
-static struct pdf_object *pdf_add_raw_rgb24(struct pdf_doc *pdf,
-                                            const uint8_t *data,
-                                            uint32_t width, uint32_t height)
+/**
+ * Create an image XObject around already encoded image data. params holds
+ * any format-specific dictionary entries (filter, decode parameters etc...).
+ * The new image takes ownership of data.
+ */
+static struct pdf_object *pdf_add_raw_image(struct pdf_doc *pdf,
+                                            uint32_t width, uint32_t height,
+                                            const char *colour_space,
+                                            int bits_per_component,
+                                            const char *params,
+                                            struct dstr *data)
 {
-    struct pdf_object *obj;
-    size_t len;
-    const char *endstream = ">\r\nendstream\r\n";
-    struct dstr str = INIT_DSTR;
-    size_t data_len = (size_t)width * (size_t)height * 3;
-
-    dstr_printf(&str,
-                "<<\r\n"
-                "  /Type /XObject\r\n"
-                "  /Name /Image%d\r\n"
-                "  /Subtype /Image\r\n"
-                "  /ColorSpace /DeviceRGB\r\n"
-                "  /Height %d\r\n"
-                "  /Width %d\r\n"
-                "  /BitsPerComponent 8\r\n"
-                "  /Length %zu\r\n"
-                ">>stream\r\n",
-                flexarray_size(&pdf->objects), height, width, data_len + 1);
-
-    len = dstr_len(&str) + data_len + strlen(endstream) + 1;
-    if (dstr_ensure(&str, len) < 0) {
-        dstr_free(&str);
-        pdf_set_err(pdf, -ENOMEM,
-                    "Unable to allocate %zu bytes memory for image", len);
+    struct dstr dict = INIT_DSTR;
+
+    if (dstr_printf(&dict,
+                    "  /ColorSpace %s\r\n"
+                    "  /Width %u\r\n"
+                    "  /Height %u\r\n"
+                    "  /BitsPerComponent %d\r\n",
+                    colour_space, width, height, bits_per_component) < 0 ||
+        (params && dstr_append(&dict, params) < 0)) {
+        dstr_free(&dict);
+        dstr_free(data);
+        pdf_set_err(pdf, -ENOMEM, "Unable to allocate image dictionary");
         return NULL;
     }
-    dstr_append_data(&str, data, data_len);
-    dstr_append(&str, endstream);
+    return pdf_add_image_xobject(pdf, width, height, &dict, data);
+}
 
-    obj = pdf_add_object(pdf, OBJ_image);
-    if (!obj) {
-        dstr_free(&str);
-        return NULL;
+/**
+ * Add 8-bit per component greyscale (colours = 1) or RGB (colours = 3)
+ * pixels as an image. When compression is enabled the rows are PNG
+ * filtered & deflated, otherwise they are stored as-is.
+ */
+static struct pdf_object *pdf_add_raw_pixels(struct pdf_doc *pdf,
+                                             const uint8_t *data,
+                                             uint32_t width, uint32_t height,
+                                             int colours)
+{
+    struct dstr str = INIT_DSTR;
+    size_t data_len = (size_t)width * (size_t)height * colours;
+    char params[160] = "";
+
+    if (pdf->compress_level > 0) {
+        if (deflate_pixels(&str, data, width, height, colours,
+                           pdf->compress_level) < 0) {
+            dstr_free(&str);
+            pdf_set_err(pdf, -ENOMEM, "Unable to compress %zu byte image",
+                        data_len);
+            return NULL;
+        }
+        snprintf(params, sizeof(params),
+                 "  /Filter /FlateDecode\r\n"
+                 "  /DecodeParms << /Predictor 15 /Colors %d "
+                 "/BitsPerComponent 8 /Columns %u >>\r\n",
+                 colours, width);
+    } else {
+        if (dstr_ensure(&str, data_len + 1) < 0) {
+            dstr_free(&str);
+            pdf_set_err(pdf, -ENOMEM,
+                        "Unable to allocate %zu bytes memory for image",
+                        data_len);
+            return NULL;
+        }
+        dstr_append_data(&str, data, data_len);
     }
-    obj->stream.stream = str;
 
-    return obj;
+    return pdf_add_raw_image(pdf, width, height,
+                             colours == 1 ? "/DeviceGray" : "/DeviceRGB", 8,
+                             params, &str);
 }
 
+/**
+ * Read the whole of a file into memory. The file is read rather than
+ * mapped: a mapping of a file that is truncated underneath us raises
+ * SIGBUS when touched, where a read just comes up short. The data is
+ * only held while the image is parsed (and, for JPEGs, hashed), and must
+ * be released with free.
+ */
 static uint8_t *get_file(struct pdf_doc *pdf, const char *file_name,
-                         size_t *length)
+                         size_t *length, struct stat *buf)
 {
     FILE *fp;
     uint8_t *file_data;
-    struct stat buf;
     off_t len;
 
     if ((fp = fopen(file_name, "rb")) == NULL) {
@@ -3278,14 +6018,19 @@ static uint8_t *get_file(struct pdf_doc *pdf, const char *file_name,
         return NULL;
     }
 
-    if (fstat(fileno(fp), &buf) < 0) {
+    if (fstat(fileno(fp), buf) < 0) {
         pdf_set_err(pdf, -errno, "Unable to access %s: %s", file_name,
                     strerror(errno));
         fclose(fp);
         return NULL;
     }
 
-    len = buf.st_size;
+    len = buf->st_size;
+    if (len <= 0) {
+        pdf_set_err(pdf, -EINVAL, "Empty image file: %s", file_name);
+        fclose(fp);
+        return NULL;
+    }
 
     file_data = (uint8_t *)malloc(len);
     if (!file_data) {
@@ -3294,8 +6039,14 @@ static uint8_t *get_file(struct pdf_doc *pdf, const char *file_name,
         return NULL;
     }
 
-    if (fread(file_data, len, 1, fp) != 1) {
-        pdf_set_err(pdf, -errno, "Unable to read full data: %s", file_name);
+    // A file that shrank or grew while we read it no longer matches buf
+    if (fread(file_data, len, 1, fp) != 1 || fgetc(fp) != EOF) {
+        if (ferror(fp))
+            pdf_set_err(pdf, -EIO, "Unable to read full data: %s",
+                        file_name);
+        else
+            pdf_set_err(pdf, -ESTALE, "Image %s changed while being read",
+                        file_name);
         free(file_data);
         fclose(fp);
         return NULL;
@@ -3312,29 +6063,51 @@ static struct pdf_object *
 pdf_add_raw_jpeg_data(struct pdf_doc *pdf, const struct pdf_img_info *info,
                       const uint8_t *jpeg_data, size_t len)
 {
-    struct pdf_object *obj = pdf_add_object(pdf, OBJ_image);
-    if (!obj)
+    struct dstr str = INIT_DSTR;
+
+    if (dstr_append_data(&str, jpeg_data, len) < 0) {
+        pdf_set_err(pdf, -ENOMEM, "Unable to allocate %zu bytes for JPEG",
+                    len);
         return NULL;
+    }
 
-    dstr_printf(&obj->stream.stream,
-                "<<\r\n"
-                "  /Type /XObject\r\n"
-                "  /Name /Image%d\r\n"
-                "  /Subtype /Image\r\n"
-                "  /ColorSpace %s\r\n"
-                "  /Width %d\r\n"
-                "  /Height %d\r\n"
-                "  /BitsPerComponent 8\r\n"
-                "  /Filter /DCTDecode\r\n"
-                "  /Length %zu\r\n"
-                ">>stream\r\n",
-                flexarray_size(&pdf->objects),
-                (info->jpeg.ncolours == 1) ? "/DeviceGray" : "/DeviceRGB",
-                info->width, info->height, len);
-    dstr_append_data(&obj->stream.stream, jpeg_data, len);
-
-    dstr_printf(&obj->stream.stream, "\r\nendstream\r\n");
+    return pdf_add_raw_image(
+        pdf, info->width, info->height,
+        (info->jpeg.ncolours == 1) ? "/DeviceGray" : "/DeviceRGB", 8,
+        "  /Filter /DCTDecode\r\n", &str);
+}
+
+/**
+ * JPEG data goes into the PDF untouched, so rather than holding a copy,
+ * just note where it lives and copy it across when the document is saved
+ */
+static struct pdf_object *pdf_add_jpeg_file(struct pdf_doc *pdf,
+                                            const struct pdf_img_info *info,
+                                            const char *file_name,
+                                            const struct stat *buf)
+{
+    struct dstr empty = INIT_DSTR;
+    struct pdf_object *obj;
+    char *source = strdup(file_name);
 
+    if (!source) {
+        pdf_set_err(pdf, -ENOMEM, "Unable to allocate image source");
+        return NULL;
+    }
+    obj = pdf_add_raw_image(
+        pdf, info->width, info->height,
+        (info->jpeg.ncolours == 1) ? "/DeviceGray" : "/DeviceRGB", 8,
+        "  /Filter /DCTDecode\r\n", &empty);
+    if (!obj) {
+        free(source);
+        return NULL;
+    }
+    obj->image.source = source;
+    obj->image.source_offset = 0;
+    obj->image.source_len = (size_t)buf->st_size;
+    obj->image.source_ino = (uint64_t)buf->st_ino;
+    obj->image.source_size = buf->st_size;
+    obj->image.source_mtime_ns = file_mtime_ns(buf);
     return obj;
 }
 
@@ -3378,9 +6151,13 @@ static int get_img_display_dimensions(struct pdf_doc *pdf, uint32_t img_width,
     return 0;
 }
 
-static int pdf_add_image(struct pdf_doc *pdf, struct pdf_object *page,
-                         struct pdf_object *image, float x, float y,
-                         float width, float height)
+/**
+ * Draw an image through the given transform, optionally clipped to a
+ * rectangle (clip == NULL => not clipped)
+ */
+static int pdf_draw_image(struct pdf_doc *pdf, struct pdf_object *page,
+                          struct pdf_object *image, const float matrix[6],
+                          const float clip[4])
 {
     int ret;
     struct dstr str = INIT_DSTR;
@@ -3396,14 +6173,25 @@ static int pdf_add_image(struct pdf_doc *pdf, struct pdf_object *page,
                            "adding an image, but wrong object type %d",
                            image->type);
 
-    if (image->stream.page != NULL)
-        return pdf_set_err(pdf, -EEXIST, "image already on a page");
-
-    image->stream.page = page;
+    /* The same XObject may be drawn several times, on any number of pages,
+     * but only needs listing once in each page's resources */
+    int i;
+    for (i = 0; i < flexarray_size(&page->page.images); i++)
+        if (flexarray_get(&page->page.images, i) == image)
+            break;
+    if (i == flexarray_size(&page->page.images)) {
+        ret = flexarray_append(&page->page.images, image);
+        if (ret < 0)
+            return pdf_set_err(pdf, ret, "Unable to add image to page");
+    }
 
     dstr_append(&str, "q ");
-    dstr_printf(&str, "%f 0 0 %f %f %f cm ", width, height, x, y);
-    dstr_printf(&str, "/Image%d Do ", image->index);
+    if (clip)
+        dstr_printf(&str, "%f %f %f %f re W n ", clip[0], clip[1], clip[2],
+                    clip[3]);
+    dstr_printf(&str, "%f %f %f %f %f %f cm ", matrix[0], matrix[1],
+                matrix[2], matrix[3], matrix[4], matrix[5]);
+    dstr_printf(&str, "/Image%d Do ", image->image.id);
     dstr_append(&str, "Q");
 
     ret = pdf_add_stream(pdf, page, dstr_data(&str));
@@ -3411,6 +6199,105 @@ static int pdf_add_image(struct pdf_doc *pdf, struct pdf_object *page,
     return ret;
 }
 
+static int pdf_add_image(struct pdf_doc *pdf, struct pdf_object *page,
+                         struct pdf_object *image, float x, float y,
+                         float width, float height)
+{
+    const float matrix[6] = {width, 0, 0, height, x, y};
+    return pdf_draw_image(pdf, page, image, matrix, NULL);
+}
+
+/**
+ * Draw an existing image object on a page, working out any display
+ * dimensions left for us to determine from the image aspect ratio
+ */
+static int pdf_place_image(struct pdf_doc *pdf, struct pdf_object *page,
+                           struct pdf_object *image, float x, float y,
+                           float display_width, float display_height)
+{
+    if (get_img_display_dimensions(pdf, image->image.width,
+                                   image->image.height, &display_width,
+                                   &display_height)) {
+        return pdf->errval;
+    }
+    return pdf_add_image(pdf, page, image, x, y, display_width,
+                         display_height);
+}
+
+/**
+ * Look for an image that has already been embedded from identical source
+ * data, so repeated assets are only stored once in the document.
+ * Where the earlier image still holds its source bytes as-is (raw JPEG
+ * data, uncompressed pixels) a digest hit is confirmed against data. The
+ * rest were encoded, left in a file or read from a cache record, so only
+ * the digest remains and a hit relies on it, the length and the size all
+ * agreeing. For n distinct images the odds of that are about n^2 / 2^65,
+ * which is accepted since they're the user's own files, not input chosen
+ * to collide. data may be NULL when it isn't to hand.
+ */
+static struct pdf_object *pdf_find_image(const struct pdf_doc *pdf,
+                                         uint64_t digest, size_t len,
+                                         uint32_t width, uint32_t height,
+                                         const uint8_t *data)
+{
+    size_t mask = pdf->image_table_size - 1;
+
+    if (!pdf->image_table_size)
+        return NULL;
+    for (size_t i = (size_t)digest & mask; pdf->image_table[i];
+         i = (i + 1) & mask) {
+        struct pdf_object *obj = pdf->image_table[i];
+        if (obj->image.digest_len != len || obj->image.digest != digest ||
+            obj->image.width != width || obj->image.height != height)
+            continue;
+        if (data && obj->image.data_is_source &&
+            memcmp(dstr_data(&obj->image.data), data, len) != 0)
+            continue;
+        return obj;
+    }
+    return NULL;
+}
+
+static void image_table_put(struct pdf_object **table, size_t size,
+                            struct pdf_object *obj)
+{
+    size_t i = (size_t)obj->image.digest & (size - 1);
+
+    while (table[i])
+        i = (i + 1) & (size - 1);
+    table[i] = obj;
+}
+
+/**
+ * Record the digest of the source data an image was made from, so that
+ * pdf_find_image can offer it for re-use. Failing to grow the table only
+ * costs later copies of the image being embedded again.
+ */
+static void pdf_note_image(struct pdf_doc *pdf, struct pdf_object *obj,
+                           uint64_t digest, size_t len, bool data_is_source)
+{
+    obj->image.digest = digest;
+    obj->image.digest_len = len;
+    obj->image.data_is_source = data_is_source;
+
+    /* Kept at most half full, so probe runs stay short */
+    if ((pdf->image_table_used + 1) * 2 > pdf->image_table_size) {
+        size_t size = pdf->image_table_size ? pdf->image_table_size * 2 : 64;
+        struct pdf_object **table =
+            (struct pdf_object **)calloc(size, sizeof(*table));
+        if (!table)
+            return;
+        for (size_t i = 0; i < pdf->image_table_size; i++)
+            if (pdf->image_table[i])
+                image_table_put(table, size, pdf->image_table[i]);
+        free(pdf->image_table);
+        pdf->image_table = table;
+        pdf->image_table_size = size;
+    }
+    image_table_put(pdf->image_table, pdf->image_table_size, obj);
+    pdf->image_table_used++;
+}
+
 // Works like fgets, except it's for a fixed in-memory buffer of data
 static size_t dgets(const uint8_t *data, size_t *pos, size_t len, char *line,
                     size_t line_len)
@@ -3484,7 +6371,8 @@ static int parse_ppm_header(struct pdf_img_info *info, const uint8_t *data,
         snprintf(err_msg, err_msg_length, "Unable to find PPM size");
         return -EINVAL;
     }
-    if (info->width > MAX_IMAGE_WIDTH || info->height > MAX_IMAGE_HEIGHT) {
+    if (info->width == 0 || info->height == 0 ||
+        info->width > MAX_IMAGE_WIDTH || info->height > MAX_IMAGE_HEIGHT) {
         snprintf(err_msg, err_msg_length, "Invalid width/height: %ux%u",
                  info->width, info->height);
         return -EINVAL;
@@ -3495,11 +6383,10 @@ static int parse_ppm_header(struct pdf_img_info *info, const uint8_t *data,
     return 0;
 }
 
-static int pdf_add_ppm_data(struct pdf_doc *pdf, struct pdf_object *page,
-                            float x, float y, float display_width,
-                            float display_height,
-                            const struct pdf_img_info *info,
-                            const uint8_t *ppm_data, size_t len)
+static struct pdf_object *pdf_add_ppm_data(struct pdf_doc *pdf,
+                                           const struct pdf_img_info *info,
+                                           const uint8_t *ppm_data,
+                                           size_t len)
 {
     char line[1024];
     // We start reading at the position delivered by parse_ppm_header,
@@ -3507,37 +6394,36 @@ static int pdf_add_ppm_data(struct pdf_doc *pdf, struct pdf_object *page,
     size_t pos = info->ppm.data_begin_pos;
 
     /* Skip over the byte-size line */
-    if (!dgets(ppm_data, &pos, len, line, sizeof(line) - 1))
-        return pdf_set_err(pdf, -EINVAL, "No byte-size line in PPM file");
+    if (!dgets(ppm_data, &pos, len, line, sizeof(line) - 1)) {
+        pdf_set_err(pdf, -EINVAL, "No byte-size line in PPM file");
+        return NULL;
+    }
 
     /* Try and limit the memory usage to sane images */
     if (info->width > MAX_IMAGE_WIDTH || info->height > MAX_IMAGE_HEIGHT) {
-        return pdf_set_err(pdf, -EINVAL,
-                           "Invalid width/height in PPM file: %ux%u",
-                           info->width, info->height);
+        pdf_set_err(pdf, -EINVAL, "Invalid width/height in PPM file: %ux%u",
+                    info->width, info->height);
+        return NULL;
     }
 
     if (info->ppm.size > len - pos) {
-        return pdf_set_err(pdf, -EINVAL, "Insufficient image data available");
+        pdf_set_err(pdf, -EINVAL, "Insufficient image data available");
+        return NULL;
     }
 
     switch (info->ppm.color_space) {
     case PPM_BINARY_COLOR_GRAY:
-        return pdf_add_grayscale8(pdf, page, x, y, display_width,
-                                  display_height, &ppm_data[pos], info->width,
-                                  info->height);
-        break;
+        return pdf_add_raw_pixels(pdf, &ppm_data[pos], info->width,
+                                  info->height, 1);
 
     case PPM_BINARY_COLOR_RGB:
-        return pdf_add_rgb24(pdf, page, x, y, display_width, display_height,
-                             &ppm_data[pos], info->width, info->height);
-        break;
+        return pdf_add_raw_pixels(pdf, &ppm_data[pos], info->width,
+                                  info->height, 3);
 
     default:
-        return pdf_set_err(pdf, -EINVAL,
-                           "Invalid color space in ppm file: %i",
-                           info->ppm.color_space);
-        break;
+        pdf_set_err(pdf, -EINVAL, "Invalid color space in ppm file: %i",
+                    info->ppm.color_space);
+        return NULL;
     }
 }
 
@@ -3557,12 +6443,19 @@ static int parse_jpeg_header(struct pdf_img_info *info, const uint8_t *data,
                 break;
             }
             int len = data[i + 1] * 256 + data[i + 2];
+            // The length includes itself, so anything shorter is corrupt
+            if (len < 2) {
+                break;
+            }
             /* Search for SOFn marker and decode jpeg details */
             if ((data[i] & 0xf4) == 0xc0) {
                 if (len >= 9 && i + len + 1 < length) {
                     info->height = data[i + 4] * 256 + data[i + 5];
                     info->width = data[i + 6] * 256 + data[i + 7];
                     info->jpeg.ncolours = data[i + 8];
+                    if (info->width == 0 || info->height == 0) {
+                        break;
+                    }
                     return 0;
                 }
                 break;
@@ -3574,56 +6467,44 @@ static int parse_jpeg_header(struct pdf_img_info *info, const uint8_t *data,
     return -EINVAL;
 }
 
-static int pdf_add_jpeg_data(struct pdf_doc *pdf, struct pdf_object *page,
-                             float x, float y, float display_width,
-                             float display_height, struct pdf_img_info *info,
-                             const uint8_t *jpeg_data, size_t len)
-{
-    struct pdf_object *obj;
-
-    obj = pdf_add_raw_jpeg_data(pdf, info, jpeg_data, len);
-    if (!obj)
-        return pdf->errval;
-
-    if (get_img_display_dimensions(pdf, info->width, info->height,
-                                   &display_width, &display_height)) {
-        return pdf->errval;
-    }
-    return pdf_add_image(pdf, page, obj, x, y, display_width, display_height);
-}
-
 int pdf_add_rgb24(struct pdf_doc *pdf, struct pdf_object *page, float x,
                   float y, float display_width, float display_height,
                   const uint8_t *data, uint32_t width, uint32_t height)
 {
+    size_t len = (size_t)width * (size_t)height * 3;
+    uint64_t digest = data_digest(data, len);
     struct pdf_object *obj;
 
-    obj = pdf_add_raw_rgb24(pdf, data, width, height);
-    if (!obj)
-        return pdf->errval;
-
-    if (get_img_display_dimensions(pdf, width, height, &display_width,
-                                   &display_height)) {
-        return pdf->errval;
+    obj = pdf_find_image(pdf, digest, len, width, height, data);
+    if (!obj) {
+        obj = pdf_add_raw_pixels(pdf, data, width, height, 3);
+        if (!obj)
+            return pdf->errval;
+        pdf_note_image(pdf, obj, digest, len, pdf->compress_level <= 0);
     }
-    return pdf_add_image(pdf, page, obj, x, y, display_width, display_height);
+
+    return pdf_place_image(pdf, page, obj, x, y, display_width,
+                           display_height);
 }
 
 int pdf_add_grayscale8(struct pdf_doc *pdf, struct pdf_object *page, float x,
                        float y, float display_width, float display_height,
                        const uint8_t *data, uint32_t width, uint32_t height)
 {
+    size_t len = (size_t)width * (size_t)height;
+    uint64_t digest = data_digest(data, len);
     struct pdf_object *obj;
 
-    obj = pdf_add_raw_grayscale8(pdf, data, width, height);
-    if (!obj)
-        return pdf->errval;
-
-    if (get_img_display_dimensions(pdf, width, height, &display_width,
-                                   &display_height)) {
-        return pdf->errval;
+    obj = pdf_find_image(pdf, digest, len, width, height, data);
+    if (!obj) {
+        obj = pdf_add_raw_pixels(pdf, data, width, height, 1);
+        if (!obj)
+            return pdf->errval;
+        pdf_note_image(pdf, obj, digest, len, pdf->compress_level <= 0);
     }
-    return pdf_add_image(pdf, page, obj, x, y, display_width, display_height);
+
+    return pdf_place_image(pdf, page, obj, x, y, display_width,
+                           display_height);
 }
 
 static int parse_png_header(struct pdf_img_info *info, const uint8_t *data,
@@ -3670,6 +6551,10 @@ static int parse_png_header(struct pdf_img_info *info, const uint8_t *data,
         // and copy them into the info struct.
         header->width = ntoh32(header->width);
         header->height = ntoh32(header->height);
+        if (header->width == 0 || header->height == 0) {
+            snprintf(err_msg, err_msg_length, "PNG has zero width/height");
+            return -EINVAL;
+        }
         info->width = header->width;
         info->height = header->height;
         return 0;
@@ -3678,11 +6563,275 @@ static int parse_png_header(struct pdf_img_info *info, const uint8_t *data,
     return -EINVAL;
 }
 
-static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
-                            float x, float y, float display_width,
-                            float display_height,
-                            const struct pdf_img_info *img_info,
-                            const uint8_t *png_data, size_t png_data_length)
+/**
+ * Adam7 interlace passes: x start, y start, x step & y step. A plain,
+ * non-interlaced image is treated as a single pass covering every pixel.
+ */
+static const uint8_t png_adam7[7][4] = {
+    {0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+    {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2},
+};
+static const uint8_t png_no_interlace[1][4] = {{0, 0, 1, 1}};
+
+/**
+ * Expand a row of packed PNG samples to one byte per sample.
+ * 16-bit samples are rounded down to 8 bits, and sub-byte samples are
+ * either scaled up to the full 8-bit range, or left alone when they are
+ * palette indices.
+ */
+static void png_expand_row(uint8_t *out, const uint8_t *in, size_t samples,
+                           uint8_t depth, bool scale)
+{
+    switch (depth) {
+    case 16:
+        for (size_t i = 0; i < samples; i++) {
+            uint32_t v = ((uint32_t)in[i * 2] << 8) | in[i * 2 + 1];
+            out[i] = (uint8_t)((v * 255 + 32895) >> 16);
+        }
+        break;
+    case 8:
+        memcpy(out, in, samples);
+        break;
+    default: {
+        const unsigned per_byte = 8 / depth;
+        const unsigned mask = (1u << depth) - 1;
+        const unsigned mul = scale ? 255 / mask : 1;
+
+        for (size_t i = 0; i < samples; i++) {
+            unsigned shift = 8 - depth * (unsigned)(i % per_byte + 1);
+            out[i] = (uint8_t)(((in[i / per_byte] >> shift) & mask) * mul);
+        }
+        break;
+    }
+    }
+}
+
+/**
+ * PNGs that can't be passed straight through (an alpha channel, 16-bit
+ * samples or Adam7 interlacing) are transcoded a row at a time: the image
+ * data is inflated, each row expanded to 8-bit samples, alpha split off
+ * into its own plane, and the result re-deflated with PNG predictors.
+ *
+ * Interlaced images are read with one decoder per pass. A first sweep
+ * over the data finds where each pass begins, and a copy of the decoder
+ * state is kept there, so the output rows can be assembled in order
+ * while only holding a couple of rows per pass. Memory use depends on
+ * the image width, never on its height.
+ *
+ * PDF keeps transparency in a separate soft mask image, which fully
+ * opaque images don't get at all.
+ */
+static struct pdf_object *pdf_add_png_transcoded(
+    struct pdf_doc *pdf, const struct png_header *header, struct dstr *idat,
+    const char *colour_space, int ncolours)
+{
+    const uint32_t width = header->width;
+    const bool has_alpha = header->colorType == PNG_COLOR_RGBA ||
+                           header->colorType == PNG_COLOR_GREYSCALE_A;
+    const size_t channels = ncolours + (has_alpha ? 1 : 0);
+    const size_t pixel_bits = channels * header->bitDepth;
+    const size_t bpp = pixel_bits >= 8 ? pixel_bits / 8 : 1;
+    const size_t row_samples = (size_t)width * channels;
+    const bool scale = header->colorType != PNG_COLOR_INDEXED;
+    const uint8_t(*passes)[4] =
+        header->interlace ? png_adam7 : png_no_interlace;
+    const int npasses = header->interlace ? 7 : 1;
+    // PNG data arrived compressed, so keep it that way
+    const int level =
+        pdf->compress_level > 0 ? pdf->compress_level : Z_DEFAULT_COMPRESSION;
+    struct png_inflater in[7], base;
+    uint32_t pass_width[7] = {0}, pass_height[7] = {0};
+    bool live[7] = {false}, base_live = false;
+    bool colour_live = false, alpha_live = false;
+    struct png_deflater colour_out, alpha_out;
+    struct dstr colour = INIT_DSTR, alpha = INIT_DSTR;
+    struct pdf_object *obj = NULL, *smask = NULL;
+    uint8_t *row = NULL, *samples, *colour_row, *alpha_row;
+    uint8_t opaque = 0xff;
+    char params[160];
+    int ret = -ENOMEM;
+
+    // Try and limit the memory usage to sane images
+    if (width > MAX_IMAGE_WIDTH || header->height > MAX_IMAGE_HEIGHT) {
+        pdf_set_err(pdf, -EINVAL, "PNG too large to transcode: %ux%u", width,
+                    header->height);
+        return NULL;
+    }
+
+    for (int p = 0; p < npasses; p++) {
+        const uint8_t *pass = passes[p];
+
+        if (width > pass[0])
+            pass_width[p] = (width - pass[0] + pass[2] - 1) / pass[2];
+        if (header->height > pass[1])
+            pass_height[p] =
+                (header->height - pass[1] + pass[3] - 1) / pass[3];
+        // Empty passes have no data at all, not even filter bytes
+        if (!pass_width[p])
+            pass_height[p] = 0;
+    }
+
+    if (npasses == 1) {
+        if (png_inflater_init(&in[0], (const uint8_t *)dstr_data(idat),
+                              dstr_len(idat),
+                              ((size_t)width * pixel_bits + 7) / 8, bpp) < 0)
+            goto done;
+        live[0] = true;
+    } else {
+        if (png_inflater_init(&base, (const uint8_t *)dstr_data(idat),
+                              dstr_len(idat), 0, 1) < 0)
+            goto done;
+        base_live = true;
+        for (int p = 0; p < npasses; p++) {
+            const size_t row_len =
+                ((size_t)pass_width[p] * pixel_bits + 7) / 8;
+
+            if (!pass_height[p])
+                continue;
+            if (png_inflater_fork(&in[p], &base, row_len, bpp) < 0)
+                goto done;
+            live[p] = true;
+            if (png_inflater_skip(&base, (row_len + 1) * pass_height[p]) <
+                0) {
+                ret = -EINVAL;
+                goto done;
+            }
+        }
+        png_inflater_end(&base);
+        base_live = false;
+    }
+
+    if (png_deflater_init(&colour_out, &colour, level, (size_t)width * ncolours,
+                          ncolours, header->height) < 0)
+        goto done;
+    colour_live = true;
+    if (has_alpha) {
+        if (png_deflater_init(&alpha_out, &alpha, level, width, 1,
+                              header->height) < 0)
+            goto done;
+        alpha_live = true;
+    }
+
+    row = (uint8_t *)malloc(2 * row_samples + (size_t)width * channels);
+    if (!row)
+        goto done;
+    samples = row + row_samples;
+    colour_row = samples + row_samples;
+    alpha_row = colour_row + (size_t)width * ncolours;
+
+    for (uint32_t y = 0; y < header->height; y++) {
+        for (int p = 0; p < npasses; p++) {
+            const uint8_t *pass = passes[p];
+            const uint8_t *packed;
+
+            if (!pass_height[p] || y < pass[1] || (y - pass[1]) % pass[3])
+                continue;
+            packed = png_inflater_next(&in[p]);
+            if (!packed) {
+                ret = -EINVAL;
+                goto done;
+            }
+            if (npasses == 1) {
+                png_expand_row(row, packed, row_samples, header->bitDepth,
+                               scale);
+                continue;
+            }
+            png_expand_row(samples, packed, (size_t)pass_width[p] * channels,
+                           header->bitDepth, scale);
+            for (uint32_t i = 0; i < pass_width[p]; i++)
+                memcpy(&row[((size_t)pass[0] + (size_t)i * pass[2]) *
+                            channels],
+                       &samples[(size_t)i * channels], channels);
+        }
+
+        if (!has_alpha) {
+            ret = png_deflater_write(&colour_out, row);
+            if (ret < 0)
+                goto done;
+            continue;
+        }
+
+        // De-interleave the planes. These are kept as simple, separate
+        // loops per layout so the compiler can vectorise them
+        if (ncolours == 3) {
+            for (uint32_t x = 0; x < width; x++) {
+                colour_row[x * 3] = row[x * 4];
+                colour_row[x * 3 + 1] = row[x * 4 + 1];
+                colour_row[x * 3 + 2] = row[x * 4 + 2];
+                alpha_row[x] = row[x * 4 + 3];
+            }
+        } else {
+            for (uint32_t x = 0; x < width; x++) {
+                colour_row[x] = row[x * 2];
+                alpha_row[x] = row[x * 2 + 1];
+            }
+        }
+        for (uint32_t x = 0; x < width; x++)
+            opaque &= alpha_row[x];
+
+        ret = png_deflater_write(&colour_out, colour_row);
+        if (ret >= 0)
+            ret = png_deflater_write(&alpha_out, alpha_row);
+        if (ret < 0)
+            goto done;
+    }
+    ret = png_deflater_finish(&colour_out);
+    if (ret >= 0 && has_alpha)
+        ret = png_deflater_finish(&alpha_out);
+
+done:
+    if (colour_live)
+        png_deflater_end(&colour_out);
+    if (alpha_live)
+        png_deflater_end(&alpha_out);
+    if (base_live)
+        png_inflater_end(&base);
+    for (int p = 0; p < npasses; p++)
+        if (live[p])
+            png_inflater_end(&in[p]);
+    free(row);
+
+    if (ret < 0) {
+        dstr_free(&colour);
+        dstr_free(&alpha);
+        pdf_set_err(pdf, ret,
+                    ret == -ENOMEM ? "Unable to allocate PNG transcoder"
+                                   : "Corrupt PNG image data");
+        return NULL;
+    }
+
+    if (has_alpha && opaque != 0xff) {
+        snprintf(params, sizeof(params),
+                 "  /Filter /FlateDecode\r\n"
+                 "  /DecodeParms << /Predictor 15 /Colors 1 "
+                 "/BitsPerComponent 8 /Columns %u >>\r\n",
+                 width);
+        smask = pdf_add_raw_image(pdf, width, header->height, "/DeviceGray",
+                                  8, params, &alpha);
+        if (!smask) {
+            dstr_free(&colour);
+            return NULL;
+        }
+    }
+    dstr_free(&alpha);
+
+    snprintf(params, sizeof(params),
+             "  /Interpolate true\r\n"
+             "  /Filter /FlateDecode\r\n"
+             "  /DecodeParms << /Predictor 15 /Colors %d "
+             "/BitsPerComponent 8 /Columns %u >>\r\n",
+             ncolours, width);
+    obj = pdf_add_raw_image(pdf, width, header->height, colour_space, 8,
+                            params, &colour);
+    if (obj)
+        obj->image.smask = smask;
+    return obj;
+}
+
+static struct pdf_object *pdf_add_png_data(struct pdf_doc *pdf,
+                                           const struct pdf_img_info *img_info,
+                                           const uint8_t *png_data,
+                                           size_t png_data_length)
 {
     // indicates if we return an error or add the img at the
     // end of the function
@@ -3693,12 +6842,12 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
     struct dstr colour_space = INIT_DSTR;
 
     struct pdf_object *obj = NULL;
-    uint8_t *final_data = NULL;
-    int written = 0;
-    uint32_t pos;
-    uint8_t *png_data_temp = NULL;
-    size_t png_data_total_length = 0;
+    size_t pos;
+    // Concatenated IDAT chunks, which form a single zlib stream
+    struct dstr idat = INIT_DSTR;
+    char params[256];
     uint8_t ncolours;
+    bool depth_ok;
 
     // Stores palette information for indexed PNGs
     struct rgb_value *palette_buffer = NULL;
@@ -3717,7 +6866,13 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
     case PNG_COLOR_INDEXED:
         ncolours = 1;
         break;
-    // PNG_COLOR_RGBA and PNG_COLOR_GREYSCALE_A are unsupported
+    // The alpha channel is split off into a soft mask
+    case PNG_COLOR_GREYSCALE_A:
+        ncolours = 1;
+        break;
+    case PNG_COLOR_RGBA:
+        ncolours = 3;
+        break;
     default:
         pdf_set_err(pdf, -EINVAL, "PNG has unsupported color type: %d",
                     header->colorType);
@@ -3725,6 +6880,36 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
         break;
     }
 
+    // Only some bit depths are valid for each colour type
+    switch (header->bitDepth) {
+    case 1:
+    case 2:
+    case 4:
+        depth_ok = header->colorType == PNG_COLOR_GREYSCALE ||
+                   header->colorType == PNG_COLOR_INDEXED;
+        break;
+    case 8:
+        depth_ok = true;
+        break;
+    case 16:
+        depth_ok = header->colorType != PNG_COLOR_INDEXED;
+        break;
+    default:
+        depth_ok = false;
+        break;
+    }
+    if (!depth_ok) {
+        pdf_set_err(pdf, -EINVAL,
+                    "PNG has invalid bit depth %u for color type %d",
+                    header->bitDepth, header->colorType);
+        goto free_buffers;
+    }
+    if (header->interlace > 1) {
+        pdf_set_err(pdf, -EINVAL, "PNG has unknown interlace method %u",
+                    header->interlace);
+        goto free_buffers;
+    }
+
     /* process PNG chunks */
     pos = sizeof(png_signature);
 
@@ -3741,7 +6926,7 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
         const uint32_t chunk_length = ntoh32(chunk->length);
         // chunk length + 4-bytes of CRC
         if (chunk_length > png_data_length - pos - 4) {
-            pdf_set_err(pdf, -EINVAL, "PNG chunk exceeds file: %d vs %ld",
+            pdf_set_err(pdf, -EINVAL, "PNG chunk exceeds file: %u vs %zu",
                         chunk_length, png_data_length - pos - 4);
             goto free_buffers;
         }
@@ -3799,17 +6984,14 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
             }
         } else if (strncmp(chunk->type, png_chunk_data, 4) == 0) {
             if (chunk_length > 0 && chunk_length < png_data_length - pos) {
-                uint8_t *data = (uint8_t *)realloc(
-                    png_data_temp, png_data_total_length + chunk_length);
-                // (uint8_t *)realloc(info.data, info.length + chunk_length);
-                if (!data) {
+                // The image data can't be larger than the file, so size the
+                // buffer once rather than growing it for every chunk
+                if (dstr_ensure(&idat, png_data_length) < 0 ||
+                    dstr_append_data(&idat, &png_data[pos], chunk_length) <
+                        0) {
                     pdf_set_err(pdf, -ENOMEM, "No memory for PNG data");
                     goto free_buffers;
                 }
-                png_data_temp = data;
-                memcpy(&png_data_temp[png_data_total_length], &png_data[pos],
-                       chunk_length);
-                png_data_total_length += chunk_length;
             }
         } else if (strncmp(chunk->type, png_chunk_end, 4) == 0) {
             /* end of file, exit */
@@ -3826,16 +7008,18 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
     }
 
     /* if no length was found */
-    if (png_data_total_length == 0) {
+    if (dstr_len(&idat) == 0) {
         pdf_set_err(pdf, -EINVAL, "PNG file has zero length");
         goto free_buffers;
     }
 
     switch (header->colorType) {
     case PNG_COLOR_GREYSCALE:
+    case PNG_COLOR_GREYSCALE_A:
         dstr_append(&colour_space, "/DeviceGray");
         break;
     case PNG_COLOR_RGB:
+    case PNG_COLOR_RGBA:
         dstr_append(&colour_space, "/DeviceRGB");
         break;
     case PNG_COLOR_INDEXED:
@@ -3868,66 +7052,37 @@ static int pdf_add_png_data(struct pdf_doc *pdf, struct pdf_object *page,
         break;
     }
 
-    final_data = (uint8_t *)malloc(png_data_total_length + 1024 +
-                                   dstr_len(&colour_space));
-    if (!final_data) {
-        pdf_set_err(pdf, -ENOMEM, "Unable to allocate PNG data %zu",
-                    png_data_total_length + 1024 + dstr_len(&colour_space));
+    if (header->colorType == PNG_COLOR_RGBA ||
+        header->colorType == PNG_COLOR_GREYSCALE_A ||
+        header->bitDepth == 16 || header->interlace) {
+        obj = pdf_add_png_transcoded(pdf, header, &idat,
+                                     dstr_data(&colour_space), ncolours);
+        success = obj != NULL;
         goto free_buffers;
     }
 
-    // Write image information to PDF
-    written =
-        sprintf((char *)final_data,
-                "<<\r\n"
-                "  /Type /XObject\r\n"
-                "  /Name /Image%d\r\n"
-                "  /Subtype /Image\r\n"
-                "  /ColorSpace %s\r\n"
-                "  /Width %u\r\n"
-                "  /Height %u\r\n"
-                "  /Interpolate true\r\n"
-                "  /BitsPerComponent %u\r\n"
-                "  /Filter /FlateDecode\r\n"
-                "  /DecodeParms << /Predictor 15 /Colors %d "
-                "/BitsPerComponent %u /Columns %u >>\r\n"
-                "  /Length %zu\r\n"
-                ">>stream\r\n",
-                flexarray_size(&pdf->objects), dstr_data(&colour_space),
-                header->width, header->height, header->bitDepth, ncolours,
-                header->bitDepth, header->width, png_data_total_length);
-
-    memcpy(&final_data[written], png_data_temp, png_data_total_length);
-    written += png_data_total_length;
-    written += sprintf((char *)&final_data[written], "\r\nendstream\r\n");
-
-    obj = pdf_add_object(pdf, OBJ_image);
-    if (!obj) {
-        goto free_buffers;
-    }
+    snprintf(params, sizeof(params),
+             "  /Interpolate true\r\n"
+             "  /Filter /FlateDecode\r\n"
+             "  /DecodeParms << /Predictor 15 /Colors %d "
+             "/BitsPerComponent %u /Columns %u >>\r\n",
+             ncolours, header->bitDepth, header->width);
 
-    dstr_append_data(&obj->stream.stream, final_data, written);
-
-    if (get_img_display_dimensions(pdf, header->width, header->height,
-                                   &display_width, &display_height)) {
+    obj = pdf_add_raw_image(pdf, header->width, header->height,
+                            dstr_data(&colour_space), header->bitDepth,
+                            params, &idat);
+    if (!obj) {
         goto free_buffers;
     }
     success = true;
 
 free_buffers:
-    if (final_data)
-        free(final_data);
     if (palette_buffer)
         free(palette_buffer);
-    if (png_data_temp)
-        free(png_data_temp);
+    dstr_free(&idat);
     dstr_free(&colour_space);
 
-    if (success)
-        return pdf_add_image(pdf, page, obj, x, y, display_width,
-                             display_height);
-    else
-        return pdf->errval;
+    return success ? obj : NULL;
 }
 
 static int parse_bmp_header(struct pdf_img_info *info, const uint8_t *data,
@@ -3960,92 +7115,91 @@ static int parse_bmp_header(struct pdf_img_info *info, const uint8_t *data,
     return 0;
 }
 
-static int pdf_add_bmp_data(struct pdf_doc *pdf, struct pdf_object *page,
-                            float x, float y, float display_width,
-                            float display_height,
-                            const struct pdf_img_info *info,
-                            const uint8_t *data, const size_t len)
+static struct pdf_object *pdf_add_bmp_data(struct pdf_doc *pdf,
+                                           const struct pdf_img_info *info,
+                                           const uint8_t *data,
+                                           const size_t len)
 {
     const struct bmp_header *header = &info->bmp;
     uint8_t *bmp_data = NULL;
-    uint8_t row_padding;
+    size_t stride;
     uint32_t bpp;
     size_t data_len;
-    int retval;
+    struct pdf_object *obj;
     const uint32_t width = info->width;
     const uint32_t height = info->height;
 
-    if (header->bfSize != len)
-        return pdf_set_err(pdf, -EINVAL,
-                           "BMP file seems to have wrong length");
-    if (header->biSize != 40)
-        return pdf_set_err(pdf, -EINVAL, "Wrong BMP header: biSize");
-    if (header->biCompression != 0)
-        return pdf_set_err(pdf, -EINVAL, "Wrong BMP compression value: %d",
-                           header->biCompression);
+    if (header->bfSize != len) {
+        pdf_set_err(pdf, -EINVAL, "BMP file seems to have wrong length");
+        return NULL;
+    }
+    if (header->biSize != 40) {
+        pdf_set_err(pdf, -EINVAL, "Wrong BMP header: biSize");
+        return NULL;
+    }
+    if (header->biCompression != 0) {
+        pdf_set_err(pdf, -EINVAL, "Wrong BMP compression value: %d",
+                    header->biCompression);
+        return NULL;
+    }
     if (header->biWidth > MAX_IMAGE_WIDTH || header->biWidth <= 0 ||
-        width > MAX_IMAGE_WIDTH || width == 0)
-        return pdf_set_err(pdf, -EINVAL, "BMP has invalid width: %d",
-                           header->biWidth);
+        width > MAX_IMAGE_WIDTH || width == 0) {
+        pdf_set_err(pdf, -EINVAL, "BMP has invalid width: %d",
+                    header->biWidth);
+        return NULL;
+    }
     if (header->biHeight > MAX_IMAGE_HEIGHT ||
         header->biHeight < -MAX_IMAGE_HEIGHT || header->biHeight == 0 ||
-        height > MAX_IMAGE_HEIGHT || height == 0)
-        return pdf_set_err(pdf, -EINVAL, "BMP has invalid height: %d",
-                           header->biHeight);
-    if (header->biBitCount != 24 && header->biBitCount != 32)
-        return pdf_set_err(pdf, -EINVAL, "Unsupported BMP bitdepth: %d",
-                           header->biBitCount);
+        height > MAX_IMAGE_HEIGHT || height == 0) {
+        pdf_set_err(pdf, -EINVAL, "BMP has invalid height: %d",
+                    header->biHeight);
+        return NULL;
+    }
+    if (header->biBitCount != 24 && header->biBitCount != 32) {
+        pdf_set_err(pdf, -EINVAL, "Unsupported BMP bitdepth: %d",
+                    header->biBitCount);
+        return NULL;
+    }
     bpp = header->biBitCount / 8;
-    /* BMP rows are 4-bytes padded! */
-    row_padding = (width * bpp) & 3;
+    /* BMP rows are padded to a multiple of 4 bytes, the last one may not be */
+    stride = ((size_t)width * bpp + 3) & ~(size_t)3;
     data_len = (size_t)width * (size_t)height * 3;
 
-    if (header->bfOffBits >= len)
-        return pdf_set_err(pdf, -EINVAL, "Invalid BMP image offset");
+    if (header->bfOffBits >= len) {
+        pdf_set_err(pdf, -EINVAL, "Invalid BMP image offset");
+        return NULL;
+    }
 
     if (len - header->bfOffBits <
-        (size_t)height * (width + row_padding) * bpp)
-        return pdf_set_err(pdf, -EINVAL, "Wrong BMP image size");
-
-    if (bpp == 3) {
-        /* 24 bits: change R and B colors */
-        bmp_data = (uint8_t *)malloc(data_len);
-        if (!bmp_data)
-            return pdf_set_err(pdf, -ENOMEM,
-                               "Insufficient memory for bitmap");
-        for (uint32_t pos = 0; pos < width * height; pos++) {
-            uint32_t src_pos =
-                header->bfOffBits + 3 * (pos + (pos / width) * row_padding);
-
-            bmp_data[pos * 3] = data[src_pos + 2];
-            bmp_data[pos * 3 + 1] = data[src_pos + 1];
-            bmp_data[pos * 3 + 2] = data[src_pos];
-        }
-    } else if (bpp == 4) {
-        /* 32 bits: change R and B colors, remove key color */
-        int offs = 0;
-        bmp_data = (uint8_t *)malloc(data_len);
-        if (!bmp_data)
-            return pdf_set_err(pdf, -ENOMEM,
-                               "Insufficient memory for bitmap");
-
-        for (uint32_t pos = 0; pos < width * height * 4; pos += 4) {
-            bmp_data[offs] = data[header->bfOffBits + pos + 2];
-            bmp_data[offs + 1] = data[header->bfOffBits + pos + 1];
-            bmp_data[offs + 2] = data[header->bfOffBits + pos];
-            offs += 3;
+        (size_t)(height - 1) * stride + (size_t)width * bpp) {
+        pdf_set_err(pdf, -EINVAL, "Wrong BMP image size");
+        return NULL;
+    }
+
+    bmp_data = (uint8_t *)malloc(data_len);
+    if (!bmp_data) {
+        pdf_set_err(pdf, -ENOMEM, "Insufficient memory for bitmap");
+        return NULL;
+    }
+    /* Swap B & R, and drop the fourth byte of 32-bit pixels */
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t *src = &data[header->bfOffBits + y * stride];
+        uint8_t *dst = &bmp_data[(size_t)y * width * 3];
+
+        for (uint32_t x = 0; x < width; x++) {
+            dst[x * 3] = src[x * bpp + 2];
+            dst[x * 3 + 1] = src[x * bpp + 1];
+            dst[x * 3 + 2] = src[x * bpp];
         }
-    } else {
-        return pdf_set_err(pdf, -EINVAL, "Unsupported BMP bitdepth: %d",
-                           header->biBitCount);
     }
     if (header->biHeight >= 0) {
         // BMP has vertically mirrored representation of lines, so swap them
         uint8_t *line = (uint8_t *)malloc(width * 3);
         if (!line) {
             free(bmp_data);
-            return pdf_set_err(pdf, -ENOMEM,
-                               "Unable to allocate memory for bitmap mirror");
+            pdf_set_err(pdf, -ENOMEM,
+                        "Unable to allocate memory for bitmap mirror");
+            return NULL;
         }
         for (uint32_t pos = 0; pos < (height / 2); pos++) {
             memcpy(line, &bmp_data[pos * width * 3], width * 3);
@@ -4057,11 +7211,10 @@ static int pdf_add_bmp_data(struct pdf_doc *pdf, struct pdf_object *page,
         free(line);
     }
 
-    retval = pdf_add_rgb24(pdf, page, x, y, display_width, display_height,
-                           bmp_data, width, height);
+    obj = pdf_add_raw_pixels(pdf, bmp_data, width, height, 3);
     free(bmp_data);
 
-    return retval;
+    return obj;
 }
 
 static int determine_image_format(const uint8_t *data, size_t length)
@@ -4109,9 +7262,15 @@ int pdf_parse_image_header(struct pdf_img_info *info, const uint8_t *data,
     }
 }
 
-int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
-                       float y, float display_width, float display_height,
-                       const uint8_t *data, size_t len)
+/**
+ * Find or create the image XObject for the given image file contents.
+ * If file_name is given, data is the whole of that file (as described by
+ * buf), and formats that are embedded as-is are left there until saving.
+ */
+static struct pdf_object *pdf_image_from_data(struct pdf_doc *pdf,
+                                              const uint8_t *data, size_t len,
+                                              const char *file_name,
+                                              const struct stat *buf)
 {
     struct pdf_img_info info = {
         .image_format = IMAGE_UNKNOWN,
@@ -4122,46 +7281,289 @@ int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
 
     int ret = pdf_parse_image_header(&info, data, len, pdf->errstr,
                                      sizeof(pdf->errstr));
-    if (ret)
-        return ret;
+    if (ret) {
+        pdf->errval = ret;
+        return NULL;
+    }
+
+    // Identical data may have been embedded already (a logo or separator
+    // repeated on several pages), in which case we just place it again
+    uint64_t digest = data_digest(data, len);
+    struct pdf_object *obj =
+        pdf_find_image(pdf, digest, len, info.width, info.height, data);
+    if (obj)
+        return obj;
 
     // Try and determine which image format it is based on the content
     switch (info.image_format) {
     case IMAGE_PNG:
-        return pdf_add_png_data(pdf, page, x, y, display_width,
-                                display_height, &info, data, len);
+        obj = pdf_add_png_data(pdf, &info, data, len);
+        break;
     case IMAGE_BMP:
-        return pdf_add_bmp_data(pdf, page, x, y, display_width,
-                                display_height, &info, data, len);
+        obj = pdf_add_bmp_data(pdf, &info, data, len);
+        break;
     case IMAGE_JPG:
-        return pdf_add_jpeg_data(pdf, page, x, y, display_width,
-                                 display_height, &info, data, len);
+        if (file_name)
+            obj = pdf_add_jpeg_file(pdf, &info, file_name, buf);
+        else
+            obj = pdf_add_raw_jpeg_data(pdf, &info, data, len);
+        break;
     case IMAGE_PPM:
-        return pdf_add_ppm_data(pdf, page, x, y, display_width,
-                                display_height, &info, data, len);
+        obj = pdf_add_ppm_data(pdf, &info, data, len);
+        break;
 
     // This case should be caught in parse_image_header, but is checked
     // here again for safety
     case IMAGE_UNKNOWN:
     default:
-        return pdf_set_err(pdf, -EINVAL, "Unable to determine image format");
+        pdf_set_err(pdf, -EINVAL, "Unable to determine image format");
+        return NULL;
     }
+    if (!obj)
+        return NULL;
+
+    pdf_note_image(pdf, obj, digest, len,
+                   info.image_format == IMAGE_JPG && !file_name);
+
+    return obj;
+}
+
+int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
+                       float y, float display_width, float display_height,
+                       const uint8_t *data, size_t len)
+{
+    struct pdf_object *obj = pdf_image_from_data(pdf, data, len, NULL, NULL);
+
+    if (!obj)
+        return pdf->errval;
+
+    return pdf_place_image(pdf, page, obj, x, y, display_width,
+                           display_height);
 }
 
 int pdf_add_image_file(struct pdf_doc *pdf, struct pdf_object *page, float x,
                        float y, float display_width, float display_height,
                        const char *image_filename)
 {
+    struct pdf_object *obj;
+
+    obj = pdf_load_image_file(pdf, image_filename, NULL);
+    if (!obj)
+        return pdf_get_errval(pdf);
+
+    return pdf_place_image(pdf, page, obj, x, y, display_width,
+                           display_height);
+}
+
+/**
+ * Image cache files
+ * These hold the encoded XObjects for one source image, so it can be
+ * embedded again without being decoded & compressed a second time:
+ *   "pdfgen-image-cache <version> <compression level>\n"
+ *   then one record for the image, and one for its soft mask if it has one:
+ *   "<width> <height> <digest> <digest len> <dict len> <data len> <check>
+ *    <smask>\n"
+ *   followed by the raw dictionary entries & data.
+ * Records only ever describe data pdfgen produced itself, but they're
+ * checked against the file size before anything is allocated, and the
+ * check value (a digest of the dictionary & data) catches damaged files.
+ */
+#define IMAGE_CACHE_VERSION 1
+
+static uint64_t image_record_check(struct dstr *dict, struct dstr *data)
+{
+    return data_digest(dstr_data(dict), dstr_len(dict)) * 31 +
+           data_digest(dstr_data(data), dstr_len(data));
+}
+
+static int pdf_write_image_record(FILE *fp, struct pdf_object *image)
+{
+    fprintf(fp,
+            "%" PRIu32 " %" PRIu32 " %" PRIx64 " %zu %zu %zu %" PRIx64
+            " %d\n",
+            image->image.width, image->image.height, image->image.digest,
+            image->image.digest_len, dstr_len(&image->image.dict),
+            dstr_len(&image->image.data),
+            image_record_check(&image->image.dict, &image->image.data),
+            image->image.smask != NULL);
+    fwrite(dstr_data(&image->image.dict), dstr_len(&image->image.dict), 1,
+           fp);
+    fwrite(dstr_data(&image->image.data), dstr_len(&image->image.data), 1,
+           fp);
+    if (image->image.smask)
+        return pdf_write_image_record(fp, image->image.smask);
+    return ferror(fp) ? -EIO : 0;
+}
+
+static int read_exact(FILE *fp, struct dstr *str, size_t len, size_t remain)
+{
+    if (len > remain || dstr_ensure(str, len + 1) < 0)
+        return -EINVAL;
+    if (len && fread(dstr_data(str), len, 1, fp) != 1)
+        return -EIO;
+    str->used_len = len;
+    dstr_data(str)[len] = '\0';
+    return 0;
+}
+
+/**
+ * Recreate an image (& its soft mask) from a cache record. Nothing is
+ * added to the document unless the whole record reads back correctly.
+ */
+static struct pdf_object *pdf_read_image_record(struct pdf_doc *pdf,
+                                                FILE *fp, int64_t file_len,
+                                                bool is_smask)
+{
+    struct dstr dict = INIT_DSTR, data = INIT_DSTR;
+    struct pdf_object *obj, *smask = NULL;
+    char line[160];
+    uint32_t width, height;
+    uint64_t digest, check;
+    size_t digest_len, dict_len, data_len;
+    int has_smask;
+    int64_t remain;
+
+    if (!fgets(line, sizeof(line), fp) ||
+        sscanf(line,
+               "%" SCNu32 " %" SCNu32 " %" SCNx64 " %zu %zu %zu %" SCNx64
+               " %d",
+               &width, &height, &digest, &digest_len, &dict_len, &data_len,
+               &check, &has_smask) != 8 ||
+        (is_smask && has_smask))
+        return NULL;
+    /* Already embedded, from the source file or another cache file */
+    if (!is_smask &&
+        (obj = pdf_find_image(pdf, digest, digest_len, width, height, NULL)))
+        return obj;
+    remain = file_len - ftello(fp);
+    if (remain < 0 || read_exact(fp, &dict, dict_len, (size_t)remain) < 0 ||
+        read_exact(fp, &data, data_len, (size_t)(remain - dict_len)) < 0 ||
+        image_record_check(&dict, &data) != check) {
+        dstr_free(&dict);
+        dstr_free(&data);
+        return NULL;
+    }
+
+    if (has_smask) {
+        smask = pdf_read_image_record(pdf, fp, file_len, true);
+        if (!smask) {
+            dstr_free(&dict);
+            dstr_free(&data);
+            return NULL;
+        }
+    }
+    obj = pdf_add_image_xobject(pdf, width, height, &dict, &data);
+    if (obj) {
+        obj->image.smask = smask;
+        pdf_note_image(pdf, obj, digest, digest_len, false);
+    }
+    return obj;
+}
+
+/**
+ * Load an image from a cache file, returning NULL on any sort of miss
+ */
+static struct pdf_object *pdf_read_image_cache(struct pdf_doc *pdf,
+                                               const char *cache_filename)
+{
+    struct pdf_object *obj = NULL;
+    struct stat buf;
+    int version, level;
+    FILE *fp;
+
+    fp = fopen(cache_filename, "rb");
+    if (!fp)
+        return NULL;
+    if (fstat(fileno(fp), &buf) == 0 &&
+        fscanf(fp, "pdfgen-image-cache %d %d", &version, &level) == 2 &&
+        fgetc(fp) == '\n' && version == IMAGE_CACHE_VERSION &&
+        level == pdf->compress_level)
+        obj = pdf_read_image_record(pdf, fp, buf.st_size, false);
+    fclose(fp);
+    return obj;
+}
+
+/**
+ * Store an image in a cache file. It's written under a temporary name &
+ * renamed into place, so a reader never sees half a file.
+ */
+static void pdf_write_image_cache(struct pdf_doc *pdf,
+                                  const char *cache_filename,
+                                  struct pdf_object *image)
+{
+    struct dstr tmp_name = INIT_DSTR;
+    FILE *fp;
+    int ret;
+
+    if (dstr_printf(&tmp_name, "%s.tmp", cache_filename) < 0)
+        return;
+    fp = fopen(dstr_data(&tmp_name), "wb");
+    if (fp) {
+        fprintf(fp, "pdfgen-image-cache %d %d\n", IMAGE_CACHE_VERSION,
+                pdf->compress_level);
+        ret = pdf_write_image_record(fp, image);
+        if (fclose(fp) != 0 || ret < 0 ||
+            rename(dstr_data(&tmp_name), cache_filename) != 0)
+            remove(dstr_data(&tmp_name));
+    }
+    dstr_free(&tmp_name);
+}
+
+struct pdf_object *pdf_load_image_file(struct pdf_doc *pdf,
+                                       const char *image_filename,
+                                       const char *cache_filename)
+{
+    struct pdf_object *obj = NULL;
+    struct stat buf;
     size_t len;
     uint8_t *data;
-    int ret = 0;
 
-    data = get_file(pdf, image_filename, &len);
+    /* JPEGs are copied across from the file at save time, so only need
+     * reading here to be parsed & hashed, which is cheaper than the cache */
+    data = get_file(pdf, image_filename, &len, &buf);
     if (data == NULL)
-        return pdf_get_errval(pdf);
-
-    ret = pdf_add_image_data(pdf, page, x, y, display_width, display_height,
-                             data, len);
+        return NULL;
+    if (cache_filename && !(len >= 2 && data[0] == 0xff && data[1] == 0xd8))
+        obj = pdf_read_image_cache(pdf, cache_filename);
+    if (!obj) {
+        obj = pdf_image_from_data(pdf, data, len, image_filename, &buf);
+        if (obj && cache_filename && !obj->image.source)
+            pdf_write_image_cache(pdf, cache_filename, obj);
+    }
     free(data);
-    return ret;
+    return obj;
+}
+
+int pdf_get_image_size(const struct pdf_object *image, uint32_t *width,
+                       uint32_t *height)
+{
+    if (!image || image->type != OBJ_image)
+        return -EINVAL;
+    if (width)
+        *width = image->image.width;
+    if (height)
+        *height = image->image.height;
+    return 0;
+}
+
+int pdf_add_image_object(struct pdf_doc *pdf, struct pdf_object *page,
+                         struct pdf_object *image, float x, float y,
+                         float display_width, float display_height)
+{
+    if (!image || image->type != OBJ_image)
+        return pdf_set_err(pdf, -EINVAL, "Invalid image object");
+    return pdf_place_image(pdf, page, image, x, y, display_width,
+                           display_height);
+}
+
+int pdf_add_image_transform(struct pdf_doc *pdf, struct pdf_object *page,
+                            struct pdf_object *image, const float matrix[6],
+                            float clip_x, float clip_y, float clip_width,
+                            float clip_height)
+{
+    const float clip[4] = {clip_x, clip_y, clip_width, clip_height};
+
+    if (!image || image->type != OBJ_image)
+        return pdf_set_err(pdf, -EINVAL, "Invalid image object");
+    return pdf_draw_image(pdf, page, image, matrix, clip);
 }
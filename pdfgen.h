@@ -331,6 +331,45 @@ void pdf_clear_err(struct pdf_doc *pdf);
  */
 int pdf_set_font(struct pdf_doc *pdf, const char *font);
 
+/**
+ * Set the compression level used for content streams and raw pixel images
+ * (PPM, PGM, BMP and buffers passed to @ref pdf_add_rgb24 or
+ * @ref pdf_add_grayscale8). Pixel rows are PNG filtered before being
+ * deflated, which typically shrinks photographic images by more than half.
+ * JPEG and PNG data are already compressed, and are embedded as before.
+ * Note: Only objects added after this call are affected.
+ * @param pdf PDF document to update
+ * @param level zlib compression level, from 1 (fastest) to 9 (smallest),
+ *  or 0 to store data uncompressed (the default)
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_set_compression(struct pdf_doc *pdf, int level);
+
+/**
+ * Output layouts for @ref pdf_set_save_flags, which may be OR'd together
+ */
+enum {
+    PDF_SAVE_OBJECT_STREAMS = 1 << 0, //!< PDF 1.5 object & xref streams
+    PDF_SAVE_LINEARIZED = 1 << 1,     //!< Linearized for fast web view
+};
+
+/**
+ * Choose how @ref pdf_save and @ref pdf_save_file lay out the document.
+ * With PDF_SAVE_OBJECT_STREAMS, every object other than a stream (pages,
+ * fonts, bookmarks etc...) is packed into compressed object streams, and
+ * the text xref table is replaced by a binary cross-reference stream.
+ * This shrinks page-heavy documents, but needs a PDF 1.5 reader.
+ * With PDF_SAVE_LINEARIZED, the file is laid out so the first page can be
+ * shown before the rest has been downloaded: its objects and hint tables
+ * come first, followed by the remaining pages in order. This takes
+ * priority over PDF_SAVE_OBJECT_STREAMS, and needs at least one page.
+ * @param pdf PDF document to update
+ * @param flags Bitmask of PDF_SAVE_xxx values, or 0 to write a classic
+ *  PDF 1.4 file (the default)
+ * @return < 0 on failure, 0 on success
+ */
+int pdf_set_save_flags(struct pdf_doc *pdf, int flags);
+
 /**
  * Calculate the width of a given string in the current font
  * @param pdf PDF document
@@ -421,6 +460,22 @@ int pdf_save(struct pdf_doc *pdf, const char *filename);
  */
 int pdf_save_file(struct pdf_doc *pdf, FILE *fp);
 
+/**
+ * Append the pages of the given pdf document to an existing PDF file, as
+ * an incremental update. The existing bytes are left as they are; the new
+ * objects, a replacement page tree and a new cross-reference section are
+ * added after them, so appending a few pages to a large file is cheap.
+ * The existing file should be one pdfgen wrote, in any save layout
+ * (a linearized file is no longer linearized afterwards). Its document
+ * info is kept, and bookmarks in the new document are not supported.
+ * If the update fails, the file is truncated back to its original length.
+ * @param pdf PDF document holding the pages to append
+ * @param filename Name of the existing PDF file to extend
+ * @return < 0 on failure (-ENOTSUP if the file's page tree isn't one we
+ *  can extend), >= 0 on success
+ */
+int pdf_save_append(struct pdf_doc *pdf, const char *filename);
+
 /**
  * Add a text string to the document
  * @param pdf PDF document to add to
@@ -704,6 +759,11 @@ int pdf_add_barcode(struct pdf_doc *pdf, struct pdf_object *page, int code,
 /**
  * Add image data as an image to the document.
  * Image data must be one of: JPEG, PNG, PPM, PGM or BMP formats
+ * The alpha channel of RGBA & grey+alpha PNGs is kept as a soft mask.
+ * 16-bit PNGs are reduced to 8 bits per component and interlaced PNGs
+ * are de-interlaced, streaming a few rows at a time.
+ * Identical image data added more than once (on the same or different
+ * pages) is only stored once in the document, and drawn at each placement.
  * Passing 0 for either the display width or height will
  * include the image but not render it visible.
  * Passing a negative number either the display height or width will
@@ -724,6 +784,7 @@ int pdf_add_image_data(struct pdf_doc *pdf, struct pdf_object *page, float x,
 
 /**
  * Add a raw 24 bit per pixel RGB buffer as an image to the document
+ * Identical pixel buffers of the same size are only embedded once.
  * Passing 0 for either the display width or height will
  * include the image but not render it visible.
  * Passing a negative number either the display height or width will
@@ -762,11 +823,17 @@ int pdf_add_grayscale8(struct pdf_doc *pdf, struct pdf_object *page, float x,
 
 /**
  * Add an image file as an image to the document.
+ * As with @ref pdf_add_image_data, repeated files or byte-identical
+ * content are only embedded once.
  * Passing 0 for either the display width or height will
  * include the image but not render it visible.
  * Passing a negative number either the display height or width will
  * have the image be resized while keeping the original aspect ratio.
  * Supports image formats: JPEG, PNG, PPM, PGM & BMP
+ * JPEG files are embedded as they are, so rather than being held in
+ * memory they're copied straight from the file when the document is
+ * saved. The file must be left alone until then: if its size or
+ * modification time has changed, saving fails with -ESTALE.
  * @param pdf PDF document to add bookmark to
  * @param page Page to add image to (NULL => most recently added page)
  * @param x X offset to put image at
@@ -780,6 +847,71 @@ int pdf_add_image_file(struct pdf_doc *pdf, struct pdf_object *page, float x,
                        float y, float display_width, float display_height,
                        const char *image_filename);
 
+/**
+ * Load an image file into the document without drawing it, so that it can
+ * be sized up and then placed with @ref pdf_add_image_object.
+ * If cache_filename is given, it is used to skip decoding & compressing
+ * the image again: when it holds an image encoded at the current
+ * compression level, that is loaded instead of image_filename, otherwise
+ * the image is loaded as usual and the cache file (re)written. The cache
+ * file name is up to the caller, and should change whenever the source
+ * image does (by including its size & modification time, say). JPEGs
+ * skip the cache, as they're referenced as for @ref pdf_add_image_file.
+ * @param pdf PDF document to add the image to
+ * @param image_filename Filename of image file to load
+ * @param cache_filename Cache file for the encoded image, or NULL
+ * @return the image object, or NULL on failure
+ */
+struct pdf_object *pdf_load_image_file(struct pdf_doc *pdf,
+                                       const char *image_filename,
+                                       const char *cache_filename);
+
+/**
+ * Get the size of an image object in pixels
+ * @param image Image object, as returned by @ref pdf_load_image_file
+ * @param width Where to store the width (may be NULL)
+ * @param height Where to store the height (may be NULL)
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_get_image_size(const struct pdf_object *image, uint32_t *width,
+                       uint32_t *height);
+
+/**
+ * Draw an image object loaded with @ref pdf_load_image_file on a page.
+ * The display width & height behave as for @ref pdf_add_image_file.
+ * @param pdf PDF document holding the image
+ * @param page Page to add image to (NULL => most recently added page)
+ * @param image Image object to draw
+ * @param x X offset to put image at
+ * @param y Y offset to put image at
+ * @param display_width Displayed width of image
+ * @param display_height Displayed height of image
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_add_image_object(struct pdf_doc *pdf, struct pdf_object *page,
+                         struct pdf_object *image, float x, float y,
+                         float display_width, float display_height);
+
+/**
+ * Draw an image object loaded with @ref pdf_load_image_file on a page
+ * through a transform, showing only the part inside a clip rectangle.
+ * The image is drawn as the unit square, so the matrix both sizes and
+ * places it; this allows rotated and cropped images.
+ * @param pdf PDF document holding the image
+ * @param page Page to add image to (NULL => most recently added page)
+ * @param image Image object to draw
+ * @param matrix Transform a b c d e f, as for the PDF 'cm' operator
+ * @param clip_x X offset of the clip rectangle
+ * @param clip_y Y offset of the clip rectangle
+ * @param clip_width Width of the clip rectangle
+ * @param clip_height Height of the clip rectangle
+ * @return < 0 on failure, >= 0 on success
+ */
+int pdf_add_image_transform(struct pdf_doc *pdf, struct pdf_object *page,
+                            struct pdf_object *image, const float matrix[6],
+                            float clip_x, float clip_y, float clip_width,
+                            float clip_height);
+
 /**
  * Parse image data to determine the image type & metadata
  * @param info structure to hold the parsed metadata
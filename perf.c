@@ -0,0 +1,370 @@
+#include "perf.h"
+#include "raylib.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// The last PERF_EVENT_CAPACITY zones are kept for the trace, about half a
+// minute of browsing; the overlay graphs the last PERF_FRAME_HISTORY frames
+#define PERF_EVENT_CAPACITY 16384
+#define PERF_FRAME_HISTORY 240
+#define PERF_DETAIL_LEN 48
+
+typedef struct {
+    int64_t start;
+    int32_t duration;
+    uint8_t stage;
+    char detail[PERF_DETAIL_LEN];
+} PerfEvent;
+
+static const char* stageNames[PERF_STAGE_COUNT] = {
+    "frame", "gallery", "full_view", "reorder", "present", "preload", "thumb_load",
+    "decode", "thumb_write", "upload", "export", "pdf_image", "pdf_save"
+};
+
+static bool perfEnabled = false;
+static PerfEvent events[PERF_EVENT_CAPACITY];
+static uint64_t eventCount; // Ever recorded, the ring holds the newest
+static int64_t frameTotals[PERF_STAGE_COUNT]; // Microseconds so far this frame
+static float history[PERF_FRAME_HISTORY][PERF_STAGE_COUNT]; // Milliseconds per frame
+static int historyCount;
+static int historyNext;
+static uint64_t counters[PERF_COUNTER_COUNT];
+static int thumbQueue;
+static char lastTrace[MAX_PATH_LEN];
+
+int64_t PerfNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void PerfEnable(bool enabled) {
+    perfEnabled = enabled;
+}
+
+PerfZone PerfBegin(PerfStage stage) {
+    return (PerfZone){ stage, perfEnabled ? PerfNow() : -1 };
+}
+
+void PerfEnd(PerfZone zone, const char* detail) {
+    if (!perfEnabled || zone.start < 0) return;
+
+    int64_t duration = PerfNow() - zone.start;
+    frameTotals[zone.stage] += duration;
+
+    PerfEvent* event = &events[eventCount++ % PERF_EVENT_CAPACITY];
+    event->start = zone.start;
+    event->duration = duration > INT32_MAX ? INT32_MAX : (int32_t)duration;
+    event->stage = zone.stage;
+    event->detail[0] = 0;
+    if (detail) {
+        size_t len = strlen(detail);
+        if (len >= PERF_DETAIL_LEN) {
+            // Cut on a character boundary so the trace stays valid UTF-8
+            len = PERF_DETAIL_LEN - 1;
+            while (len > 0 && ((unsigned char)detail[len] & 0xC0) == 0x80) len--;
+        }
+        memcpy(event->detail, detail, len);
+        event->detail[len] = 0;
+    }
+}
+
+void PerfEndFrame(void) {
+    if (!perfEnabled) return;
+    for (int s = 0; s < PERF_STAGE_COUNT; s++) {
+        history[historyNext][s] = frameTotals[s] / 1000.0f;
+        frameTotals[s] = 0;
+    }
+    historyNext = (historyNext + 1) % PERF_FRAME_HISTORY;
+    if (historyCount < PERF_FRAME_HISTORY) historyCount++;
+}
+
+void PerfCount(PerfCounter counter) {
+    if (perfEnabled) counters[counter]++;
+}
+
+void PerfSetThumbQueue(int depth) {
+    thumbQueue = depth;
+}
+
+static const char* HitRate(PerfCounter hit, uint64_t misses) {
+    uint64_t total = counters[hit] + misses;
+    if (total == 0) return "-";
+    return TextFormat("%.0f%% of %llu", 100.0 * counters[hit] / total, (unsigned long long)total);
+}
+
+// Resident set size from /proc where there is one, else 0
+static double GetResidentMB(void) {
+    long pages = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%*s %ld", &pages) != 1) pages = 0;
+        fclose(f);
+    }
+    return pages * (double)sysconf(_SC_PAGESIZE) / (1024.0 * 1024.0);
+}
+
+void DrawPerfOverlay(const State* state) {
+    const int width = PERF_FRAME_HISTORY + 20, lineH = 12, graphH = 60;
+    int x = GetScreenWidth() - width - 10, y = 60;
+    int lines = PERF_STAGE_COUNT + 6;
+    DrawRectangle(x, y, width, graphH + 20 + lines * lineH, Fade(BLACK, 0.75f));
+    x += 10;
+    y += 10;
+
+    // Frame times, oldest on the left; the line is 60 fps and the graph tops out at 50 ms
+    for (int i = 0; i < historyCount; i++) {
+        float ms = history[(historyNext - historyCount + i + PERF_FRAME_HISTORY) % PERF_FRAME_HISTORY][PERF_FRAME];
+        int h = (int)(fminf(ms, 50.0f) / 50.0f * graphH);
+        Color color = ms <= 17.0f ? GREEN : ms <= 34.0f ? ORANGE : RED;
+        DrawRectangle(x + PERF_FRAME_HISTORY - historyCount + i, y + graphH - h, 1, h, color);
+    }
+    int line60 = y + graphH - (int)(1000.0f / 60.0f / 50.0f * graphH);
+    DrawLine(x, line60, x + PERF_FRAME_HISTORY, line60, Fade(WHITE, 0.5f));
+    y += graphH + 6;
+
+    // Per-stage average and worst over the graphed frames
+    DrawText(TextFormat("%-12s %8s %8s", "stage", "avg ms", "max ms"), x, y, 10, LIGHTGRAY);
+    y += lineH;
+    for (int s = 0; s < PERF_STAGE_COUNT; s++) {
+        float sum = 0, max = 0;
+        for (int i = 0; i < historyCount; i++) {
+            sum += history[i][s];
+            if (history[i][s] > max) max = history[i][s];
+        }
+        float avg = historyCount > 0 ? sum / historyCount : 0;
+        DrawText(TextFormat("%-12s %8.2f %8.2f", stageNames[s], avg, max), x, y, 10, max > 0 ? WHITE : GRAY);
+        y += lineH;
+    }
+
+    size_t textureBytes = 0, imageBytes = 0;
+    int unloaded = 0;
+    for (int i = 0; i < state->imageCount; i++) {
+        const ImageEntry* entry = &state->images[i];
+        if (!entry->loaded) unloaded++;
+        if (entry->loaded && entry->texture.id) textureBytes += GetPixelDataSize(entry->texture.width, entry->texture.height, entry->texture.format);
+        if (entry->fullTextureLoaded) textureBytes += GetPixelDataSize(entry->fullTexture.width, entry->fullTexture.height, entry->fullTexture.format);
+        if (entry->fullLoaded) imageBytes += GetPixelDataSize(entry->fullImage.width, entry->fullImage.height, entry->fullImage.format);
+    }
+
+    DrawText(TextFormat("thumb queue %d, %d not loaded", thumbQueue, unloaded), x, y, 10, WHITE);
+    y += lineH;
+    DrawText(TextFormat("thumb cache %s, %llu regenerated", HitRate(PERF_THUMB_HIT, counters[PERF_THUMB_MISS] + counters[PERF_THUMB_REGENERATE]),
+                        (unsigned long long)counters[PERF_THUMB_REGENERATE]), x, y, 10, WHITE);
+    y += lineH;
+    DrawText(TextFormat("preload %s, export cache %s", HitRate(PERF_PRELOAD_HIT, counters[PERF_PRELOAD_MISS]),
+                        HitRate(PERF_EXPORT_CACHE_HIT, counters[PERF_EXPORT_CACHE_MISS])), x, y, 10, WHITE);
+    y += lineH;
+    DrawText(TextFormat("VRAM %.1f MB, images %.1f MB, RSS %.1f MB", textureBytes / (1024.0 * 1024.0), imageBytes / (1024.0 * 1024.0), GetResidentMB()), x, y, 10, WHITE);
+    y += lineH;
+    DrawText(lastTrace[0] ? TextFormat("F4: trace (last %s)", GetFileName(lastTrace)) : "F4: write trace", x, y, 10, LIGHTGRAY);
+}
+
+static void WriteJsonString(FILE* f, const char* text) {
+    fputc('"', f);
+    for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(f, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(f, "\\u%04x", *c);
+        } else {
+            fputc(*c, f);
+        }
+    }
+    fputc('"', f);
+}
+
+bool PerfWriteTrace(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) return false;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"Graphics Assembler\"}}");
+    uint64_t first = eventCount > PERF_EVENT_CAPACITY ? eventCount - PERF_EVENT_CAPACITY : 0;
+    for (uint64_t i = first; i < eventCount; i++) {
+        const PerfEvent* event = &events[i % PERF_EVENT_CAPACITY];
+        fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"rayview\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%d,\"pid\":1,\"tid\":1",
+                stageNames[event->stage], (long long)event->start, (int)event->duration);
+        if (event->detail[0]) {
+            fprintf(f, ",\"args\":{\"detail\":");
+            WriteJsonString(f, event->detail);
+            fputc('}', f);
+        }
+        fputc('}', f);
+    }
+    fprintf(f, "\n]}\n");
+
+    bool ok = !ferror(f);
+    if (fclose(f) != 0) ok = false;
+    if (ok) snprintf(lastTrace, sizeof(lastTrace), "%s", path);
+    return ok;
+}
+
+// The log keeps thumbnail counts per folder and decode times per format and
+// size between flushes, in fixed tables that are written out early when
+// full; scans and exports are written straight away
+#define LOG_MAX_FOLDERS 16
+#define LOG_MAX_SAMPLES 2048
+#define LOG_FORMATS 3
+#define LOG_SIZES 5
+
+typedef struct {
+    char folder[MAX_PATH_LEN];
+    uint64_t hit, miss, regenerate;
+} LogFolder;
+
+typedef struct {
+    float samples[LOG_MAX_SAMPLES]; // Milliseconds
+    int count;
+} LogSamples;
+
+static const char* logFormats[LOG_FORMATS] = { "png", "jpg", "other" };
+static const char* logSizes[LOG_SIZES] = { "<1MP", "1-4MP", "4-12MP", "12-24MP", "24MP+" };
+static const float logSizeLimits[LOG_SIZES - 1] = { 1.0f, 4.0f, 12.0f, 24.0f };
+
+static FILE* logFile;
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static LogFolder logFolders[LOG_MAX_FOLDERS];
+static int logFolderCount;
+static LogSamples logDecodes[LOG_FORMATS][LOG_SIZES];
+
+// Starts a line with the event name and the time, in UTC
+static void BeginLogLine(const char* event) {
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    fprintf(logFile, "{\"time\":\"%s\",\"event\":\"%s\"", stamp, event);
+}
+
+static void EndLogLine(void) {
+    fprintf(logFile, "}\n");
+    fflush(logFile); // Keep what's there if the app is killed
+}
+
+void PerfLogOpen(const char* mode) {
+    const char* path = getenv("RAYVIEW_PERF_LOG");
+    if (!path || !path[0] || logFile) return;
+
+    logFile = fopen(path, "a");
+    if (!logFile) {
+        TraceLog(LOG_WARNING, "PERF: Unable to open log %s", path);
+        return;
+    }
+    BeginLogLine("session");
+    fprintf(logFile, ",\"mode\":\"%s\",\"cpus\":%ld", mode, sysconf(_SC_NPROCESSORS_ONLN));
+    EndLogLine();
+}
+
+void PerfLogScan(const char* folder, int imageCount, int64_t micros) {
+    if (!logFile) return;
+    pthread_mutex_lock(&logLock);
+    BeginLogLine("scan");
+    fprintf(logFile, ",\"folder\":");
+    WriteJsonString(logFile, folder);
+    fprintf(logFile, ",\"images\":%d,\"ms\":%.3f", imageCount, micros / 1000.0);
+    EndLogLine();
+    pthread_mutex_unlock(&logLock);
+}
+
+static int CompareFloat(const void* a, const void* b) {
+    float fa = *(const float*)a, fb = *(const float*)b;
+    return (fa > fb) - (fa < fb);
+}
+
+static void WriteDecodesLocked(int f, int z) {
+    LogSamples* d = &logDecodes[f][z];
+    if (d->count == 0) return;
+
+    // Nearest rank percentiles over the sorted samples
+    qsort(d->samples, d->count, sizeof(float), CompareFloat);
+    double sum = 0;
+    for (int i = 0; i < d->count; i++) sum += d->samples[i];
+    BeginLogLine("decode");
+    fprintf(logFile, ",\"format\":\"%s\",\"size\":\"%s\",\"count\":%d,\"mean_ms\":%.3f,\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f",
+            logFormats[f], logSizes[z], d->count, sum / d->count, d->samples[(d->count - 1) * 50 / 100],
+            d->samples[(d->count - 1) * 90 / 100], d->samples[(d->count - 1) * 99 / 100], d->samples[d->count - 1]);
+    EndLogLine();
+    d->count = 0;
+}
+
+static void FlushLocked(void) {
+    for (int i = 0; i < logFolderCount; i++) {
+        BeginLogLine("thumbnails");
+        fprintf(logFile, ",\"folder\":");
+        WriteJsonString(logFile, logFolders[i].folder);
+        fprintf(logFile, ",\"hit\":%llu,\"miss\":%llu,\"regenerate\":%llu", (unsigned long long)logFolders[i].hit,
+                (unsigned long long)logFolders[i].miss, (unsigned long long)logFolders[i].regenerate);
+        EndLogLine();
+    }
+    logFolderCount = 0;
+
+    for (int f = 0; f < LOG_FORMATS; f++) {
+        for (int z = 0; z < LOG_SIZES; z++) WriteDecodesLocked(f, z);
+    }
+}
+
+void PerfLogThumbnail(const char* folder, PerfCounter counter) {
+    if (!logFile) return;
+    pthread_mutex_lock(&logLock);
+    LogFolder* entry = NULL;
+    for (int i = 0; i < logFolderCount && !entry; i++) {
+        if (strcmp(logFolders[i].folder, folder) == 0) entry = &logFolders[i];
+    }
+    if (!entry) {
+        if (logFolderCount == LOG_MAX_FOLDERS) FlushLocked();
+        entry = &logFolders[logFolderCount++];
+        snprintf(entry->folder, MAX_PATH_LEN, "%s", folder);
+        entry->hit = entry->miss = entry->regenerate = 0;
+    }
+    if (counter == PERF_THUMB_HIT) entry->hit++;
+    else if (counter == PERF_THUMB_REGENERATE) entry->regenerate++;
+    else entry->miss++;
+    pthread_mutex_unlock(&logLock);
+}
+
+void PerfLogDecode(const char* path, int width, int height, int64_t micros) {
+    if (!logFile) return;
+    const char* ext = strrchr(path, '.');
+    int format = 2;
+    if (ext && strcasecmp(ext, ".png") == 0) format = 0;
+    if (ext && (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0)) format = 1;
+    float megapixels = (float)width * height / 1e6f;
+    int size = 0;
+    while (size < LOG_SIZES - 1 && megapixels >= logSizeLimits[size]) size++;
+
+    pthread_mutex_lock(&logLock);
+    LogSamples* d = &logDecodes[format][size];
+    if (d->count == LOG_MAX_SAMPLES) WriteDecodesLocked(format, size);
+    d->samples[d->count++] = micros / 1000.0f;
+    pthread_mutex_unlock(&logLock);
+}
+
+void PerfLogExport(const char* kind, int pages, long long bytes, int64_t micros) {
+    if (!logFile) return;
+    double seconds = micros / 1e6;
+    pthread_mutex_lock(&logLock);
+    BeginLogLine("export");
+    fprintf(logFile, ",\"kind\":\"%s\",\"pages\":%d,\"bytes\":%lld,\"ms\":%.3f,\"pages_per_s\":%.2f,\"bytes_per_s\":%.0f",
+            kind, pages, bytes, micros / 1000.0, seconds > 0 ? pages / seconds : 0.0, seconds > 0 ? bytes / seconds : 0.0);
+    EndLogLine();
+    pthread_mutex_unlock(&logLock);
+}
+
+void PerfLogFlush(void) {
+    if (!logFile) return;
+    pthread_mutex_lock(&logLock);
+    FlushLocked();
+    pthread_mutex_unlock(&logLock);
+}
+
+void PerfLogClose(void) {
+    if (!logFile) return;
+    PerfLogFlush();
+    fclose(logFile);
+    logFile = NULL;
+}
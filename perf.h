@@ -0,0 +1,83 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include "state.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timed stages. Zones nest, so a stage's time includes any inside it:
+// decode and thumb_write are part of thumb_load, which is part of gallery.
+typedef enum {
+    PERF_FRAME,
+    PERF_GALLERY,
+    PERF_FULL_VIEW,
+    PERF_REORDER,
+    PERF_PRESENT,     // EndDrawing: buffer swap and the wait for the frame rate
+    PERF_PRELOAD,
+    PERF_THUMB_LOAD,
+    PERF_DECODE,
+    PERF_THUMB_WRITE, // PNG export into .rayview_thumbs
+    PERF_UPLOAD,      // Texture upload
+    PERF_EXPORT,
+    PERF_PDF_IMAGE,   // Reading and embedding one image in a PDF
+    PERF_PDF_SAVE,
+    PERF_STAGE_COUNT
+} PerfStage;
+
+// Running totals since start up, shown as hit rates
+typedef enum {
+    PERF_THUMB_HIT,   // Thumbnail on disk was current
+    PERF_THUMB_MISS,  // Thumbnail had to be made
+    PERF_THUMB_REGENERATE, // Thumbnail was older than its image
+    PERF_PRELOAD_HIT, // Neighbour already decoded
+    PERF_PRELOAD_MISS,
+    PERF_EXPORT_CACHE_HIT,
+    PERF_EXPORT_CACHE_MISS,
+    PERF_COUNTER_COUNT
+} PerfCounter;
+
+typedef struct {
+    PerfStage stage;
+    int64_t start; // Microseconds, -1 while recording is off
+} PerfZone;
+
+// Recording is off until enabled, and costs a branch per zone while it is.
+// Once on, zones must only be timed from the main thread.
+void PerfEnable(bool enabled);
+
+PerfZone PerfBegin(PerfStage stage);
+// Ends the zone; detail, if given, is kept with the event for the trace
+void PerfEnd(PerfZone zone, const char* detail);
+// Closes the frame, moving its per-stage totals into the overlay history
+void PerfEndFrame(void);
+void PerfCount(PerfCounter counter);
+// Thumbnails on screen but not yet loaded
+void PerfSetThumbQueue(int depth);
+
+// Draws the frame-time graph, per-stage times, queue depths, hit rates and
+// memory in use over the top right of the window
+void DrawPerfOverlay(const State* state);
+
+// Writes the recorded events as Chrome trace JSON, for chrome://tracing or
+// ui.perfetto.dev
+bool PerfWriteTrace(const char* path);
+
+// Monotonic clock in microseconds
+int64_t PerfNow(void);
+
+// Performance log. With RAYVIEW_PERF_LOG set to a file name, one JSON object
+// per line is appended to it: a session line, each folder scan and export as
+// it happens, and on each flush the thumbnail cache counts per folder and
+// decode latency percentiles per format and size (written early, covering
+// 2048 decodes, when one fills up between flushes). Unlike the zones above
+// these are safe to call from any thread, and do nothing when not logging.
+void PerfLogOpen(const char* mode);
+void PerfLogScan(const char* folder, int imageCount, int64_t micros);
+// counter is PERF_THUMB_HIT, PERF_THUMB_MISS or PERF_THUMB_REGENERATE
+void PerfLogThumbnail(const char* folder, PerfCounter counter);
+void PerfLogDecode(const char* path, int width, int height, int64_t micros);
+void PerfLogExport(const char* kind, int pages, long long bytes, int64_t micros);
+void PerfLogFlush(void);
+void PerfLogClose(void);
+
+#endif // PERF_H
@@ -1,70 +1,644 @@
 #include "settings.h"
+#include "journal.h"
+#include "perf.h"
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-void SaveSettings(const State* state) {
-    char settingsPath[MAX_PATH_LEN];
-    snprintf(settingsPath, MAX_PATH_LEN, "%s/.rayview_settings", state->folder);
-    FILE* f = fopen(settingsPath, "w");
-    if (f) {
-        fprintf(f, "%s\n%s\n%s\n%s\n%s\n%s\n", state->bufCanvasW, state->bufCanvasH, state->bufMarginT, state->bufMarginB, state->bufMarginL, state->bufMarginR);
-        
-        ImageEntry* sortedSelection[MAX_SELECTED_FILES];
-        int selectedCount = 0;
-        for (int i = 0; i < state->imageCount; i++) {
-            if (state->images[i].selected) {
-                sortedSelection[selectedCount++] = (ImageEntry*)&state->images[i];
-            }
+// <folder>/.rayview_project holds the folder's page sequences. Integers are
+// little-endian, and readers skip any header, sequence or page bytes past
+// the sizes they know, so fields can be added without a new version.
+//   header     magic, u32 version, u32 header size, u32 sequence size,
+//              u32 page size, u32 sequence count, u32 active sequence,
+//              u32 names size, 4 zero bytes
+//   sequences  u32 name offset, u32 last export path offset, u32 page count,
+//              4 zero bytes, then canvas W H and margins T B L R as the text
+//              typed in, 8 bytes each
+//   pages      each sequence's in turn: u64 ID, u32 name offset,
+//              u32 PROJECT_PAGE_xxx flags, then its PageLayout: u8 fit,
+//              u8 rotation, u8 own margins, 1 zero byte, f32 margins
+//              T B L R, f32 crop x y w h
+//   names      NUL terminated strings, starting with an empty one
+// A page's ID is the FNV-1a hash of its file name, so pages are matched to
+// the folder's images without comparing names one by one. Version 1 files
+// had a single sequence, its layout in an 80 byte header.
+#define PROJECT_MAGIC "RVPROJ\r\n"
+#define PROJECT_VERSION 2
+#define PROJECT_HEADER_SIZE 40
+#define PROJECT_SEQUENCE_SIZE 64
+#define PROJECT_PAGE_SIZE 52
+#define PROJECT_PAGE_MIN_SIZE 16 // Before pages had layouts
+#define PROJECT_PAGE_BLANK 0x1
+#define PROJECT_V1_HEADER_SIZE 80
+#define PROJECT_V1_LAYOUT_OFFSET 28
+
+// The text file it replaces: six lines of layout then one file name a line
+#define LEGACY_SETTINGS_NAME ".rayview_settings"
+
+// Autosave writes once changes have been quiet this long, and no later
+// than the limit after the first unsaved one while they keep coming
+#define AUTOSAVE_QUIET_US 1000000
+#define AUTOSAVE_LIMIT_US 5000000
+
+static uint64_t HashName(const char* name) {
+    uint64_t hash = 14695981039346656037ull; // FNV-1a
+    for (const char* c = name; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static void PutU32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (i * 8);
+}
+
+static void PutU64(uint8_t* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (i * 8);
+}
+
+static uint32_t GetU32(const uint8_t* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t GetU64(const uint8_t* p) {
+    return GetU32(p) | (uint64_t)GetU32(p + 4) << 32;
+}
+
+static void PutF32(uint8_t* p, float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, 4);
+    PutU32(p, bits);
+}
+
+// Anything not finite reads as 0
+static float GetF32(const uint8_t* p) {
+    uint32_t bits = GetU32(p);
+    float v;
+    memcpy(&v, &bits, 4);
+    return isfinite(v) ? v : 0;
+}
+
+static void PutPageLayout(uint8_t* p, const PageLayout* layout) {
+    const float crop[4] = { layout->crop.x, layout->crop.y, layout->crop.width, layout->crop.height };
+    p[0] = layout->fit;
+    p[1] = layout->rotation;
+    p[2] = layout->ownMargins;
+    for (int i = 0; i < 4; i++) {
+        PutF32(p + 4 + i * 4, layout->margins[i]);
+        PutF32(p + 20 + i * 4, crop[i]);
+    }
+}
+
+// Out of range values fall back to the defaults rather than failing the load
+static PageLayout GetPageLayout(const uint8_t* p) {
+    PageLayout layout = { p[0] == PAGE_FILL ? PAGE_FILL : PAGE_FIT, p[1] & 3, p[2] != 0, { 0 }, { 0 } };
+    for (int i = 0; i < 4; i++) layout.margins[i] = fmaxf(0, GetF32(p + 4 + i * 4));
+    Rectangle crop = { GetF32(p + 20), GetF32(p + 24), GetF32(p + 28), GetF32(p + 32) };
+    if (crop.x >= 0 && crop.y >= 0 && crop.width > 0 && crop.height > 0 && crop.x + crop.width <= 1 && crop.y + crop.height <= 1) {
+        layout.crop = crop;
+    }
+    return layout;
+}
+
+// Open addressed table from file name to image index, for matching a saved
+// page order against the folder in one pass
+typedef struct {
+    int* slots;
+    uint64_t* ids;
+    uint32_t mask;
+} NameIndex;
+
+static bool BuildNameIndex(const State* state, NameIndex* index) {
+    uint32_t size = 16;
+    while (size < (uint32_t)state->imageCount * 2) size *= 2;
+    index->slots = malloc(size * sizeof(int));
+    index->ids = malloc((state->imageCount + 1) * sizeof(uint64_t));
+    index->mask = size - 1;
+    if (!index->slots || !index->ids) {
+        free(index->slots);
+        free(index->ids);
+        return false;
+    }
+    memset(index->slots, -1, size * sizeof(int));
+    for (int i = 0; i < state->imageCount; i++) {
+        index->ids[i] = HashName(GetFileName(state->images[i].path));
+        uint32_t slot = index->ids[i] & index->mask;
+        while (index->slots[slot] >= 0) slot = (slot + 1) & index->mask;
+        index->slots[slot] = i;
+    }
+    return true;
+}
+
+static int FindName(const State* state, const NameIndex* index, uint64_t id, const char* name) {
+    for (uint32_t slot = id & index->mask; index->slots[slot] >= 0; slot = (slot + 1) & index->mask) {
+        int i = index->slots[slot];
+        if (index->ids[i] == id && strcmp(GetFileName(state->images[i].path), name) == 0) return i;
+    }
+    return -1;
+}
+
+static void FreeNameIndex(NameIndex* index) {
+    free(index->slots);
+    free(index->ids);
+}
+
+// Marks the image called name (or a new blank page) as the order'th page
+void SelectPage(State* state, const char* name, int order) {
+    if (strcmp(name, "[BLANK_PAGE]") == 0) {
+        AddBlankPage(state, order);
+        return;
+    }
+    for (int i = 0; i < state->imageCount; ++i) {
+        if (strcmp(GetFileName(state->images[i].path), name) == 0) {
+            state->images[i].selected = true;
+            state->images[i].selectionOrder = order;
+            break;
+        }
+    }
+}
+
+static void SelectIndexedPage(State* state, const NameIndex* index, const char* name, int order) {
+    if (strcmp(name, "[BLANK_PAGE]") == 0) {
+        AddBlankPage(state, order);
+        return;
+    }
+    int i = FindName(state, index, HashName(name), name);
+    if (i >= 0) {
+        state->images[i].selected = true;
+        state->images[i].selectionOrder = order;
+    }
+}
+
+// Fills pages with sequence seq in page order, the live selection for the
+// active one, blank pages as NULL. pages needs room for MaxSequencePages.
+static int GetSequencePages(const State* state, int seq, const ImageEntry** pages) {
+    if (seq == state->activeSequence) {
+        int count = GetSelection(state, (ImageEntry**)pages);
+        for (int i = 0; i < count; i++) {
+            if (strcmp(pages[i]->path, "[BLANK_PAGE]") == 0) pages[i] = NULL;
         }
+        return count;
+    }
+    const Sequence* sequence = &state->sequences[seq];
+    for (int i = 0; i < sequence->pageCount; i++) {
+        pages[i] = sequence->pages[i] < 0 ? NULL : &state->images[sequence->pages[i]];
+    }
+    return sequence->pageCount;
+}
 
-        for (int i = 0; i < selectedCount - 1; i++) {
-            for (int j = 0; j < selectedCount - i - 1; j++) {
-                if (sortedSelection[j]->selectionOrder > sortedSelection[j+1]->selectionOrder) {
-                    ImageEntry* temp = sortedSelection[j];
-                    sortedSelection[j] = sortedSelection[j+1];
-                    sortedSelection[j+1] = temp;
-                }
+// The most pages any sequence has. A stored one can have more than
+// imageCount, as its blank pages only get entries while it's active.
+static int MaxSequencePages(const State* state) {
+    int most = state->imageCount;
+    for (int s = 0; s < state->sequenceCount; s++) {
+        if (s != state->activeSequence && state->sequences[s].pageCount > most) most = state->sequences[s].pageCount;
+    }
+    return most;
+}
+
+static size_t NameSize(const char* name) {
+    return name[0] ? strlen(name) + 1 : 0;
+}
+
+// Adds a string to the names table, returning its offset; "" is offset 0
+static uint32_t PutName(char* names, uint32_t* namesSize, const char* name) {
+    if (!name[0]) return 0;
+    uint32_t offset = *namesSize;
+    strcpy(names + offset, name);
+    *namesSize += strlen(name) + 1;
+    return offset;
+}
+
+// Lays the project out in memory, ready to be written in one go
+static uint8_t* EncodeProject(const State* state, size_t* outLen) {
+    const ImageEntry** pages = malloc((MaxSequencePages(state) + 1) * sizeof(ImageEntry*));
+    if (!pages) return NULL;
+
+    size_t pageTotal = 0, namesSize = 1;
+    for (int s = 0; s < state->sequenceCount; s++) {
+        int count = GetSequencePages(state, s, pages);
+        for (int i = 0; i < count; i++) {
+            if (pages[i]) namesSize += NameSize(GetFileName(pages[i]->path));
+        }
+        pageTotal += count;
+        namesSize += NameSize(state->sequences[s].name) + NameSize(state->sequences[s].exportPath);
+    }
+    size_t len = PROJECT_HEADER_SIZE + (size_t)state->sequenceCount * PROJECT_SEQUENCE_SIZE + pageTotal * PROJECT_PAGE_SIZE + namesSize;
+    uint8_t* data = calloc(1, len);
+    if (!data) {
+        free(pages);
+        return NULL;
+    }
+
+    memcpy(data, PROJECT_MAGIC, 8);
+    PutU32(data + 8, PROJECT_VERSION);
+    PutU32(data + 12, PROJECT_HEADER_SIZE);
+    PutU32(data + 16, PROJECT_SEQUENCE_SIZE);
+    PutU32(data + 20, PROJECT_PAGE_SIZE);
+    PutU32(data + 24, state->sequenceCount);
+    PutU32(data + 28, state->activeSequence);
+
+    uint8_t* record = data + PROJECT_HEADER_SIZE;
+    uint8_t* page = record + (size_t)state->sequenceCount * PROJECT_SEQUENCE_SIZE;
+    char* names = (char*)page + pageTotal * PROJECT_PAGE_SIZE;
+    uint32_t nameOffset = 1;
+    for (int s = 0; s < state->sequenceCount; s++, record += PROJECT_SEQUENCE_SIZE) {
+        const Sequence* sequence = &state->sequences[s];
+        int count = GetSequencePages(state, s, pages);
+        PutU32(record, PutName(names, &nameOffset, sequence->name));
+        PutU32(record + 4, PutName(names, &nameOffset, sequence->exportPath));
+        PutU32(record + 8, count);
+        for (int i = 0; i < 6; i++) {
+            const char* field = s == state->activeSequence || !sequence->layout[0][0] ? GetLayoutField((State*)state, i) : sequence->layout[i];
+            strncpy((char*)record + 16 + i * 8, field, 7);
+        }
+        for (int i = 0; i < count; i++, page += PROJECT_PAGE_SIZE) {
+            if (!pages[i]) {
+                PutU32(page + 12, PROJECT_PAGE_BLANK);
+                continue;
+            }
+            const char* name = GetFileName(pages[i]->path);
+            PutU64(page, HashName(name));
+            PutU32(page + 8, PutName(names, &nameOffset, name));
+            if (s == state->activeSequence) {
+                PutPageLayout(page + 16, &pages[i]->layout);
+            } else if (sequence->pageLayouts) {
+                PutPageLayout(page + 16, &sequence->pageLayouts[i]);
             }
         }
+    }
+    PutU32(data + 32, nameOffset);
+    free(pages);
+    *outLen = len;
+    return data;
+}
 
-        for (int i = 0; i < selectedCount; ++i) {
-            fprintf(f, "%s\n", GetFileName(sortedSelection[i]->path));
+// Flushes the directory holding path, so a rename into it is on disk too
+static bool SyncParentDir(const char* path) {
+    char dir[MAX_PATH_LEN];
+    const char* slash = strrchr(path, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    } else {
+        strcpy(dir, ".");
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+// Writes to a temporary file beside path and renames it into place, so a
+// crash or power cut part way through leaves the previous file intact
+static bool WriteFileAtomic(const char* path, const uint8_t* data, size_t len) {
+    char tempPath[MAX_PATH_LEN + 8];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    FILE* f = fopen(tempPath, "wb");
+    if (!f) return false;
+    bool ok = fwrite(data, 1, len, f) == len && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (ok && rename(tempPath, path) == 0) return SyncParentDir(path);
+    remove(tempPath);
+    return false;
+}
+
+void GetProjectPath(const char* folder, char* outPath) {
+    snprintf(outPath, MAX_PATH_LEN, "%s/%s", folder, PROJECT_FILE_NAME);
+}
+
+// Autosave. The main thread encodes a snapshot, which is cheap, and hands
+// it to the writer thread; a newer snapshot for the same file replaces one
+// still waiting, so however often things change there's one write in hand.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t writer;
+    bool running;
+    bool stopping;
+    bool writing;
+    uint8_t* pending;
+    size_t pendingLen;
+    char pendingPath[MAX_PATH_LEN];
+} autosave = { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER };
+
+// Main thread only: what's been changed since the last snapshot
+static int64_t firstChange = -1, lastChange = -1;
+static char savedLayout[6][8];
+
+static void* AutosaveWriter(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&autosave.lock);
+    for (;;) {
+        while (!autosave.pending && !autosave.stopping) pthread_cond_wait(&autosave.changed, &autosave.lock);
+        if (!autosave.pending) break;
+
+        char path[MAX_PATH_LEN];
+        uint8_t* data = autosave.pending;
+        size_t len = autosave.pendingLen;
+        strcpy(path, autosave.pendingPath);
+        autosave.pending = NULL;
+        autosave.writing = true;
+        pthread_mutex_unlock(&autosave.lock);
+
+        if (!WriteFileAtomic(path, data, len)) TraceLog(LOG_WARNING, "SETTINGS: Unable to save %s", path);
+        free(data);
+
+        pthread_mutex_lock(&autosave.lock);
+        autosave.writing = false;
+        pthread_cond_broadcast(&autosave.changed);
+    }
+    pthread_mutex_unlock(&autosave.lock);
+    return NULL;
+}
+
+static void RememberLayout(const State* state) {
+    for (int i = 0; i < 6; i++) memcpy(savedLayout[i], GetLayoutField((State*)state, i), 8);
+}
+
+static bool LayoutChanged(const State* state) {
+    for (int i = 0; i < 6; i++) {
+        if (strcmp(savedLayout[i], GetLayoutField((State*)state, i)) != 0) return true;
+    }
+    return false;
+}
+
+void SaveSettings(const State* state) {
+    char projectPath[MAX_PATH_LEN];
+    size_t len;
+    GetProjectPath(state->folder, projectPath);
+    firstChange = lastChange = -1;
+    RememberLayout(state);
+    uint8_t* data = EncodeProject(state, &len);
+    if (!data || !WriteFileAtomic(projectPath, data, len)) {
+        TraceLog(LOG_WARNING, "SETTINGS: Unable to save %s", projectPath);
+    }
+    free(data);
+}
+
+// Snapshots the settings and queues them for the writer, or saves them
+// here if there isn't one. Only the main thread starts and stops the
+// writer, so running can't change under it.
+static void QueueSave(const State* state) {
+    pthread_mutex_lock(&autosave.lock);
+    bool running = autosave.running;
+    pthread_mutex_unlock(&autosave.lock);
+    if (!running) {
+        SaveSettings(state);
+        return;
+    }
+
+    char projectPath[MAX_PATH_LEN];
+    size_t len;
+    GetProjectPath(state->folder, projectPath);
+    firstChange = lastChange = -1;
+    RememberLayout(state);
+    uint8_t* data = EncodeProject(state, &len);
+    if (!data) {
+        TraceLog(LOG_WARNING, "SETTINGS: Unable to save %s", projectPath);
+        return;
+    }
+
+    pthread_mutex_lock(&autosave.lock);
+    // A snapshot of another folder's file can't be dropped, so let it go first
+    while (autosave.pending && strcmp(autosave.pendingPath, projectPath) != 0) {
+        pthread_cond_wait(&autosave.changed, &autosave.lock);
+    }
+    free(autosave.pending);
+    autosave.pending = data;
+    autosave.pendingLen = len;
+    strcpy(autosave.pendingPath, projectPath);
+    pthread_cond_broadcast(&autosave.changed);
+    pthread_mutex_unlock(&autosave.lock);
+}
+
+void StartAutosave(const State* state) {
+    RememberLayout(state);
+    pthread_mutex_lock(&autosave.lock);
+    autosave.stopping = false;
+    autosave.running = pthread_create(&autosave.writer, NULL, AutosaveWriter, NULL) == 0;
+    pthread_mutex_unlock(&autosave.lock);
+}
+
+void MarkSettingsChanged(void) {
+    lastChange = PerfNow();
+    if (firstChange < 0) firstChange = lastChange;
+}
+
+void UpdateAutosave(const State* state) {
+    if (firstChange < 0 && LayoutChanged(state)) MarkSettingsChanged();
+    if (firstChange < 0) return;
+    int64_t now = PerfNow();
+    if (now - lastChange >= AUTOSAVE_QUIET_US || now - firstChange >= AUTOSAVE_LIMIT_US) QueueSave(state);
+}
+
+void FlushAutosave(const State* state) {
+    if (firstChange >= 0 || LayoutChanged(state)) QueueSave(state);
+}
+
+// The writer finishes what it was given before it exits; anything newer is
+// then saved here, after it, so the latest state is what ends up on disk
+void StopAutosave(const State* state) {
+    pthread_mutex_lock(&autosave.lock);
+    bool running = autosave.running;
+    autosave.stopping = true;
+    autosave.running = false;
+    pthread_cond_broadcast(&autosave.changed);
+    pthread_mutex_unlock(&autosave.lock);
+    if (running) pthread_join(autosave.writer, NULL);
+    FlushAutosave(state);
+}
+
+// Where one sequence's parts are in a project file
+typedef struct {
+    const char* name;
+    const char* exportPath;
+    const uint8_t* layout;
+    const uint8_t* pages;
+    uint32_t pageCount;
+} SequenceView;
+
+// Finds the sequences in a project file, checking every size and offset
+// against len. Returns how many there are, or -1 if the file is damaged.
+static int ReadSequenceViews(const uint8_t* data, size_t len, SequenceView* views, const char** outNames, uint32_t* pageSize, uint32_t* active) {
+    if (len < PROJECT_HEADER_SIZE || memcmp(data, PROJECT_MAGIC, 8) != 0) return -1;
+    uint32_t version = GetU32(data + 8);
+    uint32_t headerSize = GetU32(data + 12);
+    uint32_t sequenceSize = PROJECT_SEQUENCE_SIZE, sequenceCount = 1, namesSize;
+    size_t pageTotal = 0;
+    const uint8_t* records = NULL;
+    *active = 0;
+
+    if (version == 1) {
+        *pageSize = GetU32(data + 16);
+        pageTotal = GetU32(data + 20);
+        namesSize = GetU32(data + 24);
+        if (headerSize < PROJECT_V1_HEADER_SIZE || headerSize > len) return -1;
+        views[0] = (SequenceView){ "Main", "", data + PROJECT_V1_LAYOUT_OFFSET, data + headerSize, pageTotal };
+    } else if (version == PROJECT_VERSION) {
+        sequenceSize = GetU32(data + 16);
+        *pageSize = GetU32(data + 20);
+        sequenceCount = GetU32(data + 24);
+        *active = GetU32(data + 28);
+        namesSize = GetU32(data + 32);
+        if (headerSize < PROJECT_HEADER_SIZE || sequenceSize < PROJECT_SEQUENCE_SIZE || headerSize > len) return -1;
+        if (sequenceCount < 1 || sequenceCount > MAX_SEQUENCES || sequenceCount > (len - headerSize) / sequenceSize) return -1;
+        records = data + headerSize;
+        for (uint32_t s = 0; s < sequenceCount; s++) pageTotal += GetU32(records + (size_t)s * sequenceSize + 8);
+    } else {
+        return -1;
+    }
+    if (*pageSize < PROJECT_PAGE_MIN_SIZE || *active >= sequenceCount) return -1;
+
+    size_t pagesStart = headerSize + (size_t)sequenceCount * (records ? sequenceSize : 0);
+    if (pageTotal > (len - pagesStart) / *pageSize || namesSize != len - pagesStart - pageTotal * *pageSize) return -1;
+    const char* names = (const char*)data + pagesStart + pageTotal * *pageSize;
+    if ((records && namesSize == 0) || (namesSize > 0 && names[namesSize - 1] != 0)) return -1;
+    *outNames = names;
+
+    const uint8_t* pages = data + pagesStart;
+    for (uint32_t s = 0; s < sequenceCount; s++) {
+        if (records) {
+            const uint8_t* record = records + (size_t)s * sequenceSize;
+            if (GetU32(record) >= namesSize || GetU32(record + 4) >= namesSize) return -1;
+            views[s] = (SequenceView){ names + GetU32(record), names + GetU32(record + 4), record + 16, pages, GetU32(record + 8) };
+        }
+        for (int i = 0; i < 6; i++) {
+            if (memchr(views[s].layout + i * 8, 0, 8) == NULL) return -1;
+        }
+        for (uint32_t i = 0; i < views[s].pageCount; i++) {
+            const uint8_t* page = pages + (size_t)i * *pageSize;
+            if (!(GetU32(page + 12) & PROJECT_PAGE_BLANK) && GetU32(page + 8) >= namesSize) return -1;
         }
-        fclose(f);
+        pages += (size_t)views[s].pageCount * *pageSize;
     }
+    return sequenceCount;
 }
 
-void LoadSettings(State* state) {
-    char settingsPath[MAX_PATH_LEN];
-    snprintf(settingsPath, MAX_PATH_LEN, "%s/.rayview_settings", state->folder);
-    FILE* f = fopen(settingsPath, "r");
-    if (f) {
-        if (fscanf(f, "%s\n%s\n%s\n%s\n%s\n%s\n", state->bufCanvasW, state->bufCanvasH, state->bufMarginT, state->bufMarginB, state->bufMarginL, state->bufMarginR) != 6) {
-            // Handle error or incomplete file
+// Applies a project read into data. A damaged file changes nothing.
+static bool DecodeProject(State* state, const uint8_t* data, size_t len) {
+    SequenceView views[MAX_SEQUENCES];
+    const char* names;
+    uint32_t pageSize, active;
+    int sequenceCount = ReadSequenceViews(data, len, views, &names, &pageSize, &active);
+    NameIndex index;
+    if (sequenceCount < 0 || !BuildNameIndex(state, &index)) return false;
+
+    FreeSequences(state);
+    memset(state->sequences, 0, sizeof(state->sequences));
+    for (int s = 0; s < sequenceCount; s++) {
+        Sequence* sequence = &state->sequences[s];
+        strncpy(sequence->name, views[s].name, MAX_SEQUENCE_NAME - 1);
+        strncpy(sequence->exportPath, views[s].exportPath, MAX_PATH_LEN - 1);
+        for (int i = 0; i < 6; i++) strcpy(sequence->layout[i], (const char*)views[s].layout + i * 8);
+        sequence->pages = malloc((views[s].pageCount + 1) * sizeof(int));
+        sequence->pageLayouts = calloc(views[s].pageCount + 1, sizeof(PageLayout));
+        if (!sequence->pages || !sequence->pageLayouts) {
+            free(sequence->pages);
+            free(sequence->pageLayouts);
+            sequence->pages = NULL;
+            sequence->pageLayouts = NULL;
+            continue; // Left empty
         }
-        
-        char line[MAX_FILENAME_LEN];
-        int order = 1;
-        while (fgets(line, sizeof(line), f)) {
-            line[strcspn(line, "\n")] = 0; // Remove newline
-            if (strcmp(line, "[BLANK_PAGE]") == 0) {
-                if (state->imageCount < MAX_IMAGES) {
-                    ImageEntry* blank = &state->images[state->imageCount++];
-                    strncpy(blank->path, "[BLANK_PAGE]", MAX_PATH_LEN - 1);
-                    blank->selected = true;
-                    blank->selectionOrder = order++;
-                    blank->loaded = true; // Mark as loaded to avoid processing
-                }
-            } else {
-                for (int i = 0; i < state->imageCount; ++i) {
-                    if (strcmp(GetFileName(state->images[i].path), line) == 0) {
-                        state->images[i].selected = true;
-                        state->images[i].selectionOrder = order++;
-                        break;
-                    }
-                }
+
+        // Pages whose image has gone are dropped
+        for (uint32_t i = 0; i < views[s].pageCount; i++) {
+            const uint8_t* page = views[s].pages + (size_t)i * pageSize;
+            int image = -1;
+            if (!(GetU32(page + 12) & PROJECT_PAGE_BLANK)) {
+                image = FindName(state, &index, GetU64(page), names + GetU32(page + 8));
+                if (image < 0) continue;
             }
+            if (pageSize >= PROJECT_PAGE_SIZE) sequence->pageLayouts[sequence->pageCount] = GetPageLayout(page + 16);
+            sequence->pages[sequence->pageCount++] = image;
+        }
+    }
+    state->sequenceCount = sequenceCount;
+    state->activeSequence = active;
+    FreeNameIndex(&index);
+    ApplySequence(state, active);
+    return true;
+}
+
+// Selects pages in the order they're listed, one file name per line
+static void ReadSelection(State* state, FILE* f) {
+    char line[MAX_FILENAME_LEN];
+    int order = 1;
+    NameIndex index;
+    bool indexed = BuildNameIndex(state, &index);
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0; // Remove newline
+        if (line[0] == 0) continue;
+        if (indexed) {
+            SelectIndexedPage(state, &index, line, order++);
+        } else {
+            SelectPage(state, line, order++);
         }
-        fclose(f);
     }
+    if (indexed) FreeNameIndex(&index);
+    ClearJournal(); // Its page order is stale
+}
+
+// Reads the whole file with a single read
+static uint8_t* ReadWholeFile(FILE* f, size_t* outLen) {
+    if (fseek(f, 0, SEEK_END) != 0) return NULL;
+    long size = ftell(f);
+    if (size < 0 || fseek(f, 0, SEEK_SET) != 0) return NULL;
+    uint8_t* data = malloc(size > 0 ? size : 1);
+    if (data && fread(data, 1, size, f) != (size_t)size) {
+        free(data);
+        return NULL;
+    }
+    *outLen = size;
+    return data;
+}
+
+bool LoadSettingsFile(State* state, const char* settingsPath) {
+    FILE* f = fopen(settingsPath, "rb");
+    if (!f) return false;
+
+    char magic[8];
+    bool ok = true;
+    if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, PROJECT_MAGIC, 8) == 0) {
+        size_t len;
+        uint8_t* data = ReadWholeFile(f, &len);
+        ok = data && DecodeProject(state, data, len);
+        if (!ok) TraceLog(LOG_WARNING, "SETTINGS: %s is damaged or from a newer version", settingsPath);
+        free(data);
+    } else {
+        // An older text settings file
+        rewind(f);
+        if (fscanf(f, "%7s\n%7s\n%7s\n%7s\n%7s\n%7s\n", state->bufCanvasW, state->bufCanvasH, state->bufMarginT, state->bufMarginB, state->bufMarginL, state->bufMarginR) != 6) {
+            // Handle error or incomplete file
+        }
+        ReadSelection(state, f);
+    }
+    fclose(f);
+    return ok;
+}
+
+bool LoadPageList(State* state, const char* listPath) {
+    FILE* f = fopen(listPath, "r");
+    if (!f) return false;
+    ReadSelection(state, f);
+    fclose(f);
+    return true;
+}
+
+// Falls back to the text file earlier versions kept, which is left alone;
+// the next save writes the project file beside it
+void LoadSettings(State* state) {
+    char settingsPath[MAX_PATH_LEN];
+    GetProjectPath(state->folder, settingsPath);
+    if (!FileExists(settingsPath)) snprintf(settingsPath, MAX_PATH_LEN, "%s/%s", state->folder, LEGACY_SETTINGS_NAME);
+    LoadSettingsFile(state, settingsPath);
+
+    // What was just read needs no saving
+    firstChange = lastChange = -1;
+    RememberLayout(state);
 }
@@ -3,7 +3,30 @@
 
 #include "state.h"
 
+// Canvas, margins and page order for a folder, see settings.c
+#define PROJECT_FILE_NAME ".rayview_project"
+
+void GetProjectPath(const char* folder, char* outPath);
+// Replaces the folder's project file atomically, here and now. Autosave
+// writes through it once its writer thread has stopped.
 void SaveSettings(const State* state);
 void LoadSettings(State* state);
+// Reads a project file, or the .rayview_settings text file it replaced
+bool LoadSettingsFile(State* state, const char* settingsPath);
+// Autosave of the project file, off the render thread. Changes are written
+// a second after they stop, or at most five seconds after the first, each
+// write taking the latest state. Edits to the layout boxes are noticed by
+// themselves; selection and order changes must be marked.
+void StartAutosave(const State* state);
+void MarkSettingsChanged(void);
+// Called each frame; queues a snapshot once it's due
+void UpdateAutosave(const State* state);
+// Queues any unsaved changes now, without waiting for them to be written
+void FlushAutosave(const State* state);
+// Flushes, waits for the last write and stops the writer thread
+void StopAutosave(const State* state);
+
+bool LoadPageList(State* state, const char* listPath);
+void SelectPage(State* state, const char* name, int order);
 
 #endif // SETTINGS_H
@@ -1,11 +1,14 @@
 #include "state.h"
 #include "settings.h"
+#include "journal.h"
+#include "perf.h"
 #include "tinyfiledialogs.h"
 #include <dirent.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <stdlib.h>
+#include <math.h>
 
 bool HasImageExtension(const char *filename) {
     const char *ext = strrchr(filename, '.');
@@ -29,7 +32,127 @@ void GetThumbPath(const char *folder, const char *filename, char *outPath) {
     snprintf(outPath, MAX_PATH_LEN, "%s/%s__thumb.png", thumbDir, filename);
 }
 
+// A thumbnail stays valid while it's at least as new as its image
+static bool IsThumbnailCurrent(const char *thumbPath, const char *imagePath) {
+    return FileExists(thumbPath) && GetFileModTime(thumbPath) >= GetFileModTime(imagePath);
+}
+
+// Counts the cache lookup for the overlay and the performance log
+static bool CheckThumbnail(const char *folder, const char *thumbPath, const char *imagePath) {
+    PerfCounter result = PERF_THUMB_HIT;
+    if (!IsThumbnailCurrent(thumbPath, imagePath)) result = FileExists(thumbPath) ? PERF_THUMB_REGENERATE : PERF_THUMB_MISS;
+    PerfCount(result);
+    PerfLogThumbnail(folder, result);
+    return result == PERF_THUMB_HIT;
+}
+
+// LoadImage, timed for the overlay and the performance log
+Image DecodeImage(const char *path) {
+    PerfZone zone = PerfBegin(PERF_DECODE);
+    int64_t start = PerfNow();
+    Image image = LoadImage(path);
+    PerfEnd(zone, GetFileName(path));
+    if (image.data) PerfLogDecode(path, image.width, image.height, PerfNow() - start);
+    return image;
+}
+
+// Writes the thumbnail under a name of its own and renames it into place, so
+// that nobody loads half a thumbnail and two writers of the same one (the
+// gallery and an export, or two processes) can't interleave their bytes.
+// It's only a cache, so unlike the settings it isn't synced to disk.
+static bool WriteThumbnail(Image thumb, const char *thumbPath) {
+    int size = 0;
+    unsigned char *data = ExportImageToMemory(thumb, ".png", &size);
+    if (!data) return false;
+
+    char tempPath[MAX_PATH_LEN + 8];
+    snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", thumbPath);
+    int fd = mkstemp(tempPath);
+    if (fd < 0) {
+        MemFree(data);
+        return false;
+    }
+    FILE *f = fdopen(fd, "wb");
+    bool ok = f && fchmod(fd, 0644) == 0 && fwrite(data, 1, size, f) == (size_t)size;
+    if (f) {
+        ok = fclose(f) == 0 && ok;
+    } else {
+        close(fd);
+    }
+    if (!ok || rename(tempPath, thumbPath) != 0) {
+        remove(tempPath);
+        ok = false;
+    }
+    MemFree(data);
+    return ok;
+}
+
+static Image MakeThumbnail(const char *imagePath, const char *thumbPath) {
+    Image full = DecodeImage(imagePath);
+    if (full.data) {
+        float aspect = (float)THUMB_SIZE / fmaxf(full.width, full.height);
+        ImageResize(&full, full.width * aspect, full.height * aspect);
+        PerfZone write = PerfBegin(PERF_THUMB_WRITE);
+        if (!WriteThumbnail(full, thumbPath)) TraceLog(LOG_WARNING, "THUMBS: Unable to write %s", thumbPath);
+        PerfEnd(write, NULL);
+    }
+    return full;
+}
+
+// Loads the thumbnail for imagePath, making it from the full image the first
+// time round or if the image has changed since. The returned image is empty
+// if the file couldn't be read.
+Image LoadThumbnail(const char *folder, const char *imagePath) {
+    char thumbPath[MAX_PATH_LEN];
+    PerfZone zone = PerfBegin(PERF_THUMB_LOAD);
+    GetThumbPath(folder, GetFileName(imagePath), thumbPath);
+
+    Image thumb;
+    if (CheckThumbnail(folder, thumbPath, imagePath)) {
+        thumb = LoadImage(thumbPath);
+        // Unreadable (say cut short by a crash before it reached the disk)
+        if (!thumb.data) thumb = MakeThumbnail(imagePath, thumbPath);
+    } else {
+        thumb = MakeThumbnail(imagePath, thumbPath);
+    }
+    PerfEnd(zone, GetFileName(imagePath));
+    return thumb;
+}
+
+// Brings the thumbnail for imagePath up to date without loading it
+ThumbResult RefreshThumbnail(const char *folder, const char *imagePath) {
+    char thumbPath[MAX_PATH_LEN];
+    GetThumbPath(folder, GetFileName(imagePath), thumbPath);
+
+    if (CheckThumbnail(folder, thumbPath, imagePath)) return THUMB_CURRENT;
+    Image thumb = MakeThumbnail(imagePath, thumbPath);
+    if (!thumb.data) return THUMB_FAILED;
+    UnloadImage(thumb);
+    return IsThumbnailCurrent(thumbPath, imagePath) ? THUMB_BUILT : THUMB_FAILED;
+}
+
+void FreeSequences(State* state) {
+    for (int i = 0; i < state->sequenceCount; i++) {
+        free(state->sequences[i].pages);
+        free(state->sequences[i].pageLayouts);
+        state->sequences[i].pages = NULL;
+        state->sequences[i].pageLayouts = NULL;
+    }
+}
+
+// Drops every sequence but an empty "Main", and the undo history, for a
+// newly loaded folder
+static void ResetSequences(State* state) {
+    FreeSequences(state);
+    ClearJournal(); // Its edits name the old folder's images
+    memset(state->sequences, 0, sizeof(state->sequences));
+    strcpy(state->sequences[0].name, "Main");
+    state->sequenceCount = 1;
+    state->activeSequence = 0;
+}
+
 void LoadFolder(State* state, const char* folderPath) {
+    int64_t start = PerfNow();
     DIR* dir = opendir(folderPath);
     if (!dir) return;
 
@@ -45,13 +168,17 @@ void LoadFolder(State* state, const char* folderPath) {
         state->images[state->imageCount].fullTextureLoaded = false;
         state->images[state->imageCount].selected = false;
         state->images[state->imageCount].selectionOrder = -1;
+        state->images[state->imageCount].layout = (PageLayout){ 0 };
         state->imageCount++;
     }
 
     closedir(dir);
+    ResetSequences(state);
+    PerfLogScan(folderPath, state->imageCount, PerfNow() - start);
 }
 
 void PreloadNeighbors(State* state) {
+    PerfZone zone = PerfBegin(PERF_PRELOAD);
     state->prevIndex = (state->fullViewIndex - 1 + state->imageCount) % state->imageCount;
     state->nextIndex = (state->fullViewIndex + 1) % state->imageCount;
 
@@ -59,18 +186,156 @@ void PreloadNeighbors(State* state) {
     for (int i = 0; i < 2; ++i) {
         int idx = indices[i];
         if (!state->images[idx].fullLoaded) {
-            Image img = LoadImage(state->images[idx].path);
+            PerfCount(PERF_PRELOAD_MISS);
+            Image img = DecodeImage(state->images[idx].path);
             if (img.data != NULL) {
                 state->images[idx].fullImage = img;
                 state->images[idx].fullLoaded = true;
+                PerfZone upload = PerfBegin(PERF_UPLOAD);
                 state->images[idx].fullTexture = LoadTextureFromImage(img);
+                PerfEnd(upload, NULL);
                 state->images[idx].fullTextureLoaded = true;
             }
+        } else {
+            PerfCount(PERF_PRELOAD_HIT);
         }
     }
+    PerfEnd(zone, NULL);
 }
 
-void InitializeState(State* state) {
+static int CompareSelectionOrder(const void* a, const void* b) {
+    const ImageEntry* ea = *(ImageEntry* const*)a;
+    const ImageEntry* eb = *(ImageEntry* const*)b;
+    return ea->selectionOrder - eb->selectionOrder;
+}
+
+int GetSelection(const State* state, ImageEntry** pages) {
+    int count = 0;
+    for (int i = 0; i < state->imageCount; i++) {
+        if (state->images[i].selected) pages[count++] = (ImageEntry*)&state->images[i];
+    }
+    qsort(pages, count, sizeof(*pages), CompareSelectionOrder);
+    return count;
+}
+
+char* GetLayoutField(State* state, int i) {
+    char* fields[] = { state->bufCanvasW, state->bufCanvasH, state->bufMarginT, state->bufMarginB, state->bufMarginL, state->bufMarginR };
+    return fields[i];
+}
+
+void AddBlankPage(State* state, int order) {
+    if (state->imageCount < MAX_IMAGES) {
+        ImageEntry* blank = &state->images[state->imageCount++];
+        memset(blank, 0, sizeof(*blank));
+        strncpy(blank->path, "[BLANK_PAGE]", MAX_PATH_LEN - 1);
+        blank->selected = true;
+        blank->selectionOrder = order;
+        blank->loaded = true; // Mark as loaded to avoid processing
+    }
+}
+
+void StoreSequence(State* state) {
+    Sequence* seq = &state->sequences[state->activeSequence];
+    ImageEntry** pages = malloc((state->imageCount + 1) * sizeof(ImageEntry*));
+    int* indexes = malloc((state->imageCount + 1) * sizeof(int));
+    PageLayout* layouts = malloc((state->imageCount + 1) * sizeof(PageLayout));
+    if (!pages || !indexes || !layouts) {
+        free(pages);
+        free(indexes);
+        free(layouts);
+        return; // Keeps what it had
+    }
+
+    seq->pageCount = GetSelection(state, pages);
+    for (int i = 0; i < seq->pageCount; i++) {
+        indexes[i] = strcmp(pages[i]->path, "[BLANK_PAGE]") == 0 ? -1 : (int)(pages[i] - state->images);
+        layouts[i] = pages[i]->layout;
+    }
+    free(pages);
+    free(seq->pages);
+    free(seq->pageLayouts);
+    seq->pages = indexes;
+    seq->pageLayouts = layouts;
+    for (int i = 0; i < 6; i++) memcpy(seq->layout[i], GetLayoutField(state, i), 8);
+}
+
+void ApplySequence(State* state, int index) {
+    // Blank pages are only ever added after the folder's images
+    while (state->imageCount > 0 && strcmp(state->images[state->imageCount - 1].path, "[BLANK_PAGE]") == 0) {
+        state->imageCount--;
+    }
+    for (int i = 0; i < state->imageCount; i++) {
+        state->images[i].selected = false;
+        state->images[i].selectionOrder = -1;
+        state->images[i].layout = (PageLayout){ 0 };
+    }
+
+    const Sequence* seq = &state->sequences[index];
+    int folderCount = state->imageCount;
+    for (int i = 0; i < seq->pageCount; i++) {
+        int image = seq->pages[i];
+        if (image < 0) {
+            AddBlankPage(state, i + 1);
+        } else if (image < folderCount) {
+            state->images[image].selected = true;
+            state->images[image].selectionOrder = i + 1;
+            if (seq->pageLayouts) state->images[image].layout = seq->pageLayouts[i];
+        }
+    }
+    if (seq->layout[0][0]) {
+        for (int i = 0; i < 6; i++) memcpy(GetLayoutField(state, i), seq->layout[i], 8);
+    }
+    state->activeSequence = index;
+    ClearJournal();
+}
+
+void SwitchSequence(State* state, int index) {
+    if (index == state->activeSequence || index < 0 || index >= state->sequenceCount) return;
+    StoreSequence(state);
+    ApplySequence(state, index);
+}
+
+int AddSequence(State* state, const char* name, bool copyActive) {
+    if (state->sequenceCount >= MAX_SEQUENCES) return -1;
+    StoreSequence(state);
+    const Sequence* active = &state->sequences[state->activeSequence];
+    Sequence* seq = &state->sequences[state->sequenceCount];
+    memset(seq, 0, sizeof(*seq));
+    strncpy(seq->name, name, MAX_SEQUENCE_NAME - 1);
+    memcpy(seq->layout, active->layout, sizeof(seq->layout));
+    if (copyActive && active->pageCount > 0) {
+        seq->pages = malloc(active->pageCount * sizeof(int));
+        seq->pageLayouts = malloc(active->pageCount * sizeof(PageLayout));
+        if (seq->pages && seq->pageLayouts) {
+            memcpy(seq->pages, active->pages, active->pageCount * sizeof(int));
+            memcpy(seq->pageLayouts, active->pageLayouts, active->pageCount * sizeof(PageLayout));
+            seq->pageCount = active->pageCount;
+        }
+    }
+    int index = state->sequenceCount++;
+    ApplySequence(state, index);
+    return index;
+}
+
+void DeleteSequence(State* state, int index) {
+    if (state->sequenceCount <= 1 || index < 0 || index >= state->sequenceCount) return;
+    if (index == state->activeSequence) ApplySequence(state, index > 0 ? index - 1 : 1);
+    free(state->sequences[index].pages);
+    free(state->sequences[index].pageLayouts);
+    memmove(&state->sequences[index], &state->sequences[index + 1], (state->sequenceCount - index - 1) * sizeof(Sequence));
+    state->sequenceCount--;
+    if (state->activeSequence > index) state->activeSequence--;
+}
+
+int FindSequence(const State* state, const char* name) {
+    for (int i = 0; i < state->sequenceCount; i++) {
+        if (strcmp(state->sequences[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+// Everything but the folder: default canvas, nothing selected
+void InitializeDefaults(State* state) {
     state->imageCount = 0;
     state->scrollY = 0;
     state->currentState = STATE_GALLERY;
@@ -84,7 +349,17 @@ void InitializeState(State* state) {
     strcpy(state->bufMarginL, "1.0");
     strcpy(state->bufMarginR, "1.0");
     state->activeBox = TEXTBOX_NONE;
-    state->selectedFileCount = 0;
+    memset(state->sequences, 0, sizeof(state->sequences));
+    strcpy(state->sequences[0].name, "Main");
+    state->sequenceCount = 1;
+    state->activeSequence = 0;
+    state->sheetLayout = 0;
+    state->exportSaveFlags = PDF_SAVE_OBJECT_STREAMS;
+    state->font = (Font){ 0 };
+}
+
+void InitializeState(State* state) {
+    InitializeDefaults(state);
 
     const char* initialFolder = tinyfd_selectFolderDialog("Select a folder of images", ".");
     if (!initialFolder || strlen(initialFolder) == 0) {
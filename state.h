@@ -8,7 +8,24 @@
 #define MAX_IMAGES 4096
 #define MAX_PATH_LEN 512
 #define MAX_FILENAME_LEN 256
-#define MAX_SELECTED_FILES 512
+#define THUMB_SIZE 128
+#define MAX_SEQUENCES 16
+#define MAX_SEQUENCE_NAME 32
+
+typedef enum {
+    PAGE_FIT,  // The whole image, letterboxed inside the margins
+    PAGE_FILL  // Cropped to the middle to fill them
+} PageFit;
+
+// A page's own layout on top of its sequence's canvas and margins. All
+// zeros is the default: fitted, unrotated, uncropped, the sequence's margins.
+typedef struct {
+    unsigned char fit;      // PageFit
+    unsigned char rotation; // Quarter turns clockwise
+    bool ownMargins;
+    float margins[4];       // T B L R in inches, used if ownMargins
+    Rectangle crop;         // Part of the image used, as fractions of its size; zero width for all of it
+} PageLayout;
 
 typedef struct {
     char path[MAX_PATH_LEN];
@@ -20,8 +37,28 @@ typedef struct {
     bool fullTextureLoaded;
     bool selected;
     int selectionOrder;
+    PageLayout layout;
 } ImageEntry;
 
+// A named page order with its own canvas and margins. The active one lives
+// in the images' selection and the layout buffers, where everything works
+// on it; this keeps the others, and is only brought up to date for the
+// active one by StoreSequence.
+typedef struct {
+    char name[MAX_SEQUENCE_NAME];
+    char layout[6][8];             // Canvas W H, margins T B L R
+    int* pages;                    // Image indexes in page order, -1 for a blank page
+    PageLayout* pageLayouts;       // Each page's layout, alongside pages
+    int pageCount;
+    char exportPath[MAX_PATH_LEN]; // The PDF last made from it, "" if none
+} Sequence;
+
+typedef enum {
+    THUMB_CURRENT,
+    THUMB_BUILT,
+    THUMB_FAILED
+} ThumbResult;
+
 typedef enum {
     STATE_GALLERY,
     STATE_FULL_VIEW,
@@ -35,7 +72,12 @@ typedef enum {
     TEXTBOX_MARGIN_T,
     TEXTBOX_MARGIN_B,
     TEXTBOX_MARGIN_L,
-    TEXTBOX_MARGIN_R
+    TEXTBOX_MARGIN_R,
+    TEXTBOX_SEQUENCE_NAME,
+    TEXTBOX_PAGE_MARGIN_T,
+    TEXTBOX_PAGE_MARGIN_B,
+    TEXTBOX_PAGE_MARGIN_L,
+    TEXTBOX_PAGE_MARGIN_R
 } ActiveTextBox;
 
 typedef struct {
@@ -54,15 +96,47 @@ typedef struct {
     char bufMarginL[8];
     char bufMarginR[8];
     ActiveTextBox activeBox;
-    char selectedFiles[MAX_SELECTED_FILES][MAX_FILENAME_LEN];
-    int selectedFileCount;
+    Sequence sequences[MAX_SEQUENCES];
+    int sequenceCount;
+    int activeSequence;
+    int sheetLayout; // Index into SHEET_LAYOUTS (export.h), 0 = one per page
+    int exportSaveFlags; // PDF_SAVE_xxx layout for exported PDFs
     Font font;
 } State;
 
 void LoadFolder(State* state, const char* folderPath);
 void PreloadNeighbors(State* state);
+void InitializeDefaults(State* state);
 void InitializeState(State* state);
 bool FileExists(const char *path);
+void EnsureDirectoryExists(const char *path);
 void GetThumbPath(const char *folder, const char *filename, char *outPath);
+// Fills pages, which must have room for imageCount entries, with the
+// selected images in page order and returns how many there are
+int GetSelection(const State* state, ImageEntry** pages);
+// The layout buffers, canvas W H then margins T B L R, by number
+char* GetLayoutField(State* state, int i);
+void AddBlankPage(State* state, int order);
+
+// Sequences. Loading a folder leaves it with one, empty, called "Main".
+// Copies the active sequence's pages, their layouts and the canvas into its
+// Sequence
+void StoreSequence(State* state);
+// Makes sequence index active, replacing the selection and layout without
+// storing them first
+void ApplySequence(State* state, int index);
+// Stores the active sequence, then applies index
+void SwitchSequence(State* state, int index);
+// Adds a sequence, empty or a copy of the active one, and switches to it.
+// Returns its index, or -1 if there are already MAX_SEQUENCES.
+int AddSequence(State* state, const char* name, bool copyActive);
+// Removes a sequence, unless it's the last
+void DeleteSequence(State* state, int index);
+int FindSequence(const State* state, const char* name);
+// Frees the sequences' page lists, before the State itself goes
+void FreeSequences(State* state);
+Image DecodeImage(const char *path);
+Image LoadThumbnail(const char *folder, const char *imagePath);
+ThumbResult RefreshThumbnail(const char *folder, const char *imagePath);
 
 #endif // STATE_H
@@ -5,18 +5,61 @@
 #include "raygui.h"
 
 #include "tinyfiledialogs.h"
-#include "pdfgen.h"
 #include "state.h"
 #include "settings.h"
+#include "journal.h"
+#include "layout.h"
+#include "export.h"
+#include "perf.h"
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
 
 extern bool FileExists(const char *path);
-extern void GetThumbPath(const char *folder, const char *filename, char *outPath);
+
+// The Reorder view works on its own copy of the page order, taken when the
+// view opens or the page order is edited anywhere else (see journal.c), so a
+// frame only touches the pages on screen. picked marks pages by position,
+// for moving several at once.
+static struct {
+    ImageEntry* pages[MAX_IMAGES];
+    bool picked[MAX_IMAGES];
+    int count;
+    bool valid;
+    int version;     // Journal version the copy was taken at
+    float scrollY;
+    int anchor;      // Last page clicked, where a shift-click range starts
+    int pressed;     // Page the mouse went down on, -1 if none
+    Vector2 pressPos;
+    bool dragging;
+    int dragCount;   // Pages being dragged
+} reorder;
+
+// The full view's per page controls: the text of the page margin boxes, for
+// the page it was taken from, and a crop being dragged out
+static struct {
+    int page;
+    char margins[4][8];
+    bool cropping;
+    Vector2 cropStart;
+} pageEdit = { .page = -1 };
+
+// Reads an entry's thumbnail and uploads it; it counts as loaded even if
+// the file couldn't be read, so it isn't tried again every frame
+static void LoadEntryThumbnail(State* state, ImageEntry* entry) {
+    Image thumb = LoadThumbnail(state->folder, entry->path);
+    if (thumb.data) {
+        PerfZone upload = PerfBegin(PERF_UPLOAD);
+        entry->texture = LoadTextureFromImage(thumb);
+        PerfEnd(upload, NULL);
+        UnloadImage(thumb);
+    }
+    entry->loaded = true;
+}
 
 void DrawGalleryView(State* state) {
+    PerfZone zone = PerfBegin(PERF_GALLERY);
     Rectangle titleBar = { 0, 0, (float)GetScreenWidth(), 50 };
     DrawRectangleRec(titleBar, RAYWHITE);
     DrawLine(0, (int)titleBar.height, GetScreenWidth(), (int)titleBar.height, LIGHTGRAY);
@@ -29,21 +72,12 @@ void DrawGalleryView(State* state) {
                 if (state->images[i].fullTextureLoaded) UnloadTexture(state->images[i].fullTexture);
                 if (state->images[i].fullLoaded) UnloadImage(state->images[i].fullImage);
             }
+            PerfLogFlush();
+            FlushAutosave(state);
             strncpy(state->folder, newFolder, MAX_PATH_LEN - 1);
             state->folder[MAX_PATH_LEN - 1] = '\0';
-            LoadSettings(state);
             LoadFolder(state, state->folder);
-            for (int i = 0; i < state->imageCount; ++i) {
-                state->images[i].selectionOrder = -1;
-                const char* filename = GetFileName(state->images[i].path);
-                for (int j = 0; j < state->selectedFileCount; ++j) {
-                    if (strcmp(filename, state->selectedFiles[j]) == 0) {
-                        state->images[i].selected = true;
-                        state->images[i].selectionOrder = j + 1;
-                        break;
-                    }
-                }
-            }
+            LoadSettings(state);
             state->scrollY = 0;
         }
     }
@@ -66,6 +100,7 @@ void DrawGalleryView(State* state) {
     if (selectedCount > 0) {
         if (GuiButton((Rectangle){ (float)GetScreenWidth() - 180, (titleBar.height - 30) / 2, 150, 30 }, "Reorder/Export")) {
             state->currentState = STATE_REORDER;
+            reorder.valid = false;
         }
     }
 
@@ -91,6 +126,7 @@ void DrawGalleryView(State* state) {
     if (state->scrollY < -maxScroll) state->scrollY = -maxScroll;
 
     bool loadedOne = false;
+    int thumbQueue = 0;
 
     for (int i = 0; i < state->imageCount; i++) {
         int x = startX + (i % cols) * (128 + 16);
@@ -99,25 +135,10 @@ void DrawGalleryView(State* state) {
         if (y + 128 < titleBar.height || y > GetScreenHeight()) continue;
 
         if (!state->images[i].loaded && !loadedOne) {
-            char thumbPath[MAX_PATH_LEN];
-            GetThumbPath(state->folder, GetFileName(state->images[i].path), thumbPath);
-            
-            if (FileExists(thumbPath)) {
-                Image thumb = LoadImage(thumbPath);
-                state->images[i].texture = LoadTextureFromImage(thumb);
-                UnloadImage(thumb);
-            } else {
-                Image full = LoadImage(state->images[i].path);
-                if (full.data) {
-                    float aspect = (float)128 / fmaxf(full.width, full.height);
-                    ImageResize(&full, full.width * aspect, full.height * aspect);
-                    ExportImage(full, thumbPath);
-                    state->images[i].texture = LoadTextureFromImage(full);
-                    UnloadImage(full);
-                }
-            }
-            state->images[i].loaded = true;
+            LoadEntryThumbnail(state, &state->images[i]);
             loadedOne = true;
+        } else if (!state->images[i].loaded) {
+            thumbQueue++; // Waiting its turn, one thumbnail is loaded per frame
         }
 
         if (state->images[i].loaded) {
@@ -142,28 +163,19 @@ void DrawGalleryView(State* state) {
                 Rectangle r = {(float)x, (float)y, (float)128, (float)128};
                 if (CheckCollisionPointRec(mouse, r)) {
                     if (IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL) || IsKeyDown(KEY_LEFT_SUPER) || IsKeyDown(KEY_RIGHT_SUPER)) {
-                        state->images[i].selected = !state->images[i].selected;
                         if (state->images[i].selected) {
-                            int maxOrder = 0;
-                            for (int j = 0; j < state->imageCount; ++j) {
-                                if (state->images[j].selectionOrder > maxOrder) maxOrder = state->images[j].selectionOrder;
-                            }
-                            state->images[i].selectionOrder = maxOrder + 1;
+                            JournalDeselect(state, i);
                         } else {
-                            int deselectedOrder = state->images[i].selectionOrder;
-                            state->images[i].selectionOrder = -1;
-                            for (int j = 0; j < state->imageCount; ++j) {
-                                if (state->images[j].selectionOrder > deselectedOrder) {
-                                    state->images[j].selectionOrder--;
-                                }
-                            }
+                            JournalSelect(state, i);
                         }
                     } else {
-                        Image img = LoadImage(state->images[i].path);
+                        Image img = DecodeImage(state->images[i].path);
                         if (img.data != NULL) {
                             state->images[i].fullImage = img;
                             state->images[i].fullLoaded = true;
+                            PerfZone upload = PerfBegin(PERF_UPLOAD);
                             state->images[i].fullTexture = LoadTextureFromImage(img);
+                            PerfEnd(upload, NULL);
                             state->images[i].fullTextureLoaded = true;
                             state->currentState = STATE_FULL_VIEW;
                             state->fullViewIndex = i;
@@ -175,10 +187,87 @@ void DrawGalleryView(State* state) {
         }
     }
     EndScissorMode();
+    PerfSetThumbQueue(thumbQueue);
+    PerfEnd(zone, NULL);
+}
+
+// Draws texture into dst as place has it, turned about dst's middle
+static void DrawPlacedTexture(Texture2D texture, const Placement* place, Rectangle dst) {
+    bool turned = place->rotation & 1;
+    float w = turned ? dst.height : dst.width;
+    float h = turned ? dst.width : dst.height;
+    DrawTexturePro(texture, place->src, (Rectangle){ dst.x + dst.width / 2.0f, dst.y + dst.height / 2.0f, w, h }, (Vector2){ w / 2.0f, h / 2.0f }, 90.0f * place->rotation, WHITE);
+}
+
+// A box for one of the page's own margins, T B L R, taking what's typed as
+// it changes
+static void PageMarginBox(State* state, ImageEntry* entry, int i, Rectangle bounds) {
+    char before[8];
+    ActiveTextBox box = TEXTBOX_PAGE_MARGIN_T + i;
+    memcpy(before, pageEdit.margins[i], 8);
+    if (GuiTextBox(bounds, pageEdit.margins[i], 8, state->activeBox == box)) state->activeBox = box;
+    if (memcmp(before, pageEdit.margins[i], 8) != 0) {
+        entry->layout.margins[i] = fmaxf(0, strtof(pageEdit.margins[i], NULL));
+        MarkSettingsChanged();
+    }
+}
+
+// Fit or fill, rotation, margins and crop for the page in the full view
+static void DrawPageControls(State* state, ImageEntry* entry, int baseX, int baseY) {
+    int index = (int)(entry - state->images), spacing = 40, inputW = 50, inputH = 25;
+    PageLayout* layout = &entry->layout;
+    if (pageEdit.page != index) {
+        for (int i = 0; i < 4; i++) snprintf(pageEdit.margins[i], 8, "%g", layout->margins[i]);
+        pageEdit.page = index;
+        pageEdit.cropping = false;
+    }
+
+    DrawTextEx(state->font, "This page", (Vector2){baseX, baseY}, 18, 1, GRAY);
+    int fit = layout->fit;
+    GuiToggleGroup((Rectangle){ (float)baseX, (float)baseY + 20, 50, (float)inputH }, "Fit;Fill", &fit);
+    if (fit != layout->fit) {
+        layout->fit = fit;
+        MarkSettingsChanged();
+    }
+    if (GuiButton((Rectangle){ (float)baseX + 110, (float)baseY + 20, 60, (float)inputH }, "Rotate")) {
+        layout->rotation = (layout->rotation + 1) & 3;
+        MarkSettingsChanged();
+    }
+
+    bool ownMargins = layout->ownMargins;
+    GuiCheckBox((Rectangle){ (float)baseX, (float)baseY + 60, 15, 15 }, "Own margins", &ownMargins);
+    if (ownMargins != layout->ownMargins) {
+        // Starts from the sequence's margins
+        Canvas canvas = GetCanvas(state);
+        if (ownMargins) {
+            memcpy(layout->margins, canvas.margins, sizeof(layout->margins));
+            for (int i = 0; i < 4; i++) snprintf(pageEdit.margins[i], 8, "%g", layout->margins[i]);
+        }
+        layout->ownMargins = ownMargins;
+        MarkSettingsChanged();
+    }
+    if (ownMargins) {
+        const char* labels[] = { "T", "B", "L", "R" };
+        for (int i = 0; i < 4; i++) {
+            float x = baseX + (i % 2) * (inputW + spacing), y = baseY + 85 + (i / 2) * (inputH + 10);
+            PageMarginBox(state, entry, i, (Rectangle){ x, y, (float)inputW, (float)inputH });
+            DrawTextEx(state->font, labels[i], (Vector2){ x + inputW + 5, y + 5 }, 16, 1, LIGHTGRAY);
+        }
+    }
+
+    if (layout->crop.width > 0) {
+        if (GuiButton((Rectangle){ (float)baseX, (float)baseY + 160, 110, (float)inputH }, "Reset crop")) {
+            layout->crop = (Rectangle){ 0 };
+            MarkSettingsChanged();
+        }
+    } else {
+        DrawTextEx(state->font, "Right-drag to crop", (Vector2){ (float)baseX, (float)baseY + 165 }, 16, 1, LIGHTGRAY);
+    }
 }
 
 void DrawFullScreenView(State* state) {
     if (state->fullViewIndex < 0 || !state->images[state->fullViewIndex].fullTextureLoaded) return;
+    PerfZone zone = PerfBegin(PERF_FULL_VIEW);
 
     ClearBackground(RAYWHITE);
 
@@ -190,27 +279,18 @@ void DrawFullScreenView(State* state) {
     int textSize = MeasureTextEx(state->font, filename, 20, 1).x;
     DrawTextEx(state->font, filename, (Vector2){(GetScreenWidth() - textSize) / 2, (int)(titleBar.height - 20) / 2}, 20, 1, BLACK);
 
-    float canvasWidthIn = strtof(state->bufCanvasW, NULL);
-    float canvasHeightIn = strtof(state->bufCanvasH, NULL);
-    float marginTopIn = strtof(state->bufMarginT, NULL);
-    float marginBottomIn = strtof(state->bufMarginB, NULL);
-    float marginLeftIn = strtof(state->bufMarginL, NULL);
-    float marginRightIn = strtof(state->bufMarginR, NULL);
-
-    int canvasPxW = canvasWidthIn * 300;
-    int canvasPxH = canvasHeightIn * 300;
-    int marginT = marginTopIn * 300;
-    int marginB = marginBottomIn * 300;
-    int marginL = marginLeftIn * 300;
-    int marginR = marginRightIn * 300;
-
+    // The canvas at the largest scale that fits beside the controls, in
+    // screen pixels per inch
+    Canvas canvas = GetCanvas(state);
+    ImageEntry* entry = &state->images[state->fullViewIndex];
     float controls_width = 200;
     Rectangle contentArea = { controls_width, titleBar.height, GetScreenWidth() - controls_width, GetScreenHeight() - titleBar.height };
     float padding = 50.0f;
 
-    float scale = fminf((contentArea.width - padding) / (float)canvasPxW, (contentArea.height - padding) / (float)canvasPxH);
-    float dispW = canvasPxW * scale;
-    float dispH = canvasPxH * scale;
+    float scale = fminf((contentArea.width - padding) / canvas.width, (contentArea.height - padding) / canvas.height);
+    if (!isfinite(scale) || scale < 0) scale = 0;
+    float dispW = canvas.width * scale;
+    float dispH = canvas.height * scale;
 
     float cx = contentArea.x + (contentArea.width - dispW) / 2.0f;
     float cy = contentArea.y + (contentArea.height - dispH) / 2.0f;
@@ -218,31 +298,35 @@ void DrawFullScreenView(State* state) {
     DrawRectangle(cx, cy, dispW, dispH, WHITE);
     DrawRectangleLinesEx((Rectangle){cx, cy, dispW, dispH}, 3, GRAY);
 
-    float marginL_s = marginL * scale;
-    float marginR_s = marginR * scale;
-    float marginT_s = marginT * scale;
-    float marginB_s = marginB * scale;
-    float drawW_s = dispW - marginL_s - marginR_s;
-    float drawH_s = dispH - marginT_s - marginB_s;
-
-    float imgW = state->images[state->fullViewIndex].fullImage.width;
-    float imgH = state->images[state->fullViewIndex].fullImage.height;
-    float drawAR = drawW_s / drawH_s;
-    float imgAR = imgW / imgH;
-
-    Rectangle src;
-    if (imgAR > drawAR) {
-        float cropW = imgH * drawAR;
-        src = (Rectangle){ (imgW - cropW) / 2.0f, 0, cropW, imgH };
-    } else {
-        float cropH = imgW / drawAR;
-        src = (Rectangle){ 0, (imgH - cropH) / 2.0f, imgW, cropH };
-    }
+    Placement place = PlacePage(GetPageArea(canvas, &entry->layout), &entry->layout, entry->fullImage.width, entry->fullImage.height);
+    Rectangle dst = { cx + place.dst.x * scale, cy + place.dst.y * scale, place.dst.width * scale, place.dst.height * scale };
+    if (dst.width > 0 && dst.height > 0) DrawPlacedTexture(entry->fullTexture, &place, dst);
 
-    Rectangle dst = { cx + marginL_s, cy + marginT_s, drawW_s, drawH_s };
-    DrawTexturePro(state->images[state->fullViewIndex].fullTexture, src, dst, (Vector2){0, 0}, 0, WHITE);
+    // Right-dragging over the image crops it to what's dragged out
+    Vector2 mouse = GetMousePosition();
+    if (IsMouseButtonPressed(MOUSE_RIGHT_BUTTON) && CheckCollisionPointRec(mouse, dst)) {
+        pageEdit.cropping = true;
+        pageEdit.cropStart = mouse;
+    }
+    if (pageEdit.cropping) {
+        Vector2 end = { fminf(fmaxf(mouse.x, dst.x), dst.x + dst.width), fminf(fmaxf(mouse.y, dst.y), dst.y + dst.height) };
+        Rectangle drag = { fminf(pageEdit.cropStart.x, end.x), fminf(pageEdit.cropStart.y, end.y), fabsf(end.x - pageEdit.cropStart.x), fabsf(end.y - pageEdit.cropStart.y) };
+        DrawRectangleLinesEx(drag, 2, BLUE);
+        if (IsMouseButtonReleased(MOUSE_RIGHT_BUTTON)) {
+            pageEdit.cropping = false;
+            if (drag.width > 4 && drag.height > 4) {
+                Vector2 a = PlacedToImage(&place, (Vector2){ (drag.x - cx) / scale, (drag.y - cy) / scale });
+                Vector2 b = PlacedToImage(&place, (Vector2){ (drag.x + drag.width - cx) / scale, (drag.y + drag.height - cy) / scale });
+                float imgW = entry->fullImage.width, imgH = entry->fullImage.height;
+                float x0 = fmaxf(0, fminf(a.x, b.x) / imgW), y0 = fmaxf(0, fminf(a.y, b.y) / imgH);
+                float x1 = fminf(1, fmaxf(a.x, b.x) / imgW), y1 = fminf(1, fmaxf(a.y, b.y) / imgH);
+                entry->layout.crop = (Rectangle){ x0, y0, x1 - x0, y1 - y0 };
+                MarkSettingsChanged();
+            }
+        }
+    }
 
-    int total_controls_height = 140;
+    int total_controls_height = 335;
     int baseX = 20, baseY = (GetScreenHeight() - total_controls_height) / 2, spacing = 40, inputW = 50, inputH = 25;
 
     if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
@@ -272,22 +356,18 @@ void DrawFullScreenView(State* state) {
     if (GuiTextBox(rMR, state->bufMarginR, 8, state->activeBox == TEXTBOX_MARGIN_R)) state->activeBox = TEXTBOX_MARGIN_R;
     DrawTextEx(state->font, "R", (Vector2){baseX + inputW + spacing + inputW + 5, baseY + 25 + inputH + 10}, 16, 1, LIGHTGRAY);
 
+    baseY += 100;
+    DrawPageControls(state, entry, baseX, baseY);
+
     if (state->images[state->fullViewIndex].selected) {
         DrawTextEx(state->font, "Selected", (Vector2){GetScreenWidth() - 120, GetScreenHeight() - 40}, 20, 1, BLUE);
     }
 
     if (IsKeyPressed(KEY_S)) {
-        state->images[state->fullViewIndex].selected = !state->images[state->fullViewIndex].selected;
-        if (!state->images[state->fullViewIndex].selected) {
-            state->images[state->fullViewIndex].selectionOrder = -1;
+        if (state->images[state->fullViewIndex].selected) {
+            JournalDeselect(state, state->fullViewIndex);
         } else {
-            int maxOrder = 0;
-            for (int i = 0; i < state->imageCount; ++i) {
-                if (state->images[i].selectionOrder > maxOrder) {
-                    maxOrder = state->images[i].selectionOrder;
-                }
-            }
-            state->images[state->fullViewIndex].selectionOrder = maxOrder + 1;
+            JournalSelect(state, state->fullViewIndex);
         }
     }
 
@@ -311,14 +391,6 @@ void DrawFullScreenView(State* state) {
     }
 
     if (IsKeyPressed(KEY_ESCAPE) || GuiButton((Rectangle){ (float)GetScreenWidth() - 120, (titleBar.height - 30) / 2, 100, 30 }, "Back")) {
-        state->selectedFileCount = 0;
-        for (int i = 0; i < state->imageCount; ++i) {
-            if (state->images[i].selected) {
-                state->selectedFileCount++;
-            }
-        }
-        SaveSettings(state);
-        
         for (int idx = 0; idx < state->imageCount; idx++) {
             if (state->images[idx].fullTextureLoaded) UnloadTexture(state->images[idx].fullTexture);
             if (state->images[idx].fullLoaded) UnloadImage(state->images[idx].fullImage);
@@ -327,121 +399,291 @@ void DrawFullScreenView(State* state) {
         }
         state->currentState = STATE_GALLERY;
     }
+    PerfEnd(zone, NULL);
 }
 
-void DrawReorderView(State* state) {
-    Rectangle titleBar = { 0, 0, (float)GetScreenWidth(), 50 };
-    DrawRectangleRec(titleBar, RAYWHITE);
-    DrawLine(0, (int)titleBar.height, GetScreenWidth(), (int)titleBar.height, LIGHTGRAY);
-    DrawTextEx(state->font, "Reorder/Export", (Vector2){(GetScreenWidth() - MeasureTextEx(state->font, "Reorder/Export", 20, 1).x) / 2, (titleBar.height - 20) / 2}, 20, 1, BLACK);
+// Tabs for the folder's sequences, then a box to rename the active one and
+// buttons to add an empty one, copy it or delete it
+static void DrawSequenceBar(State* state, float y) {
+    char tabs[MAX_SEQUENCES * (MAX_SEQUENCE_NAME + 1)];
+    int len = 0;
+    for (int i = 0; i < state->sequenceCount; i++) {
+        const char* name = state->sequences[i].name[0] ? state->sequences[i].name : "Untitled";
+        if (i > 0) tabs[len++] = ';';
+        for (const char* c = name; *c; c++) tabs[len++] = (*c == ';' || *c == '\n') ? ' ' : *c; // Would split the tab
+    }
+    tabs[len] = 0;
 
-    if (GuiButton((Rectangle){ 10, (titleBar.height - 30) / 2, 100, 30 }, "Back")) {
-        state->currentState = STATE_GALLERY;
+    float controlsX = GetScreenWidth() - 380;
+    float tabW = fminf(120, (controlsX - 20) / state->sequenceCount - GuiGetStyle(TOGGLE, GROUP_PADDING));
+    int active = state->activeSequence;
+    GuiToggleGroup((Rectangle){ 10, y + 5, tabW, 30 }, tabs, &active);
+    if (active != state->activeSequence) {
+        state->activeBox = TEXTBOX_NONE;
+        SwitchSequence(state, active);
+        MarkSettingsChanged();
+        reorder.valid = false;
     }
 
-    if (GuiButton((Rectangle){ 120, (titleBar.height - 30) / 2, 140, 30 }, "Add Blank Page")) {
-        if (state->imageCount < MAX_IMAGES) {
-            ImageEntry* blank = &state->images[state->imageCount++];
-            strncpy(blank->path, "[BLANK_PAGE]", MAX_PATH_LEN - 1);
-            blank->selected = true;
-            blank->loaded = true;
-            int maxOrder = 0;
-            for (int i = 0; i < state->imageCount; ++i) {
-                if (state->images[i].selectionOrder > maxOrder) {
-                    maxOrder = state->images[i].selectionOrder;
-                }
-            }
-            blank->selectionOrder = maxOrder + 1;
-        }
+    Rectangle nameBox = { controlsX, y + 5, 150, 30 };
+    char* activeName = state->sequences[state->activeSequence].name;
+    char before[MAX_SEQUENCE_NAME];
+    memcpy(before, activeName, MAX_SEQUENCE_NAME);
+    if (GuiTextBox(nameBox, activeName, MAX_SEQUENCE_NAME, state->activeBox == TEXTBOX_SEQUENCE_NAME)) state->activeBox = TEXTBOX_SEQUENCE_NAME;
+    if (strcmp(before, activeName) != 0) MarkSettingsChanged(); // Only when typed in, not every frame it has focus
+
+    if (GuiButton((Rectangle){ controlsX + 160, y + 5, 60, 30 }, "New")) {
+        char name[MAX_SEQUENCE_NAME];
+        snprintf(name, sizeof(name), "Sequence %d", state->sequenceCount + 1);
+        if (AddSequence(state, name, false) >= 0) MarkSettingsChanged();
+        reorder.valid = false;
+    }
+    if (GuiButton((Rectangle){ controlsX + 225, y + 5, 60, 30 }, "Copy")) {
+        char name[MAX_SEQUENCE_NAME];
+        snprintf(name, sizeof(name), "%.*s copy", MAX_SEQUENCE_NAME - 6, state->sequences[state->activeSequence].name);
+        if (AddSequence(state, name, true) >= 0) MarkSettingsChanged();
+        reorder.valid = false;
+    }
+    if (state->sequenceCount > 1 && GuiButton((Rectangle){ controlsX + 290, y + 5, 70, 30 }, "Delete")) {
+        DeleteSequence(state, state->activeSequence);
+        MarkSettingsChanged();
+        reorder.valid = false;
     }
+    DrawLine(0, (int)y + 40, GetScreenWidth(), (int)y + 40, LIGHTGRAY);
+}
 
-    ImageEntry* sortedSelection[MAX_SELECTED_FILES];
-    int selectedCount = 0;
-    for (int i = 0; i < state->imageCount; i++) {
-        if (state->images[i].selected) {
-            sortedSelection[selectedCount++] = &state->images[i];
-        }
+static void RefreshReorderList(State* state) {
+    if (reorder.valid && reorder.version == GetJournalVersion()) return;
+    reorder.count = GetJournalPages(state, reorder.pages);
+    memset(reorder.picked, 0, sizeof(reorder.picked));
+    reorder.anchor = -1;
+    reorder.pressed = -1;
+    reorder.dragging = false;
+    reorder.valid = true;
+    reorder.version = GetJournalVersion();
+}
+
+// Moves the picked pages, keeping their order, to just before page target
+// (or the end) as one undoable edit, and keeps them picked where they land
+static void MovePickedPages(State* state, int target) {
+    static int positions[MAX_IMAGES];
+    int movedCount = 0;
+    for (int i = 0; i < reorder.count; i++) {
+        if (reorder.picked[i]) positions[movedCount++] = i;
     }
+    if (movedCount == 0) return;
 
-    for (int i = 0; i < selectedCount - 1; i++) {
-        for (int j = 0; j < selectedCount - i - 1; j++) {
-            if (sortedSelection[j]->selectionOrder > sortedSelection[j+1]->selectionOrder) {
-                ImageEntry* temp = sortedSelection[j];
-                sortedSelection[j] = sortedSelection[j+1];
-                sortedSelection[j+1] = temp;
-            }
-        }
+    int insertAt = JournalMove(state, positions, movedCount, target);
+    reorder.count = GetJournalPages(state, reorder.pages);
+    for (int i = 0; i < reorder.count; i++) {
+        reorder.picked[i] = i >= insertAt && i < insertAt + movedCount;
+    }
+    reorder.anchor = insertAt;
+    reorder.version = GetJournalVersion();
+}
+
+// Shortens a file name with "..." until it fits in width
+static void FitName(Font font, const char* name, float size, float width, char* out, int outLen) {
+    int len = strlen(name);
+    snprintf(out, outLen, "%s", name);
+    if (len >= outLen) len = outLen - 1;
+    while (len > 0 && MeasureTextEx(font, out, size, 1).x > width) {
+        len--;
+        snprintf(out, outLen, "%.*s...", len, name);
     }
+}
 
-    int itemHeight = 40;
-    int listWidth = 400;
-    int startX = (GetScreenWidth() - listWidth) / 2;
-    int startY = (int)titleBar.height + 16;
+// The sequence as a grid of thumbnails, drawn and hit tested only for the
+// rows on screen. Click picks a page, Ctrl-click adds or removes one,
+// Shift-click picks a run; dragging moves everything picked.
+static void DrawPageGrid(State* state, float top) {
+    const int tile = 96, captionH = 20, gap = 16;
+    const int cellW = tile + gap, cellH = tile + captionH + gap;
+    int screenW = GetScreenWidth(), screenH = GetScreenHeight();
+    int cols = (screenW - gap) / cellW;
+    if (cols < 1) cols = 1;
+    int startX = (screenW - cols * cellW + gap) / 2;
+    int rows = (reorder.count + cols - 1) / cols;
+    float viewH = screenH - top - 30; // Leaves a line for the hint
+
+    // Scrolls a row per wheel notch, and by itself near the edges while dragging
+    reorder.scrollY += GetMouseWheelMove() * cellH;
+    Vector2 mouse = GetMousePosition();
+    if (reorder.dragging && mouse.y < top + 30) reorder.scrollY += 10;
+    if (reorder.dragging && mouse.y > top + viewH - 30) reorder.scrollY -= 10;
+    float maxScroll = fmaxf(0, rows * cellH + gap - viewH);
+    if (reorder.scrollY < -maxScroll) reorder.scrollY = -maxScroll;
+    if (reorder.scrollY > 0) reorder.scrollY = 0;
+
+    // Page under the mouse, and the gap nearest it for a drop
+    float gridY = top + gap + reorder.scrollY;
+    int col = (int)floorf((mouse.x - startX) / cellW);
+    int row = (int)floorf((mouse.y - gridY) / cellH);
+    int hover = -1;
+    bool inView = mouse.y >= top && mouse.y < top + viewH;
+    if (inView && col >= 0 && col < cols && row >= 0 && mouse.x - startX - col * cellW < tile) {
+        if (row * cols + col < reorder.count) hover = row * cols + col;
+    }
+    int dropCol = (int)floorf((mouse.x - startX + cellW / 2.0f) / cellW);
+    if (dropCol < 0) dropCol = 0;
+    if (dropCol > cols) dropCol = cols;
+    int dropRow = row < 0 ? 0 : row;
+    int drop = dropRow * cols + dropCol;
+    if (drop > reorder.count) drop = reorder.count;
+
+    bool additive = IsKeyDown(KEY_LEFT_CONTROL) || IsKeyDown(KEY_RIGHT_CONTROL) || IsKeyDown(KEY_LEFT_SUPER) || IsKeyDown(KEY_RIGHT_SUPER);
+    bool range = IsKeyDown(KEY_LEFT_SHIFT) || IsKeyDown(KEY_RIGHT_SHIFT);
+    if (additive && IsKeyPressed(KEY_A) && state->activeBox == TEXTBOX_NONE) {
+        for (int i = 0; i < reorder.count; i++) reorder.picked[i] = true;
+    }
+
+    if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON) && inView) {
+        if (hover < 0) {
+            if (!additive && !range) memset(reorder.picked, 0, reorder.count * sizeof(bool));
+        } else if (additive) {
+            reorder.picked[hover] = !reorder.picked[hover];
+            reorder.anchor = hover;
+        } else if (range && reorder.anchor >= 0) {
+            int from = reorder.anchor < hover ? reorder.anchor : hover;
+            int to = reorder.anchor < hover ? hover : reorder.anchor;
+            for (int i = 0; i < reorder.count; i++) reorder.picked[i] = i >= from && i <= to;
+        } else if (!reorder.picked[hover]) {
+            memset(reorder.picked, 0, reorder.count * sizeof(bool));
+            reorder.picked[hover] = true;
+            reorder.anchor = hover;
+        }
+        reorder.pressed = hover;
+        reorder.pressPos = mouse;
+    }
+    if (reorder.pressed >= 0 && !reorder.dragging && IsMouseButtonDown(MOUSE_LEFT_BUTTON) && reorder.picked[reorder.pressed]) {
+        float dx = mouse.x - reorder.pressPos.x, dy = mouse.y - reorder.pressPos.y;
+        if (dx * dx + dy * dy > 36) {
+            reorder.dragging = true;
+            reorder.dragCount = 0;
+            for (int i = 0; i < reorder.count; i++) reorder.dragCount += reorder.picked[i];
+        }
+    }
+    if (IsMouseButtonReleased(MOUSE_LEFT_BUTTON)) {
+        if (reorder.dragging) {
+            MovePickedPages(state, drop);
+        } else if (reorder.pressed >= 0 && !additive && !range) {
+            // A plain click on one of several picked pages picks just it
+            memset(reorder.picked, 0, reorder.count * sizeof(bool));
+            reorder.picked[reorder.pressed] = true;
+            reorder.anchor = reorder.pressed;
+        }
+        reorder.pressed = -1;
+        reorder.dragging = false;
+    }
 
-    for (int i = 0; i < selectedCount; i++) {
-        int y = startY + i * itemHeight;
-        const char* displayName = strcmp(sortedSelection[i]->path, "[BLANK_PAGE]") == 0 ? "[BLANK_PAGE]" : GetFileName(sortedSelection[i]->path);
-        DrawTextEx(state->font, displayName, (Vector2){startX, y + 10}, 20, 1, BLACK);
+    BeginScissorMode(0, (int)top, screenW, (int)viewH);
+    int firstRow = (int)(-reorder.scrollY / cellH);
+    int lastRow = firstRow + (int)(viewH / cellH) + 1;
+    bool loadedOne = false;
+    int thumbQueue = 0;
+    for (int r = firstRow; r <= lastRow && r < rows; r++) {
+        for (int c = 0; c < cols && r * cols + c < reorder.count; c++) {
+            int i = r * cols + c;
+            ImageEntry* entry = reorder.pages[i];
+            float x = startX + c * cellW;
+            float y = gridY + r * cellH;
+            bool blank = strcmp(entry->path, "[BLANK_PAGE]") == 0;
+
+            // One thumbnail is read per frame, as in the gallery
+            if (!entry->loaded && !loadedOne) {
+                LoadEntryThumbnail(state, entry);
+                loadedOne = true;
+            } else if (!entry->loaded) {
+                thumbQueue++;
+            }
 
-        if (GuiButton((Rectangle){ (float)startX + listWidth + 10, (float)y, 80, (float)itemHeight - 5 }, "Up")) {
-            if (i > 0) {
-                int currentOrder = sortedSelection[i]->selectionOrder;
-                sortedSelection[i]->selectionOrder = sortedSelection[i-1]->selectionOrder;
-                sortedSelection[i-1]->selectionOrder = currentOrder;
+            DrawRectangle(x, y, tile, tile, blank ? WHITE : LIGHTGRAY);
+            if (!blank && entry->loaded && entry->texture.id > 0) {
+                float scale = fminf((float)tile / entry->texture.width, (float)tile / entry->texture.height);
+                float w = entry->texture.width * scale;
+                float h = entry->texture.height * scale;
+                DrawTexturePro(entry->texture, (Rectangle){ 0, 0, (float)entry->texture.width, (float)entry->texture.height }, (Rectangle){ x + (tile - w) / 2, y + (tile - h) / 2, w, h }, (Vector2){ 0, 0 }, 0, reorder.dragging && reorder.picked[i] ? Fade(WHITE, 0.4f) : WHITE);
             }
+            DrawRectangleLinesEx((Rectangle){ x, y, (float)tile, (float)tile }, reorder.picked[i] ? 3 : 1, reorder.picked[i] ? BLUE : GRAY);
+
+            char label[MAX_FILENAME_LEN];
+            snprintf(label, sizeof(label), "%d", i + 1);
+            Vector2 labelSize = MeasureTextEx(state->font, label, 16, 1);
+            DrawRectangle(x + 3, y + 3, labelSize.x + 8, 20, reorder.picked[i] ? BLUE : DARKGRAY);
+            DrawTextEx(state->font, label, (Vector2){ x + 7, y + 5 }, 16, 1, WHITE);
+            FitName(state->font, blank ? "Blank page" : GetFileName(entry->path), 14, tile, label, sizeof(label));
+            DrawTextEx(state->font, label, (Vector2){ x, y + tile + 3 }, 14, 1, blank ? GRAY : BLACK);
         }
-        if (GuiButton((Rectangle){ (float)startX + listWidth + 100, (float)y, 80, (float)itemHeight - 5 }, "Down")) {
-            if (i < selectedCount - 1) {
-                int currentOrder = sortedSelection[i]->selectionOrder;
-                sortedSelection[i]->selectionOrder = sortedSelection[i+1]->selectionOrder;
-                sortedSelection[i+1]->selectionOrder = currentOrder;
-            }
+    }
+
+    // Where the pages will land
+    if (reorder.dragging) {
+        int markRow = drop / cols, markCol = drop % cols;
+        if (drop == reorder.count && drop > 0 && markCol == 0) {
+            markRow--; // After the last page, at the end of its row
+            markCol = cols;
         }
+        float markX = startX + markCol * cellW - gap / 2.0f;
+        DrawRectangle(markX - 2, gridY + markRow * cellH, 4, tile, BLUE);
+
+        char countStr[16];
+        snprintf(countStr, sizeof(countStr), "%d", reorder.dragCount);
+        DrawCircle(mouse.x + 12, mouse.y + 12, 12, BLUE);
+        DrawTextEx(state->font, countStr, (Vector2){ mouse.x + 12 - MeasureTextEx(state->font, countStr, 16, 1).x / 2, mouse.y + 4 }, 16, 1, WHITE);
+    }
+    EndScissorMode();
+    PerfSetThumbQueue(thumbQueue);
+
+    char hint[128];
+    snprintf(hint, sizeof(hint), "%d pages. Drag to move; Ctrl-click or Shift-click to pick several, Ctrl+A for all, Ctrl+Z to undo.", reorder.count);
+    DrawTextEx(state->font, hint, (Vector2){ 10, screenH - 24 }, 16, 1, GRAY);
+}
+
+void DrawReorderView(State* state) {
+    PerfZone zone = PerfBegin(PERF_REORDER);
+    Rectangle titleBar = { 0, 0, (float)GetScreenWidth(), 50 };
+    DrawRectangleRec(titleBar, RAYWHITE);
+    DrawLine(0, (int)titleBar.height, GetScreenWidth(), (int)titleBar.height, LIGHTGRAY);
+    DrawTextEx(state->font, "Reorder/Export", (Vector2){(GetScreenWidth() - MeasureTextEx(state->font, "Reorder/Export", 20, 1).x) / 2, (titleBar.height - 20) / 2}, 20, 1, BLACK);
+
+    if (GuiButton((Rectangle){ 10, (titleBar.height - 30) / 2, 100, 30 }, "Back")) {
+        state->currentState = STATE_GALLERY;
+    }
+
+    if (GuiButton((Rectangle){ 120, (titleBar.height - 30) / 2, 140, 30 }, "Add Blank Page")) {
+        JournalAddBlank(state);
+    }
+
+    if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON)) {
+        state->activeBox = TEXTBOX_NONE;
     }
+    DrawSequenceBar(state, titleBar.height);
+    RefreshReorderList(state);
+    DrawPageGrid(state, titleBar.height + 41);
+
+    // Images per page: one per page, or an N-up contact sheet
+    const int sheetLayouts[] = SHEET_LAYOUTS;
+    DrawTextEx(state->font, "Per page", (Vector2){ (float)GetScreenWidth() - 440, (titleBar.height - 16) / 2 }, 16, 1, GRAY);
+    GuiToggleGroup((Rectangle){ (float)GetScreenWidth() - 370, (titleBar.height - 30) / 2, 40, 30 }, "1;4;9;20;35", &state->sheetLayout);
 
     if (GuiButton((Rectangle){ (float)GetScreenWidth() - 150, (titleBar.height - 30) / 2, 120, 30 }, "Generate PDF")) {
         const char* filterPatterns[] = { "*.pdf" };
-        const char* pdfPath = tinyfd_saveFileDialog("Save PDF", "output.pdf", 1, filterPatterns, "PDF Files");
+        // Each sequence offers its own last PDF, which a re-export only appends to
+        Sequence* sequence = &state->sequences[state->activeSequence];
+        const char* pdfPath = tinyfd_saveFileDialog("Save PDF", sequence->exportPath[0] ? sequence->exportPath : "output.pdf", 1, filterPatterns, "PDF Files");
 
         if (pdfPath && strlen(pdfPath) > 0) {
-            float cw = strtof(state->bufCanvasW, NULL);
-            float ch = strtof(state->bufCanvasH, NULL);
-            float mt = strtof(state->bufMarginT, NULL);
-            float mb = strtof(state->bufMarginB, NULL);
-            float ml = strtof(state->bufMarginL, NULL);
-            float mr = strtof(state->bufMarginR, NULL);
-
-            float pageW = cw * 72.0f;
-            float pageH = ch * 72.0f;
-
-            struct pdf_info info = { .creator = "Raylib Viewer", .producer = "PDFGen", .title = "Image Compilation" };
-            struct pdf_doc *pdf = pdf_create(pageW, pageH, &info);
-            pdf_set_font(pdf, "Helvetica");
-
-            float drawX = ml * 72.0f;
-            float drawY = mb * 72.0f;
-            float drawW = (cw - ml - mr) * 72.0f;
-            float drawH = (ch - mt - mb) * 72.0f;
-
-            for (int i = 0; i < selectedCount; i++) {
-                pdf_append_page(pdf);
-                if (strcmp(sortedSelection[i]->path, "[BLANK_PAGE]") != 0) {
-                    Image img = LoadImage(sortedSelection[i]->path);
-                    if (img.data) {
-                        float imgW = img.width;
-                        float imgH = img.height;
-                        float scale = fminf(drawW / imgW, drawH / imgH);
-                        float finalW = imgW * scale;
-                        float finalH = imgH * scale;
-                        float finalX = drawX + (drawW - finalW) / 2.0f;
-                        float finalY = drawY + (drawH - finalH) / 2.0f;
-                        pdf_add_image_file(pdf, NULL, finalX, finalY, finalW, finalH, sortedSelection[i]->path);
-                        UnloadImage(img);
-                    }
-                }
+            bool ok;
+            if (state->sheetLayout > 0) {
+                ok = ExportContactSheet(state, reorder.pages, reorder.count, sheetLayouts[state->sheetLayout], pdfPath);
+            } else {
+                ok = ExportPdf(state, reorder.pages, reorder.count, pdfPath);
+            }
+            if (ok && strcmp(sequence->exportPath, pdfPath) != 0) {
+                strncpy(sequence->exportPath, pdfPath, MAX_PATH_LEN - 1);
+                MarkSettingsChanged();
             }
-            pdf_save(pdf, pdfPath);
-            pdf_destroy(pdf);
         }
     }
+    PerfEnd(zone, NULL);
 }